@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <getopt.h> // for getopt_long
+#include <time.h>	// for clock_gettime
+#include "otp_cipher.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> // for __rdtsc
+#endif
+
+#define MAX_TRIALS 101					 // trials a measurement can have
+#define WARM_UP_NS 10000000LL			 // a trial's call count is doubled until one trial takes this long
+#define DEFAULT_MAX_SIZE (1LL << 30)	 // 1 GiB, the largest buffer swept by default
+#define SIZE_GROWTH 4					 // each buffer size of the sweep is this many times the last
+#define RANDOM_BLOCK_SIZE 65536		 // random characters drawn for a buffer; the rest repeats them
+
+// one measured kernel, operation and buffer size
+struct measurement
+{
+	const char *kernel;
+	const char *operation;
+	long long size;
+	int trials;
+	long long calls;		  // calls per trial
+	double best_ns;			  // fastest trial, per call
+	double median_ns;		  // median trial, per call
+	double cycles_per_byte;	  // time stamp counter cycles per byte, in the fastest trial (0 if there is no counter)
+};
+
+// function prototypes
+long long current_time_ns(void);
+unsigned long long current_cycles(void);
+void fill_characters(char *buffer, long long size);
+int compare_doubles(const void *first, const void *second);
+void measure(otp_cipher_function cipher, const char *input, const char *key, char *output, int size, int trials,
+			 struct measurement *result);
+void print_measurement(const struct measurement *result, bool csv);
+void print_usage(void);
+
+static volatile char sink; // keeps the compiler from discarding the output of the calls
+
+/**
+ * Returns the time on the monotonic clock.
+ * @return long long, nanoseconds
+ */
+long long current_time_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Reads the CPU's time stamp counter, which counts reference cycles at a constant rate on current CPUs.
+ * @return unsigned long long, cycles, or 0 where there is no counter
+ */
+unsigned long long current_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Fills a buffer with characters of the alphabet, so every call transforms the whole buffer: a block of random
+ * characters, then copies of it, since drawing a random number per character would take most of a minute for
+ * the largest buffers.
+ * @param buffer: pointer to the buffer
+ * @param size: long long, number of characters
+ */
+void fill_characters(char *buffer, long long size)
+{
+	long long block_size = size < RANDOM_BLOCK_SIZE ? size : RANDOM_BLOCK_SIZE;
+	for (long long i = 0; i < block_size; i++)
+	{
+		buffer[i] = OTP_ALLOWED_CHARACTERS[rand() % OTP_CHARACTERS_LENGTH];
+	}
+	for (long long i = block_size; i < size; i += block_size)
+	{
+		memcpy(buffer + i, buffer, size - i < block_size ? size - i : block_size);
+	}
+}
+
+/**
+ * Orders doubles for qsort().
+ * @param first: pointer to the first double
+ * @param second: pointer to the second double
+ * @return int, negative, zero or positive as the first is smaller, equal or larger
+ */
+int compare_doubles(const void *first, const void *second)
+{
+	double difference = *(const double *)first - *(const double *)second;
+	return (difference > 0) - (difference < 0);
+}
+
+/**
+ * Measures a cipher on one buffer size: doubles the number of calls per trial until a trial takes at least
+ * WARM_UP_NS (which also brings the buffers into cache and the CPU up to speed), then runs the trials and keeps
+ * the fastest and the median.
+ * @param cipher: the cipher to call (otp_encrypt or otp_decrypt, running the selected kernel)
+ * @param input: pointer to size input characters
+ * @param key: pointer to size key characters
+ * @param output: pointer to memory for size output characters
+ * @param size: int, number of characters per call
+ * @param trials: int, number of timed trials (at most MAX_TRIALS)
+ * @param result: pointer to the measurement, whose size and timings are filled in
+ */
+void measure(otp_cipher_function cipher, const char *input, const char *key, char *output, int size, int trials,
+			 struct measurement *result)
+{
+	long long calls = 1;
+	while (true)
+	{
+		long long started_at_ns = current_time_ns();
+		for (long long i = 0; i < calls; i++)
+		{
+			cipher(input, key, output, size);
+		}
+		if (current_time_ns() - started_at_ns >= WARM_UP_NS)
+		{
+			break;
+		}
+		calls *= 2;
+	}
+
+	double trial_ns[MAX_TRIALS];
+	double best_cycles = 0;
+	for (int trial = 0; trial < trials; trial++)
+	{
+		long long started_at_ns = current_time_ns();
+		unsigned long long started_at_cycles = current_cycles();
+		for (long long i = 0; i < calls; i++)
+		{
+			cipher(input, key, output, size);
+			sink = output[0];
+		}
+		double cycles = (double)(current_cycles() - started_at_cycles) / calls;
+		trial_ns[trial] = (double)(current_time_ns() - started_at_ns) / calls;
+		if (trial == 0 || trial_ns[trial] < result->best_ns)
+		{
+			result->best_ns = trial_ns[trial];
+			best_cycles = cycles;
+		}
+	}
+	qsort(trial_ns, trials, sizeof(double), compare_doubles);
+
+	result->size = size;
+	result->trials = trials;
+	result->calls = calls;
+	result->median_ns = trial_ns[trials / 2];
+	result->cycles_per_byte = size > 0 ? best_cycles / size : 0;
+}
+
+/**
+ * Prints one measurement: an aligned line for people, or a CSV row under the header main() prints.
+ * @param result: pointer to the measurement
+ * @param csv: bool, true for a CSV row
+ */
+void print_measurement(const struct measurement *result, bool csv)
+{
+	double best_gb_per_second = result->size / result->best_ns;
+	double median_gb_per_second = result->size / result->median_ns;
+	if (csv)
+	{
+		printf("%s,%s,%lld,%d,%lld,%.3f,%.3f,%.4f,%.4f,%.4f\n", result->kernel, result->operation, result->size,
+			   result->trials, result->calls, result->best_ns, result->median_ns, best_gb_per_second,
+			   median_gb_per_second, result->cycles_per_byte);
+	}
+	else
+	{
+		printf("%-7s %-8s %11lld B %12.1f ns %9.3f GB/s (median %7.3f) %8.3f cycles/B\n", result->kernel,
+			   result->operation, result->size, result->best_ns, best_gb_per_second, median_gb_per_second,
+			   result->cycles_per_byte);
+	}
+	fflush(stdout);
+}
+
+/**
+ * Prints the command line usage of the benchmark to stderr.
+ */
+void print_usage(void)
+{
+	fprintf(stderr, "USAGE: cipher_bench [--min-size BYTES] [--max-size BYTES] [--trials N] [--kernel NAME] "
+					"[--type encrypt|decrypt|both] [--csv]\n");
+}
+
+/**
+ * Main function for the cipher micro-benchmark.
+ * Times otp_encrypt() and otp_decrypt() with each cipher kernel the CPU runs, on buffer sizes from the minimum
+ * to the maximum (growing SIZE_GROWTH times per step), with no network or system calls in the way, and prints
+ * the speed of each in GB/s and cycles per byte.
+ * @param argument_count: int, the number of command line arguments
+ * @param argument_array: array, the command line arguments entered (options only)
+ */
+int main(int argument_count, char *argument_array[])
+{
+	long long minimum_size = 16;
+	long long maximum_size = DEFAULT_MAX_SIZE;
+	int trials = 5;
+	const char *kernel = NULL; // every kernel the CPU runs
+	const char *type = "both";
+	bool csv = false;
+
+	static struct option long_options[] = {
+		{"min-size", required_argument, NULL, 'm'},
+		{"max-size", required_argument, NULL, 'M'},
+		{"trials", required_argument, NULL, 'n'},
+		{"kernel", required_argument, NULL, 'k'},
+		{"type", required_argument, NULL, 't'},
+		{"csv", no_argument, NULL, 'c'},
+		{NULL, 0, NULL, 0}};
+
+	// parse options
+	int option;
+	while ((option = getopt_long(argument_count, argument_array, "m:M:n:k:t:c", long_options, NULL)) != -1)
+	{
+		switch (option)
+		{
+		case 'm':
+			minimum_size = atoll(optarg);
+			break;
+		case 'M':
+			maximum_size = atoll(optarg);
+			break;
+		case 'n':
+			trials = atoi(optarg);
+			break;
+		case 'k':
+			kernel = optarg;
+			break;
+		case 't':
+			type = optarg;
+			break;
+		case 'c':
+			csv = true;
+			break;
+		default:
+			print_usage();
+			exit(1);
+		}
+	}
+	if (optind != argument_count || minimum_size <= 0 || maximum_size < minimum_size || maximum_size > 0x7fffffff ||
+		trials <= 0 || trials > MAX_TRIALS ||
+		(strcmp(type, "encrypt") != 0 && strcmp(type, "decrypt") != 0 && strcmp(type, "both") != 0))
+	{
+		print_usage();
+		exit(1);
+	}
+	if (kernel && !otp_select_cipher_kernel(kernel))
+	{
+		fprintf(stderr, "BENCH: ERROR- this CPU has no %s kernel\n", kernel);
+		exit(1);
+	}
+
+	// the output is a separate buffer, as in the servers, so the sweep needs three times the largest size
+	char *input = malloc(maximum_size);
+	char *key = malloc(maximum_size);
+	char *output = malloc(maximum_size);
+	if (!input || !key || !output)
+	{
+		fprintf(stderr, "BENCH: ERROR allocating %lld bytes for each of the buffers\n", maximum_size);
+		exit(1);
+	}
+	fill_characters(input, maximum_size);
+	fill_characters(key, maximum_size);
+
+	if (csv)
+	{
+		printf("kernel,operation,size,trials,calls_per_trial,best_ns_per_call,median_ns_per_call,best_gb_per_s,"
+			   "median_gb_per_s,cycles_per_byte\n");
+	}
+	for (int k = 0; kernel ? k < 1 : otp_available_cipher_kernel(k) != NULL; k++)
+	{
+		struct measurement result = {.kernel = kernel ? kernel : otp_available_cipher_kernel(k)};
+		otp_select_cipher_kernel(result.kernel);
+		for (int operation = 0; operation < 2; operation++)
+		{
+			result.operation = operation == 0 ? "encrypt" : "decrypt";
+			if (strcmp(type, "both") != 0 && strcmp(type, result.operation) != 0)
+			{
+				continue;
+			}
+			otp_cipher_function cipher = operation == 0 ? otp_encrypt : otp_decrypt;
+			for (long long size = minimum_size; size <= maximum_size;
+				 size = size * SIZE_GROWTH > maximum_size && size < maximum_size ? maximum_size : size * SIZE_GROWTH)
+			{
+				measure(cipher, input, key, output, (int)size, trials, &result);
+				print_measurement(&result, csv);
+			}
+		}
+	}
+
+	free(input);
+	free(key);
+	free(output);
+	return 0;
+}
@@ -0,0 +1,23 @@
+#!/bin/bash
+
+# Runs the same otp_bench load against enc_server in each worker model and prints the results side by side.
+# USAGE: bench/compare_modes.sh [port] [otp_bench options...]
+# Build first with ./build.sh (or IO_URING=1 ./build.sh to include the io_uring model).
+
+PORT=${1:-57170}
+shift
+MODES="fork prefork threads epoll io_uring"
+
+for MODE in $MODES; do
+	./enc_server/enc_server --mode $MODE $PORT 2>/tmp/otp_bench_server.log &
+	SERVER_PID=$!
+	sleep 0.5
+	if ! kill -0 $SERVER_PID 2>/dev/null; then
+		echo "$MODE: skipped ($(tail -n 1 /tmp/otp_bench_server.log))"
+		continue
+	fi
+
+	echo "$MODE: $(./bench/otp_bench "$@" $PORT)"
+	kill -INT $SERVER_PID
+	wait $SERVER_PID
+done
@@ -0,0 +1,723 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h> // for htonl
+#include <stdbool.h>
+#include <getopt.h>	   // for getopt_long
+#include <pthread.h>   // one thread per concurrent connection
+#include <signal.h>	   // for signal
+#include <limits.h>	   // for INT_MAX
+#include <errno.h>
+#include <sched.h>	   // for sched_yield
+#include "otp_cipher.h"
+#include "otp_pipeline.h"
+#include "otp_protocol.h"
+#include "otp_shm_ring.h"
+#include "otp_stats.h"
+
+#define MAX_SIZE_CHOICES 16	   // sizes a weighted size distribution can list
+#define PIPELINE_BATCH_SIZE 4096 // tagged requests handed to otp_pipeline_requests() at a time in a timed run
+
+// how the message size of each request is chosen
+struct size_distribution
+{
+	int choice_count; // 0 for a uniform choice between minimum and maximum
+	int sizes[MAX_SIZE_CHOICES];
+	int weights[MAX_SIZE_CHOICES];
+	int total_weight;
+	int minimum;
+	int maximum;
+};
+
+// settings shared by every load thread
+struct bench_settings
+{
+	struct otp_server_address server_address; // TCP port on the loopback address, or Unix domain socket
+	const char *client_type;
+	struct size_distribution sizes;
+	int requests_per_thread;
+	long long duration_us; // run each thread for this long instead of a number of requests (0 for a number)
+	char *characters;	   // random message characters, then random key characters, sizes.maximum of each
+	bool keep_alive;	   // send every request of a thread over one connection
+	int pipeline_depth;	   // tagged requests each thread keeps in flight on its connection (0 to wait for each reply)
+	bool use_pad;		   // upload a pad per thread, and key each request by a range of it instead of sending a key
+	int encoding;		   // wire encoding of pipelined sessions
+	struct otp_shm_ring *shm_ring; // send the requests through the server's shared memory ring (with use_pad)
+};
+
+// results of one load thread
+struct bench_results
+{
+	unsigned long requests;
+	unsigned long failures;
+	unsigned long busy;		  // failures the server refused with OTP_REPLY_BUSY (kept out of the latencies)
+	unsigned long long bytes; // message characters of the requests that succeeded
+	struct otp_histogram latency;
+};
+
+// function prototypes
+bool parse_size_distribution(const char *text, struct size_distribution *sizes);
+int choose_message_size(const struct size_distribution *sizes, unsigned int *seed);
+char *build_characters(int maximum_size);
+int build_request(const struct bench_settings *settings, char *request, int message_size, int pad_id, int pad_offset);
+bool run_request(struct bench_settings *settings, const char *request, int request_size, int message_size,
+				 int *connection_socket_fd, bool *busy);
+bool upload_pad(struct bench_settings *settings, int *pad_id);
+bool more_requests(const struct bench_settings *settings, int sent, long long deadline_us);
+void run_pipelined_requests(struct bench_settings *settings, struct bench_results *results, unsigned int *seed);
+void run_shm_requests(struct bench_settings *settings, struct bench_results *results, int pad_id, unsigned int *seed);
+void *load_thread(void *argument);
+void print_usage(void);
+
+static struct bench_settings settings;
+static pthread_barrier_t load_start; // holds the load back until every thread has uploaded its pad
+
+/**
+ * Parses a message size distribution: a single size (e.g. "64"), a range chosen from uniformly
+ * (e.g. "16-4096"), or sizes with weights (e.g. "64:90,4096:9,65536:1", each size chosen in proportion to its
+ * weight).
+ * @param text: string, the distribution as given on the command line
+ * @param sizes: pointer to where the distribution is stored
+ * @return bool, false if the text is not a valid distribution
+ */
+bool parse_size_distribution(const char *text, struct size_distribution *sizes)
+{
+	memset(sizes, 0, sizeof(*sizes));
+	char *end;
+	long first = strtol(text, &end, 10);
+	if (end == text || first < 0 || first > INT_MAX)
+	{
+		return false;
+	}
+	if (*end == '\0')
+	{
+		*sizes = (struct size_distribution){.choice_count = 1, .sizes = {(int)first}, .weights = {1}, .total_weight = 1,
+											.minimum = (int)first, .maximum = (int)first};
+		return true;
+	}
+	if (*end == '-')
+	{
+		const char *start = end + 1;
+		long last = strtol(start, &end, 10);
+		sizes->minimum = (int)first;
+		sizes->maximum = (int)last;
+		return end != start && *end == '\0' && last >= first && last <= INT_MAX;
+	}
+
+	// size:weight pairs separated by commas
+	sizes->minimum = INT_MAX;
+	for (const char *position = text; sizes->choice_count < MAX_SIZE_CHOICES;)
+	{
+		long size = strtol(position, &end, 10);
+		if (end == position || *end != ':' || size < 0 || size > INT_MAX)
+		{
+			return false;
+		}
+		position = end + 1;
+		long weight = strtol(position, &end, 10);
+		if (end == position || weight <= 0 || weight > INT_MAX - sizes->total_weight)
+		{
+			return false;
+		}
+		sizes->sizes[sizes->choice_count] = (int)size;
+		sizes->weights[sizes->choice_count++] = (int)weight;
+		sizes->total_weight += (int)weight;
+		sizes->minimum = size < sizes->minimum ? (int)size : sizes->minimum;
+		sizes->maximum = size > sizes->maximum ? (int)size : sizes->maximum;
+		if (*end == '\0')
+		{
+			return true;
+		}
+		if (*end != ',')
+		{
+			return false;
+		}
+		position = end + 1;
+	}
+	return false; // too many sizes
+}
+
+/**
+ * Chooses the message size of the next request.
+ * @param sizes: pointer to the size distribution
+ * @param seed: pointer to the thread's random seed
+ * @return int, number of message characters
+ */
+int choose_message_size(const struct size_distribution *sizes, unsigned int *seed)
+{
+	if (sizes->choice_count == 1)
+	{
+		return sizes->sizes[0];
+	}
+	if (sizes->choice_count == 0)
+	{
+		long long span = (long long)sizes->maximum - sizes->minimum + 1;
+		return sizes->minimum + (int)(((long long)rand_r(seed) * (RAND_MAX + 1LL) + rand_r(seed)) % span);
+	}
+
+	int pick = rand_r(seed) % sizes->total_weight;
+	int choice = 0;
+	while (pick >= sizes->weights[choice])
+	{
+		pick -= sizes->weights[choice++];
+	}
+	return sizes->sizes[choice];
+}
+
+/**
+ * Fills memory with random characters of the alphabet for the messages and keys every request sends.
+ * @param maximum_size: int, size of the largest message
+ * @return char *, maximum_size message characters followed by maximum_size key characters
+ */
+char *build_characters(int maximum_size)
+{
+	char *characters = malloc(2 * (size_t)maximum_size + 1);
+	if (!characters)
+	{
+		fprintf(stderr, "BENCH: ERROR allocating memory for request\n");
+		exit(1);
+	}
+	for (long long i = 0; i < 2LL * maximum_size; i++)
+	{
+		characters[i] = OTP_ALLOWED_CHARACTERS[rand() % OTP_CHARACTERS_LENGTH];
+	}
+	return characters;
+}
+
+/**
+ * Writes one complete request into memory, so each request is written with a single send(): the client type,
+ * then the size-prefixed message and the size-prefixed key, or for a pad request the frame header, pad ID,
+ * offset and size-prefixed message.
+ * @param settings: pointer to the benchmark settings
+ * @param request: pointer to memory for the request (room for the client type, four ints and two maximum messages)
+ * @param message_size: int, number of characters in the message (the key has the same length)
+ * @param pad_id: int, ID of the thread's pad, or 0 to send a key
+ * @param pad_offset: int, position of the first pad character the request uses
+ * @return int, size of the request including the client type
+ */
+int build_request(const struct bench_settings *settings, char *request, int message_size, int pad_id, int pad_offset)
+{
+	char *position = request;
+	memcpy(position, settings->client_type, OTP_HANDSHAKE_LENGTH);
+	position += OTP_HANDSHAKE_LENGTH;
+	if (pad_id != 0)
+	{
+		int header[2] = {htonl(OTP_FRAME_PAD_REQUEST), htonl(pad_id)};
+		memcpy(position, header, sizeof(header));
+		position += sizeof(header);
+		int converted_offset = htonl(pad_offset);
+		memcpy(position, &converted_offset, sizeof(int));
+		position += sizeof(int);
+	}
+
+	// message, then key unless the pad holds it, each preceded by its size in network byte order
+	for (int part = 0; part < (pad_id != 0 ? 1 : 2); part++)
+	{
+		int converted_size = htonl(message_size);
+		memcpy(position, &converted_size, sizeof(int));
+		position += sizeof(int);
+		memcpy(position, settings->characters + part * settings->sizes.maximum, message_size);
+		position += message_size;
+	}
+	return (int)(position - request);
+}
+
+/**
+ * Uploads a pad with room for every request of a thread, even if each has the largest size.
+ * @param settings: pointer to the benchmark settings
+ * @param pad_id: pointer to an int where the ID of the uploaded pad will be stored
+ * @return bool, true if the pad was uploaded
+ */
+bool upload_pad(struct bench_settings *settings, int *pad_id)
+{
+	long long pad_length = (long long)settings->requests_per_thread * settings->sizes.maximum;
+	if (pad_length > INT_MAX)
+	{
+		fprintf(stderr, "BENCH: ERROR- a pad for %d requests of up to %d characters is too large\n",
+				settings->requests_per_thread, settings->sizes.maximum);
+		return false;
+	}
+	int pad_size = (int)pad_length;
+	char *pad = malloc(pad_size > 0 ? pad_size : 1);
+	int connection_socket_fd = otp_connect_to_server(&settings->server_address);
+
+	for (int i = 0; pad && i < pad_size; i += settings->sizes.maximum)
+	{
+		memcpy(pad + i, settings->characters, settings->sizes.maximum); // any characters do
+	}
+	bool succeeded = pad && connection_socket_fd >= 0 &&
+					 otp_send_all(connection_socket_fd, settings->client_type, OTP_HANDSHAKE_LENGTH) == 0 &&
+					 otp_upload_pad(connection_socket_fd, pad, pad_size, OTP_ENCODING_TEXT, pad_id) == 0;
+	if (succeeded)
+	{
+		otp_send_goodbye(connection_socket_fd);
+	}
+
+	if (connection_socket_fd >= 0)
+	{
+		close(connection_socket_fd);
+	}
+	free(pad);
+	return succeeded;
+}
+
+/**
+ * Runs one request: connect and send the client type unless a kept-alive connection is open, send the
+ * request, and receive the whole reply. Without keep-alive the connection is closed afterwards.
+ * @param settings: pointer to the benchmark settings
+ * @param request: pointer to the request, starting with the client type
+ * @param request_size: int, size of the request including the client type
+ * @param message_size: int, number of message characters, which the reply must match
+ * @param connection_socket_fd: pointer to the thread's connection socket (-1 if none is open)
+ * @param busy: pointer to a bool set to whether the server refused the request because it was over capacity
+ * @return bool, true if a reply of the expected size was received
+ */
+bool run_request(struct bench_settings *settings, const char *request, int request_size, int message_size,
+				 int *connection_socket_fd, bool *busy)
+{
+	*busy = false;
+	if (*connection_socket_fd >= 0)
+	{
+		// the session is already open; skip the client type
+		request += OTP_HANDSHAKE_LENGTH;
+		request_size -= OTP_HANDSHAKE_LENGTH;
+	}
+	else
+	{
+		*connection_socket_fd = otp_connect_to_server(&settings->server_address);
+		if (*connection_socket_fd < 0)
+		{
+			return false;
+		}
+	}
+
+	// send the request, then receive the reply size and the reply
+	int reply_size;
+	bool sent = otp_send_all(*connection_socket_fd, request, request_size) == 0;
+	bool succeeded = sent && otp_receive_all(*connection_socket_fd, &reply_size, sizeof(int));
+	if (!sent)
+	{
+		*busy = otp_receive_refusal(*connection_socket_fd) == OTP_REPLY_BUSY;
+	}
+	if (succeeded)
+	{
+		reply_size = ntohl(reply_size);
+		*busy = reply_size == OTP_REPLY_BUSY;
+		char *reply = malloc(reply_size > 0 ? reply_size : 1);
+		succeeded = reply_size == message_size && reply && otp_receive_all(*connection_socket_fd, reply, reply_size);
+		free(reply);
+	}
+
+	if (!succeeded || !settings->keep_alive)
+	{
+		close(*connection_socket_fd);
+		*connection_socket_fd = -1;
+	}
+	return succeeded;
+}
+
+/**
+ * Tells whether a thread has more requests to send: until its share is sent, or in a timed run until the
+ * time is up.
+ * @param settings: pointer to the benchmark settings
+ * @param sent: int, number of requests the thread has sent
+ * @param deadline_us: long long, when a timed run ends
+ * @return bool, true if another request should be sent
+ */
+bool more_requests(const struct bench_settings *settings, int sent, long long deadline_us)
+{
+	return settings->duration_us > 0 ? otp_current_time_us() < deadline_us : sent < settings->requests_per_thread;
+}
+
+/**
+ * Runs a thread's share of the requests as tagged requests on one connection, keeping the configured
+ * number in flight, and records the latency of each from its first byte sent to its last byte received.
+ * A timed run hands the requests over in batches until the time is up.
+ * @param settings: pointer to the benchmark settings
+ * @param results: pointer to the thread's results
+ * @param seed: pointer to the thread's random seed
+ */
+void run_pipelined_requests(struct bench_settings *settings, struct bench_results *results, unsigned int *seed)
+{
+	int batch_size = settings->duration_us > 0 ? PIPELINE_BATCH_SIZE : settings->requests_per_thread;
+	struct otp_tagged_request *requests = calloc(batch_size, sizeof(struct otp_tagged_request));
+	char *result = malloc(settings->sizes.maximum > 0 ? settings->sizes.maximum : 1); // shared; never checked
+	int connection_socket_fd = otp_connect_to_server(&settings->server_address);
+	bool connected = requests && result && connection_socket_fd >= 0 &&
+					 otp_send_all(connection_socket_fd, settings->client_type, OTP_HANDSHAKE_LENGTH) == 0 &&
+					 (settings->encoding == OTP_ENCODING_TEXT ||
+					  otp_negotiate_encoding(connection_socket_fd, settings->encoding) == settings->encoding);
+	bool succeeded = connected;
+
+	long long deadline_us = otp_current_time_us() + settings->duration_us;
+	for (int sent = 0; succeeded && more_requests(settings, sent, deadline_us); sent += batch_size)
+	{
+		// every request sends the prebuilt message and key characters, at its own size
+		for (int i = 0; i < batch_size; i++)
+		{
+			requests[i] = (struct otp_tagged_request){settings->characters, settings->characters + settings->sizes.maximum,
+													  choose_message_size(&settings->sizes, seed), result};
+		}
+		succeeded = otp_pipeline_requests(connection_socket_fd, requests, batch_size, settings->pipeline_depth,
+										  settings->encoding) == 0;
+
+		results->requests += batch_size;
+		if (!succeeded)
+		{
+			results->failures += batch_size;
+			results->busy += errno == EAGAIN ? batch_size : 0;
+			break;
+		}
+		for (int i = 0; i < batch_size; i++)
+		{
+			results->bytes += requests[i].size;
+			results->latency.buckets[otp_histogram_bucket_index(requests[i].replied_at_us - requests[i].sent_at_us)]++;
+		}
+	}
+	if (!connected)
+	{
+		results->requests += settings->duration_us > 0 ? 1 : batch_size; // a timed run fails as one request
+		results->failures += settings->duration_us > 0 ? 1 : batch_size;
+	}
+
+	if (connection_socket_fd >= 0)
+	{
+		if (succeeded)
+		{
+			otp_send_goodbye(connection_socket_fd);
+		}
+		close(connection_socket_fd);
+	}
+	free(requests);
+	free(result);
+}
+
+/**
+ * Runs a thread's share of the requests through the server's shared memory ring, keyed by the thread's pad,
+ * keeping the pipeline depth (at least one) in flight, and records the latency of each from claiming its slot
+ * to reading its result. A full ring is retried after waiting for the oldest request in flight.
+ * @param settings: pointer to the benchmark settings
+ * @param results: pointer to the thread's results
+ * @param pad_id: int, ID of the thread's pad
+ * @param seed: pointer to the thread's random seed
+ */
+void run_shm_requests(struct bench_settings *settings, struct bench_results *results, int pad_id, unsigned int *seed)
+{
+	int depth = settings->pipeline_depth > 0 ? settings->pipeline_depth : 1;
+	uint32_t positions[OTP_PIPELINE_MAX_IN_FLIGHT];
+	int message_sizes[OTP_PIPELINE_MAX_IN_FLIGHT];
+	long long submitted_at_us[OTP_PIPELINE_MAX_IN_FLIGHT];
+	int oldest = 0; // index of the oldest request in flight, in the arrays above used as a ring
+	int in_flight = 0;
+	int pad_offset = 0;
+
+	for (int sent = 0; sent < settings->requests_per_thread || in_flight > 0;)
+	{
+		if (sent < settings->requests_per_thread && in_flight < depth)
+		{
+			uint32_t position;
+			long long started_at_us = otp_current_time_us();
+			char *data = otp_claim_shm_slot(settings->shm_ring, &position);
+			if (data)
+			{
+				// each request uses the next unused range of the pad
+				int message_size = choose_message_size(&settings->sizes, seed);
+				memcpy(data, settings->characters, message_size);
+				otp_submit_shm_request(settings->shm_ring, position, pad_id, pad_offset, message_size);
+				pad_offset += message_size;
+				int index = (oldest + in_flight) % OTP_PIPELINE_MAX_IN_FLIGHT;
+				positions[index] = position;
+				message_sizes[index] = message_size;
+				submitted_at_us[index] = started_at_us;
+				in_flight++;
+				sent++;
+				continue;
+			}
+			if (errno != EAGAIN)
+			{
+				results->requests += settings->requests_per_thread - sent;
+				results->failures += settings->requests_per_thread - sent;
+				sent = settings->requests_per_thread;
+			}
+			if (in_flight == 0)
+			{
+				sched_yield(); // the ring is full of other threads' requests
+				continue;
+			}
+		}
+
+		// collect the oldest reply
+		int result_size = otp_wait_for_shm_reply(settings->shm_ring, positions[oldest]);
+		otp_release_shm_slot(settings->shm_ring, positions[oldest]);
+		results->requests++;
+		if (result_size != message_sizes[oldest])
+		{
+			results->failures++;
+		}
+		else
+		{
+			results->bytes += result_size;
+		}
+		results->latency.buckets[otp_histogram_bucket_index(otp_current_time_us() - submitted_at_us[oldest])]++;
+		oldest = (oldest + 1) % OTP_PIPELINE_MAX_IN_FLIGHT;
+		in_flight--;
+	}
+}
+
+/**
+ * Main loop of a load thread: runs its share of the requests back to back, or pipelined, or for the
+ * configured duration.
+ * @param argument: pointer to the thread's results
+ * @return NULL
+ */
+void *load_thread(void *argument)
+{
+	struct bench_results *results = argument;
+	unsigned int seed = (unsigned int)(size_t)argument; // differs between threads
+	int connection_socket_fd = -1;
+
+	if (settings.pipeline_depth > 0 && !settings.shm_ring)
+	{
+		pthread_barrier_wait(&load_start);
+		run_pipelined_requests(&settings, results, &seed);
+		return NULL;
+	}
+
+	int pad_id = 0;
+	bool ready = !settings.use_pad || upload_pad(&settings, &pad_id);
+	pthread_barrier_wait(&load_start);
+	if (!ready)
+	{
+		results->requests = results->failures = settings.requests_per_thread;
+		return NULL;
+	}
+	if (settings.shm_ring)
+	{
+		run_shm_requests(&settings, results, pad_id, &seed);
+		return NULL;
+	}
+
+	char *request = malloc(OTP_HANDSHAKE_LENGTH + 4 * sizeof(int) + 2 * (size_t)settings.sizes.maximum);
+	if (!request)
+	{
+		fprintf(stderr, "BENCH: ERROR allocating memory for request\n");
+		exit(1);
+	}
+	int request_size = 0;
+	int previous_size = -1;
+	int pad_offset = 0;
+	long long deadline_us = otp_current_time_us() + settings.duration_us;
+	for (int sent = 0; more_requests(&settings, sent, deadline_us); sent++)
+	{
+		// a request keyed by the pad uses the next unused range of it; others are only rebuilt for a new size
+		int message_size = choose_message_size(&settings.sizes, &seed);
+		if (settings.use_pad || message_size != previous_size)
+		{
+			request_size = build_request(&settings, request, message_size, pad_id, pad_offset);
+			pad_offset += settings.use_pad ? message_size : 0;
+			previous_size = message_size;
+		}
+
+		long long started_at_us = otp_current_time_us();
+		bool busy;
+		bool succeeded = run_request(&settings, request, request_size, message_size, &connection_socket_fd, &busy);
+
+		results->requests++;
+		if (!succeeded)
+		{
+			results->failures++;
+			results->busy += busy;
+		}
+		else
+		{
+			results->bytes += message_size;
+		}
+		if (!busy)
+		{
+			results->latency.buckets[otp_histogram_bucket_index(otp_current_time_us() - started_at_us)]++;
+		}
+	}
+
+	// end the kept-alive session
+	if (connection_socket_fd >= 0)
+	{
+		otp_send_goodbye(connection_socket_fd);
+		close(connection_socket_fd);
+	}
+	free(request);
+	return NULL;
+}
+
+/**
+ * Prints the command line usage of the benchmark to stderr.
+ */
+void print_usage(void)
+{
+	fprintf(stderr, "USAGE: otp_bench [--connections N] [--requests N | --duration SECONDS] [--size BYTES|MIN-MAX|BYTES:WEIGHT,...] "
+					"[--type encrypt|decrypt] [--keep-alive] [--pipeline DEPTH [--packed]] [--pad [--shm NAME]] port|socket_path\n");
+}
+
+/**
+ * Main function for the benchmark client.
+ * Runs a closed loop of requests against an enc_server or dec_server from several threads at once,
+ * each request on a new connection (or each thread's requests on one kept-alive connection, possibly
+ * pipelined), for a number of requests or a duration, and prints the request rate, the message throughput
+ * and latency percentiles.
+ * @param argument_count: int, the number of command line arguments
+ * @param argument_array: array, the command line arguments entered (options, then the port number or socket path)
+ */
+int main(int argument_count, char *argument_array[])
+{
+	int connection_count = 8;
+	int total_requests = 10000;
+	double duration_seconds = 0;
+	const char *size_text = "64";
+	const char *client_type = OTP_ENCRYPT_CLIENT;
+	bool keep_alive = false;
+	int pipeline_depth = 0;
+	bool use_pad = false;
+	int encoding = OTP_ENCODING_TEXT;
+	const char *shm_name = NULL;
+
+	static struct option long_options[] = {
+		{"connections", required_argument, NULL, 'c'},
+		{"requests", required_argument, NULL, 'n'},
+		{"duration", required_argument, NULL, 'd'},
+		{"size", required_argument, NULL, 's'},
+		{"type", required_argument, NULL, 't'},
+		{"keep-alive", no_argument, NULL, 'k'},
+		{"pipeline", required_argument, NULL, 'p'},
+		{"pad", no_argument, NULL, 'P'},
+		{"packed", no_argument, NULL, 'e'},
+		{"shm", required_argument, NULL, 'S'},
+		{NULL, 0, NULL, 0}};
+
+	// parse options
+	int option;
+	while ((option = getopt_long(argument_count, argument_array, "c:n:d:s:t:kp:PeS:", long_options, NULL)) != -1)
+	{
+		switch (option)
+		{
+		case 'c':
+			connection_count = atoi(optarg);
+			break;
+		case 'n':
+			total_requests = atoi(optarg);
+			break;
+		case 'd':
+			duration_seconds = atof(optarg);
+			break;
+		case 's':
+			size_text = optarg;
+			break;
+		case 't':
+			client_type = optarg;
+			break;
+		case 'k':
+			keep_alive = true;
+			break;
+		case 'p':
+			pipeline_depth = atoi(optarg);
+			break;
+		case 'P':
+			use_pad = true;
+			break;
+		case 'e':
+			encoding = OTP_ENCODING_PACKED;
+			break;
+		case 'S':
+			shm_name = optarg;
+			break;
+		default:
+			print_usage();
+			exit(1);
+		}
+	}
+	memset(&settings, 0, sizeof(settings));
+	if (argument_count - optind != 1 || connection_count <= 0 || total_requests <= 0 || duration_seconds < 0 ||
+		!parse_size_distribution(size_text, &settings.sizes) ||
+		pipeline_depth < 0 || pipeline_depth > OTP_PIPELINE_MAX_IN_FLIGHT || (use_pad && pipeline_depth > 0 && !shm_name) ||
+		(use_pad && duration_seconds > 0) || (encoding != OTP_ENCODING_TEXT && (pipeline_depth == 0 || shm_name)) ||
+		(shm_name && (!use_pad || keep_alive || settings.sizes.maximum > OTP_SHM_SLOT_SIZE)) ||
+		(strcmp(client_type, OTP_ENCRYPT_CLIENT) != 0 && strcmp(client_type, OTP_DECRYPT_CLIENT) != 0))
+	{
+		print_usage();
+		exit(1);
+	}
+
+	// set up the server address and the characters every thread sends
+	if (otp_setup_server_address(&settings.server_address, argument_array[optind], "localhost") < 0)
+	{
+		fprintf(stderr, "BENCH: ERROR- bad server %s\n", argument_array[optind]);
+		exit(1);
+	}
+	settings.client_type = client_type;
+	settings.requests_per_thread = (total_requests + connection_count - 1) / connection_count;
+	settings.duration_us = (long long)(duration_seconds * 1000000);
+	settings.characters = build_characters(settings.sizes.maximum);
+	settings.keep_alive = keep_alive;
+	settings.pipeline_depth = pipeline_depth;
+	settings.use_pad = use_pad;
+	settings.encoding = encoding;
+	if (shm_name && !(settings.shm_ring = otp_attach_shm_ring(shm_name, client_type)))
+	{
+		fprintf(stderr, "BENCH: ERROR attaching to shared memory ring %s (%s)\n", shm_name, strerror(errno));
+		exit(1);
+	}
+	signal(SIGPIPE, SIG_IGN); // a server that closes the connection early fails the request instead of the benchmark
+
+	pthread_t *threads = calloc(connection_count, sizeof(pthread_t));
+	struct bench_results *results = calloc(connection_count, sizeof(struct bench_results));
+	if (!threads || !results)
+	{
+		fprintf(stderr, "BENCH: ERROR allocating memory for threads\n");
+		exit(1);
+	}
+
+	// run the load
+	pthread_barrier_init(&load_start, NULL, connection_count + 1);
+	for (int i = 0; i < connection_count; i++)
+	{
+		if (pthread_create(&threads[i], NULL, load_thread, &results[i]) != 0)
+		{
+			fprintf(stderr, "BENCH: ERROR creating load thread\n");
+			exit(1);
+		}
+	}
+	pthread_barrier_wait(&load_start);
+	long long started_at_us = otp_current_time_us();
+	for (int i = 0; i < connection_count; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	double elapsed_seconds = (otp_current_time_us() - started_at_us) / 1000000.0;
+
+	// merge the per-thread results
+	struct bench_results total;
+	memset(&total, 0, sizeof(total));
+	for (int i = 0; i < connection_count; i++)
+	{
+		total.requests += results[i].requests;
+		total.failures += results[i].failures;
+		total.busy += results[i].busy;
+		total.bytes += results[i].bytes;
+		for (int j = 0; j < OTP_HISTOGRAM_BUCKETS; j++)
+		{
+			total.latency.buckets[j] += results[i].latency.buckets[j];
+		}
+	}
+
+	printf("requests=%lu failed=%lu busy=%lu connections=%d size=%s elapsed=%.2fs rate=%.1f req/s throughput=%.2f MB/s "
+		   "p50=%lldus p99=%lldus p999=%lldus\n",
+		   total.requests, total.failures, total.busy, connection_count, size_text, elapsed_seconds,
+		   total.requests / elapsed_seconds, total.bytes / elapsed_seconds / 1000000.0,
+		   otp_histogram_percentile(&total.latency, 50), otp_histogram_percentile(&total.latency, 99),
+		   otp_histogram_percentile(&total.latency, 99.9));
+
+	// clean up
+	free(settings.characters);
+	free(threads);
+	free(results);
+	return total.failures > 0 ? 1 : 0;
+}
@@ -1,7 +1,26 @@
 #!/bin/bash
 
-gcc -o keygen keygen/keygen.c
-gcc -o enc_server enc_server/enc_server.c
-gcc -o enc_client enc_client/enc_client.c
-gcc -o dec_server dec_server/dec_server.c
-gcc -o dec_client dec_client/dec_client.c
+# each binary is built next to its source, e.g. enc_server/enc_server
+# set IO_URING=1 to build the servers with the io_uring worker model (Linux 6.0 or newer)
+CFLAGS="-O2 -Wall -Ilibotp"
+LIBOTP_FLAGS=""
+if [ "$IO_URING" = "1" ]; then
+	LIBOTP_FLAGS="-DUSE_IO_URING"
+fi
+
+# the protocol, cipher and server code shared by every program lives in libotp/libotp.a
+rm -f libotp/libotp.a
+for source in libotp/*.c; do
+	gcc $CFLAGS $LIBOTP_FLAGS -c -o "${source%.c}.o" "$source" || exit 1
+done
+ar rcs libotp/libotp.a libotp/*.o || exit 1
+
+LIBS="libotp/libotp.a -pthread"
+gcc $CFLAGS -o keygen/keygen keygen/keygen.c $LIBS
+gcc $CFLAGS -o padconv/padconv padconv/padconv.c $LIBS
+gcc $CFLAGS -o enc_server/enc_server enc_server/enc_server.c $LIBS
+gcc $CFLAGS -o enc_client/enc_client enc_client/enc_client.c $LIBS
+gcc $CFLAGS -o dec_server/dec_server dec_server/dec_server.c $LIBS
+gcc $CFLAGS -o dec_client/dec_client dec_client/dec_client.c $LIBS
+gcc $CFLAGS -o bench/otp_bench bench/otp_bench.c $LIBS
+gcc $CFLAGS -o bench/cipher_bench bench/cipher_bench.c $LIBS
@@ -1,38 +1,305 @@
-#include <stdio.h>	// for printf
-#include <stdlib.h> // for atoi
-#include <time.h>	// for srand
+#include <stdio.h>	// for fprintf
+#include <stdlib.h> // for strtoll
+#include <stdint.h> // for uint32_t
 #include <errno.h>	// for errno
-#include <limits.h> // for INT_MAX
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>	 // for open
+#include <unistd.h>	 // for write, pwrite
+#include <getopt.h>	 // for getopt_long
+#include <pthread.h> // one thread per slice of the key
+#include <sys/stat.h>	// for fstat
+#include <sys/random.h> // for getrandom
+#include "otp_cipher.h"	  // for OTP_ALLOWED_CHARACTERS
+#include "otp_encoding.h" // for otp_pack_characters
+#include "otp_pad_file.h" // the packed pad file format
+#include "otp_stats.h"	  // for otp_current_time_us
 
 // macros
-#define ALLOWED_CHARACTERS "ABCDEFGHIJKLMNOPQRSTUVWXYZ "
-#define CHARACTERS_LENGTH (sizeof(ALLOWED_CHARACTERS) - 1)
-#define MAX_KEY_LENGTH 100000 // maximum reasonable key length
+#define KEY_BUFFER_SIZE (1 << 20)	 // key characters written at a time
+#define PACKED_GROUP_CHARACTERS 5	 // characters in a packed group
+#define PACKED_GROUP_BYTES 3		 // bytes of a packed group
+#define PACKED_BUFFER_CHARACTERS (KEY_BUFFER_SIZE / PACKED_GROUP_CHARACTERS * PACKED_GROUP_CHARACTERS) // whole groups
+#define ENTROPY_WORDS (1 << 14)	 // random 32-bit words requested from the kernel at a time
+#define CHARACTERS_PER_WORD 6		 // key characters taken from each accepted word, as base-27 digits
+#define WORD_RANGE 387420489U		 // 27^6, the number of distinct 6-character groups
+// random words at or above this value are rejected, so every accepted word maps onto the 6-character
+// groups the same number of times and no character is more likely than another (fewer than 1% are rejected)
+#define REJECTION_LIMIT (UINT32_MAX / WORD_RANGE * WORD_RANGE)
+#define MAX_THREADS 1024
+#define USAGE "USAGE: keygen [--threads N] [--output FILE] [--packed] [--report] key_length\n"
+
+// random words not used for key characters yet
+struct entropy_pool
+{
+	uint32_t words[ENTROPY_WORDS];
+	int used;	// words taken so far
+	int length; // words in the pool
+};
+
+// one thread's share of the key, written at its own position of the output
+struct key_slice
+{
+	int output_fd;
+	bool positional; // written with pwrite() at offset, so slices can be written in parallel
+	long long offset; // position of the slice in the output
+	long long length; // number of key characters
+	bool packed;	  // written five characters to three bytes, for a pad file
+	uint32_t checksum; // CRC-32C of the packed bytes of the slice
+	long long size;	  // bytes written
+	int error;		  // errno of the first failure, 0 on success
+	const char *failure;
+};
+
+// function prototypes
+int refill_entropy_pool(struct entropy_pool *pool);
+int generate_key_characters(struct entropy_pool *pool, char *key, int length);
+int write_all(int fd, const char *buffer, size_t length);
+int pwrite_all(int fd, const char *buffer, size_t length, long long offset);
+void *generate_key_slice(void *argument);
+
+/**
+ * Refills the pool with random words from the kernel's CSPRNG.
+ * @param pool: pointer to the entropy pool
+ * @return int, 0 on success, -1 with errno set if no random bytes could be read
+ */
+int refill_entropy_pool(struct entropy_pool *pool)
+{
+	ssize_t bytes_read;
+	do
+	{
+		bytes_read = getrandom(pool->words, sizeof(pool->words), 0);
+	} while (bytes_read < 0 && errno == EINTR);
+	if (bytes_read < (ssize_t)sizeof(uint32_t))
+	{
+		if (bytes_read >= 0)
+		{
+			errno = EIO;
+		}
+		return -1;
+	}
+	pool->used = 0;
+	pool->length = bytes_read / sizeof(uint32_t); // may be short if a signal arrived; the rest comes next time
+	return 0;
+}
+
+/**
+ * Fills a buffer with uniformly random key characters, using rejection sampling on random 32-bit words:
+ * a word below REJECTION_LIMIT is reduced modulo 27^6 and its six base-27 digits pick six characters,
+ * and any other word is skipped. This takes about 0.67 random bytes per character instead of one.
+ * @param pool: pointer to the entropy pool the random words come from
+ * @param key: buffer for the key characters
+ * @param length: int, number of characters to generate
+ * @return int, 0 on success, -1 with errno set if the pool could not be refilled
+ */
+int generate_key_characters(struct entropy_pool *pool, char *key, int length)
+{
+	int generated = 0;
+	while (generated < length)
+	{
+		if (pool->used == pool->length && refill_entropy_pool(pool) < 0)
+		{
+			return -1;
+		}
+		while (pool->used < pool->length && generated < length)
+		{
+			uint32_t random_word = pool->words[pool->used++];
+			if (random_word >= REJECTION_LIMIT)
+			{
+				continue;
+			}
+			random_word %= WORD_RANGE;
+
+			// the digits of an accepted word are independent, so a partial group at the end is still uniform
+			for (int digit = 0; digit < CHARACTERS_PER_WORD && generated < length; digit++)
+			{
+				key[generated++] = OTP_ALLOWED_CHARACTERS[random_word % OTP_CHARACTERS_LENGTH];
+				random_word /= OTP_CHARACTERS_LENGTH;
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * Writes a whole buffer to a file descriptor, continuing after short writes.
+ * @param fd: int, file descriptor to write to
+ * @param buffer: bytes to write
+ * @param length: size_t, number of bytes
+ * @return int, 0 on success, -1 with errno set if the write failed
+ */
+int write_all(int fd, const char *buffer, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t bytes_written = write(fd, buffer, length);
+		if (bytes_written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		buffer += bytes_written;
+		length -= bytes_written;
+	}
+	return 0;
+}
+
+/**
+ * Writes a whole buffer at a position of a file, continuing after short writes.
+ * @param fd: int, file descriptor of a regular file
+ * @param buffer: bytes to write
+ * @param length: size_t, number of bytes
+ * @param offset: long long, position in the file of the first byte
+ * @return int, 0 on success, -1 with errno set if the write failed
+ */
+int pwrite_all(int fd, const char *buffer, size_t length, long long offset)
+{
+	while (length > 0)
+	{
+		ssize_t bytes_written = pwrite(fd, buffer, length, offset);
+		if (bytes_written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		buffer += bytes_written;
+		length -= bytes_written;
+		offset += bytes_written;
+	}
+	return 0;
+}
+
+/**
+ * Generates one slice of the key and writes it a buffer at a time, with its own buffer and entropy
+ * pool so slices share nothing and run in parallel. A packed slice is packed in place before it is
+ * written, and its checksum is computed as it goes.
+ * @param argument: pointer to the struct key_slice to generate; its error and failure are filled in
+ * @return void *, always NULL
+ */
+void *generate_key_slice(void *argument)
+{
+	struct key_slice *slice = argument;
+	struct entropy_pool *pool = malloc(sizeof(struct entropy_pool));
+	char *key = malloc(KEY_BUFFER_SIZE);
+	if (!pool || !key)
+	{
+		slice->error = ENOMEM;
+		slice->failure = "Memory could not be allocated for key buffer";
+		free(pool);
+		free(key);
+		return NULL;
+	}
+	pool->used = pool->length = 0;
+
+	int buffer_length = slice->packed ? PACKED_BUFFER_CHARACTERS : KEY_BUFFER_SIZE;
+	for (long long generated = 0; generated < slice->length;)
+	{
+		int length = slice->length - generated < buffer_length ? (int)(slice->length - generated) : buffer_length;
+		if (generate_key_characters(pool, key, length) < 0)
+		{
+			slice->error = errno;
+			slice->failure = "Could not read random bytes";
+			break;
+		}
+		int size = length;
+		if (slice->packed)
+		{
+			otp_pack_characters(key, length, key); // the characters are all valid
+			size = otp_encoded_size(OTP_ENCODING_PACKED, length);
+			slice->checksum = otp_crc32c(slice->checksum, key, size);
+		}
+		int status = slice->positional ? pwrite_all(slice->output_fd, key, size, slice->offset + slice->size)
+									   : write_all(slice->output_fd, key, size);
+		if (status < 0)
+		{
+			slice->error = errno;
+			slice->failure = "Could not write key";
+			break;
+		}
+		generated += length;
+		slice->size += size;
+	}
+
+	free(pool);
+	free(key);
+	return NULL;
+}
 
 /**
  * Generates a random key from a predefined set of characters.
- * Length of the key is specified by user from command line.
+ * Length of the key is specified by user from command line. The key is generated and written a buffer
+ * at a time, so any length works in fixed memory. With --threads the key is split into that many slices,
+ * generated in parallel and written with pwrite() at their own positions of the output, which must then
+ * be a regular file. With --packed the key is written as a pad file (see otp_pad_file.h) instead of text;
+ * its header is written last, once the checksum is known, so the output must be a regular file too.
  * @param argument_count: int, the number of command line arguments
- * @param argument_array: array, the command line arguments entered (first is the program name,
- * second is the length of the key)
+ * @param argument_array: array, the command line arguments entered (options, then the length of the key)
  */
 int main(int argument_count, char *argument_array[])
 {
-	if (argument_count < 2)
+	int thread_count = 1;
+	const char *output_path = NULL;
+	bool report = false;
+	bool packed = false;
+
+	static struct option long_options[] = {
+		{"threads", required_argument, NULL, 't'},
+		{"output", required_argument, NULL, 'o'},
+		{"packed", no_argument, NULL, 'p'},
+		{"report", no_argument, NULL, 'r'},
+		{NULL, 0, NULL, 0}};
+
+	// parse options
+	int option;
+	while ((option = getopt_long(argument_count, argument_array, "t:o:pr", long_options, NULL)) != -1)
+	{
+		switch (option)
+		{
+		case 't':
+			thread_count = atoi(optarg);
+			break;
+		case 'o':
+			output_path = optarg;
+			break;
+		case 'p':
+			packed = true;
+			break;
+		case 'r':
+			report = true;
+			break;
+		default:
+			fprintf(stderr, USAGE);
+			exit(1);
+		}
+	}
+	if (thread_count < 1 || thread_count > MAX_THREADS)
+	{
+		fprintf(stderr, "ERROR: Thread count must be between 1 and %d\n", MAX_THREADS);
+		exit(1);
+	}
+
+	if (argument_count - optind < 1)
 	{
 		fprintf(stderr, "Please specify the length of the key.\n");
 		exit(1);
 	}
-	else if (argument_count > 2)
+	else if (argument_count - optind > 1)
 	{
 		fprintf(stderr, "Please ONLY specify the length of the key.\n");
 		exit(1);
 	}
 
 	// validate and convert command line argument to integer
+	char *length_argument = argument_array[optind];
 	char *endptr;
 	errno = 0;
-	long key_length_long = strtol(argument_array[1], &endptr, 10);
+	long long key_length = strtoll(length_argument, &endptr, 10);
 
 	// check for conversion errors
 	if (errno != 0)
@@ -42,55 +309,132 @@ int main(int argument_count, char *argument_array[])
 	}
 
 	// check if entire string was converted
-	if (endptr == argument_array[1] || *endptr != '\0')
+	if (endptr == length_argument || *endptr != '\0')
 	{
 		fprintf(stderr, "ERROR: Key length must be a valid integer\n");
 		exit(2);
 	}
 
 	// check for valid range
-	if (key_length_long <= 0)
+	if (key_length <= 0)
 	{
 		fprintf(stderr, "ERROR: Key length must be a positive integer\n");
 		exit(2);
 	}
 
-	if (key_length_long > MAX_KEY_LENGTH)
+	// open the output
+	int output_fd = STDOUT_FILENO;
+	if (output_path)
 	{
-		fprintf(stderr, "ERROR: Key length too large (maximum %d)\n", MAX_KEY_LENGTH);
-		exit(2);
+		output_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0600); // pads are secret
+		if (output_fd < 0)
+		{
+			fprintf(stderr, "ERROR: Could not open %s\n", output_path);
+			exit(3);
+		}
 	}
 
-	// check if value fits in int
-	if (key_length_long > INT_MAX)
+	// slices are written at their own positions, which needs a regular file (not opened for appending,
+	// where Linux ignores the position); size it up front so the slices fill in a file of the final size
+	long long start = 0;
+	bool positional = thread_count > 1 || packed;
+	if (positional)
 	{
-		fprintf(stderr, "ERROR: Key length exceeds maximum integer value\n");
-		exit(2);
+		struct stat output_status;
+		long long output_size = packed ? otp_pad_file_size(key_length) : key_length + 1;
+		if (fstat(output_fd, &output_status) < 0 || !S_ISREG(output_status.st_mode) ||
+			(fcntl(output_fd, F_GETFL) & O_APPEND) || (start = lseek(output_fd, 0, SEEK_CUR)) < 0 ||
+			ftruncate(output_fd, start + output_size) < 0)
+		{
+			fprintf(stderr, "ERROR: %s needs a regular output file (use --output, or redirect with >)\n",
+					packed ? "--packed" : "--threads");
+			exit(3);
+		}
 	}
 
-	int key_length = (int)key_length_long;
+	struct key_slice *slices = calloc(thread_count, sizeof(struct key_slice));
+	pthread_t *threads = calloc(thread_count, sizeof(pthread_t));
+	if (!slices || !threads)
+	{
+		fprintf(stderr, "ERROR: Memory could not be allocated for threads\n");
+		exit(3);
+	}
 
-	// seed random number generator
-	srand(time(NULL));
+	// split the key into equal slices, the first ones taking a character more when it does not divide evenly;
+	// packed slices are split by whole groups, so each packs on its own
+	long long started_at_us = otp_current_time_us();
+	long long unit = packed ? PACKED_GROUP_CHARACTERS : 1;
+	long long units = (key_length + unit - 1) / unit;
+	long long offset = packed ? start + OTP_PAD_FILE_HEADER_SIZE : start;
+	long long remaining = key_length;
+	for (int i = 0; i < thread_count; i++)
+	{
+		long long length = (units / thread_count + (i < units % thread_count)) * unit;
+		length = length < remaining ? length : remaining;
+		slices[i] = (struct key_slice){output_fd, positional, offset, length, packed};
+		offset += packed ? length / unit * PACKED_GROUP_BYTES : length;
+		remaining -= length;
+	}
+	if (thread_count == 1)
+	{
+		generate_key_slice(&slices[0]); // streamed in order, so any output works
+	}
+	else
+	{
+		for (int i = 0; i < thread_count; i++)
+		{
+			if (pthread_create(&threads[i], NULL, generate_key_slice, &slices[i]) != 0)
+			{
+				fprintf(stderr, "ERROR: Could not create key thread\n");
+				exit(3);
+			}
+		}
+		for (int i = 0; i < thread_count; i++)
+		{
+			pthread_join(threads[i], NULL);
+		}
+	}
 
-	// allocate memory for key with bounds checking
-	char *key = calloc((size_t)key_length + 1, sizeof(char));
-	if (!key)
+	for (int i = 0; i < thread_count; i++)
+	{
+		if (slices[i].failure)
+		{
+			fprintf(stderr, "ERROR: %s (%s)\n", slices[i].failure, strerror(slices[i].error));
+			exit(3);
+		}
+	}
+	int status;
+	if (packed)
+	{
+		// the slices' checksums, in order, make up the checksum of the whole pad
+		uint32_t checksum = 0;
+		for (int i = 0; i < thread_count; i++)
+		{
+			checksum = otp_crc32c_combine(checksum, slices[i].checksum, slices[i].size);
+		}
+		char header[OTP_PAD_FILE_HEADER_SIZE];
+		otp_format_pad_file_header(header, key_length, checksum);
+		status = pwrite_all(output_fd, header, sizeof(header), start);
+	}
+	else
 	{
-		fprintf(stderr, "ERROR: Memory could not be allocated for key of length %d\n", key_length);
+		status = positional ? pwrite_all(output_fd, "\n", 1, offset) : write_all(output_fd, "\n", 1);
+	}
+	if (status < 0 || (output_path && close(output_fd) < 0))
+	{
+		fprintf(stderr, "ERROR: Could not write key\n");
 		exit(3);
 	}
 
-	// generate key
-	for (int i = 0; i < key_length; i++)
+	if (report)
 	{
-		int random_index = rand() % CHARACTERS_LENGTH;
-		key[i] = ALLOWED_CHARACTERS[random_index];
+		double elapsed = (otp_current_time_us() - started_at_us) / 1e6;
+		double rate = key_length / elapsed / 1e9;
+		fprintf(stderr, "KEYGEN: threads=%d bytes=%lld elapsed=%.2fs rate=%.3f GB/s per_thread=%.3f GB/s\n",
+				thread_count, key_length, elapsed, rate, rate / thread_count);
 	}
 
-	key[key_length] = '\0'; // ensure null termination
-
-	printf("%s\n", key);
-	free(key);
+	free(slices);
+	free(threads);
 	return 0;
 }
@@ -0,0 +1,296 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "otp_buffer_pool.h"
+
+#define POOL_CLASS_COUNT 18		// size classes from OTP_POOL_MIN_BUFFER_SIZE (2^6) to OTP_POOL_MAX_BUFFER_SIZE (2^23)
+#define POOL_MIN_CLASS_SHIFT 6	// log2 of OTP_POOL_MIN_BUFFER_SIZE
+#define POOL_HEADER_SIZE 16		// bytes in front of each buffer, which keeps malloc()'s alignment
+#define POOL_UNPOOLED_CLASS -1	// the class of a buffer too large to pool
+
+// a free buffer, linked into its class's free list through its first bytes
+struct pool_buffer
+{
+	struct pool_buffer *next;
+};
+
+// free buffers, of one thread or of the shared depot
+struct buffer_pool
+{
+	struct pool_buffer *free_buffers[POOL_CLASS_COUNT];
+	int free_counts[POOL_CLASS_COUNT]; // the depot's are read without its lock, so they are only stored atomically
+	long long cached_bytes; // bytes in all the free lists
+};
+
+static __thread struct buffer_pool pool;
+static __thread long long pool_trim_generation; // the budget's trim generation this thread's pool last saw
+
+// buffers a thread had no room for, for threads whose own lists are empty (under depot_lock)
+static struct buffer_pool depot;
+static pthread_mutex_t depot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// set once by otp_set_pool_budget(), before any other thread or worker process starts
+static struct otp_pool_budget *budget;
+static const long long *budget_held_bytes; // bytes requests hold, which the pools' bytes are added to
+static long long budget_limit;			   // the most both may come to, or 0 for no limit
+
+// function prototypes
+static int size_class(size_t size);
+static struct pool_buffer *take_buffer(struct buffer_pool *from, int class);
+static bool put_buffer(struct buffer_pool *into, int class, struct pool_buffer *buffer, int max_count,
+					   long long max_bytes);
+static bool count_pooled_bytes(long long bytes);
+static void uncount_pooled_bytes(long long bytes);
+static void empty_pool(struct buffer_pool *from);
+static void follow_trim_generation(void);
+
+/**
+ * Returns the size class of a buffer size: the smallest power of two class that holds it.
+ * @param size: size_t, bytes needed
+ * @return int, the class index, or POOL_UNPOOLED_CLASS if the size is larger than OTP_POOL_MAX_BUFFER_SIZE
+ */
+static int size_class(size_t size)
+{
+	if (size <= OTP_POOL_MIN_BUFFER_SIZE)
+	{
+		return 0;
+	}
+	if (size > OTP_POOL_MAX_BUFFER_SIZE)
+	{
+		return POOL_UNPOOLED_CLASS;
+	}
+	return (int)(sizeof(unsigned long long) * 8) - __builtin_clzll(size - 1) - POOL_MIN_CLASS_SHIFT;
+}
+
+/**
+ * Takes a free buffer of a size class from a pool.
+ * @param from: pointer to the pool
+ * @param class: int, the size class
+ * @return pointer to the buffer, or NULL if the class's free list is empty
+ */
+static struct pool_buffer *take_buffer(struct buffer_pool *from, int class)
+{
+	struct pool_buffer *buffer = from->free_buffers[class];
+	if (buffer)
+	{
+		from->free_buffers[class] = buffer->next;
+		__atomic_store_n(&from->free_counts[class], from->free_counts[class] - 1, __ATOMIC_RELAXED);
+		from->cached_bytes -= (long long)OTP_POOL_MIN_BUFFER_SIZE << class;
+	}
+	return buffer;
+}
+
+/**
+ * Puts a free buffer of a size class into a pool, if the pool has room for it.
+ * @param into: pointer to the pool
+ * @param class: int, the size class
+ * @param buffer: pointer to the buffer
+ * @param max_count: int, free buffers the class's list may hold
+ * @param max_bytes: long long, free bytes the pool may hold
+ * @return bool, false if the pool is full (the buffer is then left to the caller)
+ */
+static bool put_buffer(struct buffer_pool *into, int class, struct pool_buffer *buffer, int max_count,
+					   long long max_bytes)
+{
+	long long capacity = (long long)OTP_POOL_MIN_BUFFER_SIZE << class;
+	if (into->free_counts[class] >= max_count || into->cached_bytes + capacity > max_bytes)
+	{
+		return false;
+	}
+	buffer->next = into->free_buffers[class];
+	into->free_buffers[class] = buffer;
+	__atomic_store_n(&into->free_counts[class], into->free_counts[class] + 1, __ATOMIC_RELAXED);
+	into->cached_bytes += capacity;
+	return true;
+}
+
+/**
+ * Allocates a buffer, reusing a free one of the same size class from this thread's pool, or else from the
+ * shared depot, if there is one. The contents are not zeroed.
+ * @param size: size_t, bytes needed
+ * @return pointer to the buffer (release it with otp_free_buffer(), not free()), or NULL if memory ran out
+ */
+void *otp_allocate_buffer(size_t size)
+{
+	follow_trim_generation();
+	int class = size_class(size);
+	if (class != POOL_UNPOOLED_CLASS)
+	{
+		struct pool_buffer *buffer = take_buffer(&pool, class);
+		// the count is read without the lock, so a thread that never frees into the depot never takes it
+		if (!buffer && __atomic_load_n(&depot.free_counts[class], __ATOMIC_RELAXED) > 0)
+		{
+			pthread_mutex_lock(&depot_lock);
+			buffer = take_buffer(&depot, class);
+			pthread_mutex_unlock(&depot_lock);
+		}
+		if (buffer)
+		{
+			uncount_pooled_bytes((long long)OTP_POOL_MIN_BUFFER_SIZE << class);
+			return buffer;
+		}
+	}
+
+	char *block = malloc(POOL_HEADER_SIZE + otp_buffer_capacity(size));
+	if (!block)
+	{
+		return NULL;
+	}
+	*(int *)block = class;
+	return block + POOL_HEADER_SIZE;
+}
+
+/**
+ * Returns a buffer to this thread's pool, or to the shared depot if its class's free list or the pool is full,
+ * or to the allocator if the depot is full too, or if keeping it would take the pools over their budget.
+ * @param buffer: pointer to a buffer from otp_allocate_buffer(), or NULL
+ */
+void otp_free_buffer(void *buffer)
+{
+	if (!buffer)
+	{
+		return;
+	}
+	follow_trim_generation();
+	char *block = (char *)buffer - POOL_HEADER_SIZE;
+	int class = *(int *)block;
+	long long capacity = class == POOL_UNPOOLED_CLASS ? 0 : (long long)OTP_POOL_MIN_BUFFER_SIZE << class;
+	if (class == POOL_UNPOOLED_CLASS || !count_pooled_bytes(capacity))
+	{
+		free(block);
+		return;
+	}
+	if (put_buffer(&pool, class, buffer, OTP_POOL_BUFFERS_PER_CLASS, OTP_POOL_MAX_CACHED_BYTES))
+	{
+		return;
+	}
+	pthread_mutex_lock(&depot_lock);
+	bool kept = put_buffer(&depot, class, buffer, OTP_POOL_SHARED_BUFFERS_PER_CLASS, OTP_POOL_MAX_SHARED_BYTES);
+	pthread_mutex_unlock(&depot_lock);
+	if (!kept)
+	{
+		uncount_pooled_bytes(capacity);
+		free(block);
+	}
+}
+
+/**
+ * Returns the memory a buffer of a size takes: its size class, or the size itself for a buffer too large to pool.
+ * Memory reserved for a buffer should be its capacity, not the size asked for.
+ * @param size: size_t, bytes needed
+ * @return size_t, bytes the buffer will take (not counting the few in front of it)
+ */
+size_t otp_buffer_capacity(size_t size)
+{
+	int class = size_class(size);
+	return class == POOL_UNPOOLED_CLASS ? size : (size_t)OTP_POOL_MIN_BUFFER_SIZE << class;
+}
+
+/**
+ * Counts what the pools keep against a limit shared with the memory requests hold, such as --max-buffered.
+ * Call before starting any other thread or worker process; without a budget, the pools only keep within
+ * their own limits.
+ * @param pool_budget: pointer to the budget, in memory every worker process shares
+ * @param held_bytes: pointer to the bytes requests hold, in the same memory
+ * @param limit: long long, the most both may come to, or 0 to only count what the pools keep
+ */
+void otp_set_pool_budget(struct otp_pool_budget *pool_budget, const long long *held_bytes, long long limit)
+{
+	budget = pool_budget;
+	budget_held_bytes = held_bytes;
+	budget_limit = limit;
+}
+
+/**
+ * Frees what this thread's pool and its process's depot keep, and has every other pool do the same at its
+ * next allocation or free. Called when a request finds no room within the budget, as the pools may be what
+ * takes it.
+ */
+void otp_trim_buffer_pools(void)
+{
+	if (budget)
+	{
+		pool_trim_generation = __atomic_add_fetch(&budget->trim_generation, 1, __ATOMIC_RELAXED);
+	}
+	otp_empty_buffer_pools();
+}
+
+/**
+ * Frees what this thread's pool and its process's depot keep, such as before a worker process exits, so the
+ * budget stops counting it.
+ */
+void otp_empty_buffer_pools(void)
+{
+	empty_pool(&pool);
+	pthread_mutex_lock(&depot_lock);
+	empty_pool(&depot);
+	pthread_mutex_unlock(&depot_lock);
+}
+
+/**
+ * Counts a buffer's bytes as kept by the pools, if they fit the budget.
+ * @param bytes: long long, the buffer's capacity
+ * @return bool, false if keeping the buffer would take the pools and requests over the limit (nothing is counted)
+ */
+static bool count_pooled_bytes(long long bytes)
+{
+	if (!budget)
+	{
+		return true;
+	}
+	long long pooled = __atomic_add_fetch(&budget->pooled_bytes, bytes, __ATOMIC_RELAXED);
+	if (budget_limit > 0 && pooled + __atomic_load_n(budget_held_bytes, __ATOMIC_RELAXED) > budget_limit)
+	{
+		__atomic_fetch_sub(&budget->pooled_bytes, bytes, __ATOMIC_RELAXED);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Stops counting a buffer's bytes as kept by the pools, once it is taken out of one.
+ * @param bytes: long long, the buffer's capacity
+ */
+static void uncount_pooled_bytes(long long bytes)
+{
+	if (budget)
+	{
+		__atomic_fetch_sub(&budget->pooled_bytes, bytes, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Gives every buffer a pool keeps back to the allocator.
+ * @param from: pointer to the pool (the depot under depot_lock)
+ */
+static void empty_pool(struct buffer_pool *from)
+{
+	for (int class = 0; class < POOL_CLASS_COUNT; class++)
+	{
+		struct pool_buffer *buffer;
+		while ((buffer = take_buffer(from, class)))
+		{
+			uncount_pooled_bytes((long long)OTP_POOL_MIN_BUFFER_SIZE << class);
+			free((char *)buffer - POOL_HEADER_SIZE);
+		}
+	}
+}
+
+/**
+ * Empties this thread's pool and its process's depot if another thread has trimmed the pools since this one
+ * last looked (see otp_trim_buffer_pools()).
+ */
+static void follow_trim_generation(void)
+{
+	if (!budget)
+	{
+		return;
+	}
+	long long generation = __atomic_load_n(&budget->trim_generation, __ATOMIC_RELAXED);
+	if (generation == pool_trim_generation)
+	{
+		return;
+	}
+	pool_trim_generation = generation;
+	otp_empty_buffer_pools();
+}
@@ -0,0 +1,39 @@
+#ifndef OTP_BUFFER_POOL_H
+#define OTP_BUFFER_POOL_H
+
+#include <stddef.h>
+
+// The buffers of a request (message, key, result and reply) come from a pool kept by each thread, so a worker
+// serving requests of similar sizes reuses the same few buffers instead of calling the allocator three times
+// per request. Sizes are rounded up to a power of two between OTP_POOL_MIN_BUFFER_SIZE and
+// OTP_POOL_MAX_BUFFER_SIZE, and each size class keeps a free list of up to OTP_POOL_BUFFERS_PER_CLASS buffers,
+// with at most OTP_POOL_MAX_CACHED_BYTES held per thread. A buffer a thread has no room for goes to a depot
+// shared by the process's threads, behind a lock, and from there back to the allocator once the depot is full.
+// Buffers are not zeroed. A buffer may be freed by another thread than the one that allocated it (a tagged
+// request's message and key are freed by the cipher thread that answered it); the depot carries such buffers
+// back to the threads that allocate them, so that traffic needs no allocator calls either. Every worker model
+// serves each connection from one thread, so the pool is per worker; forked workers each have their own depot.
+// With a budget (see otp_set_pool_budget()), a freed buffer is only kept while the bytes requests hold plus the
+// bytes every pool keeps stay within it, and a request that finds no room has every pool freed what it keeps.
+#define OTP_POOL_MIN_BUFFER_SIZE 64					// smallest size class, in bytes
+#define OTP_POOL_MAX_BUFFER_SIZE (8 << 20)			// largest size class; larger buffers are not pooled
+#define OTP_POOL_BUFFERS_PER_CLASS 4				// free buffers kept per size class and thread
+#define OTP_POOL_MAX_CACHED_BYTES (32LL << 20)		// free bytes kept per thread
+#define OTP_POOL_SHARED_BUFFERS_PER_CLASS 64		// free buffers kept per size class in the depot
+#define OTP_POOL_MAX_SHARED_BYTES (64LL << 20)		// free bytes kept in the depot
+
+// what the pools of every worker process keep, in memory they share (part of the server's statistics)
+struct otp_pool_budget
+{
+	long long pooled_bytes;	   // free bytes kept in every pool and depot
+	long long trim_generation; // advanced to have every pool free what it keeps, at its next allocation or free
+};
+
+void *otp_allocate_buffer(size_t size);
+void otp_free_buffer(void *buffer);
+size_t otp_buffer_capacity(size_t size);
+void otp_set_pool_budget(struct otp_pool_budget *budget, const long long *held_bytes, long long limit);
+void otp_trim_buffer_pools(void);
+void otp_empty_buffer_pools(void);
+
+#endif
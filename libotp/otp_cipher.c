@@ -0,0 +1,562 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h> // for strcmp
+#include "otp_cipher.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSE2, AVX2 and AVX-512 intrinsics
+#endif
+
+// a cipher kernel: transforms characters up to the end or to the first input or key character outside the
+// alphabet, and returns how many it transformed
+typedef int (*cipher_kernel)(const char *input, const char *key, char *output, int length);
+
+// one vector width's pair of kernels
+struct cipher_kernels
+{
+	const char *name;
+	bool (*cpu_supports)(void); // tells whether the CPU has the instructions they need, or NULL if every CPU does
+	cipher_kernel encrypt;
+	cipher_kernel decrypt;
+};
+
+// function prototypes
+static void select_cipher_kernels(void);
+static bool cpu_runs_kernels(const struct cipher_kernels *kernels);
+#if defined(__x86_64__) || defined(__i386__)
+static bool cpu_supports_avx512(void);
+static bool cpu_supports_avx2(void);
+static bool cpu_supports_sse2(void);
+#endif
+static inline bool is_allowed_character(char character);
+static int encrypt_scalar(const char *input, const char *key, char *output, int length);
+static int decrypt_scalar(const char *input, const char *key, char *output, int length);
+#if defined(__x86_64__) || defined(__i386__)
+static int encrypt_sse2(const char *input, const char *key, char *output, int length);
+static int decrypt_sse2(const char *input, const char *key, char *output, int length);
+static int encrypt_avx2(const char *input, const char *key, char *output, int length);
+static int decrypt_avx2(const char *input, const char *key, char *output, int length);
+static int encrypt_avx512(const char *input, const char *key, char *output, int length);
+static int decrypt_avx512(const char *input, const char *key, char *output, int length);
+#endif
+
+// every pair of kernels, widest first
+static const struct cipher_kernels all_kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+	{"avx512", cpu_supports_avx512, encrypt_avx512, decrypt_avx512},
+	{"avx2", cpu_supports_avx2, encrypt_avx2, decrypt_avx2},
+	{"sse2", cpu_supports_sse2, encrypt_sse2, decrypt_sse2},
+#endif
+	{"scalar", NULL, encrypt_scalar, decrypt_scalar}};
+#define KERNEL_COUNT (int)(sizeof(all_kernels) / sizeof(all_kernels[0]))
+
+static const struct cipher_kernels *selected_kernels; // chosen on first use
+
+/**
+ * Encrypts plaintext to ciphertext using the one time pad method, checking in the same pass that every
+ * plaintext and key character is in the alphabet. Runs the fastest cipher kernel the CPU supports.
+ * @param plaintext: pointer to the message to be encrypted
+ * @param key: pointer to the key used for encryption (at least length characters)
+ * @param ciphertext: pointer to memory for the encrypted message (no null terminator is written)
+ * @param length: int, number of characters to encrypt
+ * @return int, -1 if every character was encrypted, or the position of the first plaintext or key character
+ * outside the alphabet (the ciphertext is only complete before that position)
+ */
+int otp_encrypt(const char *plaintext, const char *key, char *ciphertext, int length)
+{
+	if (!selected_kernels)
+	{
+		select_cipher_kernels();
+	}
+	int transformed = selected_kernels->encrypt(plaintext, key, ciphertext, length);
+	return transformed == length ? -1 : transformed;
+}
+
+/**
+ * Decrypts ciphertext to plaintext using the one time pad method, checking every character in the same
+ * pass (see otp_encrypt()).
+ * @param ciphertext: pointer to the message to be decrypted
+ * @param key: pointer to the key used for decryption (at least length characters)
+ * @param plaintext: pointer to memory for the decrypted message (no null terminator is written)
+ * @param length: int, number of characters to decrypt
+ * @return int, -1 if every character was decrypted, or the position of the first ciphertext or key character
+ * outside the alphabet
+ */
+int otp_decrypt(const char *ciphertext, const char *key, char *plaintext, int length)
+{
+	if (!selected_kernels)
+	{
+		select_cipher_kernels();
+	}
+	int transformed = selected_kernels->decrypt(ciphertext, key, plaintext, length);
+	return transformed == length ? -1 : transformed;
+}
+
+/**
+ * Returns the name of the cipher kernel in use ("avx512", "avx2", "sse2" or "scalar").
+ * @return string, the kernel name
+ */
+const char *otp_cipher_kernel_name(void)
+{
+	if (!selected_kernels)
+	{
+		select_cipher_kernels();
+	}
+	return selected_kernels->name;
+}
+
+/**
+ * Returns the name of one of the cipher kernels the CPU can run, widest first, so a benchmark can try each.
+ * @param index: int, position in the list (0 for the kernel otp_encrypt() chooses by itself)
+ * @return string, the kernel name, or NULL past the last kernel
+ */
+const char *otp_available_cipher_kernel(int index)
+{
+	for (int i = 0; i < KERNEL_COUNT; i++)
+	{
+		if (cpu_runs_kernels(&all_kernels[i]) && index-- == 0)
+		{
+			return all_kernels[i].name;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Makes otp_encrypt() and otp_decrypt() run the named kernel from now on instead of the widest one, for
+ * benchmarks that compare kernels. Not safe while another thread is encrypting or decrypting.
+ * @param name: string, a name returned by otp_available_cipher_kernel()
+ * @return bool, false if there is no such kernel or the CPU cannot run it (the choice is then unchanged)
+ */
+bool otp_select_cipher_kernel(const char *name)
+{
+	for (int i = 0; i < KERNEL_COUNT; i++)
+	{
+		if (strcmp(all_kernels[i].name, name) == 0 && cpu_runs_kernels(&all_kernels[i]))
+		{
+			__atomic_store_n(&selected_kernels, &all_kernels[i], __ATOMIC_RELEASE);
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Chooses the widest cipher kernels the CPU supports. Concurrent first calls all store the same answer.
+ */
+static void select_cipher_kernels(void)
+{
+	const struct cipher_kernels *kernels = &all_kernels[KERNEL_COUNT - 1];
+	for (int i = 0; i < KERNEL_COUNT; i++)
+	{
+		if (cpu_runs_kernels(&all_kernels[i]))
+		{
+			kernels = &all_kernels[i];
+			break;
+		}
+	}
+	__atomic_store_n(&selected_kernels, kernels, __ATOMIC_RELEASE);
+}
+
+/**
+ * Tells whether the CPU has the instructions a pair of kernels needs.
+ * @param kernels: pointer to the kernels
+ * @return bool, true if they can run here
+ */
+static bool cpu_runs_kernels(const struct cipher_kernels *kernels)
+{
+	return !kernels->cpu_supports || kernels->cpu_supports();
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * Tells whether the CPU has the AVX-512 byte and word instructions the AVX-512 kernels need.
+ * @return bool, true if it has
+ */
+static bool cpu_supports_avx512(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx512bw");
+}
+
+/**
+ * Tells whether the CPU has AVX2.
+ * @return bool, true if it has
+ */
+static bool cpu_supports_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+/**
+ * Tells whether the CPU has SSE2.
+ * @return bool, true if it has
+ */
+static bool cpu_supports_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+#endif
+
+/**
+ * Tells whether a character is in the alphabet: a letter is at most 25 above 'A' as an unsigned byte.
+ * @param character: char, the character
+ * @return bool, true for A-Z and space
+ */
+static inline bool is_allowed_character(char character)
+{
+	return (unsigned char)(character - 'A') <= 25 || character == ' ';
+}
+
+/**
+ * Scalar encryption kernel, used when the CPU has no supported vector extension, for the
+ * last few characters the vector kernels leave over, and to find the bad character in a block
+ * a vector kernel refused.
+ * @param input: pointer to the plaintext
+ * @param key: pointer to the key
+ * @param output: pointer to memory for the ciphertext
+ * @param length: int, number of characters to encrypt
+ * @return int, number of characters encrypted: length, or the position of the first bad character
+ */
+static int encrypt_scalar(const char *input, const char *key, char *output, int length)
+{
+	for (int i = 0; i < length; i++)
+	{
+		if (!is_allowed_character(input[i]) || !is_allowed_character(key[i]))
+		{
+			return i;
+		}
+
+		// convert characters to numbers: A-Z to 0-25, space to 26
+		int converted_input = input[i] == ' ' ? 26 : input[i] - 'A';
+		int converted_key = key[i] == ' ' ? 26 : key[i] - 'A';
+
+		// apply encryption
+		int value = converted_input + converted_key;
+		if (value >= 27)
+		{
+			value -= 27;
+		}
+
+		// convert the value back to a character
+		output[i] = value == 26 ? ' ' : 'A' + value;
+	}
+	return length;
+}
+
+/**
+ * Scalar decryption kernel (see encrypt_scalar()).
+ * @param input: pointer to the ciphertext
+ * @param key: pointer to the key
+ * @param output: pointer to memory for the plaintext
+ * @param length: int, number of characters to decrypt
+ * @return int, number of characters decrypted: length, or the position of the first bad character
+ */
+static int decrypt_scalar(const char *input, const char *key, char *output, int length)
+{
+	for (int i = 0; i < length; i++)
+	{
+		if (!is_allowed_character(input[i]) || !is_allowed_character(key[i]))
+		{
+			return i;
+		}
+
+		// convert characters to numbers: A-Z to 0-25, space to 26
+		int converted_input = input[i] == ' ' ? 26 : input[i] - 'A';
+		int converted_key = key[i] == ' ' ? 26 : key[i] - 'A';
+
+		// apply decryption (add 27 to negative differences)
+		int value = converted_input - converted_key;
+		if (value < 0)
+		{
+			value += 27;
+		}
+
+		// convert the value back to a character
+		output[i] = value == 26 ? ' ' : 'A' + value;
+	}
+	return length;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * Converts 16 characters to numbers (A-Z to 0-25, space to 26) with a compare and masks instead of branches.
+ * The same offsets from 'A' tell the letters apart (an unsigned minimum with 25 leaves them unchanged), so
+ * the conversion also checks the characters.
+ * @param characters: __m128i, the characters
+ * @param valid: pointer to a mask of valid lanes, cleared in the lanes holding a character outside the alphabet
+ * @return __m128i, the numbers
+ */
+__attribute__((target("sse2"))) static inline __m128i characters_to_numbers_sse2(__m128i characters, __m128i *valid)
+{
+	__m128i is_space = _mm_cmpeq_epi8(characters, _mm_set1_epi8(' '));
+	__m128i offset = _mm_sub_epi8(characters, _mm_set1_epi8('A'));
+	__m128i is_letter = _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(25)), offset);
+	*valid = _mm_and_si128(*valid, _mm_or_si128(is_letter, is_space));
+	return _mm_or_si128(_mm_and_si128(is_space, _mm_set1_epi8(26)), _mm_andnot_si128(is_space, offset));
+}
+
+/**
+ * Converts 16 numbers (0-26) back to characters.
+ * @param numbers: __m128i, the numbers
+ * @return __m128i, the characters
+ */
+__attribute__((target("sse2"))) static inline __m128i numbers_to_characters_sse2(__m128i numbers)
+{
+	__m128i is_space = _mm_cmpeq_epi8(numbers, _mm_set1_epi8(26));
+	return _mm_or_si128(_mm_and_si128(is_space, _mm_set1_epi8(' ')),
+						_mm_andnot_si128(is_space, _mm_add_epi8(numbers, _mm_set1_epi8('A'))));
+}
+
+/**
+ * SSE2 encryption kernel: checks and encrypts 16 characters per iteration. A block holding a bad
+ * character is not stored; the scalar kernel finds the character.
+ * @param input: pointer to the plaintext
+ * @param key: pointer to the key
+ * @param output: pointer to memory for the ciphertext
+ * @param length: int, number of characters to encrypt
+ * @return int, number of characters encrypted: length, or the position of the first bad character
+ */
+__attribute__((target("sse2"))) static int encrypt_sse2(const char *input, const char *key, char *output, int length)
+{
+	const __m128i twenty_six = _mm_set1_epi8(26);
+	const __m128i twenty_seven = _mm_set1_epi8(27);
+	int i = 0;
+
+	for (; i + 16 <= length; i += 16)
+	{
+		__m128i valid = _mm_set1_epi8(-1);
+		__m128i converted_input = characters_to_numbers_sse2(_mm_loadu_si128((const __m128i *)(input + i)), &valid);
+		__m128i converted_key = characters_to_numbers_sse2(_mm_loadu_si128((const __m128i *)(key + i)), &valid);
+		if (_mm_movemask_epi8(valid) != 0xffff)
+		{
+			break;
+		}
+
+		// apply encryption: add, then subtract 27 from sums above 26
+		__m128i value = _mm_add_epi8(converted_input, converted_key);
+		value = _mm_sub_epi8(value, _mm_and_si128(_mm_cmpgt_epi8(value, twenty_six), twenty_seven));
+
+		_mm_storeu_si128((__m128i *)(output + i), numbers_to_characters_sse2(value));
+	}
+	return i + encrypt_scalar(input + i, key + i, output + i, length - i);
+}
+
+/**
+ * SSE2 decryption kernel: checks and decrypts 16 characters per iteration (see encrypt_sse2()).
+ * @param input: pointer to the ciphertext
+ * @param key: pointer to the key
+ * @param output: pointer to memory for the plaintext
+ * @param length: int, number of characters to decrypt
+ * @return int, number of characters decrypted: length, or the position of the first bad character
+ */
+__attribute__((target("sse2"))) static int decrypt_sse2(const char *input, const char *key, char *output, int length)
+{
+	const __m128i twenty_seven = _mm_set1_epi8(27);
+	int i = 0;
+
+	for (; i + 16 <= length; i += 16)
+	{
+		__m128i valid = _mm_set1_epi8(-1);
+		__m128i converted_input = characters_to_numbers_sse2(_mm_loadu_si128((const __m128i *)(input + i)), &valid);
+		__m128i converted_key = characters_to_numbers_sse2(_mm_loadu_si128((const __m128i *)(key + i)), &valid);
+		if (_mm_movemask_epi8(valid) != 0xffff)
+		{
+			break;
+		}
+
+		// apply decryption: subtract, then add 27 to negative differences
+		__m128i value = _mm_sub_epi8(converted_input, converted_key);
+		value = _mm_add_epi8(value, _mm_and_si128(_mm_cmplt_epi8(value, _mm_setzero_si128()), twenty_seven));
+
+		_mm_storeu_si128((__m128i *)(output + i), numbers_to_characters_sse2(value));
+	}
+	return i + decrypt_scalar(input + i, key + i, output + i, length - i);
+}
+
+/**
+ * Converts 32 characters to numbers (A-Z to 0-25, space to 26), checking them (see characters_to_numbers_sse2()).
+ * @param characters: __m256i, the characters
+ * @param valid: pointer to a mask of valid lanes, cleared in the lanes holding a character outside the alphabet
+ * @return __m256i, the numbers
+ */
+__attribute__((target("avx2"))) static inline __m256i characters_to_numbers_avx2(__m256i characters, __m256i *valid)
+{
+	__m256i is_space = _mm256_cmpeq_epi8(characters, _mm256_set1_epi8(' '));
+	__m256i offset = _mm256_sub_epi8(characters, _mm256_set1_epi8('A'));
+	__m256i is_letter = _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(25)), offset);
+	*valid = _mm256_and_si256(*valid, _mm256_or_si256(is_letter, is_space));
+	return _mm256_blendv_epi8(offset, _mm256_set1_epi8(26), is_space);
+}
+
+/**
+ * Converts 32 numbers (0-26) back to characters.
+ * @param numbers: __m256i, the numbers
+ * @return __m256i, the characters
+ */
+__attribute__((target("avx2"))) static inline __m256i numbers_to_characters_avx2(__m256i numbers)
+{
+	return _mm256_blendv_epi8(_mm256_add_epi8(numbers, _mm256_set1_epi8('A')), _mm256_set1_epi8(' '),
+							  _mm256_cmpeq_epi8(numbers, _mm256_set1_epi8(26)));
+}
+
+/**
+ * AVX2 encryption kernel: checks and encrypts 32 characters per iteration (see encrypt_sse2()).
+ * @param input: pointer to the plaintext
+ * @param key: pointer to the key
+ * @param output: pointer to memory for the ciphertext
+ * @param length: int, number of characters to encrypt
+ * @return int, number of characters encrypted: length, or the position of the first bad character
+ */
+__attribute__((target("avx2"))) static int encrypt_avx2(const char *input, const char *key, char *output, int length)
+{
+	const __m256i twenty_six = _mm256_set1_epi8(26);
+	const __m256i twenty_seven = _mm256_set1_epi8(27);
+	int i = 0;
+
+	for (; i + 32 <= length; i += 32)
+	{
+		__m256i valid = _mm256_set1_epi8(-1);
+		__m256i converted_input = characters_to_numbers_avx2(_mm256_loadu_si256((const __m256i *)(input + i)), &valid);
+		__m256i converted_key = characters_to_numbers_avx2(_mm256_loadu_si256((const __m256i *)(key + i)), &valid);
+		if (_mm256_movemask_epi8(valid) != -1)
+		{
+			break;
+		}
+
+		// apply encryption: add, then subtract 27 from sums above 26
+		__m256i value = _mm256_add_epi8(converted_input, converted_key);
+		value = _mm256_sub_epi8(value, _mm256_and_si256(_mm256_cmpgt_epi8(value, twenty_six), twenty_seven));
+
+		_mm256_storeu_si256((__m256i *)(output + i), numbers_to_characters_avx2(value));
+	}
+	return i + encrypt_scalar(input + i, key + i, output + i, length - i);
+}
+
+/**
+ * AVX2 decryption kernel: checks and decrypts 32 characters per iteration (see encrypt_sse2()).
+ * @param input: pointer to the ciphertext
+ * @param key: pointer to the key
+ * @param output: pointer to memory for the plaintext
+ * @param length: int, number of characters to decrypt
+ * @return int, number of characters decrypted: length, or the position of the first bad character
+ */
+__attribute__((target("avx2"))) static int decrypt_avx2(const char *input, const char *key, char *output, int length)
+{
+	const __m256i twenty_seven = _mm256_set1_epi8(27);
+	int i = 0;
+
+	for (; i + 32 <= length; i += 32)
+	{
+		__m256i valid = _mm256_set1_epi8(-1);
+		__m256i converted_input = characters_to_numbers_avx2(_mm256_loadu_si256((const __m256i *)(input + i)), &valid);
+		__m256i converted_key = characters_to_numbers_avx2(_mm256_loadu_si256((const __m256i *)(key + i)), &valid);
+		if (_mm256_movemask_epi8(valid) != -1)
+		{
+			break;
+		}
+
+		// apply decryption: subtract, then add 27 to negative differences
+		__m256i value = _mm256_sub_epi8(converted_input, converted_key);
+		value = _mm256_add_epi8(value, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_setzero_si256(), value), twenty_seven));
+
+		_mm256_storeu_si256((__m256i *)(output + i), numbers_to_characters_avx2(value));
+	}
+	return i + decrypt_scalar(input + i, key + i, output + i, length - i);
+}
+
+/**
+ * Converts 64 characters to numbers (A-Z to 0-25, space to 26), checking them (see characters_to_numbers_sse2()).
+ * @param characters: __m512i, the characters
+ * @param valid: pointer to a mask of valid lanes, cleared in the lanes holding a character outside the alphabet
+ * @return __m512i, the numbers
+ */
+__attribute__((target("avx512f,avx512bw"))) static inline __m512i characters_to_numbers_avx512(__m512i characters, __mmask64 *valid)
+{
+	__mmask64 is_space = _mm512_cmpeq_epi8_mask(characters, _mm512_set1_epi8(' '));
+	__m512i offset = _mm512_sub_epi8(characters, _mm512_set1_epi8('A'));
+	*valid &= _mm512_cmple_epu8_mask(offset, _mm512_set1_epi8(25)) | is_space;
+	return _mm512_mask_blend_epi8(is_space, offset, _mm512_set1_epi8(26));
+}
+
+/**
+ * Converts 64 numbers (0-26) back to characters.
+ * @param numbers: __m512i, the numbers
+ * @return __m512i, the characters
+ */
+__attribute__((target("avx512f,avx512bw"))) static inline __m512i numbers_to_characters_avx512(__m512i numbers)
+{
+	return _mm512_mask_blend_epi8(_mm512_cmpeq_epi8_mask(numbers, _mm512_set1_epi8(26)),
+								  _mm512_add_epi8(numbers, _mm512_set1_epi8('A')), _mm512_set1_epi8(' '));
+}
+
+/**
+ * AVX-512 encryption kernel: checks and encrypts 64 characters per iteration, and handles the last partial
+ * block with masked loads and stores instead of falling back to scalar code. A block holding a bad
+ * character is not stored; the scalar kernel finds the character.
+ * @param input: pointer to the plaintext
+ * @param key: pointer to the key
+ * @param output: pointer to memory for the ciphertext
+ * @param length: int, number of characters to encrypt
+ * @return int, number of characters encrypted: length, or the position of the first bad character
+ */
+__attribute__((target("avx512f,avx512bw"))) static int encrypt_avx512(const char *input, const char *key, char *output, int length)
+{
+	const __m512i twenty_six = _mm512_set1_epi8(26);
+	const __m512i twenty_seven = _mm512_set1_epi8(27);
+
+	for (int i = 0; i < length; i += 64)
+	{
+		int remaining = length - i;
+		__mmask64 lanes = remaining >= 64 ? ~(__mmask64)0 : ((__mmask64)1 << remaining) - 1;
+		__mmask64 valid = lanes;
+		__m512i converted_input = characters_to_numbers_avx512(_mm512_maskz_loadu_epi8(lanes, input + i), &valid);
+		__m512i converted_key = characters_to_numbers_avx512(_mm512_maskz_loadu_epi8(lanes, key + i), &valid);
+		if (valid != lanes)
+		{
+			return i + encrypt_scalar(input + i, key + i, output + i, remaining);
+		}
+
+		// apply encryption: add, then subtract 27 from sums above 26
+		__m512i value = _mm512_add_epi8(converted_input, converted_key);
+		value = _mm512_mask_sub_epi8(value, _mm512_cmpgt_epi8_mask(value, twenty_six), value, twenty_seven);
+
+		_mm512_mask_storeu_epi8(output + i, lanes, numbers_to_characters_avx512(value));
+	}
+	return length;
+}
+
+/**
+ * AVX-512 decryption kernel: checks and decrypts 64 characters per iteration (see encrypt_avx512()).
+ * @param input: pointer to the ciphertext
+ * @param key: pointer to the key
+ * @param output: pointer to memory for the plaintext
+ * @param length: int, number of characters to decrypt
+ * @return int, number of characters decrypted: length, or the position of the first bad character
+ */
+__attribute__((target("avx512f,avx512bw"))) static int decrypt_avx512(const char *input, const char *key, char *output, int length)
+{
+	const __m512i twenty_seven = _mm512_set1_epi8(27);
+
+	for (int i = 0; i < length; i += 64)
+	{
+		int remaining = length - i;
+		__mmask64 lanes = remaining >= 64 ? ~(__mmask64)0 : ((__mmask64)1 << remaining) - 1;
+		__mmask64 valid = lanes;
+		__m512i converted_input = characters_to_numbers_avx512(_mm512_maskz_loadu_epi8(lanes, input + i), &valid);
+		__m512i converted_key = characters_to_numbers_avx512(_mm512_maskz_loadu_epi8(lanes, key + i), &valid);
+		if (valid != lanes)
+		{
+			return i + decrypt_scalar(input + i, key + i, output + i, remaining);
+		}
+
+		// apply decryption: subtract, then add 27 to negative differences
+		__m512i value = _mm512_sub_epi8(converted_input, converted_key);
+		value = _mm512_mask_add_epi8(value, _mm512_movepi8_mask(value), value, twenty_seven);
+
+		_mm512_mask_storeu_epi8(output + i, lanes, numbers_to_characters_avx512(value));
+	}
+	return length;
+}
+#endif
@@ -0,0 +1,22 @@
+#ifndef OTP_CIPHER_H
+#define OTP_CIPHER_H
+
+#include <stdbool.h>
+
+// the 27 characters the system supports: A-Z map to 0-25 and space maps to 26
+#define OTP_ALLOWED_CHARACTERS "ABCDEFGHIJKLMNOPQRSTUVWXYZ "
+#define OTP_CHARACTERS_LENGTH (sizeof(OTP_ALLOWED_CHARACTERS) - 1)
+
+// a cipher: transforms length characters of input with the key into output (no null terminator is written);
+// each output character only depends on the input and key characters at the same position, so output may be input.
+// The characters are checked in the same pass: returns -1 if all were transformed, or the position of the first
+// input or key character outside the alphabet, before which the output is complete
+typedef int (*otp_cipher_function)(const char *input, const char *key, char *output, int length);
+
+int otp_encrypt(const char *plaintext, const char *key, char *ciphertext, int length);
+int otp_decrypt(const char *ciphertext, const char *key, char *plaintext, int length);
+const char *otp_cipher_kernel_name(void);
+const char *otp_available_cipher_kernel(int index);
+bool otp_select_cipher_kernel(const char *name);
+
+#endif
@@ -0,0 +1,586 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h> // for getopt_long
+#include "otp_client.h"
+#include "otp_file.h"
+#include "otp_pad_file.h"
+#include "otp_protocol.h"
+#include "otp_pipeline.h"
+#include "otp_stream.h"
+
+// role of this client: the client type it sends and the names of what it sends and gets back
+static const struct otp_client_role *client_role;
+
+// wire encoding of the session: asked for with --packed, then whatever the server agreed to
+static int wire_encoding = OTP_ENCODING_TEXT;
+
+// function prototypes
+static void verify_pad_file(char *file_path, struct otp_mapped_file *file);
+static void map_input_file(char *file_path, struct otp_mapped_file *file);
+static int connect_to_server(const char *server);
+static void exit_if_server_busy(int connection_socket_fd);
+static void send_message_request(char *message_path, char *key_path, const char *server, int *connection_socket_fd);
+static void stream_message_request(char *message_path, char *key_path, const char *server, int *connection_socket_fd);
+static void pipeline_message_requests(char **file_paths, int pair_count, const char *server, int *connection_socket_fd);
+static void upload_pad(char *key_path, const char *server, int *connection_socket_fd);
+static void send_pad_request(char *message_path, int pad_id, int *pad_offset, const char *server, int *connection_socket_fd);
+static void release_pad(int pad_id, const char *server);
+static void print_usage(void);
+
+/**
+ * Runs a client with the given role: connects to the server, sends each message (plaintext or ciphertext) and
+ * key, and prints each result. Several message and key pairs share a single connection: they are pipelined as
+ * tagged requests (or streamed one after another with --stream), and one result is printed per line in the
+ * order of the pairs. With --upload-pad the key is stored on the server instead, and with --pad later messages
+ * are keyed by consecutive ranges of such a stored pad, until --release-pad gives its room back. With --packed
+ * the characters travel five to three bytes, if the server supports it. Exits with an error message if a
+ * request fails.
+ * @param argument_count: int, the number of command line arguments
+ * @param argument_array: array, the command line arguments entered (options, then one or more message file and
+ * key file name pairs, a key file to upload, or message files keyed by a stored pad, then the port number or
+ * socket path)
+ * @param role: pointer to the role (client type, and the names of the messages and results)
+ * @return int, exit status for main()
+ */
+int otp_run_client(int argument_count, char *argument_array[], const struct otp_client_role *role)
+{
+	client_role = role;
+
+	bool streaming = false;
+	bool uploading_pad = false;
+	int pad_id = 0; // nonzero when the requests are keyed by an uploaded pad
+	int released_pad_id = 0;
+	int pad_offset = 0;
+	int connection_socket_fd = -1; // opened on the first request, then shared by the others
+
+	static struct option long_options[] = {
+		{"stream", no_argument, NULL, 's'},
+		{"upload-pad", no_argument, NULL, 'u'},
+		{"pad", required_argument, NULL, 'p'},
+		{"packed", no_argument, NULL, 'k'},
+		{"release-pad", required_argument, NULL, 'r'},
+		{NULL, 0, NULL, 0}};
+
+	// a server refusing the connection as busy may close it while a request is still being sent; report
+	// its reply (see exit_if_server_busy()) rather than die of SIGPIPE
+	signal(SIGPIPE, SIG_IGN);
+
+	// parse options
+	int option;
+	while ((option = getopt_long(argument_count, argument_array, "sup:kr:", long_options, NULL)) != -1)
+	{
+		switch (option)
+		{
+		case 's':
+			streaming = true;
+			break;
+
+		case 'u':
+			uploading_pad = true;
+			break;
+
+		case 'k':
+			wire_encoding = OTP_ENCODING_PACKED;
+			break;
+
+		case 'p':
+			// ID[:OFFSET]
+			if (sscanf(optarg, "%d:%d", &pad_id, &pad_offset) < 1 || pad_id <= 0 || pad_offset < 0)
+			{
+				fprintf(stderr, "CLIENT: ERROR- pad must be given as ID or ID:OFFSET\n");
+				exit(1);
+			}
+			break;
+
+		case 'r':
+			if (sscanf(optarg, "%d", &released_pad_id) != 1 || released_pad_id <= 0)
+			{
+				fprintf(stderr, "CLIENT: ERROR- pad must be given as ID\n");
+				exit(1);
+			}
+			break;
+
+		default:
+			print_usage();
+			exit(1);
+		}
+	}
+
+	// check if correct amount of arguments is given
+	int remaining = argument_count - optind;
+	if (released_pad_id)
+	{
+		if (remaining != 1 || uploading_pad || pad_id || streaming || wire_encoding != OTP_ENCODING_TEXT)
+		{
+			print_usage();
+			exit(1);
+		}
+		release_pad(released_pad_id, argument_array[optind]);
+		return 0;
+	}
+	if ((uploading_pad && (remaining != 2 || pad_id || streaming)) || (pad_id && (remaining < 2 || streaming)) ||
+		(!uploading_pad && !pad_id && (remaining < 3 || remaining % 2 == 0)) ||
+		(streaming && wire_encoding != OTP_ENCODING_TEXT))
+	{
+		print_usage();
+		exit(1);
+	}
+
+	char **arguments = argument_array + optind;
+	const char *server = arguments[remaining - 1];
+	if (uploading_pad || pad_id)
+	{
+		for (int i = 0; i + 1 < remaining; i++)
+		{
+			if (uploading_pad)
+			{
+				upload_pad(arguments[i], server, &connection_socket_fd);
+			}
+			else
+			{
+				send_pad_request(arguments[i], pad_id, &pad_offset, server, &connection_socket_fd);
+			}
+		}
+		otp_send_goodbye(connection_socket_fd);
+		close(connection_socket_fd);
+		return 0;
+	}
+	int pair_count = remaining / 2;
+	if (pair_count > 1 && !streaming)
+	{
+		pipeline_message_requests(arguments, pair_count, server, &connection_socket_fd);
+	}
+	for (int i = 0; i + 1 < remaining && (pair_count == 1 || streaming); i += 2)
+	{
+		if (streaming)
+		{
+			stream_message_request(arguments[i], arguments[i + 1], server, &connection_socket_fd);
+		}
+		else
+		{
+			send_message_request(arguments[i], arguments[i + 1], server, &connection_socket_fd);
+		}
+	}
+
+	// end the session
+	otp_send_goodbye(connection_socket_fd);
+	close(connection_socket_fd); // close the socket
+	return 0;
+}
+
+/**
+ * Checks a mapped pad file against its checksum.
+ * Exits with an error message if the pad is corrupt.
+ * @param file_path: path to the file
+ * @param file: pointer to the mapped pad file
+ */
+static void verify_pad_file(char *file_path, struct otp_mapped_file *file)
+{
+	if (otp_verify_pad_file(file) < 0)
+	{
+		otp_unmap_file(file);
+		fprintf(stderr, "CLIENT: ERROR- pad file %s is corrupt\n", file_path);
+		exit(1);
+	}
+}
+
+/**
+ * Maps a message or key file into memory, and checks it for bad characters (or a pad file against its
+ * checksum). Exits with an error message if the file cannot be read or contains bad characters.
+ * @param file_path: path to the file
+ * @param file: pointer to the mapped file to fill in; its length excludes the trailing newline
+ */
+static void map_input_file(char *file_path, struct otp_mapped_file *file)
+{
+	if (otp_map_file(file_path, file) < 0)
+	{
+		fprintf(stderr, "CLIENT: ERROR- could not read file %s\n", file_path);
+		exit(1);
+	}
+
+	// check file for bad characters
+	if (file->encoding == OTP_ENCODING_PACKED)
+	{
+		verify_pad_file(file_path, file);
+	}
+	else if (otp_find_invalid_mapped_character(file) >= 0)
+	{
+		otp_unmap_file(file);
+		fprintf(stderr, "CLIENT: ERROR- input contains bad characters");
+		exit(1);
+	}
+}
+
+/**
+ * Connects to the server on this host and sends the role's client type, then agrees on the packed
+ * encoding with the server if --packed was given. Exits with an error message if the server cannot be reached.
+ * @param server: string, port number on which the server is listening, or the path of its Unix domain socket
+ * (anything containing a '/'), which skips the TCP/IP stack
+ * @return int, file descriptor of the connection socket
+ */
+static int connect_to_server(const char *server)
+{
+	// set up the address struct for the server
+	struct otp_server_address server_address;
+	if (otp_setup_server_address(&server_address, server, "localhost") < 0)
+	{
+		fprintf(stderr, errno == ENAMETOOLONG ? "CLIENT: ERROR- socket path is too long\n" : "CLIENT: ERROR- no such host\n");
+		exit(1);
+	}
+
+	// connect to server
+	int connection_socket_fd = otp_connect_to_server(&server_address);
+	if (connection_socket_fd < 0)
+	{
+		fprintf(stderr, "CLIENT: ERROR connecting to server\n");
+		exit(2);
+	}
+
+	// send identification
+	if (otp_send_all(connection_socket_fd, client_role->client_type, OTP_HANDSHAKE_LENGTH) < 0)
+	{
+		exit_if_server_busy(connection_socket_fd);
+		close(connection_socket_fd);
+		fprintf(stderr, "CLIENT: ERROR sending message\n");
+		exit(1);
+	}
+
+	// a server that does not support the encoding keeps the session in text
+	if (wire_encoding != OTP_ENCODING_TEXT)
+	{
+		wire_encoding = otp_negotiate_encoding(connection_socket_fd, wire_encoding);
+		if (wire_encoding < 0)
+		{
+			exit_if_server_busy(connection_socket_fd);
+			close(connection_socket_fd);
+			fprintf(stderr, "CLIENT: ERROR negotiating encoding\n");
+			exit(1);
+		}
+	}
+	return connection_socket_fd;
+}
+
+/**
+ * Exits with a message if a request failed because the server was over capacity: it replied OTP_REPLY_BUSY,
+ * possibly before closing the connection on the rest of the request. The exit status is 2, as when the server
+ * cannot be reached, so scripts can tell that trying again later may work.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ */
+static void exit_if_server_busy(int connection_socket_fd)
+{
+	if (errno == EAGAIN || otp_receive_refusal(connection_socket_fd) == OTP_REPLY_BUSY)
+	{
+		close(connection_socket_fd);
+		fprintf(stderr, "CLIENT: ERROR- server is busy, try again later\n");
+		exit(2);
+	}
+}
+
+/**
+ * Sends the whole message and key to the server in one request, then receives the result and
+ * prints it as it arrives. Both files are sent straight from the page cache when they hold the characters
+ * the way the session's encoding carries them (and are packed or unpacked piece by piece otherwise), and the
+ * result is never held in memory as a whole, so memory use does not depend on the file sizes.
+ * @param message_path: path to the message (plaintext or ciphertext) file
+ * @param key_path: path to the key file
+ * @param server: string, port number or Unix domain socket path of the server
+ * @param connection_socket_fd: pointer to the session's connection socket, opened here if it is still -1
+ */
+static void send_message_request(char *message_path, char *key_path, const char *server, int *connection_socket_fd)
+{
+	struct otp_mapped_file message;
+	struct otp_mapped_file key;
+	map_input_file(message_path, &message);
+	map_input_file(key_path, &key);
+
+	// check that the key is at least as long as the message
+	if (key.length < message.length)
+	{
+		fprintf(stderr, "CLIENT: ERROR- encryption key is too short\n");
+		otp_unmap_file(&message);
+		otp_unmap_file(&key);
+		exit(1);
+	}
+
+	if (*connection_socket_fd < 0)
+	{
+		*connection_socket_fd = connect_to_server(server);
+	}
+
+	// send message and key to server; only the key characters the message needs are sent
+	if (otp_send_file_message(*connection_socket_fd, &message, message.length, wire_encoding) < 0 ||
+		otp_send_file_message(*connection_socket_fd, &key, message.length, wire_encoding) < 0)
+	{
+		exit_if_server_busy(*connection_socket_fd);
+		close(*connection_socket_fd);
+		fprintf(stderr, "CLIENT: ERROR sending message\n");
+		exit(1);
+	}
+
+	// receive the result from server
+	if (otp_receive_message_to_file(*connection_socket_fd, stdout, wire_encoding) < 0)
+	{
+		exit_if_server_busy(*connection_socket_fd);
+		fprintf(stderr, "CLIENT: ERROR receiving %s\n", client_role->result_noun);
+		otp_unmap_file(&message);
+		otp_unmap_file(&key);
+		close(*connection_socket_fd);
+		exit(1);
+	}
+	printf("\n"); // add newline back
+
+	// clean up
+	otp_unmap_file(&message);
+	otp_unmap_file(&key);
+}
+
+/**
+ * Streams the message and key to the server in chunks, printing each chunk of the result as it
+ * arrives. Neither file is read into memory as a whole, so any file size works in fixed memory.
+ * @param message_path: path to the message (plaintext or ciphertext) file
+ * @param key_path: path to the key file
+ * @param server: string, port number or Unix domain socket path of the server
+ * @param connection_socket_fd: pointer to the session's connection socket, opened here if it is still -1
+ */
+static void stream_message_request(char *message_path, char *key_path, const char *server, int *connection_socket_fd)
+{
+	FILE *message_file = fopen(message_path, "r");
+	FILE *key_file = fopen(key_path, "r");
+	int message_size = message_file ? otp_text_file_length(message_file) : -1;
+	int key_size = key_file ? otp_text_file_length(key_file) : -1;
+	if (message_size < 0 || key_size < 0)
+	{
+		fprintf(stderr, "CLIENT: ERROR- could not read file %s\n", message_size < 0 ? message_path : key_path);
+		exit(1);
+	}
+
+	// the files are streamed as they are read, which needs text rather than pad files
+	FILE *files[2] = {message_file, key_file};
+	for (int i = 0; i < 2; i++)
+	{
+		char start[OTP_PAD_FILE_MAGIC_SIZE];
+		size_t start_size = fread(start, 1, sizeof(start), files[i]);
+		rewind(files[i]);
+		if (otp_is_pad_file(start, start_size))
+		{
+			fprintf(stderr, "CLIENT: ERROR- --stream needs text files; convert %s with padconv\n", i == 0 ? message_path : key_path);
+			exit(1);
+		}
+	}
+
+	// check that the key is at least as long as the message
+	if (key_size < message_size)
+	{
+		fprintf(stderr, "CLIENT: ERROR- encryption key is too short\n");
+		exit(1);
+	}
+
+	if (*connection_socket_fd < 0)
+	{
+		*connection_socket_fd = connect_to_server(server);
+	}
+	if (otp_stream_files(*connection_socket_fd, message_file, key_file, message_size, stdout, true) < 0)
+	{
+		exit_if_server_busy(*connection_socket_fd);
+		close(*connection_socket_fd);
+		if (errno == EINVAL)
+		{
+			fprintf(stderr, "CLIENT: ERROR- input contains bad characters");
+		}
+		else
+		{
+			fprintf(stderr, "CLIENT: ERROR streaming %s\n", client_role->result_noun);
+		}
+		exit(1);
+	}
+	printf("\n"); // add newline back
+
+	// clean up
+	fclose(message_file);
+	fclose(key_file);
+}
+
+/**
+ * Sends several message and key pairs as tagged requests, keeping many in flight on the connection instead of
+ * waiting for each result before sending the next, then prints the results in the order of the pairs.
+ * @param file_paths: array of message file and key file paths, alternating
+ * @param pair_count: int, number of message and key pairs
+ * @param server: string, port number or Unix domain socket path of the server
+ * @param connection_socket_fd: pointer to the session's connection socket, opened here if it is still -1
+ */
+static void pipeline_message_requests(char **file_paths, int pair_count, const char *server, int *connection_socket_fd)
+{
+	struct otp_tagged_request *requests = calloc(pair_count, sizeof(struct otp_tagged_request));
+	struct otp_mapped_file *files = calloc(2 * pair_count, sizeof(struct otp_mapped_file));
+	if (!requests || !files)
+	{
+		fprintf(stderr, "CLIENT: ERROR allocating memory for requests\n");
+		exit(1);
+	}
+
+	// read every message and key before sending anything, so a bad file fails the whole batch
+	for (int i = 0; i < pair_count; i++)
+	{
+		map_input_file(file_paths[2 * i], &files[2 * i]);
+		map_input_file(file_paths[2 * i + 1], &files[2 * i + 1]);
+
+		// check that the key is at least as long as the message
+		if (files[2 * i + 1].length < files[2 * i].length)
+		{
+			fprintf(stderr, "CLIENT: ERROR- encryption key is too short\n");
+			exit(1);
+		}
+
+		// tagged requests are built from characters, so pad files are unpacked (only as far as needed)
+		if (otp_unpack_mapped_file(&files[2 * i], files[2 * i].length) < 0 ||
+			otp_unpack_mapped_file(&files[2 * i + 1], files[2 * i].length) < 0)
+		{
+			fprintf(stderr, "CLIENT: ERROR allocating memory for requests\n");
+			exit(1);
+		}
+		requests[i].message = files[2 * i].contents;
+		requests[i].size = files[2 * i].length;
+		requests[i].key = files[2 * i + 1].contents;
+
+		requests[i].result = malloc(requests[i].size + 1); // +1 for null terminator
+		if (!requests[i].result)
+		{
+			fprintf(stderr, "CLIENT: ERROR allocating memory for %s\n", client_role->result_noun);
+			exit(1);
+		}
+	}
+
+	if (*connection_socket_fd < 0)
+	{
+		*connection_socket_fd = connect_to_server(server);
+	}
+	if (otp_pipeline_requests(*connection_socket_fd, requests, pair_count, OTP_PIPELINE_MAX_IN_FLIGHT, wire_encoding) < 0)
+	{
+		exit_if_server_busy(*connection_socket_fd);
+		close(*connection_socket_fd);
+		fprintf(stderr, "CLIENT: ERROR receiving %s\n", client_role->result_noun);
+		exit(1);
+	}
+
+	for (int i = 0; i < pair_count; i++)
+	{
+		requests[i].result[requests[i].size] = '\0';
+		printf("%s\n", requests[i].result); // add newline back
+
+		// clean up
+		otp_unmap_file(&files[2 * i]);
+		otp_unmap_file(&files[2 * i + 1]);
+		free(requests[i].result);
+	}
+	free(requests);
+	free(files);
+}
+
+/**
+ * Uploads a key file to the server's pad store, and prints the pad ID later requests can refer to it by.
+ * @param key_path: path to the key file
+ * @param server: string, port number or Unix domain socket path of the server
+ * @param connection_socket_fd: pointer to the session's connection socket, opened here if it is still -1
+ */
+static void upload_pad(char *key_path, const char *server, int *connection_socket_fd)
+{
+	struct otp_mapped_file key;
+	map_input_file(key_path, &key);
+
+	if (*connection_socket_fd < 0)
+	{
+		*connection_socket_fd = connect_to_server(server);
+	}
+	int pad_id;
+	if (otp_upload_pad_file(*connection_socket_fd, &key, wire_encoding, &pad_id) < 0)
+	{
+		close(*connection_socket_fd);
+		fprintf(stderr, "CLIENT: ERROR uploading pad\n");
+		exit(1);
+	}
+	printf("%d\n", pad_id);
+	otp_unmap_file(&key);
+}
+
+/**
+ * Sends the message keyed by a range of a pad uploaded earlier, then receives and prints the result.
+ * Only the message goes over the network.
+ * @param message_path: path to the message (plaintext or ciphertext) file
+ * @param pad_id: int, ID of the pad
+ * @param pad_offset: pointer to the position of the first pad character to use; advanced past the range used
+ * @param server: string, port number or Unix domain socket path of the server
+ * @param connection_socket_fd: pointer to the session's connection socket, opened here if it is still -1
+ */
+static void send_pad_request(char *message_path, int pad_id, int *pad_offset, const char *server, int *connection_socket_fd)
+{
+	struct otp_mapped_file message;
+	map_input_file(message_path, &message);
+	if (otp_unpack_mapped_file(&message, message.length) < 0)
+	{
+		fprintf(stderr, "CLIENT: ERROR allocating memory for %s\n", client_role->message_noun);
+		exit(1);
+	}
+
+	if (*connection_socket_fd < 0)
+	{
+		*connection_socket_fd = connect_to_server(server);
+	}
+	if (otp_send_pad_request(*connection_socket_fd, pad_id, *pad_offset, message.contents, message.length, wire_encoding) < 0)
+	{
+		exit_if_server_busy(*connection_socket_fd);
+		close(*connection_socket_fd);
+		fprintf(stderr, "CLIENT: ERROR sending message\n");
+		exit(1);
+	}
+
+	// the server closes the connection instead if the range is outside the pad or was used before
+	if (otp_receive_message_to_file(*connection_socket_fd, stdout, wire_encoding) < 0)
+	{
+		exit_if_server_busy(*connection_socket_fd);
+		fprintf(stderr, "CLIENT: ERROR receiving %s (is the pad range unused?)\n", client_role->result_noun);
+		close(*connection_socket_fd);
+		exit(1);
+	}
+	printf("\n"); // add newline back
+	*pad_offset += message.length;
+
+	// clean up
+	otp_unmap_file(&message);
+}
+
+/**
+ * Releases a pad uploaded earlier, so the server can reuse its room once the requests still reading it are done.
+ * @param pad_id: int, ID of the pad
+ * @param server: string, port number or Unix domain socket path of the server
+ */
+static void release_pad(int pad_id, const char *server)
+{
+	int connection_socket_fd = connect_to_server(server);
+	if (otp_release_pad(connection_socket_fd, pad_id) < 0)
+	{
+		exit_if_server_busy(connection_socket_fd);
+		close(connection_socket_fd);
+		fprintf(stderr, "CLIENT: ERROR releasing pad\n");
+		exit(1);
+	}
+	otp_send_goodbye(connection_socket_fd);
+	close(connection_socket_fd);
+}
+
+/**
+ * Prints the usage message, naming the messages after the role.
+ */
+static void print_usage(void)
+{
+	const char *noun = client_role->message_noun;
+	fprintf(stderr, "USAGE: [--stream | --packed] %s key [%s key ...] port|socket_path\n"
+					"   or: [--packed] --upload-pad key port|socket_path\n"
+					"   or: [--packed] --pad ID[:OFFSET] %s [%s ...] port|socket_path\n"
+					"   or: --release-pad ID port|socket_path\n",
+			noun, noun, noun, noun);
+}
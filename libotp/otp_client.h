@@ -0,0 +1,14 @@
+#ifndef OTP_CLIENT_H
+#define OTP_CLIENT_H
+
+// what makes a client an encryption or a decryption client
+struct otp_client_role
+{
+	const char *client_type;  // handshake sent to the server, e.g. OTP_ENCRYPT_CLIENT
+	const char *message_noun; // what the client sends, for the usage and error messages, e.g. "plaintext"
+	const char *result_noun;  // what the server sends back, e.g. "ciphertext"
+};
+
+int otp_run_client(int argument_count, char *argument_array[], const struct otp_client_role *role);
+
+#endif
@@ -0,0 +1,786 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h> // for shutdown
+#include "otp_buffer_pool.h"
+#include "otp_connection.h"
+#include "otp_stream.h"
+
+// function prototypes
+static bool begin_connection_message(struct otp_connection *connection);
+static bool build_connection_reply(struct otp_connection *connection, const char *key);
+static void refuse_connection_request(struct otp_connection *connection, int header_length, int error);
+static bool refuse_busy_request(struct otp_connection *connection);
+static void discard_connection_bytes(struct otp_connection *connection, long long size, enum otp_connection_state next);
+static void release_connection_memory(struct otp_connection *connection);
+static void reset_connection_request(struct otp_connection *connection);
+static void stop_draining_connection(struct otp_connection *connection);
+
+// destination of the bytes of OTP_STATE_DISCARD and OTP_STATE_DRAIN, which are never read
+static char discarded_bytes[OTP_DISCARD_BUFFER_SIZE];
+
+// connections in OTP_STATE_DRAIN, oldest first; each gets the same time, so this is also the order of their deadlines
+// (there is one event loop per process)
+static struct otp_connection *oldest_draining;
+static struct otp_connection *newest_draining;
+
+/**
+ * Allocates the state of a newly accepted connection, waiting for the handshake. A connection that admission
+ * control refuses (see otp_admit_connection()) starts with the busy reply ready to send instead, and once it
+ * is sent only drains what the client still sends.
+ * @param server: pointer to the server the connection belongs to
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @return struct otp_connection *, the connection, or NULL if memory ran out (the socket is then closed)
+ */
+struct otp_connection *otp_create_connection(const struct otp_server *server, int connection_socket_fd)
+{
+	long long accepted_at_us = otp_record_accept(server->stats);
+	bool admitted = otp_admit_connection(server);
+	struct otp_connection *connection = calloc(1, sizeof(struct otp_connection));
+	if (!connection)
+	{
+		fprintf(stderr, "SERVER: ERROR allocating memory for connection\n");
+		otp_record_error(server->stats, OTP_ERROR_MEMORY);
+		close(connection_socket_fd);
+		if (admitted)
+		{
+			otp_record_connection(server->stats, accepted_at_us, false);
+		}
+		return NULL;
+	}
+	otp_set_no_delay(connection_socket_fd);
+	connection->server = server;
+	connection->fd = connection_socket_fd;
+	connection->accepted_at_us = accepted_at_us;
+	connection->timing.started_ns = otp_current_time_ns();
+	connection->encoding = OTP_ENCODING_TEXT;
+	otp_begin_connection_stage(connection, OTP_STATE_HANDSHAKE, connection->handshake, OTP_HANDSHAKE_LENGTH);
+	if (!admitted)
+	{
+		connection->shed = true; // already counted as busy, not active
+		if (!refuse_busy_request(connection))
+		{
+			otp_close_connection(connection, false);
+			return NULL;
+		}
+	}
+	return connection;
+}
+
+/**
+ * Moves a connection to the next protocol stage.
+ * @param connection: pointer to the connection
+ * @param state: enum otp_connection_state, the stage to begin
+ * @param buffer: pointer to memory that will hold the bytes of the stage
+ * @param expected: int, number of bytes the stage needs
+ */
+void otp_begin_connection_stage(struct otp_connection *connection, enum otp_connection_state state, void *buffer, int expected)
+{
+	connection->state = state;
+	connection->stage_buffer = buffer;
+	connection->stage_expected = expected;
+	connection->stage_received = 0;
+}
+
+/**
+ * Acts on a fully received protocol stage and begins the next one.
+ * Packed messages, keys and pads are unpacked in place as soon as they are complete. Once the key (or a
+ * chunk of a stream request) is complete, the server's cipher is applied to the message into the reply buffer.
+ * @param connection: pointer to the connection
+ * @return bool, false if the client sent something invalid or memory ran out
+ */
+bool otp_complete_connection_stage(struct otp_connection *connection)
+{
+	int converted_size;
+
+	switch (connection->state)
+	{
+	case OTP_STATE_HANDSHAKE:
+		connection->handshake[OTP_HANDSHAKE_LENGTH] = '\0'; // ensure null-termination
+		if (strcmp(connection->handshake, connection->server->role->client_type) != 0)
+		{
+			fprintf(stderr, "SERVER: ERROR- client rejected\n");
+			otp_record_error(connection->server->stats, OTP_ERROR_REJECTED);
+			return false;
+		}
+		otp_record_phase(connection->server->stats, OTP_PHASE_HANDSHAKE, otp_current_time_ns() - connection->timing.started_ns);
+		otp_begin_connection_stage(connection, OTP_STATE_FRAME_HEADER, &connection->size_field, sizeof(int));
+		return true;
+
+	case OTP_STATE_FRAME_HEADER:
+		connection->timing.started_ns = otp_current_time_ns();
+		connection->message_size = ntohl(connection->size_field); // convert to host byte order
+		if (connection->message_size == OTP_FRAME_GOODBYE)
+		{
+			connection->state = OTP_STATE_FINISHED;
+			return true;
+		}
+		if (connection->message_size == OTP_FRAME_STREAM)
+		{
+			// the chunk and reply buffers are reused for every chunk, so memory stays fixed
+			connection->streaming = true;
+			connection->message = otp_allocate_buffer(2 * OTP_STREAM_CHUNK_SIZE);
+			connection->reply = otp_allocate_buffer(sizeof(int) + OTP_STREAM_CHUNK_SIZE);
+			if (!connection->message || !connection->reply)
+			{
+				fprintf(stderr, "SERVER: ERROR allocating memory for stream\n");
+				otp_record_error(connection->server->stats, OTP_ERROR_MEMORY);
+				return false;
+			}
+			otp_begin_connection_stage(connection, OTP_STATE_CHUNK_SIZE, &connection->size_field, sizeof(int));
+			return true;
+		}
+		if (connection->message_size == OTP_FRAME_TAGGED)
+		{
+			connection->tagged = true;
+			otp_begin_connection_stage(connection, OTP_STATE_TAG, &connection->tag, sizeof(int));
+			return true;
+		}
+		if (connection->message_size == OTP_FRAME_PAD_UPLOAD)
+		{
+			connection->pad_upload = true;
+			otp_begin_connection_stage(connection, OTP_STATE_PAD_SIZE, &connection->size_field, sizeof(int));
+			return true;
+		}
+		if (connection->message_size == OTP_FRAME_PAD_REQUEST)
+		{
+			connection->pad_request = true;
+			otp_begin_connection_stage(connection, OTP_STATE_PAD_RANGE, connection->pad_range, sizeof(connection->pad_range));
+			return true;
+		}
+		if (connection->message_size == OTP_FRAME_PAD_RELEASE)
+		{
+			connection->pad_release = true;
+			otp_begin_connection_stage(connection, OTP_STATE_PAD_RELEASE, &connection->size_field, sizeof(int));
+			return true;
+		}
+		if (connection->message_size == OTP_FRAME_ENCODING)
+		{
+			connection->encoding_request = true;
+			otp_begin_connection_stage(connection, OTP_STATE_ENCODING, &connection->size_field, sizeof(int));
+			return true;
+		}
+		return begin_connection_message(connection);
+
+	case OTP_STATE_ENCODING:
+		// reply with the encoding the session uses from now on: the one asked for, or plain text
+		connection->encoding = otp_encoding_supported(ntohl(connection->size_field)) ? (int)ntohl(connection->size_field)
+																					: OTP_ENCODING_TEXT;
+		connection->reply = otp_allocate_buffer(sizeof(int));
+		if (!connection->reply)
+		{
+			fprintf(stderr, "SERVER: ERROR allocating memory for result\n");
+			otp_record_error(connection->server->stats, OTP_ERROR_MEMORY);
+			return false;
+		}
+		converted_size = htonl(connection->encoding);
+		memcpy(connection->reply, &converted_size, sizeof(int));
+		connection->reply_size = sizeof(int);
+		connection->reply_sent = 0;
+		connection->state = OTP_STATE_REPLY;
+		return true;
+
+	case OTP_STATE_PAD_RELEASE:
+		otp_retire_pad(connection->server->pad_store, ntohl(connection->size_field));
+		connection->reply = otp_allocate_buffer(sizeof(int));
+		if (!connection->reply)
+		{
+			fprintf(stderr, "SERVER: ERROR allocating memory for result\n");
+			otp_record_error(connection->server->stats, OTP_ERROR_MEMORY);
+			return false;
+		}
+		memset(connection->reply, 0, sizeof(int)); // released
+		connection->reply_size = sizeof(int);
+		connection->reply_sent = 0;
+		connection->state = OTP_STATE_REPLY;
+		return true;
+
+	case OTP_STATE_PAD_SIZE:
+	{
+		char *pad = otp_reserve_pad(connection->server->pad_store, ntohl(connection->size_field), &connection->pad_id);
+		if (!pad)
+		{
+			fprintf(stderr, errno == ENOSPC ? "SERVER: ERROR- pad store is full\n" : "SERVER: ERROR- invalid pad size\n");
+			otp_record_error(connection->server->stats, errno == ENOSPC ? OTP_ERROR_PAD : OTP_ERROR_PROTOCOL);
+			return false;
+		}
+		connection->message_size = ntohl(connection->size_field);
+		otp_begin_connection_stage(connection, OTP_STATE_PAD, pad, otp_encoded_size(connection->encoding, connection->message_size));
+		return true;
+	}
+
+	case OTP_STATE_PAD:
+		connection->timing.received_ns = connection->timing.ciphered_ns = otp_current_time_ns(); // only stored
+		if (connection->encoding == OTP_ENCODING_PACKED &&
+			!otp_unpack_characters(connection->stage_buffer, connection->message_size, connection->stage_buffer))
+		{
+			fprintf(stderr, "SERVER: ERROR- invalid packed message\n");
+			otp_record_error(connection->server->stats, OTP_ERROR_PROTOCOL);
+			return false; // the pad is discarded when the connection closes
+		}
+
+		// reply with the ID of the now usable pad
+		otp_publish_pad(connection->server->pad_store, connection->pad_id);
+		connection->reply = otp_allocate_buffer(sizeof(int));
+		if (!connection->reply)
+		{
+			fprintf(stderr, "SERVER: ERROR allocating memory for result\n");
+			otp_record_error(connection->server->stats, OTP_ERROR_MEMORY);
+			return false;
+		}
+		converted_size = htonl(connection->pad_id);
+		memcpy(connection->reply, &converted_size, sizeof(int));
+		connection->reply_size = sizeof(int);
+		connection->reply_sent = 0;
+		connection->state = OTP_STATE_REPLY;
+		return true;
+
+	case OTP_STATE_PAD_RANGE:
+		connection->message_size = ntohl(connection->pad_range[2]);
+		return begin_connection_message(connection);
+
+	case OTP_STATE_TAG:
+		otp_begin_connection_stage(connection, OTP_STATE_MESSAGE_SIZE, &connection->size_field, sizeof(int));
+		return true;
+
+	case OTP_STATE_MESSAGE_SIZE:
+		connection->message_size = ntohl(connection->size_field);
+		return begin_connection_message(connection);
+
+	case OTP_STATE_MESSAGE:
+		if (connection->encoding == OTP_ENCODING_PACKED)
+		{
+			if (!otp_unpack_characters(connection->message, connection->message_size, connection->message))
+			{
+				fprintf(stderr, "SERVER: ERROR- invalid packed message\n");
+				otp_record_error(connection->server->stats, OTP_ERROR_PROTOCOL);
+				return false;
+			}
+		}
+		else
+		{
+			connection->message_size = otp_trim_null_terminators(connection->message, connection->message_size);
+		}
+		if (connection->pad_request)
+		{
+			// the key is a range of a stored pad, which no other request may use again
+			int pad_id = ntohl(connection->pad_range[0]);
+			const char *key = otp_use_pad(connection->server->pad_store, pad_id, ntohl(connection->pad_range[1]),
+										  connection->message_size);
+			if (!key)
+			{
+				fprintf(stderr, "SERVER: ERROR- pad range unavailable\n");
+				otp_record_error(connection->server->stats, OTP_ERROR_PAD);
+				return false;
+			}
+			bool built = build_connection_reply(connection, key);
+			otp_finish_pad_use(connection->server->pad_store, pad_id);
+			return built;
+		}
+		otp_begin_connection_stage(connection, OTP_STATE_KEY_SIZE, &connection->size_field, sizeof(int));
+		return true;
+
+	case OTP_STATE_KEY_SIZE:
+		connection->key_size = ntohl(connection->size_field);
+		if (connection->key_size < 0)
+		{
+			fprintf(stderr, "SERVER: ERROR- invalid message size\n");
+			otp_record_error(connection->server->stats, OTP_ERROR_PROTOCOL);
+			return false;
+		}
+		if (connection->refusal == OTP_REPLY_BUSY)
+		{
+			discard_connection_bytes(connection, otp_encoded_size(connection->encoding, connection->key_size), OTP_STATE_REPLY);
+			return true;
+		}
+		// reserved once its size is known, since nothing makes a key as short as its message
+		long long key_bytes = otp_buffer_capacity((size_t)connection->key_size + 1);
+		if (!otp_reserve_request_memory(connection->server, connection->reserved_bytes, key_bytes))
+		{
+			connection->refusal = OTP_REPLY_BUSY;
+			otp_free_buffer(connection->message);
+			connection->message = NULL;
+			release_connection_memory(connection);
+			discard_connection_bytes(connection, otp_encoded_size(connection->encoding, connection->key_size), OTP_STATE_REPLY);
+			return true;
+		}
+		connection->reserved_bytes += key_bytes;
+		connection->key = otp_allocate_buffer(otp_encoding_buffer_size(connection->encoding, connection->key_size) + 1);
+		if (!connection->key)
+		{
+			fprintf(stderr, "SERVER: ERROR allocating memory for message\n");
+			otp_record_error(connection->server->stats, OTP_ERROR_MEMORY);
+			return false;
+		}
+		otp_begin_connection_stage(connection, OTP_STATE_KEY, connection->key,
+								   otp_encoded_size(connection->encoding, connection->key_size));
+		return true;
+
+	case OTP_STATE_KEY:
+		if (connection->encoding == OTP_ENCODING_PACKED)
+		{
+			if (!otp_unpack_characters(connection->key, connection->key_size, connection->key))
+			{
+				fprintf(stderr, "SERVER: ERROR- invalid packed message\n");
+				otp_record_error(connection->server->stats, OTP_ERROR_PROTOCOL);
+				return false;
+			}
+		}
+		else
+		{
+			connection->key_size = otp_trim_null_terminators(connection->key, connection->key_size);
+		}
+
+		// check that key is at least as long as the message
+		if (connection->key_size < connection->message_size)
+		{
+			fprintf(stderr, "SERVER: ERROR- key is too short\n");
+			otp_record_error(connection->server->stats, OTP_ERROR_PROTOCOL);
+			return false;
+		}
+
+		return build_connection_reply(connection, connection->key);
+
+	case OTP_STATE_CHUNK_SIZE:
+		connection->timing.started_ns = otp_current_time_ns();
+		connection->message_size = ntohl(connection->size_field);
+		if (connection->message_size < 0 || connection->message_size > OTP_STREAM_CHUNK_SIZE)
+		{
+			fprintf(stderr, "SERVER: ERROR- invalid chunk size\n");
+			otp_record_error(connection->server->stats, OTP_ERROR_PROTOCOL);
+			return false;
+		}
+		otp_begin_connection_stage(connection, OTP_STATE_CHUNK, connection->message, 2 * connection->message_size);
+		return true;
+
+	case OTP_STATE_CHUNK:
+		// answer the chunk (a chunk of size 0 ends the request and is echoed)
+		connection->timing.received_ns = otp_current_time_ns();
+		bool answered = otp_apply_cipher(connection->server, connection->message, connection->message + connection->message_size,
+										 connection->reply + sizeof(int), connection->message_size);
+		connection->timing.ciphered_ns = otp_current_time_ns();
+		if (!answered)
+		{
+			refuse_connection_request(connection, sizeof(int), OTP_REPLY_BAD_CHARACTER);
+			return true;
+		}
+		converted_size = htonl(connection->message_size);
+		memcpy(connection->reply, &converted_size, sizeof(int));
+		connection->reply_size = sizeof(int) + connection->message_size;
+		connection->reply_sent = 0;
+		connection->state = OTP_STATE_REPLY;
+		return true;
+
+	case OTP_STATE_DISCARD:
+		connection->discard_remaining -= connection->stage_expected;
+		if (connection->discard_remaining > 0)
+		{
+			discard_connection_bytes(connection, connection->discard_remaining, connection->after_discard);
+			return true;
+		}
+		if (connection->after_discard == OTP_STATE_KEY_SIZE)
+		{
+			otp_begin_connection_stage(connection, OTP_STATE_KEY_SIZE, &connection->size_field, sizeof(int));
+			return true;
+		}
+		return refuse_busy_request(connection);
+
+	case OTP_STATE_DRAIN:
+		connection->discard_remaining -= connection->stage_expected;
+		if (connection->discard_remaining <= 0)
+		{
+			return false; // the client is still sending; give up on it
+		}
+		otp_begin_connection_stage(connection, OTP_STATE_DRAIN, discarded_bytes, sizeof(discarded_bytes));
+		return true;
+
+	case OTP_STATE_REPLY:
+	case OTP_STATE_FINISHED:
+		break;
+	}
+	return true;
+}
+
+/**
+ * Checks the size of a whole (tagged or untagged) message and begins receiving it, or refuses it with
+ * OTP_REPLY_BUSY if its buffers would take the server over --max-buffered. A refused request is still read,
+ * and dropped, so the reply goes out in its place and the session goes on.
+ * @param connection: pointer to the connection, whose message_size has been received
+ * @return bool, false if the size is invalid or memory ran out
+ */
+static bool begin_connection_message(struct otp_connection *connection)
+{
+	if (connection->message_size < 0)
+	{
+		fprintf(stderr, "SERVER: ERROR- invalid message size\n");
+		otp_record_error(connection->server->stats, OTP_ERROR_PROTOCOL);
+		return false;
+	}
+	// the message (+1 for null terminator) and the reply (after a tag and size); the key is reserved once its size arrives
+	long long reserved_bytes = otp_buffer_capacity((size_t)connection->message_size + 1) +
+							   otp_buffer_capacity(2 * sizeof(int) + (size_t)connection->message_size);
+	if (!otp_reserve_request_memory(connection->server, 0, reserved_bytes))
+	{
+		connection->refusal = OTP_REPLY_BUSY;
+		discard_connection_bytes(connection, otp_encoded_size(connection->encoding, connection->message_size),
+								 connection->pad_request ? OTP_STATE_REPLY : OTP_STATE_KEY_SIZE);
+		return true;
+	}
+	connection->reserved_bytes = reserved_bytes;
+	// +1 for null terminator; a packed message is received at the start and unpacked in place
+	connection->message = otp_allocate_buffer(otp_encoding_buffer_size(connection->encoding, connection->message_size) + 1);
+	if (!connection->message)
+	{
+		fprintf(stderr, "SERVER: ERROR allocating memory for message\n");
+		otp_record_error(connection->server->stats, OTP_ERROR_MEMORY);
+		return false;
+	}
+	otp_begin_connection_stage(connection, OTP_STATE_MESSAGE, connection->message,
+							   otp_encoded_size(connection->encoding, connection->message_size));
+	return true;
+}
+
+/**
+ * Applies the server's cipher to the message with the given key, into a new reply: the tag of a tagged
+ * request, then the result size in network byte order, followed by the result in the session's encoding.
+ * @param connection: pointer to the connection, whose whole message has been received
+ * @param key: pointer to at least message_size key characters
+ * @return bool, false if memory ran out
+ */
+static bool build_connection_reply(struct otp_connection *connection, const char *key)
+{
+	int reply_length = connection->message_size;
+	int header_length = connection->tagged ? 2 * sizeof(int) : sizeof(int);
+	connection->timing.received_ns = otp_current_time_ns();
+	connection->reply = otp_allocate_buffer(header_length + otp_encoding_buffer_size(connection->encoding, reply_length));
+	if (!connection->reply)
+	{
+		fprintf(stderr, "SERVER: ERROR allocating memory for result\n");
+		otp_record_error(connection->server->stats, OTP_ERROR_MEMORY);
+		return false;
+	}
+	int converted_size = htonl(reply_length);
+	if (connection->tagged)
+	{
+		memcpy(connection->reply, &connection->tag, sizeof(int)); // already in network byte order
+	}
+	memcpy(connection->reply + header_length - sizeof(int), &converted_size, sizeof(int));
+	bool answered = otp_apply_cipher(connection->server, connection->message, key, connection->reply + header_length,
+									 reply_length);
+	connection->timing.ciphered_ns = otp_current_time_ns();
+	if (!answered)
+	{
+		refuse_connection_request(connection, header_length, OTP_REPLY_BAD_CHARACTER);
+		return true;
+	}
+	if (connection->encoding == OTP_ENCODING_PACKED)
+	{
+		// every result character is in the allowed set, so packing cannot fail
+		otp_pack_characters(connection->reply + header_length, reply_length, connection->reply + header_length);
+	}
+	connection->reply_size = header_length + otp_encoded_size(connection->encoding, reply_length);
+	connection->reply_sent = 0;
+	connection->state = OTP_STATE_REPLY;
+	return true;
+}
+
+/**
+ * Turns the reply being built into a refusal: the tag of a tagged request, then the error in place of the
+ * result size. The session ends once it has been sent.
+ * @param connection: pointer to the connection, whose reply buffer has room for the header and holds the tag
+ * @param header_length: int, size of the reply header (the tag, if any, and the size)
+ * @param error: int, the reason, e.g. OTP_REPLY_BAD_CHARACTER
+ */
+static void refuse_connection_request(struct otp_connection *connection, int header_length, int error)
+{
+	int converted_error = htonl(error);
+	memcpy(connection->reply + header_length - sizeof(int), &converted_error, sizeof(int));
+	connection->reply_size = header_length;
+	connection->reply_sent = 0;
+	connection->refusal = error;
+	connection->state = OTP_STATE_REPLY;
+}
+
+/**
+ * Turns a request refused as busy, or a connection refused at accept, into its reply: OTP_REPLY_BUSY,
+ * after the tag of a tagged request.
+ * @param connection: pointer to the connection, which holds no reply buffer
+ * @return bool, false if memory ran out
+ */
+static bool refuse_busy_request(struct otp_connection *connection)
+{
+	connection->reply = otp_allocate_buffer(2 * sizeof(int));
+	if (!connection->reply)
+	{
+		fprintf(stderr, "SERVER: ERROR allocating memory for result\n");
+		otp_record_error(connection->server->stats, OTP_ERROR_MEMORY);
+		return false;
+	}
+	if (connection->tagged)
+	{
+		memcpy(connection->reply, &connection->tag, sizeof(int)); // already in network byte order
+	}
+	refuse_connection_request(connection, connection->tagged ? 2 * sizeof(int) : sizeof(int), OTP_REPLY_BUSY);
+	return true;
+}
+
+/**
+ * Begins receiving and dropping bytes of a request refused as busy, at most a scratch buffer's worth per stage.
+ * @param connection: pointer to the connection
+ * @param size: long long, number of bytes to drop
+ * @param next: enum otp_connection_state, OTP_STATE_KEY_SIZE to go on with the key message afterwards, or
+ * OTP_STATE_REPLY to send the busy reply
+ */
+static void discard_connection_bytes(struct otp_connection *connection, long long size, enum otp_connection_state next)
+{
+	connection->discard_remaining = size;
+	connection->after_discard = next;
+	otp_begin_connection_stage(connection, OTP_STATE_DISCARD, discarded_bytes,
+							   size < (long long)sizeof(discarded_bytes) ? (int)size : (int)sizeof(discarded_bytes));
+}
+
+/**
+ * Returns the memory reserved for the connection's request, once its buffers are freed or about to be.
+ * @param connection: pointer to the connection
+ */
+static void release_connection_memory(struct otp_connection *connection)
+{
+	otp_release_buffered_bytes(connection->server->stats, connection->reserved_bytes);
+	connection->reserved_bytes = 0;
+}
+
+/**
+ * Called once the whole reply has been sent; times and counts what was served, then begins receiving the next chunk
+ * if a stream request is still in progress, and otherwise frees the request and waits for the next one. A
+ * connection refused at accept goes on to drain what the client still sends instead: closing it with the request
+ * unread would make the kernel reset the connection, and the client could fail on that before reading the reply.
+ * @param connection: pointer to the connection
+ * @return bool, false if the reply refused the request (other than as busy), in which case the caller closes the
+ * connection
+ */
+bool otp_finish_connection_reply(struct otp_connection *connection)
+{
+	bool counted = !connection->encoding_request && !connection->pad_release;
+	if (counted && connection->refusal != OTP_REPLY_BUSY) // a busy request was never served
+	{
+		enum otp_request_type type = connection->streaming	  ? OTP_REQUEST_STREAM
+									 : connection->pad_upload  ? OTP_REQUEST_PAD_UPLOAD
+									 : connection->pad_request ? OTP_REQUEST_PAD_REQUEST
+									 : connection->tagged	  ? OTP_REQUEST_TAGGED
+															  : OTP_REQUEST_MESSAGE;
+		otp_finish_request_timing(connection->server, type, connection->message_size, &connection->timing,
+								  connection->refusal == 0);
+	}
+	if (connection->shed)
+	{
+		shutdown(connection->fd, SHUT_WR);
+		connection->discard_remaining = OTP_REFUSAL_DRAIN_BYTES;
+		connection->drain_deadline_ns = otp_current_time_ns() + OTP_REFUSAL_DRAIN_MS * 1000000LL;
+		connection->drain_previous = newest_draining;
+		if (newest_draining)
+		{
+			newest_draining->drain_next = connection;
+		}
+		else
+		{
+			oldest_draining = connection;
+		}
+		newest_draining = connection;
+		otp_begin_connection_stage(connection, OTP_STATE_DRAIN, discarded_bytes, sizeof(discarded_bytes));
+		return true;
+	}
+	if (connection->refusal == OTP_REPLY_BUSY)
+	{
+		reset_connection_request(connection); // read in full, so the session goes on
+		return true;
+	}
+	if (connection->refusal != 0)
+	{
+		return false;
+	}
+	struct otp_server_stats *stats = connection->server->stats;
+	if (connection->streaming)
+	{
+		otp_record_transfer(stats, 2LL * connection->message_size, connection->message_size);
+		if (connection->message_size > 0)
+		{
+			otp_begin_connection_stage(connection, OTP_STATE_CHUNK_SIZE, &connection->size_field, sizeof(int));
+			return true;
+		}
+	}
+	else if (connection->pad_upload)
+	{
+		otp_record_transfer(stats, connection->message_size, 0);
+	}
+	else if (counted)
+	{
+		// a pad request's key comes from the pad store, not the client
+		otp_record_transfer(stats, (connection->pad_request ? 1LL : 2LL) * connection->message_size,
+							connection->message_size);
+	}
+
+	if (counted)
+	{
+		otp_record_request(stats);
+	}
+	reset_connection_request(connection);
+	return true;
+}
+
+/**
+ * Frees the request a connection has answered and waits for the next one.
+ * @param connection: pointer to the connection
+ */
+static void reset_connection_request(struct otp_connection *connection)
+{
+	otp_free_buffer(connection->message);
+	otp_free_buffer(connection->key);
+	otp_free_buffer(connection->reply);
+	connection->message = connection->key = connection->reply = NULL;
+	release_connection_memory(connection);
+	connection->streaming = connection->tagged = connection->pad_request = connection->pad_upload = false;
+	connection->encoding_request = connection->pad_release = false;
+	connection->refusal = 0;
+	otp_begin_connection_stage(connection, OTP_STATE_FRAME_HEADER, &connection->size_field, sizeof(int));
+}
+
+/**
+ * Tells whether a connection is between requests, where the client may close it to end the session.
+ * @param connection: pointer to the connection
+ * @return bool, true if no part of a request has been received since the last reply, or the connection was
+ * refused at accept and only drains
+ */
+bool otp_connection_between_requests(const struct otp_connection *connection)
+{
+	return connection->state == OTP_STATE_DRAIN ||
+		   (connection->state == OTP_STATE_FRAME_HEADER && connection->stage_received == 0);
+}
+
+/**
+ * Copies received bytes into the current protocol stage, completing stages as they fill up,
+ * until the bytes run out, the reply is ready, or the client ends the session.
+ * @param connection: pointer to the connection
+ * @param data: pointer to the received bytes
+ * @param length: int, number of received bytes
+ * @return int, number of bytes consumed, or -1 if the client sent something invalid
+ */
+int otp_consume_connection_bytes(struct otp_connection *connection, const char *data, int length)
+{
+	int consumed = 0;
+
+	while (connection->state != OTP_STATE_REPLY && connection->state != OTP_STATE_FINISHED)
+	{
+		if (connection->stage_received < connection->stage_expected)
+		{
+			if (consumed == length)
+			{
+				break; // wait for more data
+			}
+
+			int wanted = connection->stage_expected - connection->stage_received;
+			int available = length - consumed;
+			int copied = wanted < available ? wanted : available;
+			memcpy(connection->stage_buffer + connection->stage_received, data + consumed, copied);
+			connection->stage_received += copied;
+			consumed += copied;
+			continue;
+		}
+
+		if (!otp_complete_connection_stage(connection))
+		{
+			return -1;
+		}
+	}
+	return consumed;
+}
+
+/**
+ * Closes a connection, records it in the server statistics, and frees it.
+ * The caller must have removed it from its event loop and have no operation for it in flight.
+ * @param connection: pointer to the connection
+ * @param succeeded: bool, whether the client was served without errors
+ */
+void otp_close_connection(struct otp_connection *connection, bool succeeded)
+{
+	if (connection->state == OTP_STATE_PAD)
+	{
+		otp_discard_pad(connection->server->pad_store, connection->pad_id); // the upload was cut short
+	}
+	stop_draining_connection(connection);
+	close(connection->fd);
+	if (!connection->shed) // counted as busy instead
+	{
+		otp_record_connection(connection->server->stats, connection->accepted_at_us, succeeded);
+	}
+
+	// clean up
+	otp_free_buffer(connection->message);
+	otp_free_buffer(connection->key);
+	otp_free_buffer(connection->reply);
+	free(connection->pending);
+	release_connection_memory(connection);
+	free(connection);
+}
+
+/**
+ * Takes the oldest connection whose OTP_REFUSAL_DRAIN_MS are up off the draining connections, for the event loop
+ * to close: a refused client that neither closes nor sends would otherwise hold its socket for good, as it does
+ * not count against --max-connections.
+ * @return struct otp_connection *, the connection, or NULL if none has expired
+ */
+struct otp_connection *otp_next_expired_connection(void)
+{
+	struct otp_connection *connection = oldest_draining;
+	if (!connection || connection->drain_deadline_ns > otp_current_time_ns())
+	{
+		return NULL;
+	}
+	stop_draining_connection(connection);
+	return connection;
+}
+
+/**
+ * Tells the event loop how long it may wait for events before the oldest draining connection expires.
+ * @return int, milliseconds until then (rounded up), or -1 if no connection is draining
+ */
+int otp_drain_timeout_ms(void)
+{
+	if (!oldest_draining)
+	{
+		return -1;
+	}
+	long long remaining_ns = oldest_draining->drain_deadline_ns - otp_current_time_ns();
+	return remaining_ns > 0 ? (int)((remaining_ns + 999999) / 1000000) : 0;
+}
+
+/**
+ * Removes a connection from the draining connections, if it is among them.
+ * @param connection: pointer to the connection
+ */
+static void stop_draining_connection(struct otp_connection *connection)
+{
+	if (connection->drain_deadline_ns == 0)
+	{
+		return;
+	}
+	if (connection->drain_previous)
+	{
+		connection->drain_previous->drain_next = connection->drain_next;
+	}
+	else
+	{
+		oldest_draining = connection->drain_next;
+	}
+	if (connection->drain_next)
+	{
+		connection->drain_next->drain_previous = connection->drain_previous;
+	}
+	else
+	{
+		newest_draining = connection->drain_previous;
+	}
+	connection->drain_previous = connection->drain_next = NULL;
+	connection->drain_deadline_ns = 0;
+}
@@ -0,0 +1,86 @@
+#ifndef OTP_CONNECTION_H
+#define OTP_CONNECTION_H
+
+#include <stdbool.h>
+#include "otp_pad_store.h"
+#include "otp_protocol.h"
+#include "otp_server.h"
+
+// protocol stages of a connection served by one of the event-driven worker models
+enum otp_connection_state
+{
+	OTP_STATE_HANDSHAKE,	// receiving the 7-byte client type
+	OTP_STATE_FRAME_HEADER, // receiving the 4-byte header of the next request (message size or request type)
+	OTP_STATE_TAG,			// receiving the 4-byte tag of a tagged request
+	OTP_STATE_MESSAGE_SIZE, // receiving the 4-byte message size of a tagged request
+	OTP_STATE_MESSAGE,		// receiving the message
+	OTP_STATE_KEY_SIZE,		// receiving the 4-byte key size
+	OTP_STATE_KEY,			// receiving the key
+	OTP_STATE_PAD_SIZE,		// receiving the 4-byte size of an uploaded pad
+	OTP_STATE_PAD,			// receiving the characters of an uploaded pad, straight into the pad store
+	OTP_STATE_PAD_RANGE,	// receiving the pad ID, offset and message size of a pad request
+	OTP_STATE_PAD_RELEASE,	// receiving the ID of a pad the client releases
+	OTP_STATE_CHUNK_SIZE,	// receiving the 4-byte size of the next chunk of a stream request
+	OTP_STATE_CHUNK,		// receiving the message and key characters of a chunk
+	OTP_STATE_ENCODING,		// receiving the 4-byte wire encoding the client asks for
+	OTP_STATE_DISCARD,		// receiving and dropping the message or key of a request refused as busy
+	OTP_STATE_DRAIN,		// dropping what a client refused at accept still sends, until it closes the connection
+	OTP_STATE_REPLY,		// sending the size-prefixed result (after the tag, for a tagged request), a pad ID, or an encoding
+	OTP_STATE_FINISHED		// the client ended the session
+};
+
+// a connection served by an event loop, holding everything needed to resume it when its socket is ready
+struct otp_connection
+{
+	const struct otp_server *server;
+	int fd;
+	long long accepted_at_us;
+	enum otp_connection_state state;
+	char handshake[OTP_HANDSHAKE_LENGTH + 1];
+	int size_field;		// message or key size, in network byte order while being received
+	char *stage_buffer; // destination of the bytes of the current stage
+	int stage_expected; // number of bytes the current stage needs
+	int stage_received; // number of bytes of the current stage received so far
+	bool streaming; // serving a stream request (message holds one chunk of message and key characters)
+	bool tagged;	// serving a tagged request, whose reply starts with its tag
+	int tag;		// tag of the request, in network byte order
+	bool pad_request; // serving a pad request, whose key comes from the pad store
+	int pad_range[3]; // pad ID, offset and message size of a pad request, in network byte order
+	bool pad_upload;  // serving a pad upload, whose reply is the pad's ID
+	int pad_id;		  // ID of the pad being uploaded
+	int encoding;		   // wire encoding of messages, OTP_ENCODING_TEXT until the client negotiates another
+	bool encoding_request; // answering an encoding request, which is not counted as a request
+	bool pad_release;	   // answering a pad release, which is not counted as a request either
+	char *message;			  // message, key and reply come from the worker's buffer pool (otp_allocate_buffer())
+	int message_size;		  // size of the message, or of the current chunk of a stream request
+	long long reserved_bytes; // memory reserved for the current request against --max-buffered
+	char *key;
+	int key_size;
+	char *reply;	// size-prefixed result, after the tag for a tagged request
+	int reply_size; // size of the reply including the tag and size prefix
+	int reply_sent; // number of reply bytes sent so far
+	int refusal;	// error the reply refuses the request with (e.g. OTP_REPLY_BAD_CHARACTER), or 0; the session ends once it
+					// is sent, unless the request was refused as busy
+	bool shed;								 // refused at accept by admission control; only the busy reply is sent
+	long long discard_remaining;			 // bytes still to drop in OTP_STATE_DISCARD or OTP_STATE_DRAIN
+	enum otp_connection_state after_discard; // stage that follows OTP_STATE_DISCARD
+	long long drain_deadline_ns;			 // when a connection in OTP_STATE_DRAIN is closed, or 0 if it is not draining
+	struct otp_connection *drain_previous;	 // neighbours among the draining connections, oldest first
+	struct otp_connection *drain_next;
+	bool waiting_to_send; // registered with the event loop for output space instead of input
+	char *pending;		  // bytes received past the end of a request, kept until its reply has been sent
+	int pending_size; // number of pending bytes
+	struct otp_request_timing timing; // when the handshake, or the current request or chunk, reached each phase
+};
+
+struct otp_connection *otp_create_connection(const struct otp_server *server, int connection_socket_fd);
+void otp_begin_connection_stage(struct otp_connection *connection, enum otp_connection_state state, void *buffer, int expected);
+bool otp_complete_connection_stage(struct otp_connection *connection);
+bool otp_finish_connection_reply(struct otp_connection *connection);
+bool otp_connection_between_requests(const struct otp_connection *connection);
+int otp_consume_connection_bytes(struct otp_connection *connection, const char *data, int length);
+void otp_close_connection(struct otp_connection *connection, bool succeeded);
+struct otp_connection *otp_next_expired_connection(void);
+int otp_drain_timeout_ms(void);
+
+#endif
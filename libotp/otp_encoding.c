@@ -0,0 +1,358 @@
+#include <stddef.h>
+#include <string.h>
+#include "otp_cipher.h"
+#include "otp_encoding.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // AVX2 intrinsics
+#endif
+
+#define GROUP_CHARACTERS 5	// characters in a packed group
+#define GROUP_BYTES 3		// bytes of a packed group
+#define GROUP_RANGE 14348907 // 27^5, the number of distinct groups; packed groups at or above it are invalid
+#define VECTOR_GROUPS 8		// groups handled per iteration of the AVX2 kernels
+
+// one implementation of packing and unpacking
+struct packing_kernels
+{
+	const char *name;
+	bool (*pack)(const char *characters, int length, char *packed);
+	bool (*unpack)(const char *packed, int length, char *characters);
+};
+
+// function prototypes
+static void select_packing_kernels(void);
+static bool pack_scalar(const char *characters, int length, char *packed);
+static bool unpack_scalar(const char *packed, int length, char *characters);
+#if defined(__x86_64__) || defined(__i386__)
+static bool pack_avx2(const char *characters, int length, char *packed);
+static bool unpack_avx2(const char *packed, int length, char *characters);
+#endif
+
+static const struct packing_kernels scalar_kernels = {"scalar", pack_scalar, unpack_scalar};
+#if defined(__x86_64__) || defined(__i386__)
+static const struct packing_kernels avx2_kernels = {"avx2", pack_avx2, unpack_avx2};
+#endif
+
+static const struct packing_kernels *selected_kernels; // chosen on first use
+
+/**
+ * Returns the number of bytes length characters take on the wire in an encoding.
+ * @param encoding: int, OTP_ENCODING_TEXT or OTP_ENCODING_PACKED
+ * @param length: int, number of characters (0 or more)
+ * @return int, number of bytes
+ */
+int otp_encoded_size(int encoding, int length)
+{
+	if (encoding == OTP_ENCODING_PACKED)
+	{
+		return (int)(((long long)length + GROUP_CHARACTERS - 1) / GROUP_CHARACTERS * GROUP_BYTES);
+	}
+	return length;
+}
+
+/**
+ * Returns the size of a buffer that can hold both the encoded form and the characters of a message, so it
+ * can be received encoded and then decoded in place (or encoded in place before it is sent).
+ * @param encoding: int, OTP_ENCODING_TEXT or OTP_ENCODING_PACKED
+ * @param length: int, number of characters (0 or more)
+ * @return int, number of bytes
+ */
+int otp_encoding_buffer_size(int encoding, int length)
+{
+	int encoded_size = otp_encoded_size(encoding, length);
+	return encoded_size > length ? encoded_size : length;
+}
+
+/**
+ * Tells whether an encoding is one this library can send and receive.
+ * @param encoding: int, the encoding a peer asked for
+ * @return bool, true for OTP_ENCODING_TEXT and OTP_ENCODING_PACKED
+ */
+bool otp_encoding_supported(int encoding)
+{
+	return encoding == OTP_ENCODING_TEXT || encoding == OTP_ENCODING_PACKED;
+}
+
+/**
+ * Packs characters five to three bytes, with the fastest kernel the CPU supports.
+ * @param characters: pointer to the characters
+ * @param length: int, number of characters
+ * @param packed: pointer to memory for otp_encoded_size(OTP_ENCODING_PACKED, length) bytes; may be characters
+ * itself, which must then hold otp_encoding_buffer_size() bytes
+ * @return bool, false if a character is not in the allowed character set (the packed bytes are then undefined)
+ */
+bool otp_pack_characters(const char *characters, int length, char *packed)
+{
+	if (!selected_kernels)
+	{
+		select_packing_kernels();
+	}
+	return selected_kernels->pack(characters, length, packed);
+}
+
+/**
+ * Unpacks characters packed with otp_pack_characters(), with the fastest kernel the CPU supports.
+ * @param packed: pointer to otp_encoded_size(OTP_ENCODING_PACKED, length) packed bytes
+ * @param length: int, number of characters they hold
+ * @param characters: pointer to memory for the characters (no null terminator is written); may be packed
+ * itself, which must then hold otp_encoding_buffer_size() bytes
+ * @return bool, false if a group is not a valid packed group (the characters are then undefined)
+ */
+bool otp_unpack_characters(const char *packed, int length, char *characters)
+{
+	if (!selected_kernels)
+	{
+		select_packing_kernels();
+	}
+	return selected_kernels->unpack(packed, length, characters);
+}
+
+/**
+ * Returns the name of the packing kernel in use ("avx2" or "scalar").
+ * @return string, the kernel name
+ */
+const char *otp_packing_kernel_name(void)
+{
+	if (!selected_kernels)
+	{
+		select_packing_kernels();
+	}
+	return selected_kernels->name;
+}
+
+/**
+ * Chooses the fastest packing kernels the CPU supports. Concurrent first calls all store the same answer.
+ */
+static void select_packing_kernels(void)
+{
+	const struct packing_kernels *kernels = &scalar_kernels;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		kernels = &avx2_kernels;
+	}
+#endif
+	__atomic_store_n(&selected_kernels, kernels, __ATOMIC_RELEASE);
+}
+
+/**
+ * Scalar packing kernel, used when the CPU has no AVX2 and for the groups the AVX2 kernel leaves over.
+ * Every group is read before it is written, so packing in place works.
+ * @param characters: pointer to the characters
+ * @param length: int, number of characters
+ * @param packed: pointer to memory for the packed bytes
+ * @return bool, false if a character is not in the allowed character set
+ */
+static bool pack_scalar(const char *characters, int length, char *packed)
+{
+	for (int group = 0; group * GROUP_CHARACTERS < length; group++)
+	{
+		int count = length - group * GROUP_CHARACTERS < GROUP_CHARACTERS ? length - group * GROUP_CHARACTERS : GROUP_CHARACTERS;
+		unsigned int value = 0;
+		for (int i = count - 1; i >= 0; i--)
+		{
+			// convert the character to a number: A-Z to 0-25, space to 26
+			char character = characters[group * GROUP_CHARACTERS + i];
+			unsigned int number = character == ' ' ? 26 : (unsigned int)(character - 'A');
+			if (number > 25 && character != ' ')
+			{
+				return false;
+			}
+			value = value * 27 + number;
+		}
+		packed[group * GROUP_BYTES] = value & 0xff;
+		packed[group * GROUP_BYTES + 1] = (value >> 8) & 0xff;
+		packed[group * GROUP_BYTES + 2] = value >> 16;
+	}
+	return true;
+}
+
+/**
+ * Scalar unpacking kernel (see pack_scalar()). Works from the last group to the first, and reads each group
+ * before writing its characters, so unpacking in place works.
+ * @param packed: pointer to the packed bytes
+ * @param length: int, number of characters they hold
+ * @param characters: pointer to memory for the characters
+ * @return bool, false if a group is not a valid packed group
+ */
+static bool unpack_scalar(const char *packed, int length, char *characters)
+{
+	for (int group = (length + GROUP_CHARACTERS - 1) / GROUP_CHARACTERS - 1; group >= 0; group--)
+	{
+		const unsigned char *bytes = (const unsigned char *)packed + group * GROUP_BYTES;
+		unsigned int value = bytes[0] | bytes[1] << 8 | bytes[2] << 16;
+		if (value >= GROUP_RANGE)
+		{
+			return false;
+		}
+
+		int count = length - group * GROUP_CHARACTERS < GROUP_CHARACTERS ? length - group * GROUP_CHARACTERS : GROUP_CHARACTERS;
+		for (int i = 0; i < count; i++)
+		{
+			characters[group * GROUP_CHARACTERS + i] = OTP_ALLOWED_CHARACTERS[value % 27];
+			value /= 27;
+		}
+	}
+	return true;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * Converts 32 characters to numbers (A-Z to 0-25, space to 26), and flags any other character.
+ * @param characters: __m256i, the characters
+ * @param invalid: pointer to a vector that gets a nonzero byte where a character is not in the allowed set
+ * @return __m256i, the numbers
+ */
+__attribute__((target("avx2"))) static inline __m256i characters_to_numbers_avx2(__m256i characters, __m256i *invalid)
+{
+	__m256i is_space = _mm256_cmpeq_epi8(characters, _mm256_set1_epi8(' '));
+	__m256i letter_numbers = _mm256_sub_epi8(characters, _mm256_set1_epi8('A'));
+
+	// a letter number above 25 leaves a nonzero byte after subtracting 25 with saturation
+	*invalid = _mm256_or_si256(*invalid, _mm256_andnot_si256(is_space, _mm256_subs_epu8(letter_numbers, _mm256_set1_epi8(25))));
+	return _mm256_blendv_epi8(letter_numbers, _mm256_set1_epi8(26), is_space);
+}
+
+/**
+ * Converts 32 numbers (0-26) back to characters.
+ * @param numbers: __m256i, the numbers
+ * @return __m256i, the characters
+ */
+__attribute__((target("avx2"))) static inline __m256i numbers_to_characters_avx2(__m256i numbers)
+{
+	return _mm256_blendv_epi8(_mm256_add_epi8(numbers, _mm256_set1_epi8('A')), _mm256_set1_epi8(' '),
+							  _mm256_cmpeq_epi8(numbers, _mm256_set1_epi8(26)));
+}
+
+/**
+ * Divides eight 24-bit numbers by 27. The quotient estimated in single precision (exact for the dividends,
+ * off by at most one after rounding) is corrected with the remainder.
+ * @param values: __m256i, the dividends (below 2^24)
+ * @param remainders: pointer to where the eight remainders are stored
+ * @return __m256i, the quotients
+ */
+__attribute__((target("avx2"))) static inline __m256i divide_by_27_avx2(__m256i values, __m256i *remainders)
+{
+	const __m256i twenty_seven = _mm256_set1_epi32(27);
+	__m256i quotients = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(values), _mm256_set1_ps(1.0f / 27)));
+	__m256i remainder = _mm256_sub_epi32(values, _mm256_mullo_epi32(quotients, twenty_seven));
+
+	// the masks are -1 where the estimate was one too high or one too low
+	__m256i too_high = _mm256_cmpgt_epi32(_mm256_setzero_si256(), remainder);
+	__m256i too_low = _mm256_cmpgt_epi32(remainder, _mm256_set1_epi32(26));
+	quotients = _mm256_sub_epi32(_mm256_add_epi32(quotients, too_high), too_low);
+	remainder = _mm256_add_epi32(remainder, _mm256_and_si256(too_high, twenty_seven));
+	*remainders = _mm256_sub_epi32(remainder, _mm256_and_si256(too_low, twenty_seven));
+	return quotients;
+}
+
+/**
+ * AVX2 packing kernel: packs eight groups (40 characters into 24 bytes) per iteration. Two gathers load
+ * characters 0-3 and 1-4 of every group into its own 32-bit lane, multiply-adds combine them into the
+ * group's number, and a shuffle and masked store write the low three bytes of each lane.
+ * @param characters: pointer to the characters
+ * @param length: int, number of characters
+ * @param packed: pointer to memory for the packed bytes
+ * @return bool, false if a character is not in the allowed character set
+ */
+__attribute__((target("avx2"))) static bool pack_avx2(const char *characters, int length, char *packed)
+{
+	const __m256i group_offsets = _mm256_setr_epi32(0, 5, 10, 15, 20, 25, 30, 35);
+	const __m256i pair_weights = _mm256_set1_epi16(27 << 8 | 1);		// c0 + 27*c1, c2 + 27*c3
+	const __m256i quad_weights = _mm256_set1_epi32(27 * 27 << 16 | 1); // (c0 + 27*c1) + 27^2*(c2 + 27*c3)
+	const __m256i compact_bytes = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+												   0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	const __m256i compact_lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+	const __m256i store_mask = _mm256_setr_epi32(-1, -1, -1, -1, -1, -1, 0, 0);
+	__m256i invalid = _mm256_setzero_si256();
+	int group = 0;
+
+	for (; (group + VECTOR_GROUPS) * GROUP_CHARACTERS <= length; group += VECTOR_GROUPS)
+	{
+		const char *first = characters + group * GROUP_CHARACTERS;
+		__m256i low_numbers = characters_to_numbers_avx2(_mm256_i32gather_epi32((const int *)first, group_offsets, 1), &invalid);
+		__m256i high_numbers = characters_to_numbers_avx2(_mm256_i32gather_epi32((const int *)(first + 1), group_offsets, 1), &invalid);
+
+		__m256i values = _mm256_madd_epi16(_mm256_maddubs_epi16(low_numbers, pair_weights), quad_weights);
+		__m256i last_numbers = _mm256_srli_epi32(high_numbers, 24); // character 4 of each group
+		values = _mm256_add_epi32(values, _mm256_mullo_epi32(last_numbers, _mm256_set1_epi32(27 * 27 * 27 * 27)));
+
+		__m256i bytes = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(values, compact_bytes), compact_lanes);
+		_mm256_maskstore_epi32((int *)(packed + group * GROUP_BYTES), store_mask, bytes);
+	}
+	if (!_mm256_testz_si256(invalid, invalid))
+	{
+		return false;
+	}
+	return pack_scalar(characters + group * GROUP_CHARACTERS, length - group * GROUP_CHARACTERS,
+					   packed + group * GROUP_BYTES);
+}
+
+/**
+ * AVX2 unpacking kernel: unpacks eight groups (24 bytes into 40 characters) per iteration, from the last
+ * groups to the first so unpacking in place works. Each group's number is spread into its own 32-bit lane
+ * and split into its five base-27 digits, which are interleaved back into characters with byte shuffles.
+ * @param packed: pointer to the packed bytes
+ * @param length: int, number of characters they hold
+ * @param characters: pointer to memory for the characters
+ * @return bool, false if a group is not a valid packed group
+ */
+__attribute__((target("avx2"))) static bool unpack_avx2(const char *packed, int length, char *characters)
+{
+	const __m256i load_mask = _mm256_setr_epi32(-1, -1, -1, -1, -1, -1, 0, 0);
+	const __m256i spread_lanes = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+	const __m256i spread_bytes = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+												  0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	// characters 0-3 of each group of a 128-bit half come from its lane, character 4 from the last digit
+	const __m256i head_from_digits = _mm256_setr_epi8(0, 1, 2, 3, -1, 4, 5, 6, 7, -1, 8, 9, 10, 11, -1, 12,
+													  0, 1, 2, 3, -1, 4, 5, 6, 7, -1, 8, 9, 10, 11, -1, 12);
+	const __m256i head_from_last = _mm256_setr_epi8(-1, -1, -1, -1, 0, -1, -1, -1, -1, 4, -1, -1, -1, -1, 8, -1,
+													-1, -1, -1, -1, 0, -1, -1, -1, -1, 4, -1, -1, -1, -1, 8, -1);
+	const __m256i tail_from_digits = _mm256_setr_epi8(13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+													  13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m256i tail_from_last = _mm256_setr_epi8(-1, -1, -1, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+													-1, -1, -1, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	__m256i invalid = _mm256_setzero_si256();
+
+	// the groups after the last whole iteration go first, so every group is read before its room is overwritten
+	int vector_groups = length / GROUP_CHARACTERS / VECTOR_GROUPS * VECTOR_GROUPS;
+	if (!unpack_scalar(packed + vector_groups * GROUP_BYTES, length - vector_groups * GROUP_CHARACTERS,
+					   characters + vector_groups * GROUP_CHARACTERS))
+	{
+		return false;
+	}
+
+	for (int group = vector_groups - VECTOR_GROUPS; group >= 0; group -= VECTOR_GROUPS)
+	{
+		__m256i bytes = _mm256_maskload_epi32((const int *)(packed + group * GROUP_BYTES), load_mask);
+		__m256i values = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(bytes, spread_lanes), spread_bytes);
+		invalid = _mm256_or_si256(invalid, _mm256_cmpgt_epi32(values, _mm256_set1_epi32(GROUP_RANGE - 1)));
+
+		// split into digits; the first four share a lane (one per byte), the last is left in the quotient
+		__m256i digits = _mm256_setzero_si256();
+		for (int digit = 0; digit < 4; digit++)
+		{
+			__m256i remainders;
+			values = divide_by_27_avx2(values, &remainders);
+			digits = _mm256_or_si256(digits, _mm256_slli_epi32(remainders, 8 * digit));
+		}
+		__m256i head_characters = numbers_to_characters_avx2(digits);
+		__m256i last_characters = numbers_to_characters_avx2(values);
+
+		// each 128-bit half holds four groups, which become 16 + 4 consecutive characters
+		__m256i head = _mm256_or_si256(_mm256_shuffle_epi8(head_characters, head_from_digits),
+									   _mm256_shuffle_epi8(last_characters, head_from_last));
+		__m256i tail = _mm256_or_si256(_mm256_shuffle_epi8(head_characters, tail_from_digits),
+									   _mm256_shuffle_epi8(last_characters, tail_from_last));
+		char *output = characters + group * GROUP_CHARACTERS;
+		int tail_low = _mm256_extract_epi32(tail, 0);
+		int tail_high = _mm256_extract_epi32(tail, 4);
+		_mm_storeu_si128((__m128i *)output, _mm256_castsi256_si128(head));
+		memcpy(output + 16, &tail_low, sizeof(int));
+		_mm_storeu_si128((__m128i *)(output + 20), _mm256_extracti128_si256(head, 1));
+		memcpy(output + 36, &tail_high, sizeof(int));
+	}
+	return _mm256_testz_si256(invalid, invalid);
+}
+#endif
@@ -0,0 +1,23 @@
+#ifndef OTP_ENCODING_H
+#define OTP_ENCODING_H
+
+#include <stdbool.h>
+
+// A client may send the frame header OTP_FRAME_ENCODING followed by a 4-byte encoding, both in network byte order,
+// and the server replies with the 4-byte encoding it will use for the rest of the session: the one asked for if it
+// supports it, OTP_ENCODING_TEXT otherwise. With OTP_ENCODING_PACKED the characters of every size-prefixed message
+// (messages, keys, pads and results, tagged or not) travel as groups of five characters in three bytes: the little
+// endian 24-bit number c0 + 27*c1 + 27^2*c2 + 27^3*c3 + 27^4*c4 of their values (A-Z are 0-25, space is 26), which
+// is below 27^5 < 2^24. A last group of fewer than five characters is padded with zeros. The sizes in front of the
+// messages still count characters. Stream requests always send plain characters.
+#define OTP_ENCODING_TEXT 0	  // one byte per character
+#define OTP_ENCODING_PACKED 1 // five characters in three bytes, 40% fewer bytes
+
+int otp_encoded_size(int encoding, int length);
+int otp_encoding_buffer_size(int encoding, int length);
+bool otp_encoding_supported(int encoding);
+bool otp_pack_characters(const char *characters, int length, char *packed);
+bool otp_unpack_characters(const char *packed, int length, char *characters);
+const char *otp_packing_kernel_name(void);
+
+#endif
@@ -0,0 +1,289 @@
+#define _GNU_SOURCE // for accept4
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h> // for fcntl
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include "otp_connection.h"
+
+#define MAX_EPOLL_EVENTS 256 // events handled per epoll_wait() call
+
+// function prototypes
+static void accept_event_connections(struct otp_server *server, int epoll_fd, int listening_socket_fd);
+static void serve_event_connection(int epoll_fd, struct otp_connection *connection);
+static bool read_event_connection(struct otp_connection *connection);
+static bool write_event_connection(struct otp_connection *connection, bool *finished);
+static void close_event_connection(int epoll_fd, struct otp_connection *connection, bool succeeded);
+
+/**
+ * Runs the event loop worker model: a single thread multiplexes every connection with epoll.
+ * Sockets are non-blocking, and each connection advances through the protocol stages
+ * (handshake, message, key, reply) as its data arrives, so idle or slow clients only cost
+ * their buffers instead of a whole process or thread.
+ * @param server: pointer to the server
+ */
+void otp_run_event_loop_server(struct otp_server *server)
+{
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+
+	otp_raise_file_descriptor_limit();
+
+	int epoll_fd = epoll_create1(0);
+	if (epoll_fd < 0)
+	{
+		fprintf(stderr, "SERVER: ERROR creating epoll instance\n");
+		exit(1);
+	}
+
+	// the listening sockets are registered with a NULL pointer; connections with their state
+	for (int i = 0; i < server->listening_socket_count; i++)
+	{
+		int listening_socket_fd = server->listening_socket_fds[i];
+		fcntl(listening_socket_fd, F_SETFL, fcntl(listening_socket_fd, F_GETFL) | O_NONBLOCK);
+		struct epoll_event listening_event = {.events = EPOLLIN, .data.ptr = NULL};
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listening_socket_fd, &listening_event) < 0)
+		{
+			fprintf(stderr, "SERVER: ERROR registering listening socket\n");
+			exit(1);
+		}
+	}
+
+	long long cpu_started_ns = otp_thread_cpu_time_ns();
+	while (!otp_stop_requested)
+	{
+		// close the refused connections whose time to drain is up, and wake up for the next one
+		struct otp_connection *expired;
+		while ((expired = otp_next_expired_connection()))
+		{
+			close_event_connection(epoll_fd, expired, true);
+		}
+		int event_count = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, otp_drain_timeout_ms());
+		if (event_count < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue; // interrupted by a signal; re-check otp_stop_requested
+			}
+			fprintf(stderr, "SERVER: ERROR waiting for events\n");
+			exit(1);
+		}
+
+		for (int i = 0; i < event_count; i++)
+		{
+			struct otp_connection *connection = events[i].data.ptr;
+			if (!connection)
+			{
+				// a listening socket is ready; the others return EAGAIN at once
+				for (int j = 0; j < server->listening_socket_count; j++)
+				{
+					accept_event_connections(server, epoll_fd, server->listening_socket_fds[j]);
+				}
+				continue;
+			}
+
+			serve_event_connection(epoll_fd, connection);
+		}
+		cpu_started_ns = otp_record_cpu_time(server->stats, cpu_started_ns); // all of it serving, as waits take none
+	}
+	close(epoll_fd);
+}
+
+/**
+ * Advances a connection whose socket is ready: receives and sends as far as the socket allows without
+ * blocking, serving every request (or chunk of a stream request) that has already arrived, and closes
+ * the connection once the client has ended the session or the connection has failed.
+ * @param epoll_fd: int, file descriptor of the epoll instance
+ * @param connection: pointer to the connection
+ */
+static void serve_event_connection(int epoll_fd, struct otp_connection *connection)
+{
+	while (true)
+	{
+		// errors and hang-ups are picked up by the recv() or send() that follows
+		if (connection->state != OTP_STATE_REPLY && !read_event_connection(connection))
+		{
+			close_event_connection(epoll_fd, connection, false);
+			return;
+		}
+		if (connection->state == OTP_STATE_FINISHED)
+		{
+			close_event_connection(epoll_fd, connection, true);
+			return;
+		}
+		if (connection->state != OTP_STATE_REPLY)
+		{
+			break; // waiting for more data
+		}
+
+		bool finished = false;
+		if (!write_event_connection(connection, &finished))
+		{
+			close_event_connection(epoll_fd, connection, false);
+			return;
+		}
+		if (!finished)
+		{
+			break; // the socket buffer is full
+		}
+		if (!otp_finish_connection_reply(connection))
+		{
+			close_event_connection(epoll_fd, connection, false); // the request was refused
+			return;
+		}
+	}
+
+	// wait for output space while a reply is stuck in a full socket buffer, and for input otherwise
+	bool waiting_to_send = connection->state == OTP_STATE_REPLY;
+	if (waiting_to_send != connection->waiting_to_send)
+	{
+		struct epoll_event connection_event = {.events = waiting_to_send ? EPOLLOUT : EPOLLIN, .data.ptr = connection};
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &connection_event);
+		connection->waiting_to_send = waiting_to_send;
+	}
+}
+
+/**
+ * Accepts every pending connection on a (non-blocking) listening socket and registers it
+ * with the event loop.
+ * @param server: pointer to the server
+ * @param epoll_fd: int, file descriptor of the epoll instance
+ * @param listening_socket_fd: int, file descriptor of the listening socket
+ */
+static void accept_event_connections(struct otp_server *server, int epoll_fd, int listening_socket_fd)
+{
+	while (true)
+	{
+		int connection_socket_fd = accept4(listening_socket_fd, NULL, NULL, SOCK_NONBLOCK);
+		if (connection_socket_fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				// e.g. out of file descriptors; keep serving the connections we already have
+				fprintf(stderr, "SERVER: ERROR on accept\n");
+			}
+			return;
+		}
+
+		struct otp_connection *connection = otp_create_connection(server, connection_socket_fd);
+		if (!connection)
+		{
+			continue;
+		}
+
+		struct epoll_event connection_event = {.events = EPOLLIN, .data.ptr = connection};
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection_socket_fd, &connection_event) < 0)
+		{
+			fprintf(stderr, "SERVER: ERROR registering connection\n");
+			otp_close_connection(connection, false);
+		}
+		else if (connection->state == OTP_STATE_REPLY)
+		{
+			serve_event_connection(epoll_fd, connection); // refused at accept; the busy reply goes out at once
+		}
+	}
+}
+
+/**
+ * Receives as much as the socket has available and advances the connection through the
+ * protocol stages, stopping when the socket would block, the reply is ready, or the session has ended.
+ * @param connection: pointer to the connection
+ * @return bool, false if the connection failed and must be closed
+ */
+static bool read_event_connection(struct otp_connection *connection)
+{
+	while (connection->state != OTP_STATE_REPLY && connection->state != OTP_STATE_FINISHED)
+	{
+		if (connection->stage_received < connection->stage_expected)
+		{
+			int bytes_received = recv(connection->fd, connection->stage_buffer + connection->stage_received,
+									  connection->stage_expected - connection->stage_received, 0);
+			if (bytes_received < 0)
+			{
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+				{
+					return true; // nothing more to read for now
+				}
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				if (connection->state != OTP_STATE_DRAIN) // a refused client may reset the connection
+				{
+					fprintf(stderr, "SERVER: ERROR receiving from client\n");
+					otp_record_error(connection->server->stats, OTP_ERROR_RECEIVE);
+				}
+				return false;
+			}
+			if (bytes_received == 0)
+			{
+				if (otp_connection_between_requests(connection))
+				{
+					connection->state = OTP_STATE_FINISHED; // the client closed the session
+					return true;
+				}
+				fprintf(stderr, "SERVER: ERROR client disconnected unexpectedly\n");
+				otp_record_error(connection->server->stats, OTP_ERROR_RECEIVE);
+				return false;
+			}
+			connection->stage_received += bytes_received;
+			continue;
+		}
+
+		if (!otp_complete_connection_stage(connection))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Sends as much of the reply as the socket accepts without blocking.
+ * @param connection: pointer to the connection
+ * @param finished: pointer to a bool, set to true once the whole reply has been sent
+ * @return bool, false if the reply could not be sent
+ */
+static bool write_event_connection(struct otp_connection *connection, bool *finished)
+{
+	while (connection->reply_sent < connection->reply_size)
+	{
+		int bytes_sent = send(connection->fd, connection->reply + connection->reply_sent,
+							  connection->reply_size - connection->reply_sent, 0);
+		if (bytes_sent < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				return true; // socket buffer full; resume on EPOLLOUT
+			}
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			fprintf(stderr, "SERVER: ERROR sending message\n");
+			otp_record_error(connection->server->stats, OTP_ERROR_SEND);
+			return false;
+		}
+		connection->reply_sent += bytes_sent;
+	}
+	*finished = true;
+	return true;
+}
+
+/**
+ * Removes a connection from the event loop, then closes it.
+ * @param epoll_fd: int, file descriptor of the epoll instance
+ * @param connection: pointer to the connection
+ * @param succeeded: bool, whether the client was served without errors
+ */
+static void close_event_connection(int epoll_fd, struct otp_connection *connection, bool succeeded)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+	otp_close_connection(connection, succeeded);
+}
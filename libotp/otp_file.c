@@ -0,0 +1,449 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h> // for INT_MAX
+#include <fcntl.h>	// for open
+#include <unistd.h>
+#include <sys/mman.h> // for mmap
+#include <sys/stat.h> // for fstat
+#include "otp_encoding.h"
+#include "otp_pad_file.h"
+#include "otp_file.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSE2, AVX2 and AVX-512 intrinsics
+#endif
+
+#define MAPPED_CHECK_WINDOW (16 << 20) // bytes of a mapped file checked before they are dropped again (page aligned)
+#define VERIFY_PIECE_CHARACTERS 65535  // characters of a pad file unpacked at a time to check them (whole groups)
+
+typedef int (*validator_function)(const char *text, int length);
+
+// function prototypes
+static validator_function select_validator(void);
+static int find_invalid_scalar(const char *text, int length);
+#if defined(__x86_64__) || defined(__i386__)
+static int find_invalid_sse2(const char *text, int length);
+static int find_invalid_avx2(const char *text, int length);
+static int find_invalid_avx512(const char *text, int length);
+#endif
+
+static validator_function selected_validator; // chosen on first use; only accessed atomically
+
+/**
+ * Maps a text file read-only into memory instead of reading it, so large files cost neither a copy nor
+ * memory of their own: the characters are read straight from the page cache as they are used. A pad file
+ * is recognised by its header and mapped as is, with contents pointing at its packed characters; check it
+ * with otp_verify_pad_file() before use.
+ * @param file_path: path to the file
+ * @param file: pointer to the mapped file to fill in (release it with otp_unmap_file())
+ * @return int, 0 on success, -1 with errno set if the file could not be opened or mapped (EFBIG if it
+ * has more characters than a message can carry, EINVAL for a pad file whose header does not match its size)
+ */
+int otp_map_file(const char *file_path, struct otp_mapped_file *file)
+{
+	struct stat file_status;
+
+	file->fd = open(file_path, O_RDONLY);
+	if (file->fd < 0)
+	{
+		return -1;
+	}
+	if (fstat(file->fd, &file_status) < 0)
+	{
+		close(file->fd);
+		return -1;
+	}
+	if (file_status.st_size > INT_MAX)
+	{
+		close(file->fd);
+		errno = EFBIG;
+		return -1;
+	}
+
+	file->mapped_size = file_status.st_size;
+	file->contents = "";
+	file->encoding = OTP_ENCODING_TEXT;
+	file->data_offset = 0;
+	if (file->mapped_size > 0)
+	{
+		void *mapping = mmap(NULL, file->mapped_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+		if (mapping == MAP_FAILED)
+		{
+			close(file->fd);
+			return -1;
+		}
+		madvise(mapping, file->mapped_size, MADV_SEQUENTIAL); // read ahead aggressively, drop behind
+		file->contents = mapping;
+	}
+
+	if (otp_is_pad_file(file->contents, file->mapped_size))
+	{
+		long long length;
+		uint32_t checksum;
+		if (otp_parse_pad_file_header(file->contents, file->mapped_size, &length, &checksum) < 0 || length > INT_MAX)
+		{
+			int error = length > INT_MAX ? EFBIG : EINVAL;
+			otp_unmap_file(file);
+			errno = error;
+			return -1;
+		}
+		file->contents += OTP_PAD_FILE_HEADER_SIZE;
+		file->length = (int)length;
+		file->encoding = OTP_ENCODING_PACKED;
+		file->data_offset = OTP_PAD_FILE_HEADER_SIZE;
+		return 0;
+	}
+
+	// don't count the trailing newline, which is not part of the text
+	file->length = (int)file->mapped_size;
+	if (file->length > 0 && file->contents[file->length - 1] == '\n')
+	{
+		file->length--;
+	}
+	return 0;
+}
+
+/**
+ * Unmaps and closes a file mapped with otp_map_file().
+ * @param file: pointer to the mapped file
+ */
+void otp_unmap_file(struct otp_mapped_file *file)
+{
+	if (file->mapped_size > 0)
+	{
+		munmap((void *)(file->contents - (file->data_offset > 0 ? file->data_offset : 0)), file->mapped_size);
+	}
+	close(file->fd);
+	file->contents = NULL;
+	file->mapped_size = 0;
+}
+
+/**
+ * Finds the first character of a mapped text file that is not in the allowed character set. The file is
+ * checked a window at a time, and each checked window is dropped from the process's memory again (it
+ * stays in the page cache), so checking a file of any size keeps resident memory flat.
+ * @param file: pointer to the mapped file
+ * @return int, offset of the first invalid character, or -1 if every character is allowed
+ */
+int otp_find_invalid_mapped_character(const struct otp_mapped_file *file)
+{
+	for (int start = 0; start < file->length; start += MAPPED_CHECK_WINDOW)
+	{
+		int length = file->length - start < MAPPED_CHECK_WINDOW ? file->length - start : MAPPED_CHECK_WINDOW;
+		int offset = otp_find_invalid_character(file->contents + start, length);
+		madvise((void *)(file->contents + start), length, MADV_DONTNEED);
+		if (offset >= 0)
+		{
+			return start + offset;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Checks a mapped pad file against the checksum in its header, and checks that every packed group holds
+ * valid characters. Like otp_find_invalid_mapped_character(), it drops each checked window from the process's
+ * memory again, so checking a pad of any size keeps resident memory flat.
+ * @param file: pointer to a pad file mapped with otp_map_file()
+ * @return int, 0 if the pad is intact, -1 with errno set otherwise (EBADMSG for a corrupt pad)
+ */
+int otp_verify_pad_file(const struct otp_mapped_file *file)
+{
+	const char *start = file->contents - file->data_offset;
+	long long length;
+	uint32_t checksum;
+	if (otp_parse_pad_file_header(start, file->mapped_size, &length, &checksum) < 0)
+	{
+		return -1;
+	}
+
+	char *characters = malloc(VERIFY_PIECE_CHARACTERS);
+	if (!characters)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	uint32_t crc = 0;
+	bool valid = true;
+	size_t dropped = 0; // bytes at the start of the mapping dropped from memory so far
+	for (int offset = 0; valid && offset < file->length; offset += VERIFY_PIECE_CHARACTERS)
+	{
+		int piece = file->length - offset < VERIFY_PIECE_CHARACTERS ? file->length - offset : VERIFY_PIECE_CHARACTERS;
+		const char *packed = file->contents + otp_encoded_size(OTP_ENCODING_PACKED, offset);
+		int packed_size = otp_encoded_size(OTP_ENCODING_PACKED, piece);
+		crc = otp_crc32c(crc, packed, packed_size);
+		valid = otp_unpack_characters(packed, piece, characters);
+
+		size_t checked = (size_t)(packed + packed_size - start) / MAPPED_CHECK_WINDOW * MAPPED_CHECK_WINDOW;
+		if (checked > dropped)
+		{
+			madvise((void *)(start + dropped), checked - dropped, MADV_DONTNEED);
+			dropped = checked;
+		}
+	}
+	free(characters);
+
+	if (!valid || crc != checksum)
+	{
+		errno = EBADMSG;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Replaces the mapping of a pad file by its first characters, unpacked into memory of their own, for code
+ * that needs the characters themselves. Does nothing for a text file.
+ * @param file: pointer to the mapped file; afterwards its contents are length characters, not file-backed
+ * @param length: int, number of characters needed (at most the file's length)
+ * @return int, 0 on success, -1 with errno set if memory ran out (the file is then unchanged)
+ */
+int otp_unpack_mapped_file(struct otp_mapped_file *file, int length)
+{
+	if (file->encoding != OTP_ENCODING_PACKED)
+	{
+		return 0;
+	}
+
+	size_t size = length > 0 ? (size_t)length : 1; // an empty mapping is not allowed
+	char *characters = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (characters == MAP_FAILED)
+	{
+		return -1;
+	}
+	otp_unpack_characters(file->contents, length, characters); // checked by otp_verify_pad_file()
+
+	munmap((void *)(file->contents - file->data_offset), file->mapped_size);
+	file->contents = characters;
+	file->length = length;
+	file->mapped_size = size;
+	file->encoding = OTP_ENCODING_TEXT;
+	file->data_offset = -1;
+	return 0;
+}
+
+/**
+ * Returns the number of characters in a file without the trailing newline, without reading the whole file,
+ * and leaves the file positioned at its first character.
+ * @param file: the open file
+ * @return int, number of characters, or -1 with errno set if the file cannot be measured
+ */
+int otp_text_file_length(FILE *file)
+{
+	if (fseek(file, 0, SEEK_END) < 0)
+	{
+		return -1;
+	}
+	long file_size = ftell(file);
+	if (file_size < 0)
+	{
+		return -1;
+	}
+	if (file_size > INT_MAX)
+	{
+		errno = EFBIG;
+		return -1;
+	}
+
+	// don't count the trailing newline, which is not part of the text
+	if (file_size > 0)
+	{
+		fseek(file, -1, SEEK_END);
+		if (fgetc(file) == '\n')
+		{
+			file_size--;
+		}
+	}
+	fseek(file, 0, SEEK_SET);
+	return (int)file_size;
+}
+
+/**
+ * Finds the first character that is not in the allowed character set (A-Z and space), with the widest
+ * vector kernel the CPU supports. The kernels check whole blocks with range compares and only look for the
+ * exact offset once a block has failed, so a valid file is checked at memory bandwidth.
+ * @param text: pointer to the characters to check
+ * @param length: int, number of characters to check
+ * @return int, offset of the first invalid character, or -1 if every character is allowed
+ */
+int otp_find_invalid_character(const char *text, int length)
+{
+	validator_function validator = __atomic_load_n(&selected_validator, __ATOMIC_ACQUIRE);
+	if (!validator)
+	{
+		validator = select_validator();
+	}
+	return validator(text, length);
+}
+
+/**
+ * Chooses the widest validation kernel the CPU supports. Concurrent first calls all store the same answer.
+ * @return validator_function, the chosen kernel
+ */
+static validator_function select_validator(void)
+{
+	validator_function validator = find_invalid_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512bw"))
+	{
+		validator = find_invalid_avx512;
+	}
+	else if (__builtin_cpu_supports("avx2"))
+	{
+		validator = find_invalid_avx2;
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		validator = find_invalid_sse2;
+	}
+#endif
+	__atomic_store_n(&selected_validator, validator, __ATOMIC_RELEASE);
+	return validator;
+}
+
+/**
+ * Scalar validation kernel, used when the CPU has no supported vector extension, for the last few
+ * characters the vector kernels leave over, and to find the offending character of a failed block.
+ * @param text: pointer to the characters to check
+ * @param length: int, number of characters to check
+ * @return int, offset of the first invalid character, or -1 if every character is allowed
+ */
+static int find_invalid_scalar(const char *text, int length)
+{
+	for (int i = 0; i < length; i++)
+	{
+		if ((text[i] < 'A' || text[i] > 'Z') && text[i] != ' ')
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * Flags the allowed characters among 16: A-Z (an unsigned range check on the offset from 'A') or space.
+ * @param characters: __m128i, the characters
+ * @return __m128i, 0xff where the character is allowed, 0 elsewhere
+ */
+__attribute__((target("sse2"))) static inline __m128i allowed_characters_sse2(__m128i characters)
+{
+	__m128i offsets = _mm_sub_epi8(characters, _mm_set1_epi8('A'));
+	__m128i letters = _mm_cmpeq_epi8(_mm_min_epu8(offsets, _mm_set1_epi8(25)), offsets);
+	return _mm_or_si128(letters, _mm_cmpeq_epi8(characters, _mm_set1_epi8(' ')));
+}
+
+/**
+ * SSE2 validation kernel: checks 64 characters per iteration.
+ * @param text: pointer to the characters to check
+ * @param length: int, number of characters to check
+ * @return int, offset of the first invalid character, or -1 if every character is allowed
+ */
+__attribute__((target("sse2"))) static int find_invalid_sse2(const char *text, int length)
+{
+	int i = 0;
+	for (; i + 64 <= length; i += 64)
+	{
+		__m128i allowed = allowed_characters_sse2(_mm_loadu_si128((const __m128i *)(text + i)));
+		allowed = _mm_and_si128(allowed, allowed_characters_sse2(_mm_loadu_si128((const __m128i *)(text + i + 16))));
+		allowed = _mm_and_si128(allowed, allowed_characters_sse2(_mm_loadu_si128((const __m128i *)(text + i + 32))));
+		allowed = _mm_and_si128(allowed, allowed_characters_sse2(_mm_loadu_si128((const __m128i *)(text + i + 48))));
+		if (_mm_movemask_epi8(allowed) != 0xffff)
+		{
+			return i + find_invalid_scalar(text + i, 64);
+		}
+	}
+	int offset = find_invalid_scalar(text + i, length - i);
+	return offset < 0 ? -1 : i + offset;
+}
+
+/**
+ * Flags the allowed characters among 32 (see allowed_characters_sse2()).
+ * @param characters: __m256i, the characters
+ * @return __m256i, 0xff where the character is allowed, 0 elsewhere
+ */
+__attribute__((target("avx2"))) static inline __m256i allowed_characters_avx2(__m256i characters)
+{
+	__m256i offsets = _mm256_sub_epi8(characters, _mm256_set1_epi8('A'));
+	__m256i letters = _mm256_cmpeq_epi8(_mm256_min_epu8(offsets, _mm256_set1_epi8(25)), offsets);
+	return _mm256_or_si256(letters, _mm256_cmpeq_epi8(characters, _mm256_set1_epi8(' ')));
+}
+
+/**
+ * AVX2 validation kernel: checks 128 characters per iteration.
+ * @param text: pointer to the characters to check
+ * @param length: int, number of characters to check
+ * @return int, offset of the first invalid character, or -1 if every character is allowed
+ */
+__attribute__((target("avx2"))) static int find_invalid_avx2(const char *text, int length)
+{
+	int i = 0;
+	for (; i + 128 <= length; i += 128)
+	{
+		__m256i allowed = allowed_characters_avx2(_mm256_loadu_si256((const __m256i *)(text + i)));
+		allowed = _mm256_and_si256(allowed, allowed_characters_avx2(_mm256_loadu_si256((const __m256i *)(text + i + 32))));
+		allowed = _mm256_and_si256(allowed, allowed_characters_avx2(_mm256_loadu_si256((const __m256i *)(text + i + 64))));
+		allowed = _mm256_and_si256(allowed, allowed_characters_avx2(_mm256_loadu_si256((const __m256i *)(text + i + 96))));
+		if (_mm256_movemask_epi8(allowed) != -1)
+		{
+			return i + find_invalid_scalar(text + i, 128);
+		}
+	}
+	for (; i + 32 <= length; i += 32)
+	{
+		unsigned int allowed = _mm256_movemask_epi8(allowed_characters_avx2(_mm256_loadu_si256((const __m256i *)(text + i))));
+		if (allowed != 0xffffffffU)
+		{
+			return i + __builtin_ctz(~allowed);
+		}
+	}
+	int offset = find_invalid_scalar(text + i, length - i);
+	return offset < 0 ? -1 : i + offset;
+}
+
+/**
+ * Flags the allowed characters among 64 (see allowed_characters_sse2()).
+ * @param characters: __m512i, the characters
+ * @return __mmask64, a set bit where the character is allowed
+ */
+__attribute__((target("avx512f,avx512bw"))) static inline __mmask64 allowed_characters_avx512(__m512i characters)
+{
+	__m512i offsets = _mm512_sub_epi8(characters, _mm512_set1_epi8('A'));
+	return _mm512_cmple_epu8_mask(offsets, _mm512_set1_epi8(25)) | _mm512_cmpeq_epi8_mask(characters, _mm512_set1_epi8(' '));
+}
+
+/**
+ * AVX-512 validation kernel: checks 256 characters per iteration, and the last few with a masked load.
+ * @param text: pointer to the characters to check
+ * @param length: int, number of characters to check
+ * @return int, offset of the first invalid character, or -1 if every character is allowed
+ */
+__attribute__((target("avx512f,avx512bw"))) static int find_invalid_avx512(const char *text, int length)
+{
+	int i = 0;
+	for (; i + 256 <= length; i += 256)
+	{
+		__mmask64 allowed = allowed_characters_avx512(_mm512_loadu_si512(text + i)) &
+							allowed_characters_avx512(_mm512_loadu_si512(text + i + 64)) &
+							allowed_characters_avx512(_mm512_loadu_si512(text + i + 128)) &
+							allowed_characters_avx512(_mm512_loadu_si512(text + i + 192));
+		if (allowed != ~0ULL)
+		{
+			return i + find_invalid_scalar(text + i, 256);
+		}
+	}
+	for (; i < length; i += 64)
+	{
+		// characters past the end are loaded as zero, and counted as allowed
+		__mmask64 in_range = length - i >= 64 ? ~0ULL : (1ULL << (length - i)) - 1;
+		__mmask64 allowed = allowed_characters_avx512(_mm512_maskz_loadu_epi8(in_range, text + i)) | ~in_range;
+		if (allowed != ~0ULL)
+		{
+			return i + __builtin_ctzll(~allowed);
+		}
+	}
+	return -1;
+}
+#endif
@@ -0,0 +1,28 @@
+#ifndef OTP_FILE_H
+#define OTP_FILE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/types.h> // for off_t
+
+// a text file or pad file (see otp_pad_file.h) mapped read-only into memory, so its characters are used
+// straight from the page cache
+struct otp_mapped_file
+{
+	int fd;				  // open file descriptor, e.g. for sendfile()
+	const char *contents; // the characters (not null-terminated), or a pad file's packed characters
+	int length;			  // number of characters, without the trailing newline
+	size_t mapped_size;	  // size of the mapping, 0 if nothing is mapped (empty file)
+	int encoding;		  // OTP_ENCODING_PACKED for a pad file, OTP_ENCODING_TEXT otherwise
+	off_t data_offset;	  // position of the contents in the file, -1 once they are an unpacked copy
+};
+
+int otp_map_file(const char *file_path, struct otp_mapped_file *file);
+void otp_unmap_file(struct otp_mapped_file *file);
+int otp_find_invalid_mapped_character(const struct otp_mapped_file *file);
+int otp_verify_pad_file(const struct otp_mapped_file *file);
+int otp_unpack_mapped_file(struct otp_mapped_file *file, int length);
+int otp_text_file_length(FILE *file);
+int otp_find_invalid_character(const char *text, int length);
+
+#endif
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h> // for the endpoint's thread
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h> // for stat
+#include <sys/time.h> // for struct timeval
+#include <sys/un.h>	  // for struct sockaddr_un
+#include "otp_protocol.h"
+#include "otp_server.h"
+
+#define METRICS_REQUEST_SIZE 4096 // bytes of an HTTP request read before it is answered anyway
+#define METRICS_TIMEOUT_SECONDS 1 // a scraper that sends nothing for this long is dropped
+#define METRICS_LISTEN_BACKLOG 8	 // scrapes waiting while one is answered
+
+// function prototypes
+static void *metrics_thread(void *argument);
+static bool receive_metrics_request(int connection_socket_fd, char *request, int size);
+static void serve_metrics_request(const struct otp_server *server, int connection_socket_fd);
+
+/**
+ * Opens the metrics endpoint on a port of the loopback address, or on a Unix domain socket path (any address
+ * holding a '/'), and starts the thread that serves it. The thread runs next to any worker model, in the
+ * server's first process, with the stop signals blocked so they still reach the accepting thread; the
+ * statistics it reports live in shared memory, so they cover every worker process.
+ * @param server: pointer to the server, whose metrics_address is set; its metrics socket is filled in (exits
+ * on failure)
+ */
+void otp_start_metrics_endpoint(struct otp_server *server)
+{
+	struct otp_server_address address;
+	if (otp_setup_server_address(&address, server->metrics_address, "localhost") < 0)
+	{
+		fprintf(stderr, "SERVER: ERROR- invalid metrics address %s\n", server->metrics_address);
+		exit(1);
+	}
+
+	int family = address.address.ss_family;
+	server->metrics_socket_fd = socket(family, SOCK_STREAM, 0);
+	if (server->metrics_socket_fd < 0)
+	{
+		fprintf(stderr, "SERVER: ERROR opening socket\n");
+		exit(1);
+	}
+	struct stat file_status;
+	if (family == AF_UNIX && stat(server->metrics_address, &file_status) == 0 && S_ISSOCK(file_status.st_mode))
+	{
+		unlink(server->metrics_address); // left by an earlier run
+	}
+	int reuse_address = 1;
+	setsockopt(server->metrics_socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse_address, sizeof(reuse_address));
+	if (bind(server->metrics_socket_fd, (struct sockaddr *)&address.address, address.size) < 0)
+	{
+		fprintf(stderr, "SERVER: ERROR on binding metrics endpoint %s\n", server->metrics_address);
+		exit(1);
+	}
+	listen(server->metrics_socket_fd, METRICS_LISTEN_BACKLOG);
+
+	sigset_t stop_signals, previous_signals;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, &previous_signals);
+	pthread_t endpoint_thread;
+	if (pthread_create(&endpoint_thread, NULL, metrics_thread, server) != 0)
+	{
+		fprintf(stderr, "SERVER: ERROR creating metrics thread\n");
+		exit(1);
+	}
+	pthread_detach(endpoint_thread);
+	pthread_sigmask(SIG_SETMASK, &previous_signals, NULL);
+}
+
+/**
+ * Closes the metrics endpoint when the server stops, removing its Unix domain socket if it has one.
+ * @param server: pointer to the server
+ */
+void otp_stop_metrics_endpoint(const struct otp_server *server)
+{
+	close(server->metrics_socket_fd);
+	if (strchr(server->metrics_address, '/'))
+	{
+		unlink(server->metrics_address);
+	}
+}
+
+/**
+ * Main loop of the metrics thread: answers one scrape at a time, which is all a monitoring system sends.
+ * @param argument: pointer to the server
+ * @return NULL (never returns)
+ */
+static void *metrics_thread(void *argument)
+{
+	const struct otp_server *server = argument;
+
+	while (true)
+	{
+		int connection_socket_fd = accept(server->metrics_socket_fd, NULL, NULL);
+		if (connection_socket_fd < 0)
+		{
+			if (errno != EINTR && errno != ECONNABORTED)
+			{
+				fprintf(stderr, "SERVER: ERROR on accept\n");
+				sleep(1); // e.g. out of file descriptors; the workers may free some
+			}
+			continue;
+		}
+
+		struct timeval timeout = {.tv_sec = METRICS_TIMEOUT_SECONDS};
+		setsockopt(connection_socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(connection_socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		serve_metrics_request(server, connection_socket_fd);
+		close(connection_socket_fd);
+	}
+	return NULL;
+}
+
+/**
+ * Receives the head of an HTTP request, up to the blank line that ends it (or size - 1 bytes).
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param request: pointer to memory for the request, which is null-terminated
+ * @param size: int, size of that memory
+ * @return bool, false if the connection failed or timed out first
+ */
+static bool receive_metrics_request(int connection_socket_fd, char *request, int size)
+{
+	int received = 0;
+	request[0] = '\0';
+	while (received < size - 1 && !strstr(request, "\r\n\r\n") && !strstr(request, "\n\n"))
+	{
+		int bytes_received = recv(connection_socket_fd, request + received, size - 1 - received, 0);
+		if (bytes_received <= 0)
+		{
+			return false;
+		}
+		received += bytes_received;
+		request[received] = '\0';
+	}
+	return true;
+}
+
+/**
+ * Answers a scrape: GET /metrics (or /) gets the server's statistics in the Prometheus text format, anything
+ * else a 404. The connection is closed after the reply, as HTTP/1.0 allows.
+ * @param server: pointer to the server
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ */
+static void serve_metrics_request(const struct otp_server *server, int connection_socket_fd)
+{
+	char request[METRICS_REQUEST_SIZE];
+	if (!receive_metrics_request(connection_socket_fd, request, sizeof(request)))
+	{
+		return;
+	}
+
+	char *body = NULL;
+	size_t body_size = 0;
+	FILE *output = open_memstream(&body, &body_size);
+	if (!output)
+	{
+		fprintf(stderr, "SERVER: ERROR allocating memory for metrics\n");
+		return;
+	}
+	bool found = strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0 ||
+				 strncmp(request, "GET /metrics?", 13) == 0;
+	if (found)
+	{
+		otp_write_server_metrics(output, server->stats, server->role->program_name, server->mode_name,
+								 server->worker_count);
+	}
+	else
+	{
+		fprintf(output, "not found; the metrics are at /metrics\n");
+	}
+	fclose(output);
+
+	char header[256];
+	int header_size = snprintf(header, sizeof(header),
+							   "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+							   "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+							   found ? "200 OK" : "404 Not Found", body_size);
+	if (otp_send_all(connection_socket_fd, header, header_size) == 0)
+	{
+		otp_send_all(connection_socket_fd, body, body_size);
+	}
+	free(body);
+}
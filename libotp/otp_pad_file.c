@@ -0,0 +1,248 @@
+#include <string.h>
+#include <errno.h>
+#include "otp_pad_file.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSE4.2 CRC-32C instruction
+#endif
+
+#define CRC32C_POLYNOMIAL 0x82f63b78U // Castagnoli polynomial, bit-reversed
+#define PACKED_GROUP_CHARACTERS 5	  // characters in a packed group
+#define PACKED_GROUP_BYTES 3		  // bytes of a packed group
+
+// function prototypes
+static void select_crc32c_kernel(void);
+static uint32_t crc32c_scalar(uint32_t crc, const unsigned char *data, size_t size);
+#if defined(__x86_64__)
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t size);
+#endif
+static uint32_t multiply_modulo(uint32_t a, uint32_t b);
+static void write_little_endian(char *bytes, unsigned long long value, int size);
+static unsigned long long read_little_endian(const char *bytes, int size);
+
+static uint32_t crc32c_table[256];									// filled in when the scalar kernel is chosen
+static uint32_t (*selected_crc32c)(uint32_t, const unsigned char *, size_t); // chosen on first use
+
+/**
+ * Returns the size of the pad file that holds a number of characters, header included.
+ * @param length: long long, number of characters
+ * @return long long, size of the file in bytes
+ */
+long long otp_pad_file_size(long long length)
+{
+	return OTP_PAD_FILE_HEADER_SIZE + (length + PACKED_GROUP_CHARACTERS - 1) / PACKED_GROUP_CHARACTERS * PACKED_GROUP_BYTES;
+}
+
+/**
+ * Fills in the header of a pad file.
+ * @param header: pointer to OTP_PAD_FILE_HEADER_SIZE bytes
+ * @param length: long long, number of characters in the pad
+ * @param checksum: uint32_t, CRC-32C of the packed bytes (see otp_crc32c())
+ */
+void otp_format_pad_file_header(char *header, long long length, uint32_t checksum)
+{
+	memcpy(header, OTP_PAD_FILE_MAGIC, OTP_PAD_FILE_MAGIC_SIZE);
+	write_little_endian(header + 8, (unsigned long long)length, 8);
+	write_little_endian(header + 16, checksum, 4);
+	write_little_endian(header + 20, 0, 4);
+}
+
+/**
+ * Tells whether the contents of a file start like a pad file rather than a text file.
+ * @param contents: pointer to the start of the file
+ * @param size: size_t, number of bytes available
+ * @return bool, true if the file starts with the pad file magic bytes
+ */
+bool otp_is_pad_file(const char *contents, size_t size)
+{
+	return size >= OTP_PAD_FILE_MAGIC_SIZE && memcmp(contents, OTP_PAD_FILE_MAGIC, OTP_PAD_FILE_MAGIC_SIZE) == 0;
+}
+
+/**
+ * Reads the header of a pad file, and checks it against the size of the file.
+ * @param contents: pointer to the start of the file
+ * @param size: size_t, size of the file in bytes
+ * @param length: pointer to a long long where the number of characters will be stored
+ * @param checksum: pointer to a uint32_t where the CRC-32C of the packed bytes will be stored
+ * @return int, 0 on success, -1 with errno set to EINVAL if this is not a pad file or its size does not
+ * match its length
+ */
+int otp_parse_pad_file_header(const char *contents, size_t size, long long *length, uint32_t *checksum)
+{
+	if (size < OTP_PAD_FILE_HEADER_SIZE || !otp_is_pad_file(contents, size))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	unsigned long long characters = read_little_endian(contents + 8, 8);
+	if (characters > (unsigned long long)(size - OTP_PAD_FILE_HEADER_SIZE) / PACKED_GROUP_BYTES * PACKED_GROUP_CHARACTERS ||
+		(size_t)otp_pad_file_size((long long)characters) != size || read_little_endian(contents + 20, 4) != 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	*length = (long long)characters;
+	*checksum = (uint32_t)read_little_endian(contents + 16, 4);
+	return 0;
+}
+
+/**
+ * Computes the CRC-32C (Castagnoli) of some bytes, with the SSE4.2 instruction where the CPU has it.
+ * A checksum can be computed a piece at a time by passing the result for the earlier pieces.
+ * @param crc: uint32_t, CRC-32C of the bytes before these (0 to start)
+ * @param data: pointer to the bytes
+ * @param size: size_t, number of bytes
+ * @return uint32_t, CRC-32C of the bytes so far
+ */
+uint32_t otp_crc32c(uint32_t crc, const void *data, size_t size)
+{
+	if (!selected_crc32c)
+	{
+		select_crc32c_kernel();
+	}
+	return ~selected_crc32c(~crc, data, size);
+}
+
+/**
+ * Combines the CRC-32Cs of two consecutive pieces into the CRC-32C of both, so pieces checksummed in
+ * parallel give the checksum of the whole. Multiplies the first checksum by x^(8 * second_size) modulo the
+ * polynomial, squaring x^8 once per bit of the size.
+ * @param first: uint32_t, CRC-32C of the first piece
+ * @param second: uint32_t, CRC-32C of the second piece
+ * @param second_size: size_t, number of bytes in the second piece
+ * @return uint32_t, CRC-32C of the first piece followed by the second
+ */
+uint32_t otp_crc32c_combine(uint32_t first, uint32_t second, size_t second_size)
+{
+	uint32_t power = 0x00800000U; // x^8, bit-reversed like the checksums
+	uint32_t factor = 0x80000000U; // 1
+	for (; second_size > 0; second_size >>= 1)
+	{
+		if (second_size & 1)
+		{
+			factor = multiply_modulo(power, factor);
+		}
+		power = multiply_modulo(power, power);
+	}
+	return multiply_modulo(factor, first) ^ second;
+}
+
+/**
+ * Chooses the SSE4.2 kernel if the CPU has it, and builds the table of the scalar kernel otherwise.
+ * Concurrent first calls all store the same answer.
+ */
+static void select_crc32c_kernel(void)
+{
+	uint32_t (*kernel)(uint32_t, const unsigned char *, size_t) = crc32c_scalar;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+	{
+		kernel = crc32c_sse42;
+	}
+#endif
+	if (kernel == crc32c_scalar)
+	{
+		for (uint32_t byte = 0; byte < 256; byte++)
+		{
+			uint32_t value = byte;
+			for (int bit = 0; bit < 8; bit++)
+			{
+				value = value & 1 ? (value >> 1) ^ CRC32C_POLYNOMIAL : value >> 1;
+			}
+			crc32c_table[byte] = value;
+		}
+	}
+	__atomic_store_n(&selected_crc32c, kernel, __ATOMIC_RELEASE);
+}
+
+/**
+ * Table-driven CRC-32C kernel, a byte at a time, for CPUs without SSE4.2. Works on the inverted checksum.
+ * @param crc: uint32_t, inverted checksum so far
+ * @param data: pointer to the bytes
+ * @param size: size_t, number of bytes
+ * @return uint32_t, inverted checksum including the bytes
+ */
+static uint32_t crc32c_scalar(uint32_t crc, const unsigned char *data, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		crc = (crc >> 8) ^ crc32c_table[(crc ^ data[i]) & 0xff];
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * SSE4.2 CRC-32C kernel, eight bytes per instruction (see crc32c_scalar()).
+ * @param crc: uint32_t, inverted checksum so far
+ * @param data: pointer to the bytes
+ * @param size: size_t, number of bytes
+ * @return uint32_t, inverted checksum including the bytes
+ */
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t size)
+{
+	unsigned long long value = crc;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		unsigned long long word;
+		memcpy(&word, data + i, sizeof(word));
+		value = _mm_crc32_u64(value, word);
+	}
+	for (; i < size; i++)
+	{
+		value = _mm_crc32_u8((uint32_t)value, data[i]);
+	}
+	return (uint32_t)value;
+}
+#endif
+
+/**
+ * Multiplies two polynomials modulo the CRC-32C polynomial, both bit-reversed like the checksums.
+ * @param a: uint32_t, first polynomial
+ * @param b: uint32_t, second polynomial
+ * @return uint32_t, the product modulo the polynomial
+ */
+static uint32_t multiply_modulo(uint32_t a, uint32_t b)
+{
+	uint32_t product = 0;
+	for (uint32_t bit = 0x80000000U; bit != 0; bit >>= 1)
+	{
+		if (a & bit)
+		{
+			product ^= b;
+		}
+		b = b & 1 ? (b >> 1) ^ CRC32C_POLYNOMIAL : b >> 1;
+	}
+	return product;
+}
+
+/**
+ * Stores an integer as little endian bytes.
+ * @param bytes: pointer to size bytes
+ * @param value: unsigned long long, the integer
+ * @param size: int, number of bytes
+ */
+static void write_little_endian(char *bytes, unsigned long long value, int size)
+{
+	for (int i = 0; i < size; i++)
+	{
+		bytes[i] = (char)(value >> (8 * i));
+	}
+}
+
+/**
+ * Reads an integer stored as little endian bytes.
+ * @param bytes: pointer to size bytes
+ * @param size: int, number of bytes
+ * @return unsigned long long, the integer
+ */
+static unsigned long long read_little_endian(const char *bytes, int size)
+{
+	unsigned long long value = 0;
+	for (int i = size - 1; i >= 0; i--)
+	{
+		value = value << 8 | (unsigned char)bytes[i];
+	}
+	return value;
+}
@@ -0,0 +1,27 @@
+#ifndef OTP_PAD_FILE_H
+#define OTP_PAD_FILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A pad file holds a key in the packed encoding of otp_encoding.h, five characters in three bytes, behind a
+// header of OTP_PAD_FILE_HEADER_SIZE bytes:
+//   bytes 0-7    the magic bytes OTP_PAD_FILE_MAGIC (a text file never starts with 0x7f)
+//   bytes 8-15   the number of characters, a little endian 64-bit integer
+//   bytes 16-19  the CRC-32C of the packed bytes, a little endian 32-bit integer
+//   bytes 20-23  reserved, zero
+// The packed bytes follow the header to the end of the file, with no trailing newline. Since they are exactly
+// what a packed session sends, a pad file can be sent without unpacking it.
+#define OTP_PAD_FILE_MAGIC "\x7fOTPPAD1"
+#define OTP_PAD_FILE_MAGIC_SIZE 8
+#define OTP_PAD_FILE_HEADER_SIZE 24
+
+long long otp_pad_file_size(long long length);
+void otp_format_pad_file_header(char *header, long long length, uint32_t checksum);
+bool otp_is_pad_file(const char *contents, size_t size);
+int otp_parse_pad_file_header(const char *contents, size_t size, long long *length, uint32_t *checksum);
+uint32_t otp_crc32c(uint32_t crc, const void *data, size_t size);
+uint32_t otp_crc32c_combine(uint32_t first, uint32_t second, size_t second_size);
+
+#endif
@@ -0,0 +1,272 @@
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>	// for mmap
+#include <sys/random.h> // for getrandom
+#include "otp_encoding.h"
+#include "otp_pad_store.h"
+
+// function prototypes
+static struct otp_pad *find_pad(struct otp_pad_store *store, int pad_id);
+static size_t pad_end(const struct otp_pad *pad);
+static void release_unused_pads(struct otp_pad_store *store);
+
+/**
+ * Creates an empty pad store in shared memory, so the children of a forking server see the same pads.
+ * Pages are only committed as pads are uploaded into them.
+ * @param capacity: size_t, bytes available for pad characters and their usage bitmaps
+ * @return struct otp_pad_store *, the store, or NULL with errno set if it could not be created
+ */
+struct otp_pad_store *otp_create_pad_store(size_t capacity)
+{
+	struct otp_pad_store *store = mmap(NULL, sizeof(struct otp_pad_store) + capacity, PROT_READ | PROT_WRITE,
+									   MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (store == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	pthread_mutexattr_t attributes;
+	pthread_mutexattr_init(&attributes);
+	pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(&store->lock, &attributes);
+	pthread_mutexattr_destroy(&attributes);
+	store->capacity = capacity;
+	return store;
+}
+
+/**
+ * Allocates room for a new pad, in the first gap between stored pads it fits in, and gives it a fresh random ID.
+ * Requests cannot use the pad until the characters have been written to the returned memory and the pad has
+ * been published. The room also fits the packed form of the pad, so a packed upload can be received into it and
+ * unpacked in place.
+ * @param store: pointer to the pad store
+ * @param length: int, number of pad characters (at least 1)
+ * @param pad_id: pointer to an int where the ID of the pad will be stored
+ * @return char *, where the pad characters go, or NULL with errno set (EINVAL for an empty pad,
+ * ENOSPC if the store is full)
+ */
+char *otp_reserve_pad(struct otp_pad_store *store, int length, int *pad_id)
+{
+	if (length <= 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	// characters, then one usage bit per character, rounded up to whole 64-bit words
+	size_t bitmap_size = ((size_t)length + 63) / 64 * sizeof(unsigned long long);
+	size_t data_size = ((size_t)otp_encoding_buffer_size(OTP_ENCODING_PACKED, length) + 7) & ~(size_t)7;
+
+	pthread_mutex_lock(&store->lock);
+	int index = 0;
+	size_t gap_start = 0;
+	while (index < store->pad_count && store->pads[index].data_offset - gap_start < data_size + bitmap_size)
+	{
+		gap_start = pad_end(&store->pads[index++]);
+	}
+	if (store->pad_count == OTP_MAX_PADS || (index == store->pad_count && store->capacity - gap_start < data_size + bitmap_size))
+	{
+		pthread_mutex_unlock(&store->lock);
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	// IDs are random, so a client cannot use another client's pad by guessing the next ID
+	int id;
+	int attempts = 0;
+	do
+	{
+		if (getrandom(&id, sizeof(id), 0) != sizeof(id))
+		{
+			id = (int)(store->allocated + store->pad_count + ++attempts); // entropy unavailable; tried until unused
+		}
+		id &= 0x7fffffff;
+	} while (id == 0 || find_pad(store, id));
+
+	struct otp_pad *pad = &store->pads[index];
+	memmove(pad + 1, pad, (store->pad_count - index) * sizeof(struct otp_pad));
+	store->pad_count++;
+	*pad = (struct otp_pad){.id = id, .length = length, .data_offset = gap_start, .bitmap_offset = gap_start + data_size};
+	store->allocated += data_size + bitmap_size;
+	memset(store->data + pad->bitmap_offset, 0, bitmap_size); // the space may have held an earlier pad
+	pthread_mutex_unlock(&store->lock);
+
+	*pad_id = id;
+	return store->data + pad->data_offset;
+}
+
+/**
+ * Makes a reserved pad available to requests, once all of its characters have been written.
+ * @param store: pointer to the pad store
+ * @param pad_id: int, ID returned by otp_reserve_pad()
+ */
+void otp_publish_pad(struct otp_pad_store *store, int pad_id)
+{
+	pthread_mutex_lock(&store->lock);
+	struct otp_pad *pad = find_pad(store, pad_id);
+	if (pad)
+	{
+		pad->published = true;
+	}
+	pthread_mutex_unlock(&store->lock);
+}
+
+/**
+ * Gives up a reserved pad whose upload failed, so its room can be reused.
+ * @param store: pointer to the pad store
+ * @param pad_id: int, ID returned by otp_reserve_pad()
+ */
+void otp_discard_pad(struct otp_pad_store *store, int pad_id)
+{
+	pthread_mutex_lock(&store->lock);
+	struct otp_pad *pad = find_pad(store, pad_id);
+	if (pad)
+	{
+		pad->published = false;
+		pad->retired = true;
+		release_unused_pads(store);
+	}
+	pthread_mutex_unlock(&store->lock);
+}
+
+/**
+ * Retires a published pad a client has no more use for: it takes no more requests, and its room is reused
+ * once the requests still reading it are done, whether or not all of its characters were used. Does nothing
+ * if there is no published pad with that ID, as a used-up pad is gone already.
+ * @param store: pointer to the pad store
+ * @param pad_id: int, ID of the pad
+ */
+void otp_retire_pad(struct otp_pad_store *store, int pad_id)
+{
+	pthread_mutex_lock(&store->lock);
+	struct otp_pad *pad = find_pad(store, pad_id);
+	if (pad && pad->published)
+	{
+		pad->published = false;
+		pad->retired = true;
+		release_unused_pads(store);
+	}
+	pthread_mutex_unlock(&store->lock);
+}
+
+/**
+ * Claims a range of pad characters as the key of one request, and marks them as used so no other
+ * request can ever use them. The characters stay valid until otp_finish_pad_use() is called.
+ * @param store: pointer to the pad store
+ * @param pad_id: int, ID of the pad
+ * @param offset: int, position of the first character
+ * @param length: int, number of characters
+ * @return const char *, the first character of the range, or NULL with errno set (ENOENT for an unknown
+ * pad, ERANGE for a range outside the pad, EALREADY if part of the range has been used before)
+ */
+const char *otp_use_pad(struct otp_pad_store *store, int pad_id, int offset, int length)
+{
+	pthread_mutex_lock(&store->lock);
+	struct otp_pad *pad = find_pad(store, pad_id);
+	if (!pad || !pad->published)
+	{
+		pthread_mutex_unlock(&store->lock);
+		errno = ENOENT;
+		return NULL;
+	}
+	if (offset < 0 || length < 0 || length > pad->length - offset)
+	{
+		pthread_mutex_unlock(&store->lock);
+		errno = ERANGE;
+		return NULL;
+	}
+
+	// check every bit of the range before setting any, so a refused request uses nothing
+	unsigned long long *bitmap = (unsigned long long *)(store->data + pad->bitmap_offset);
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (int position = offset; position < offset + length;)
+		{
+			int bit = position % 64;
+			int count = 64 - bit < offset + length - position ? 64 - bit : offset + length - position;
+			unsigned long long mask = (count == 64 ? ~0ULL : ((1ULL << count) - 1)) << bit;
+			if (pass == 0 && (bitmap[position / 64] & mask))
+			{
+				pthread_mutex_unlock(&store->lock);
+				errno = EALREADY;
+				return NULL;
+			}
+			if (pass == 1)
+			{
+				bitmap[position / 64] |= mask;
+			}
+			position += count;
+		}
+	}
+	pad->used += length;
+	pad->readers++;
+	pthread_mutex_unlock(&store->lock);
+	return store->data + pad->data_offset + offset;
+}
+
+/**
+ * Ends a request's use of the characters returned by otp_use_pad(). Once every character of a pad has
+ * been used, or the pad has been released, and no request is still reading it, its room can be reused.
+ * @param store: pointer to the pad store
+ * @param pad_id: int, ID of the pad
+ */
+void otp_finish_pad_use(struct otp_pad_store *store, int pad_id)
+{
+	pthread_mutex_lock(&store->lock);
+	struct otp_pad *pad = find_pad(store, pad_id);
+	if (pad)
+	{
+		pad->readers--;
+		release_unused_pads(store);
+	}
+	pthread_mutex_unlock(&store->lock);
+}
+
+/**
+ * Looks up a pad by ID. The store's lock must be held.
+ * @param store: pointer to the pad store
+ * @param pad_id: int, ID of the pad
+ * @return struct otp_pad *, the pad, or NULL if there is none with that ID
+ */
+static struct otp_pad *find_pad(struct otp_pad_store *store, int pad_id)
+{
+	for (int i = 0; i < store->pad_count; i++)
+	{
+		if (store->pads[i].id == pad_id)
+		{
+			return &store->pads[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Returns the end of a pad's room in the store's data area: its characters, then its usage bitmap.
+ * @param pad: pointer to the pad
+ * @return size_t, the position just past the pad's usage bitmap
+ */
+static size_t pad_end(const struct otp_pad *pad)
+{
+	return pad->bitmap_offset + ((size_t)pad->length + 63) / 64 * sizeof(unsigned long long);
+}
+
+/**
+ * Frees the room of every pad that is used up or retired and no longer read, wherever it lies in the data
+ * area; the gap it leaves takes the next pad that fits. The store's lock must be held.
+ * @param store: pointer to the pad store
+ */
+static void release_unused_pads(struct otp_pad_store *store)
+{
+	int kept = 0;
+	for (int i = 0; i < store->pad_count; i++)
+	{
+		struct otp_pad *pad = &store->pads[i];
+		if (pad->readers == 0 && (pad->retired || (pad->published && pad->used == pad->length)))
+		{
+			store->allocated -= pad_end(pad) - pad->data_offset;
+			continue;
+		}
+		store->pads[kept++] = *pad;
+	}
+	store->pad_count = kept;
+}
@@ -0,0 +1,51 @@
+#ifndef OTP_PAD_STORE_H
+#define OTP_PAD_STORE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// A client uploads a pad once with the frame header OTP_FRAME_PAD_UPLOAD followed by the pad as a size-prefixed
+// message, and the server replies with a 4-byte pad ID. A pad request (OTP_FRAME_PAD_REQUEST) then carries a pad
+// ID and an offset, followed by the message as a size-prefixed message, and is answered like a message and key:
+// the key is the pad characters from the offset on. Every pad character is used for at most one request; a
+// request naming characters that were already used is refused. A pad release (OTP_FRAME_PAD_RELEASE) carries a
+// pad ID and is answered with 0: the pad takes no more requests, and its room is reused once the requests still
+// reading it are done, as is the room of a pad whose characters have all been used (so releasing a pad that is
+// already gone does nothing). All values are 4 bytes in network byte order.
+#define OTP_MAX_PADS 1024					 // pads a store can hold at once
+#define OTP_DEFAULT_PAD_STORE_SIZE (1L << 30) // bytes of pad characters (and usage bitmaps) a server can hold
+
+// one pad in a store
+struct otp_pad
+{
+	int id;				  // random positive ID the clients refer to it by
+	bool published;		  // the upload is complete, so requests may use it
+	bool retired;		  // released or discarded, so its room is reused once no request reads it
+	int length;			  // number of pad characters
+	size_t data_offset;	  // position of the pad characters in the store's data area
+	size_t bitmap_offset; // position of the usage bitmap (one bit per character) in the store's data area
+	long long used;		  // number of characters used so far
+	int readers;		  // requests still reading characters of the pad
+};
+
+// pads shared by every worker of a server (lives in a MAP_SHARED mapping so forked children see the same pads)
+struct otp_pad_store
+{
+	pthread_mutex_t lock; // process-shared; guards everything below except the pad characters
+	size_t capacity;	  // size of the data area
+	size_t allocated;	  // bytes of the data area in use (a new pad takes the first gap it fits in)
+	int pad_count;
+	struct otp_pad pads[OTP_MAX_PADS]; // in order of their position in the data area
+	char data[];
+};
+
+struct otp_pad_store *otp_create_pad_store(size_t capacity);
+char *otp_reserve_pad(struct otp_pad_store *store, int length, int *pad_id);
+void otp_publish_pad(struct otp_pad_store *store, int pad_id);
+void otp_discard_pad(struct otp_pad_store *store, int pad_id);
+void otp_retire_pad(struct otp_pad_store *store, int pad_id);
+const char *otp_use_pad(struct otp_pad_store *store, int pad_id, int offset, int length);
+void otp_finish_pad_use(struct otp_pad_store *store, int pad_id);
+
+#endif
@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h> // for poll
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h> // for struct iovec
+#include <netinet/in.h>
+#include "otp_encoding.h"
+#include "otp_protocol.h"
+#include "otp_pipeline.h"
+#include "otp_stats.h"
+
+// the sending half of a pipeline: the request being sent, as frame header, tag and message size,
+// message, key size, key
+struct pipeline_sender
+{
+	struct otp_tagged_request *requests;
+	int count;
+	int encoding;	  // wire encoding of the session
+	int next;		  // index (and tag) of the request being sent
+	int header[3];	  // frame header, tag and message size, in network byte order
+	int key_header;	  // key size, in network byte order
+	char *packed;	  // packed message, then packed key, of the current request (packed sessions only)
+	size_t offset;	  // bytes of the current request sent so far
+	size_t total;	  // bytes of the current request
+};
+
+// the receiving half of a pipeline
+struct pipeline_receiver
+{
+	struct otp_tagged_request *requests;
+	int count;
+	int encoding;			// wire encoding of the session
+	char *packed;			// packed result being received, unpacked into the request once complete
+	int header[2];			// tag and result size, in network byte order while being received
+	int header_received;	// bytes of the header received so far
+	int tag;				// request the result being received belongs to, or -1 between replies
+	int result_received;	// result bytes of that request received so far
+	int replies;			// number of complete replies
+	char *answered;			// one flag per request, set once its reply has started
+};
+
+// function prototypes
+static int prepare_pipeline_request(struct pipeline_sender *sender);
+static int send_pipeline_bytes(int connection_socket_fd, struct pipeline_sender *sender);
+static int receive_pipeline_bytes(int connection_socket_fd, struct pipeline_receiver *receiver);
+
+/**
+ * Runs a batch of tagged requests on a connection whose handshake has been sent, keeping up to depth of them
+ * in flight. Each request is tagged with its index, and its reply is written to its result whenever it
+ * arrives, in whatever order the server finishes them. Sending and receiving overlap, so neither side stalls
+ * on a full socket buffer however large the requests are.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param requests: array of requests; their results and timestamps are filled in
+ * @param count: int, number of requests
+ * @param depth: int, most requests in flight at once (clamped to 1..OTP_PIPELINE_MAX_IN_FLIGHT)
+ * @param encoding: int, the session's wire encoding
+ * @return int, 0 once every reply has arrived, -1 with errno set on failure (EPROTO for an invalid reply,
+ * EILSEQ if the server refused a bad character, EINVAL for a message or key that cannot be packed)
+ */
+int otp_pipeline_requests(int connection_socket_fd, struct otp_tagged_request *requests, int count, int depth, int encoding)
+{
+	struct pipeline_sender sender = {requests, count, encoding};
+	struct pipeline_receiver receiver = {requests, count, encoding, .tag = -1};
+	int status = 0;
+
+	depth = depth < 1 ? 1 : depth > OTP_PIPELINE_MAX_IN_FLIGHT ? OTP_PIPELINE_MAX_IN_FLIGHT : depth;
+	receiver.answered = calloc(count > 0 ? count : 1, 1);
+	if (!receiver.answered)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	while (status == 0 && receiver.replies < count)
+	{
+		// start the next request once the previous one is out and the window has room
+		bool sending = sender.offset < sender.total;
+		if (!sending && sender.next < count && sender.next - receiver.replies < depth)
+		{
+			if (prepare_pipeline_request(&sender) < 0)
+			{
+				status = -1;
+				break;
+			}
+			sending = true;
+		}
+
+		// wait until the server has sent something, or can take more of the current request
+		struct pollfd poll_entry = {.fd = connection_socket_fd, .events = POLLIN};
+		if (sending)
+		{
+			poll_entry.events |= POLLOUT;
+		}
+		if (poll(&poll_entry, 1, -1) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			status = -1;
+			break;
+		}
+
+		if (poll_entry.revents & (POLLIN | POLLHUP | POLLERR))
+		{
+			status = receive_pipeline_bytes(connection_socket_fd, &receiver);
+		}
+		if (status == 0 && (poll_entry.revents & POLLOUT))
+		{
+			status = send_pipeline_bytes(connection_socket_fd, &sender);
+		}
+	}
+
+	free(receiver.answered);
+	free(receiver.packed);
+	free(sender.packed);
+	return status;
+}
+
+/**
+ * Fills in the headers of the next request (and packs its message and key in a packed session) and starts
+ * sending it.
+ * @param sender: pointer to the sending half of the pipeline
+ * @return int, 0 on success, -1 with errno set if memory ran out or the message or key cannot be packed
+ */
+static int prepare_pipeline_request(struct pipeline_sender *sender)
+{
+	struct otp_tagged_request *request = &sender->requests[sender->next];
+	int encoded_size = otp_encoded_size(sender->encoding, request->size);
+
+	if (sender->encoding == OTP_ENCODING_PACKED)
+	{
+		free(sender->packed);
+		sender->packed = malloc(2 * (size_t)encoded_size + 1);
+		if (!sender->packed)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+		if (!otp_pack_characters(request->message, request->size, sender->packed) ||
+			!otp_pack_characters(request->key, request->size, sender->packed + encoded_size))
+		{
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	sender->header[0] = htonl(OTP_FRAME_TAGGED);
+	sender->header[1] = htonl(sender->next);
+	sender->header[2] = htonl(request->size);
+	sender->key_header = sender->header[2]; // only the characters the message needs are sent
+	sender->offset = 0;
+	sender->total = sizeof(sender->header) + sizeof(int) + 2 * (size_t)encoded_size;
+	request->sent_at_us = otp_current_time_us();
+	return 0;
+}
+
+/**
+ * Sends as much of the current request as the socket accepts without blocking, straight from the
+ * caller's message and key (or their packed copies). Moves on to the next request once it has all been sent.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param sender: pointer to the sending half of the pipeline
+ * @return int, 0 on success, -1 with errno set if the connection failed
+ */
+static int send_pipeline_bytes(int connection_socket_fd, struct pipeline_sender *sender)
+{
+	struct otp_tagged_request *request = &sender->requests[sender->next];
+	size_t encoded_size = otp_encoded_size(sender->encoding, request->size);
+	bool packed = sender->encoding == OTP_ENCODING_PACKED;
+	struct iovec parts[4] = {
+		{sender->header, sizeof(sender->header)},
+		{packed ? sender->packed : (char *)request->message, encoded_size},
+		{&sender->key_header, sizeof(int)},
+		{packed ? sender->packed + encoded_size : (char *)request->key, encoded_size},
+	};
+
+	// skip what has already been sent
+	int first = 0;
+	size_t skipped = sender->offset;
+	while (skipped >= parts[first].iov_len && first < 3)
+	{
+		skipped -= parts[first].iov_len;
+		first++;
+	}
+	parts[first].iov_base = (char *)parts[first].iov_base + skipped;
+	parts[first].iov_len -= skipped;
+
+	struct msghdr message_header = {.msg_iov = parts + first, .msg_iovlen = 4 - first};
+	ssize_t bytes_sent = sendmsg(connection_socket_fd, &message_header, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (bytes_sent < 0)
+	{
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+	}
+	sender->offset += bytes_sent;
+	if (sender->offset == sender->total)
+	{
+		sender->next++;
+		sender->offset = sender->total = 0;
+	}
+	return 0;
+}
+
+/**
+ * Receives whatever the server has sent without blocking, writing result characters straight into
+ * the result of the request they belong to (packed results are collected first and unpacked once complete).
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param receiver: pointer to the receiving half of the pipeline
+ * @return int, 0 on success, -1 with errno set if the connection failed or a reply is invalid
+ */
+static int receive_pipeline_bytes(int connection_socket_fd, struct pipeline_receiver *receiver)
+{
+	ssize_t bytes_received;
+
+	if (receiver->tag < 0)
+	{
+		// receiving the tag and size of the next reply
+		bytes_received = recv(connection_socket_fd, (char *)receiver->header + receiver->header_received,
+							  sizeof(receiver->header) - receiver->header_received, MSG_DONTWAIT);
+	}
+	else
+	{
+		struct otp_tagged_request *request = &receiver->requests[receiver->tag];
+		char *destination = receiver->encoding == OTP_ENCODING_PACKED ? receiver->packed : request->result;
+		bytes_received = recv(connection_socket_fd, destination + receiver->result_received,
+							  otp_encoded_size(receiver->encoding, request->size) - receiver->result_received, MSG_DONTWAIT);
+	}
+
+	if (bytes_received < 0)
+	{
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+	}
+	if (bytes_received == 0)
+	{
+		errno = ECONNRESET; // server disconnected before every reply had arrived
+		return -1;
+	}
+
+	if (receiver->tag < 0)
+	{
+		receiver->header_received += bytes_received;
+		if (receiver->header_received < (int)sizeof(receiver->header))
+		{
+			return 0;
+		}
+		receiver->header_received = 0;
+
+		// the tag must name a request that was sent and not answered yet, and the size must match it
+		int tag = ntohl(receiver->header[0]);
+		int size = ntohl(receiver->header[1]);
+		if (tag < 0 || tag >= receiver->count || receiver->answered[tag] || size != receiver->requests[tag].size)
+		{
+			errno = size < 0 ? otp_reply_error_number(size) : EPROTO;
+			return -1;
+		}
+		receiver->answered[tag] = 1;
+		receiver->tag = tag;
+		receiver->result_received = 0;
+		if (receiver->encoding == OTP_ENCODING_PACKED)
+		{
+			free(receiver->packed);
+			receiver->packed = malloc(otp_encoded_size(receiver->encoding, receiver->requests[tag].size) + 1);
+			if (!receiver->packed)
+			{
+				errno = ENOMEM;
+				return -1;
+			}
+		}
+	}
+	else
+	{
+		receiver->result_received += bytes_received;
+	}
+
+	// the reply is complete once all of its result bytes are in (possibly none)
+	struct otp_tagged_request *request = &receiver->requests[receiver->tag];
+	if (receiver->result_received == otp_encoded_size(receiver->encoding, request->size))
+	{
+		if (receiver->encoding == OTP_ENCODING_PACKED && !otp_unpack_characters(receiver->packed, request->size, request->result))
+		{
+			errno = EPROTO;
+			return -1;
+		}
+		request->replied_at_us = otp_current_time_us();
+		receiver->replies++;
+		receiver->tag = -1;
+	}
+	return 0;
+}
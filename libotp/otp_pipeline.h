@@ -0,0 +1,25 @@
+#ifndef OTP_PIPELINE_H
+#define OTP_PIPELINE_H
+
+// A tagged request starts with the frame header OTP_FRAME_TAGGED and a 4-byte tag chosen by the client, both in
+// network byte order, followed by the message and key as two size-prefixed messages, like an untagged request.
+// The reply is the tag, then the size-prefixed result. A client may send up to OTP_PIPELINE_MAX_IN_FLIGHT tagged
+// requests before reading any reply; the server keeps reading while fewer are outstanding, and a multi-threaded
+// server answers each as soon as it is done, so replies may arrive in any order. An untagged request is only
+// served once every tagged request before it has been answered.
+#define OTP_PIPELINE_MAX_IN_FLIGHT 64 // tagged requests a client may have outstanding on one connection
+
+// one request of a pipeline, answered into result
+struct otp_tagged_request
+{
+	const char *message;
+	const char *key;		// at least size characters
+	int size;				// number of message characters
+	char *result;			// memory for size result characters
+	long long sent_at_us;	// when the first byte of the request was sent
+	long long replied_at_us; // when the last byte of the reply arrived
+};
+
+int otp_pipeline_requests(int connection_socket_fd, struct otp_tagged_request *requests, int count, int depth, int encoding);
+
+#endif
@@ -0,0 +1,809 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>		  // for struct sockaddr_un
+#include <sys/sendfile.h> // for sendfile
+#include <netinet/tcp.h> // for TCP_NODELAY
+#include <netdb.h>		 // gethostbyname()
+#include "otp_buffer_pool.h"
+#include "otp_protocol.h"
+
+#define RECEIVE_PIECE_SIZE 65536 // bytes of a message received at a time when it goes straight to a file
+#define PACK_PIECE_CHARACTERS 65535 // characters packed at a time when sending (a whole number of groups)
+#define PACK_PIECE_BYTES 39321		// bytes they pack into
+#define PACKED_GROUP_CHARACTERS 5	// characters in a packed group
+#define PACKED_GROUP_BYTES 3		// bytes of a packed group
+
+// function prototypes
+static int send_all_with_flags(int connection_socket_fd, const void *buffer, int size, int flags);
+static int send_packed_characters(int connection_socket_fd, const char *characters, int length);
+static int send_unpacked_characters(int connection_socket_fd, const char *packed, int length);
+static int send_file_bytes(int connection_socket_fd, const struct otp_mapped_file *file, int size);
+
+/**
+ * Sends exactly size bytes over the given socket, handling partial sends.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param buffer: pointer to the bytes to send
+ * @param size: int, number of bytes to send
+ * @return int, 0 on success, -1 if the bytes could not be sent
+ */
+int otp_send_all(int connection_socket_fd, const void *buffer, int size)
+{
+	return send_all_with_flags(connection_socket_fd, buffer, size, 0);
+}
+
+/**
+ * Sends exactly size bytes over the given socket with the given send() flags, handling partial sends.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param buffer: pointer to the bytes to send
+ * @param size: int, number of bytes to send
+ * @param flags: int, flags passed to every send() call (e.g. MSG_MORE)
+ * @return int, 0 on success, -1 if the bytes could not be sent
+ */
+static int send_all_with_flags(int connection_socket_fd, const void *buffer, int size, int flags)
+{
+	int total_bytes_sent = 0;
+
+	while (total_bytes_sent < size)
+	{
+		// move pointer forward in buffer, and only send remaining bytes
+		int bytes_sent = send(connection_socket_fd, (const char *)buffer + total_bytes_sent, size - total_bytes_sent, flags);
+		if (bytes_sent < 0 && errno == EINTR)
+		{
+			continue; // interrupted by a signal before any data was sent
+		}
+		if (bytes_sent < 0)
+		{
+			return -1;
+		}
+		total_bytes_sent += bytes_sent;
+	}
+	return 0;
+}
+
+/**
+ * Receives exactly size bytes from the given socket, handling partial receives.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param buffer: pointer to memory that will hold the received bytes
+ * @param size: int, number of bytes to receive
+ * @return bool, false if the peer disconnected or an error occurred first
+ */
+bool otp_receive_all(int connection_socket_fd, void *buffer, int size)
+{
+	int total_bytes_received = 0;
+
+	while (total_bytes_received < size)
+	{
+		// move pointer forward in buffer, and only receive remaining bytes
+		int bytes_received = recv(connection_socket_fd, (char *)buffer + total_bytes_received,
+								  size - total_bytes_received, 0);
+		if (bytes_received < 0 && errno == EINTR)
+		{
+			continue; // interrupted by a signal before any data arrived
+		}
+		if (bytes_received <= 0)
+		{
+			return false; // error, or peer disconnected unexpectedly
+		}
+		total_bytes_received += bytes_received;
+	}
+	return true;
+}
+
+/**
+ * Receives and drops exactly size bytes from the given socket, e.g. the rest of a request that is refused
+ * without being read into memory, so the next request is read from the right place.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param size: long long, number of bytes to drop
+ * @return bool, false if the peer disconnected or an error occurred first
+ */
+bool otp_discard_received_bytes(int connection_socket_fd, long long size)
+{
+	char discarded[OTP_DISCARD_BUFFER_SIZE];
+	while (size > 0)
+	{
+		int piece_size = size < (long long)sizeof(discarded) ? (int)size : (int)sizeof(discarded);
+		if (!otp_receive_all(connection_socket_fd, discarded, piece_size))
+		{
+			return false;
+		}
+		size -= piece_size;
+	}
+	return true;
+}
+
+/**
+ * Sends a message over the given socket.
+ * Sends the message size first, so the recipient can dynamically allocate memory, then sends the message.
+ * @param connection_socket_fd: int, the file descriptor for the connection socket
+ * @param message: pointer to the message to be sent
+ * @param message_size: int, the size of the message in bytes
+ * @return int, 0 on success, -1 if the message could not be sent
+ */
+int otp_send_message(int connection_socket_fd, const char *message, int message_size)
+{
+	int converted_size = htonl(message_size); // convert to network byte order
+
+	// MSG_MORE holds the size back until the message follows, so both leave in the same packet
+	if (send_all_with_flags(connection_socket_fd, &converted_size, sizeof(int), MSG_MORE) < 0)
+	{
+		return -1;
+	}
+	return otp_send_all(connection_socket_fd, message, message_size);
+}
+
+/**
+ * Sends a message in a wire encoding: the size (in characters), then the encoded characters.
+ * @param connection_socket_fd: int, the file descriptor for the connection socket
+ * @param message: pointer to the message to be sent
+ * @param message_size: int, number of characters
+ * @param encoding: int, the session's encoding (OTP_ENCODING_TEXT or OTP_ENCODING_PACKED)
+ * @return int, 0 on success, -1 if the message could not be sent (errno is EINVAL if it cannot be packed
+ * because a character is not in the allowed character set)
+ */
+int otp_send_encoded_message(int connection_socket_fd, const char *message, int message_size, int encoding)
+{
+	if (encoding != OTP_ENCODING_PACKED)
+	{
+		return otp_send_message(connection_socket_fd, message, message_size);
+	}
+
+	int converted_size = htonl(message_size); // convert to network byte order
+	if (send_all_with_flags(connection_socket_fd, &converted_size, sizeof(int), MSG_MORE) < 0)
+	{
+		return -1;
+	}
+	return send_packed_characters(connection_socket_fd, message, message_size);
+}
+
+/**
+ * Packs characters a piece at a time into a small buffer and sends each piece, so a message of any size
+ * is sent packed without a copy of the whole message.
+ * @param connection_socket_fd: int, the file descriptor for the connection socket
+ * @param characters: pointer to the characters
+ * @param length: int, number of characters
+ * @return int, 0 on success, -1 with errno set if the characters could not be packed (EINVAL) or sent
+ */
+static int send_packed_characters(int connection_socket_fd, const char *characters, int length)
+{
+	char packed[PACK_PIECE_BYTES];
+	for (int offset = 0; offset < length; offset += PACK_PIECE_CHARACTERS)
+	{
+		int piece = length - offset < PACK_PIECE_CHARACTERS ? length - offset : PACK_PIECE_CHARACTERS;
+		if (!otp_pack_characters(characters + offset, piece, packed))
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		int flags = offset + piece < length ? MSG_MORE : 0;
+		if (send_all_with_flags(connection_socket_fd, packed, otp_encoded_size(OTP_ENCODING_PACKED, piece), flags) < 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Unpacks characters a piece at a time into a small buffer and sends each piece, so the characters of a
+ * pad file of any size are sent as text without a copy of the whole pad.
+ * @param connection_socket_fd: int, the file descriptor for the connection socket
+ * @param packed: pointer to the packed characters
+ * @param length: int, number of characters
+ * @return int, 0 on success, -1 with errno set if a group is invalid (EINVAL) or the characters could not be sent
+ */
+static int send_unpacked_characters(int connection_socket_fd, const char *packed, int length)
+{
+	char characters[PACK_PIECE_CHARACTERS];
+	for (int offset = 0; offset < length; offset += PACK_PIECE_CHARACTERS)
+	{
+		int piece = length - offset < PACK_PIECE_CHARACTERS ? length - offset : PACK_PIECE_CHARACTERS;
+		if (!otp_unpack_characters(packed + otp_encoded_size(OTP_ENCODING_PACKED, offset), piece, characters))
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		int flags = offset + piece < length ? MSG_MORE : 0;
+		if (send_all_with_flags(connection_socket_fd, characters, piece, flags) < 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Sends the first characters of a mapped file as a message in a wire encoding. When the file already holds
+ * them the way the wire carries them (a text file in a text session, a pad file in a packed session), they
+ * go straight from the page cache with sendfile() and are never copied through user space; otherwise they
+ * are packed or unpacked a piece at a time.
+ * @param connection_socket_fd: int, the file descriptor for the connection socket
+ * @param file: pointer to the mapped file
+ * @param message_size: int, number of characters to send from the start of the file (at most its length)
+ * @param encoding: int, the session's encoding
+ * @return int, 0 on success, -1 if the message could not be sent
+ */
+int otp_send_file_message(int connection_socket_fd, const struct otp_mapped_file *file, int message_size, int encoding)
+{
+	if (file->data_offset < 0 || (file->encoding != OTP_ENCODING_PACKED && encoding == OTP_ENCODING_PACKED))
+	{
+		return otp_send_encoded_message(connection_socket_fd, file->contents, message_size, encoding);
+	}
+
+	int converted_size = htonl(message_size); // convert to network byte order
+	if (send_all_with_flags(connection_socket_fd, &converted_size, sizeof(int), MSG_MORE) < 0)
+	{
+		return -1;
+	}
+	if (file->encoding != OTP_ENCODING_PACKED)
+	{
+		return send_file_bytes(connection_socket_fd, file, message_size);
+	}
+	if (encoding != OTP_ENCODING_PACKED)
+	{
+		return send_unpacked_characters(connection_socket_fd, file->contents, message_size);
+	}
+
+	// whole groups go as they are; a last group the message only partly fills would carry the pad
+	// characters after the message, so it is cut down to the message's characters
+	int whole_groups = message_size / PACKED_GROUP_CHARACTERS;
+	int rest = message_size % PACKED_GROUP_CHARACTERS;
+	if (send_file_bytes(connection_socket_fd, file, whole_groups * PACKED_GROUP_BYTES) < 0)
+	{
+		return -1;
+	}
+	if (rest == 0)
+	{
+		return 0;
+	}
+	const unsigned char *group = (const unsigned char *)file->contents + whole_groups * PACKED_GROUP_BYTES;
+	unsigned int value = group[0] | group[1] << 8 | group[2] << 16;
+	unsigned int range = 1;
+	for (int i = 0; i < rest; i++)
+	{
+		range *= 27;
+	}
+	value %= range; // the first characters of a group are its lowest base-27 digits
+	unsigned char last_group[PACKED_GROUP_BYTES] = {value & 0xff, (value >> 8) & 0xff, value >> 16};
+	return otp_send_all(connection_socket_fd, last_group, PACKED_GROUP_BYTES);
+}
+
+/**
+ * Sends the first bytes of a mapped file's contents straight from the page cache with sendfile().
+ * @param connection_socket_fd: int, the file descriptor for the connection socket
+ * @param file: pointer to the mapped file
+ * @param size: int, number of bytes to send
+ * @return int, 0 on success, -1 if the bytes could not be sent
+ */
+static int send_file_bytes(int connection_socket_fd, const struct otp_mapped_file *file, int size)
+{
+	off_t offset = file->data_offset;
+	off_t end = file->data_offset + size;
+	while (offset < end)
+	{
+		ssize_t bytes_sent = sendfile(connection_socket_fd, file->fd, &offset, end - offset);
+		if (bytes_sent < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (bytes_sent < 0 && (errno == EINVAL || errno == ENOSYS))
+		{
+			// the file system cannot splice; send from the mapping instead
+			return otp_send_all(connection_socket_fd, file->contents + (offset - file->data_offset), end - offset);
+		}
+		if (bytes_sent <= 0)
+		{
+			return -1; // error, or the file shrank
+		}
+	}
+	return 0;
+}
+
+/**
+ * Sends the reply to a tagged request: the tag, then the size-prefixed message.
+ * @param connection_socket_fd: int, the file descriptor for the connection socket
+ * @param tag: int, the tag of the request being answered
+ * @param message: pointer to the message to be sent
+ * @param message_size: int, the size of the message in bytes
+ * @param encoding: int, the session's encoding
+ * @return int, 0 on success, -1 if the message could not be sent
+ */
+int otp_send_tagged_message(int connection_socket_fd, int tag, const char *message, int message_size, int encoding)
+{
+	int converted_tag = htonl(tag);
+	if (send_all_with_flags(connection_socket_fd, &converted_tag, sizeof(int), MSG_MORE) < 0)
+	{
+		return -1;
+	}
+	return otp_send_encoded_message(connection_socket_fd, message, message_size, encoding);
+}
+
+/**
+ * Receives a message over the given socket, and returns a pointer to the message in memory.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param message_size: pointer to an int where the message size will be stored
+ * @return message: string, the null-terminated message (otp_free_buffer() it), or NULL if it could not be received
+ */
+char *otp_receive_message(int connection_socket_fd, int *message_size)
+{
+	if (!otp_receive_frame_header(connection_socket_fd, message_size))
+	{
+		return NULL;
+	}
+	return otp_receive_message_body(connection_socket_fd, message_size);
+}
+
+/**
+ * Receives a message in the given socket's encoding over the given socket, and returns a pointer to the
+ * message characters in memory.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param message_size: pointer to an int where the message size will be stored
+ * @param encoding: int, the session's encoding
+ * @return message: string, the null-terminated message (otp_free_buffer() it), or NULL if it could not be received
+ */
+char *otp_receive_encoded_message(int connection_socket_fd, int *message_size, int encoding)
+{
+	if (!otp_receive_frame_header(connection_socket_fd, message_size))
+	{
+		return NULL;
+	}
+	return otp_receive_encoded_message_body(connection_socket_fd, message_size, encoding);
+}
+
+/**
+ * Receives a message over the given socket and writes it to a file a piece at a time as it arrives,
+ * so memory use does not depend on the message size.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param output_file: file the message is written to
+ * @param encoding: int, the session's encoding (packed pieces are unpacked before they are written)
+ * @return int, the message size, or -1 if the message could not be received, unpacked or written (errno is
+ * EILSEQ if the server refused a bad character)
+ */
+int otp_receive_message_to_file(int connection_socket_fd, FILE *output_file, int encoding)
+{
+	int message_size;
+	if (!otp_receive_frame_header(connection_socket_fd, &message_size))
+	{
+		return -1;
+	}
+	if (message_size < 0)
+	{
+		errno = otp_reply_error_number(message_size);
+		return -1;
+	}
+
+	char *buffer = malloc(encoding == OTP_ENCODING_PACKED ? PACK_PIECE_CHARACTERS : RECEIVE_PIECE_SIZE);
+	if (!buffer)
+	{
+		return -1;
+	}
+	for (int received = 0; received < message_size;)
+	{
+		if (encoding == OTP_ENCODING_PACKED)
+		{
+			// whole groups at a time, unpacked in place
+			int piece = message_size - received < PACK_PIECE_CHARACTERS ? message_size - received : PACK_PIECE_CHARACTERS;
+			if (!otp_receive_all(connection_socket_fd, buffer, otp_encoded_size(encoding, piece)) ||
+				!otp_unpack_characters(buffer, piece, buffer) || fwrite(buffer, 1, piece, output_file) != (size_t)piece)
+			{
+				free(buffer);
+				return -1;
+			}
+			received += piece;
+			continue;
+		}
+
+		int wanted = message_size - received < RECEIVE_PIECE_SIZE ? message_size - received : RECEIVE_PIECE_SIZE;
+		int bytes_received = recv(connection_socket_fd, buffer, wanted, 0);
+		if (bytes_received < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (bytes_received <= 0 || fwrite(buffer, 1, bytes_received, output_file) != (size_t)bytes_received)
+		{
+			free(buffer);
+			return -1;
+		}
+		received += bytes_received;
+	}
+	free(buffer);
+	return message_size;
+}
+
+/**
+ * Receives the 4-byte header of a frame: a message size, or a negative request type.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param frame_header: pointer to an int where the header will be stored in host byte order
+ * @return bool, false if the peer disconnected or an error occurred first
+ */
+bool otp_receive_frame_header(int connection_socket_fd, int *frame_header)
+{
+	if (!otp_receive_all(connection_socket_fd, frame_header, sizeof(int)))
+	{
+		return false;
+	}
+	*frame_header = ntohl(*frame_header); // convert to host byte order
+	return true;
+}
+
+/**
+ * Waits for the next request of a session and receives its frame header.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param frame_header: pointer to an int where the header will be stored in host byte order
+ * @return int, 1 if a request follows, 0 if the client ended the session (goodbye, or closed the
+ * connection between requests), -1 on error or if the connection closed in the middle of the header
+ */
+int otp_receive_next_request(int connection_socket_fd, int *frame_header)
+{
+	int bytes_received;
+
+	// the first byte tells a new request from the end of the session
+	do
+	{
+		bytes_received = recv(connection_socket_fd, frame_header, sizeof(int), 0);
+	} while (bytes_received < 0 && errno == EINTR);
+
+	if (bytes_received <= 0)
+	{
+		return bytes_received;
+	}
+	if (!otp_receive_all(connection_socket_fd, (char *)frame_header + bytes_received, sizeof(int) - bytes_received))
+	{
+		return -1;
+	}
+	*frame_header = ntohl(*frame_header); // convert to host byte order
+	return *frame_header == OTP_FRAME_GOODBYE ? 0 : 1;
+}
+
+/**
+ * Ends a session, telling the server that no more requests follow.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @return int, 0 on success, -1 if the goodbye could not be sent
+ */
+int otp_send_goodbye(int connection_socket_fd)
+{
+	int converted_header = htonl(OTP_FRAME_GOODBYE);
+	return otp_send_all(connection_socket_fd, &converted_header, sizeof(int));
+}
+
+/**
+ * Refuses a request, telling the client why in place of the size of its result.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param error: int, the reason, e.g. OTP_REPLY_BAD_CHARACTER
+ * @return int, 0 on success, -1 if the reply could not be sent
+ */
+int otp_send_error_reply(int connection_socket_fd, int error)
+{
+	int converted_error = htonl(error);
+	return otp_send_all(connection_socket_fd, &converted_error, sizeof(int));
+}
+
+/**
+ * Returns the errno value that describes a reply whose size is negative, for clients to report.
+ * @param reply_size: int, the size the server sent
+ * @return int, EILSEQ if the server refused a character outside the alphabet, EAGAIN if it was busy, EPROTO for
+ * any other size
+ */
+int otp_reply_error_number(int reply_size)
+{
+	return reply_size == OTP_REPLY_BAD_CHARACTER ? EILSEQ : reply_size == OTP_REPLY_BUSY ? EAGAIN : EPROTO;
+}
+
+/**
+ * Looks for a refusal the server sent before closing the connection, after sending a request failed: a server
+ * refusing a connection as busy answers without reading the request, and stops draining it after a while, so
+ * the rest of it can meet a closed or reset connection. Does not wait.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @return int, the error the server replied with (e.g. OTP_REPLY_BUSY), or 0 if there is none to read
+ */
+int otp_receive_refusal(int connection_socket_fd)
+{
+	int reply_size;
+	if (recv(connection_socket_fd, &reply_size, sizeof(int), MSG_DONTWAIT | MSG_PEEK) != sizeof(int))
+	{
+		return 0;
+	}
+	reply_size = ntohl(reply_size);
+	return reply_size < 0 ? reply_size : 0;
+}
+
+/**
+ * Asks the server for a wire encoding for the rest of the session.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param encoding: int, the encoding wanted
+ * @return int, the encoding the server will use (the one wanted, or OTP_ENCODING_TEXT if it does not
+ * support it), or -1 if the request failed or the server answered with an encoding this library lacks (errno is
+ * EAGAIN if the server refused it as busy)
+ */
+int otp_negotiate_encoding(int connection_socket_fd, int encoding)
+{
+	int request[2] = {htonl(OTP_FRAME_ENCODING), htonl(encoding)};
+	int agreed_encoding;
+	if (otp_send_all(connection_socket_fd, request, sizeof(request)) < 0 ||
+		!otp_receive_frame_header(connection_socket_fd, &agreed_encoding))
+	{
+		return -1;
+	}
+	if (!otp_encoding_supported(agreed_encoding))
+	{
+		errno = agreed_encoding < 0 ? otp_reply_error_number(agreed_encoding) : EPROTO;
+		return -1;
+	}
+	return agreed_encoding;
+}
+
+/**
+ * Uploads a pad to the server's pad store, and receives the ID later requests refer to it by.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param pad: pointer to the pad characters
+ * @param pad_size: int, number of pad characters
+ * @param encoding: int, the session's encoding
+ * @param pad_id: pointer to an int where the ID of the stored pad will be stored
+ * @return int, 0 on success, -1 if the pad could not be sent or the server refused it
+ */
+int otp_upload_pad(int connection_socket_fd, const char *pad, int pad_size, int encoding, int *pad_id)
+{
+	int converted_header = htonl(OTP_FRAME_PAD_UPLOAD);
+	if (send_all_with_flags(connection_socket_fd, &converted_header, sizeof(int), MSG_MORE) < 0 ||
+		otp_send_encoded_message(connection_socket_fd, pad, pad_size, encoding) < 0 ||
+		!otp_receive_frame_header(connection_socket_fd, pad_id))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Uploads the characters of a mapped key or pad file to the server's pad store, like otp_upload_pad().
+ * A pad file in a packed session is sent as it is stored.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param pad: pointer to the mapped file
+ * @param encoding: int, the session's encoding
+ * @param pad_id: pointer to an int where the ID of the stored pad will be stored
+ * @return int, 0 on success, -1 if the pad could not be sent or the server refused it
+ */
+int otp_upload_pad_file(int connection_socket_fd, const struct otp_mapped_file *pad, int encoding, int *pad_id)
+{
+	int converted_header = htonl(OTP_FRAME_PAD_UPLOAD);
+	if (send_all_with_flags(connection_socket_fd, &converted_header, sizeof(int), MSG_MORE) < 0 ||
+		otp_send_file_message(connection_socket_fd, pad, pad->length, encoding) < 0 ||
+		!otp_receive_frame_header(connection_socket_fd, pad_id))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Sends a request keyed by a range of a pad in the server's pad store: only the message travels.
+ * The reply is a message, as for any other request.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param pad_id: int, ID the server gave the pad
+ * @param offset: int, position of the first pad character to use as the key
+ * @param message: pointer to the message
+ * @param message_size: int, number of message characters
+ * @param encoding: int, the session's encoding
+ * @return int, 0 on success, -1 if the request could not be sent
+ */
+int otp_send_pad_request(int connection_socket_fd, int pad_id, int offset, const char *message, int message_size, int encoding)
+{
+	int header[3] = {htonl(OTP_FRAME_PAD_REQUEST), htonl(pad_id), htonl(offset)};
+	if (send_all_with_flags(connection_socket_fd, header, sizeof(header), MSG_MORE) < 0)
+	{
+		return -1;
+	}
+	return otp_send_encoded_message(connection_socket_fd, message, message_size, encoding);
+}
+
+/**
+ * Releases a pad in the server's pad store once no more requests will use it, so its room can take another pad.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param pad_id: int, ID the server gave the pad
+ * @return int, 0 on success (also if the pad was gone already), -1 if the request failed (errno is EAGAIN if the
+ * server refused it as busy)
+ */
+int otp_release_pad(int connection_socket_fd, int pad_id)
+{
+	int request[2] = {htonl(OTP_FRAME_PAD_RELEASE), htonl(pad_id)};
+	int reply;
+	if (otp_send_all(connection_socket_fd, request, sizeof(request)) < 0 ||
+		!otp_receive_frame_header(connection_socket_fd, &reply))
+	{
+		return -1;
+	}
+	if (reply != 0)
+	{
+		errno = reply < 0 ? otp_reply_error_number(reply) : EPROTO;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Receives the characters of a message whose size has already been received.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param message_size: pointer to the received message size; updated to exclude trailing null characters
+ * @return message: string, the null-terminated message (otp_free_buffer() it), or NULL if the size is invalid
+ * (errno is EILSEQ if it is the server refusing a bad character) or the message could not be received
+ */
+char *otp_receive_message_body(int connection_socket_fd, int *message_size)
+{
+	if (*message_size < 0)
+	{
+		errno = otp_reply_error_number(*message_size);
+		return NULL;
+	}
+
+	// allocate memory for message based on size
+	char *message = otp_allocate_buffer(*message_size + 1); // +1 for null terminator
+	if (!message)
+	{
+		return NULL;
+	}
+
+	// receive the message
+	if (!otp_receive_all(connection_socket_fd, message, *message_size))
+	{
+		otp_free_buffer(message);
+		return NULL;
+	}
+
+	message[*message_size] = '\0'; // ensure null termination
+	*message_size = otp_trim_null_terminators(message, *message_size);
+	return message;
+}
+
+/**
+ * Receives the encoded characters of a message whose size has already been received, and decodes them.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param message_size: pointer to the received message size (in characters); for text, updated to exclude
+ * trailing null characters
+ * @param encoding: int, the session's encoding
+ * @return message: string, the null-terminated message (otp_free_buffer() it), or NULL if the size is invalid, the
+ * message could not be received, or it is not validly packed
+ */
+char *otp_receive_encoded_message_body(int connection_socket_fd, int *message_size, int encoding)
+{
+	if (encoding != OTP_ENCODING_PACKED)
+	{
+		return otp_receive_message_body(connection_socket_fd, message_size);
+	}
+	if (*message_size < 0)
+	{
+		errno = otp_reply_error_number(*message_size);
+		return NULL;
+	}
+
+	// the packed bytes are received at the start of the buffer and unpacked in place
+	char *message = otp_allocate_buffer(otp_encoding_buffer_size(encoding, *message_size) + 1); // +1 for null terminator
+	if (!message)
+	{
+		return NULL;
+	}
+	if (!otp_receive_all(connection_socket_fd, message, otp_encoded_size(encoding, *message_size)) ||
+		!otp_unpack_characters(message, *message_size, message))
+	{
+		otp_free_buffer(message);
+		return NULL;
+	}
+	message[*message_size] = '\0'; // ensure null termination
+	return message;
+}
+
+/**
+ * Returns the length of a received message without trailing null characters.
+ * Older clients send their file size, which counts the null terminator left where the newline was stripped.
+ * @param message: pointer to the received message
+ * @param message_size: int, number of bytes received
+ * @return int, number of characters before the trailing null characters
+ */
+int otp_trim_null_terminators(const char *message, int message_size)
+{
+	while (message_size > 0 && message[message_size - 1] == '\0')
+	{
+		message_size--;
+	}
+	return message_size;
+}
+
+/**
+ * Sets up a client socket address struct to connect to the server.
+ * @param socket_address: pointer to sockaddr_in structure
+ * @param port_number: int, port number on which the server is listening
+ * @param host_name: string, host name of the server to connect to
+ * @return int, 0 on success, -1 if the host name could not be resolved
+ */
+int otp_setup_client_address(struct sockaddr_in *socket_address, int port_number, const char *host_name)
+{
+	memset((char *)socket_address, '\0', sizeof(*socket_address)); // clear out the socket_address struct
+	socket_address->sin_family = AF_INET;						   // the address should be network capable
+	socket_address->sin_port = htons(port_number);				   // bind to port number after converting to network byte order
+
+	// get the DNS entry for this host name
+	struct hostent *host_info = gethostbyname(host_name);
+	if (host_info == NULL)
+	{
+		return -1;
+	}
+
+	// copy the first IP address from the DNS entry to sin_addr.s_addr (IP address field)
+	memcpy((char *)&socket_address->sin_addr.s_addr, host_info->h_addr_list[0], host_info->h_length);
+	return 0;
+}
+
+/**
+ * Sets up the address of a server the way a client's command line gives it: a port number on the given host,
+ * or the path of a Unix domain socket, which is anything containing a '/' (e.g. ./otp.sock).
+ * @param server_address: pointer to the address to fill in
+ * @param server: string, port number or socket path
+ * @param host_name: string, host name of the server when a port number is given
+ * @return int, 0 on success, -1 with errno set if the host name could not be resolved (ENOENT) or the socket
+ * path is too long (ENAMETOOLONG)
+ */
+int otp_setup_server_address(struct otp_server_address *server_address, const char *server, const char *host_name)
+{
+	memset(server_address, 0, sizeof(*server_address));
+	if (!strchr(server, '/'))
+	{
+		server_address->size = sizeof(struct sockaddr_in);
+		if (otp_setup_client_address((struct sockaddr_in *)&server_address->address, atoi(server), host_name) < 0)
+		{
+			errno = ENOENT;
+			return -1;
+		}
+		return 0;
+	}
+
+	struct sockaddr_un *socket_address = (struct sockaddr_un *)&server_address->address;
+	if (strlen(server) >= sizeof(socket_address->sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	socket_address->sun_family = AF_UNIX;
+	strcpy(socket_address->sun_path, server);
+	server_address->size = sizeof(struct sockaddr_un);
+	return 0;
+}
+
+/**
+ * Opens a connection to a server, over TCP (with Nagle's algorithm turned off) or a Unix domain socket.
+ * @param server_address: pointer to the address set up by otp_setup_server_address()
+ * @return int, file descriptor of the connection socket, or -1 with errno set if the server could not be reached
+ */
+int otp_connect_to_server(const struct otp_server_address *server_address)
+{
+	int family = server_address->address.ss_family;
+	int connection_socket_fd = socket(family, SOCK_STREAM, 0);
+	if (connection_socket_fd < 0)
+	{
+		return -1;
+	}
+	if (connect(connection_socket_fd, (const struct sockaddr *)&server_address->address, server_address->size) < 0)
+	{
+		int connect_error = errno;
+		close(connection_socket_fd);
+		errno = connect_error;
+		return -1;
+	}
+	if (family == AF_INET)
+	{
+		otp_set_no_delay(connection_socket_fd);
+	}
+	return connection_socket_fd;
+}
+
+/**
+ * Turns off Nagle's algorithm on a connection socket. A session sends many small frames back to back,
+ * and waiting for the peer's delayed acknowledgement before each one would add tens of milliseconds
+ * to every request. Does nothing on a Unix domain socket, which has no such delay.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ */
+void otp_set_no_delay(int connection_socket_fd)
+{
+	int no_delay = 1;
+	setsockopt(connection_socket_fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+}
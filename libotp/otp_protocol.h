@@ -0,0 +1,74 @@
+#ifndef OTP_PROTOCOL_H
+#define OTP_PROTOCOL_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "otp_encoding.h"
+#include "otp_file.h"
+
+// every connection starts with the client type, which the server checks before anything else
+#define OTP_HANDSHAKE_LENGTH 7
+#define OTP_ENCRYPT_CLIENT "encrypt"
+#define OTP_DECRYPT_CLIENT "decrypt"
+
+// After the handshake a session carries any number of requests, each starting with a 4-byte frame header in
+// network byte order. A header of 0 or more is the size of a message, which is followed by a key message; the
+// reply is a message of the same size. A negative header announces one of the request types below. The session
+// ends when the client sends OTP_FRAME_GOODBYE or closes the connection between requests.
+#define OTP_FRAME_STREAM -1	 // a chunked request follows (see otp_stream.h)
+#define OTP_FRAME_GOODBYE -2 // the client has no more requests
+#define OTP_FRAME_TAGGED -3	 // a request with a tag echoed in its reply follows (see otp_pipeline.h)
+#define OTP_FRAME_PAD_UPLOAD -4	 // a pad for the server's pad store follows (see otp_pad_store.h)
+#define OTP_FRAME_PAD_REQUEST -5 // a request keyed by a range of a stored pad follows (see otp_pad_store.h)
+#define OTP_FRAME_ENCODING -6	 // the client asks for a wire encoding for the rest of the session (see otp_encoding.h)
+#define OTP_FRAME_PAD_RELEASE -7 // the client is done with a stored pad, whose ID follows (see otp_pad_store.h)
+
+// A reply starts with the size of its result (after the tag, for a tagged request). A server that refuses a request
+// sends a negative size instead, one of the errors below with nothing after it, and then ends the session, except
+// that a request refused as busy is read in full first, so the session goes on. A server over capacity may also
+// send OTP_REPLY_BUSY as soon as it accepts a connection, in place of the reply to its first request; it then reads
+// and drops what the client sends until the client closes the connection.
+#define OTP_REPLY_BAD_CHARACTER -1 // the message or key holds a character outside the alphabet
+#define OTP_REPLY_BUSY -2		   // the server is over capacity and did not serve the request; try again later
+
+#define OTP_DISCARD_BUFFER_SIZE 16384 // bytes received at a time while dropping the rest of a refused request
+
+// where a client reaches a server: a TCP port on a host, or the path of a Unix domain socket on this host
+struct otp_server_address
+{
+	struct sockaddr_storage address;
+	socklen_t size;
+};
+
+int otp_send_all(int connection_socket_fd, const void *buffer, int size);
+bool otp_receive_all(int connection_socket_fd, void *buffer, int size);
+bool otp_discard_received_bytes(int connection_socket_fd, long long size);
+int otp_send_message(int connection_socket_fd, const char *message, int message_size);
+int otp_send_encoded_message(int connection_socket_fd, const char *message, int message_size, int encoding);
+int otp_send_tagged_message(int connection_socket_fd, int tag, const char *message, int message_size, int encoding);
+int otp_send_file_message(int connection_socket_fd, const struct otp_mapped_file *file, int message_size, int encoding);
+char *otp_receive_message(int connection_socket_fd, int *message_size);
+char *otp_receive_encoded_message(int connection_socket_fd, int *message_size, int encoding);
+int otp_receive_message_to_file(int connection_socket_fd, FILE *output_file, int encoding);
+bool otp_receive_frame_header(int connection_socket_fd, int *frame_header);
+int otp_receive_next_request(int connection_socket_fd, int *frame_header);
+int otp_send_goodbye(int connection_socket_fd);
+int otp_send_error_reply(int connection_socket_fd, int error);
+int otp_reply_error_number(int reply_size);
+int otp_receive_refusal(int connection_socket_fd);
+int otp_negotiate_encoding(int connection_socket_fd, int encoding);
+int otp_upload_pad(int connection_socket_fd, const char *pad, int pad_size, int encoding, int *pad_id);
+int otp_upload_pad_file(int connection_socket_fd, const struct otp_mapped_file *pad, int encoding, int *pad_id);
+int otp_send_pad_request(int connection_socket_fd, int pad_id, int offset, const char *message, int message_size, int encoding);
+int otp_release_pad(int connection_socket_fd, int pad_id);
+char *otp_receive_message_body(int connection_socket_fd, int *message_size);
+char *otp_receive_encoded_message_body(int connection_socket_fd, int *message_size, int encoding);
+int otp_trim_null_terminators(const char *message, int message_size);
+int otp_setup_client_address(struct sockaddr_in *socket_address, int port_number, const char *host_name);
+int otp_setup_server_address(struct otp_server_address *server_address, const char *server, const char *host_name);
+int otp_connect_to_server(const struct otp_server_address *server_address);
+void otp_set_no_delay(int connection_socket_fd);
+
+#endif
@@ -0,0 +1,2139 @@
+#define _GNU_SOURCE // for sched_setaffinity
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>	  // for struct sockaddr_un
+#include <sys/stat.h> // for stat
+#include <netinet/in.h>
+#include <poll.h> // for poll
+#include <sys/wait.h>	  // for waitpid
+#include <sys/resource.h> // for setrlimit
+#include <errno.h>
+#include <fcntl.h>	 // for fcntl
+#include <getopt.h>	 // for getopt_long
+#include <pthread.h> // for the thread pool worker model
+#include <sched.h>	 // for sched_setaffinity
+#include "otp_buffer_pool.h"
+#include "otp_protocol.h"
+#include "otp_pipeline.h"
+#include "otp_server.h"
+#include "otp_stream.h"
+
+#define CONNECTION_QUEUE_CAPACITY 128 // accepted connections waiting for a free worker thread
+#define TAGGED_JOB_QUEUE_CAPACITY 256 // tagged requests waiting for a free cipher thread
+
+// bounded queue of accepted connections, consumed by the worker threads
+struct connection_queue
+{
+	int connection_fds[CONNECTION_QUEUE_CAPACITY];
+	long long accepted_at_us[CONNECTION_QUEUE_CAPACITY];
+	int head;  // index of the oldest queued connection
+	int count; // number of queued connections
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+};
+
+// a connection's session; in the threads model its tagged requests are answered by the cipher threads
+struct tagged_session
+{
+	int connection_socket_fd;
+	int encoding;				// wire encoding of messages, OTP_ENCODING_TEXT until the client negotiates another
+	int in_flight;				// tagged requests received but not answered yet
+	bool failed;				// a reply could not be sent
+	pthread_mutex_t lock;		// guards in_flight and failed
+	pthread_cond_t answered;	// signalled whenever a tagged request has been answered
+	pthread_mutex_t send_lock;	// keeps the replies of different cipher threads from interleaving
+};
+
+// a tagged request that has been received and is waiting for a cipher thread
+struct tagged_job
+{
+	struct tagged_session *session;
+	int tag;
+	char *message;
+	char *key;
+	int message_size;
+	long long reserved_bytes;		  // memory reserved for the message and key (see otp_reserve_request_memory())
+	struct otp_request_timing timing; // started and received so far
+};
+
+// connections refused at accept, drained by the acceptor between accepts (see otp_refuse_connection())
+struct refused_connections
+{
+	int fds[OTP_MAX_DRAINING_CONNECTIONS];
+	long long deadlines_ns[OTP_MAX_DRAINING_CONNECTIONS]; // when each is closed; in order, as each gets the same time
+	long long remaining_bytes[OTP_MAX_DRAINING_CONNECTIONS]; // what each may still send before it is closed
+	int count;
+};
+
+// bounded queue of tagged requests, consumed by the cipher threads
+struct tagged_job_queue
+{
+	struct tagged_job jobs[TAGGED_JOB_QUEUE_CAPACITY];
+	int head;  // index of the oldest queued job
+	int count; // number of queued jobs
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+};
+
+volatile sig_atomic_t otp_stop_requested = 0;
+static struct connection_queue queue;		 // used by OTP_MODE_THREADS only
+static struct tagged_job_queue tagged_queue; // used by OTP_MODE_THREADS only
+static struct refused_connections refused;	 // used by the acceptor of this process only
+
+// function prototypes
+static bool parse_server_options(struct otp_server *server, int argument_count, char *argument_array[]);
+static int open_listening_socket(int port_number, int backlog, bool reuse_port);
+static int open_unix_listening_socket(const char *socket_path, int backlog);
+static int accept_connection(const struct otp_server *server);
+static void drain_refused_connections(const struct pollfd *poll_entries);
+static void close_refused_connection(int index);
+static void forget_refused_connections(void);
+static bool check_client_type(const struct otp_server *server, int connection_socket_fd);
+static int receive_message_and_key(const struct otp_server *server, int connection_socket_fd, int encoding, int *message_size,
+								   char **message, char **key, long long *reserved_bytes);
+static bool serve_message_request(const struct otp_server *server, int connection_socket_fd, int encoding, int message_size);
+static bool serve_tagged_request(const struct otp_server *server, struct tagged_session *session, bool queue_reply);
+static bool serve_stream_request(const struct otp_server *server, int connection_socket_fd);
+static bool serve_pad_upload(const struct otp_server *server, int connection_socket_fd, int encoding);
+static bool serve_pad_request(const struct otp_server *server, int connection_socket_fd, int encoding);
+static bool serve_encoding_request(const struct otp_server *server, struct tagged_session *session);
+static bool serve_pad_release(const struct otp_server *server, int connection_socket_fd);
+static bool discard_refused_request(const struct otp_server *server, int connection_socket_fd, int encoding,
+									int message_size, bool keyed);
+static bool refuse_tagged_request(int connection_socket_fd, int tag, int error);
+static bool wait_for_tagged_replies(struct tagged_session *session);
+static void handle_stop_signal(int signal_number);
+static void reap_children(int signal_number);
+static void install_signal_handlers(void);
+static void run_fork_server(struct otp_server *server);
+static void run_prefork_server(struct otp_server *server);
+static void run_prefork_worker(struct otp_server *server, int index);
+static void pin_worker_to_cpu(int index);
+static void run_thread_server(struct otp_server *server);
+static void *connection_worker_thread(void *argument);
+static void *cipher_worker_thread(void *argument);
+static void start_shm_ring_thread(struct otp_server *server);
+static void *shm_ring_thread(void *argument);
+static void start_trace_dump_thread(struct otp_server *server);
+static void *trace_dump_thread(void *argument);
+static void print_usage(const struct otp_server_role *role);
+
+/**
+ * Runs a server with the given role: parses the command line, listens on the given port and/or Unix domain
+ * socket, and hands each client to the selected worker model, while threads of their own serve the shared
+ * memory request ring, the metrics endpoint and the trace dump if they were asked for. On SIGINT/SIGTERM,
+ * prints connection statistics and returns.
+ * @param argument_count: int, the number of command line arguments
+ * @param argument_array: array, the command line arguments entered (options, then the port number unless a
+ * socket path was given)
+ * @param role: pointer to the role (program name, accepted client type and cipher)
+ * @return int, exit status for main()
+ */
+int otp_run_server(int argument_count, char *argument_array[], const struct otp_server_role *role)
+{
+	struct otp_server server = {
+		.role = role,
+		.mode = OTP_MODE_FORK,
+		.mode_name = "fork",
+		.worker_count = OTP_DEFAULT_WORKER_COUNT,
+		.port_number = -1,
+		.listen_backlog = OTP_DEFAULT_LISTEN_BACKLOG,
+		.pad_store_size = OTP_DEFAULT_PAD_STORE_SIZE,
+		.pid = getpid()};
+
+	if (!parse_server_options(&server, argument_count, argument_array))
+	{
+		return 1;
+	}
+
+	if (server.port_number >= 0)
+	{
+		server.listening_socket_fds[server.listening_socket_count++] =
+			open_listening_socket(server.port_number, server.listen_backlog, server.reuse_port);
+	}
+	if (server.socket_path)
+	{
+		server.listening_socket_fds[server.listening_socket_count++] =
+			open_unix_listening_socket(server.socket_path, server.listen_backlog);
+	}
+	if ((server.listening_socket_count > 1 || server.max_connections > 0) && server.mode != OTP_MODE_IO_URING)
+	{
+		// the other worker models poll the sockets, and must not then block in accept() (see accept_connection())
+		for (int i = 0; i < server.listening_socket_count; i++)
+		{
+			int fd = server.listening_socket_fds[i];
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		}
+	}
+	server.stats = otp_create_server_stats();
+	otp_set_pool_budget(&server.stats->pool, &server.stats->buffered_bytes, server.max_buffered);
+	server.pad_store = otp_create_pad_store(server.pad_store_size);
+	if (!server.pad_store)
+	{
+		fprintf(stderr, "SERVER: ERROR allocating pad store\n");
+		exit(1);
+	}
+	install_signal_handlers();
+	if (server.trace_capacity > 0)
+	{
+		start_trace_dump_thread(&server); // first, so every later thread and process blocks SIGUSR1
+	}
+	if (server.shm_name)
+	{
+		start_shm_ring_thread(&server);
+	}
+	if (server.metrics_address)
+	{
+		otp_start_metrics_endpoint(&server);
+	}
+
+	// accept and serve client connections until a stop is requested
+	switch (server.mode)
+	{
+	case OTP_MODE_FORK:
+		server.worker_count = 1;
+		run_fork_server(&server);
+		break;
+
+	case OTP_MODE_PREFORK:
+		run_prefork_server(&server);
+		break;
+
+	case OTP_MODE_THREADS:
+		run_thread_server(&server);
+		break;
+
+	case OTP_MODE_EPOLL:
+		if (server.reuse_port)
+		{
+			run_prefork_server(&server); // an event loop per worker process
+			break;
+		}
+		server.worker_count = 1;
+		otp_run_event_loop_server(&server);
+		break;
+
+	case OTP_MODE_IO_URING:
+		if (server.reuse_port)
+		{
+			run_prefork_server(&server);
+			break;
+		}
+		server.worker_count = 1;
+#ifdef USE_IO_URING
+		otp_run_uring_server(&server);
+#endif
+		break;
+	}
+
+	otp_print_server_stats(server.stats, server.mode_name, server.worker_count);
+	for (int i = 0; i < server.listening_socket_count; i++)
+	{
+		close(server.listening_socket_fds[i]); // close the listening sockets
+	}
+	if (server.socket_path)
+	{
+		unlink(server.socket_path);
+	}
+	if (server.shm_ring)
+	{
+		otp_close_shm_ring(server.shm_ring, server.shm_name);
+	}
+	if (server.metrics_address)
+	{
+		otp_stop_metrics_endpoint(&server);
+	}
+	return 0;
+}
+
+/**
+ * Parses the command line options and checks that exactly one port number follows them, or at most one if a
+ * socket path was given, and that the options fit the worker model.
+ * @param server: pointer to the server, whose mode, worker count, port and listening options are filled in
+ * @param argument_count: int, the number of command line arguments
+ * @param argument_array: array, the command line arguments entered
+ * @return bool, false if the command line is invalid (the error has been printed)
+ */
+static bool parse_server_options(struct otp_server *server, int argument_count, char *argument_array[])
+{
+	static struct option long_options[] = {
+		{"mode", required_argument, NULL, 'm'},
+		{"workers", required_argument, NULL, 'w'},
+		{"pad-store-size", required_argument, NULL, 'p'},
+		{"socket", required_argument, NULL, 's'},
+		{"shm", required_argument, NULL, 'r'},
+		{"metrics", required_argument, NULL, 'M'},
+		{"trace", required_argument, NULL, 't'},
+		{"backlog", required_argument, NULL, 'b'},
+		{"reuseport", no_argument, NULL, 'R'},
+		{"pin-cpus", no_argument, NULL, 'c'},
+		{"max-connections", required_argument, NULL, 'C'},
+		{"max-buffered", required_argument, NULL, 'B'},
+		{NULL, 0, NULL, 0}};
+
+	int option;
+	while ((option = getopt_long(argument_count, argument_array, "m:w:p:s:r:M:t:b:RcC:B:", long_options, NULL)) != -1)
+	{
+		switch (option)
+		{
+		case 'm':
+			server->mode_name = optarg;
+			if (strcmp(optarg, "fork") == 0)
+			{
+				server->mode = OTP_MODE_FORK;
+			}
+			else if (strcmp(optarg, "prefork") == 0)
+			{
+				server->mode = OTP_MODE_PREFORK;
+			}
+			else if (strcmp(optarg, "threads") == 0)
+			{
+				server->mode = OTP_MODE_THREADS;
+			}
+			else if (strcmp(optarg, "epoll") == 0)
+			{
+				server->mode = OTP_MODE_EPOLL;
+			}
+			else if (strcmp(optarg, "io_uring") == 0)
+			{
+#ifdef USE_IO_URING
+				server->mode = OTP_MODE_IO_URING;
+#else
+				fprintf(stderr, "SERVER: ERROR- io_uring support was not built in (build with IO_URING=1 ./build.sh)\n");
+				return false;
+#endif
+			}
+			else
+			{
+				fprintf(stderr, "SERVER: ERROR- unknown mode %s\n", optarg);
+				print_usage(server->role);
+				return false;
+			}
+			break;
+
+		case 'w':
+			server->worker_count = atoi(optarg);
+			if (server->worker_count <= 0)
+			{
+				fprintf(stderr, "SERVER: ERROR- worker count must be a positive integer\n");
+				return false;
+			}
+			break;
+
+		case 'p':
+		{
+			char *end;
+			long long size = strtoll(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || size < 0)
+			{
+				fprintf(stderr, "SERVER: ERROR- pad store size must be a number of bytes\n");
+				return false;
+			}
+			server->pad_store_size = size;
+			break;
+		}
+
+		case 's':
+			if (strlen(optarg) >= sizeof(((struct sockaddr_un *)NULL)->sun_path))
+			{
+				fprintf(stderr, "SERVER: ERROR- socket path is too long\n");
+				return false;
+			}
+			server->socket_path = optarg;
+			break;
+
+		case 'r':
+			server->shm_name = optarg;
+			break;
+
+		case 'M':
+			server->metrics_address = optarg;
+			break;
+
+		case 't':
+			server->trace_capacity = atoi(optarg);
+			if (server->trace_capacity <= 0)
+			{
+				fprintf(stderr, "SERVER: ERROR- trace size must be a positive number of requests\n");
+				return false;
+			}
+			break;
+
+		case 'b':
+			server->listen_backlog = atoi(optarg);
+			if (server->listen_backlog <= 0)
+			{
+				fprintf(stderr, "SERVER: ERROR- backlog must be a positive number of connections\n");
+				return false;
+			}
+			break;
+
+		case 'R':
+			server->reuse_port = true;
+			break;
+
+		case 'c':
+			server->pin_cpus = true;
+			break;
+
+		case 'C':
+			server->max_connections = atoi(optarg);
+			if (server->max_connections <= 0)
+			{
+				fprintf(stderr, "SERVER: ERROR- maximum connections must be a positive integer\n");
+				return false;
+			}
+			break;
+
+		case 'B':
+		{
+			char *end;
+			server->max_buffered = strtoll(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || server->max_buffered <= 0)
+			{
+				fprintf(stderr, "SERVER: ERROR- maximum buffered size must be a positive number of bytes\n");
+				return false;
+			}
+			break;
+		}
+
+		default:
+			print_usage(server->role);
+			return false;
+		}
+	}
+
+	// check if correct amount of arguments is given (the port is optional when listening on a socket path)
+	if (argument_count - optind < 1 && !server->socket_path)
+	{
+		fprintf(stderr, "Please specify the port number.\n");
+		return false;
+	}
+	else if (argument_count - optind > 1)
+	{
+		fprintf(stderr, "Please ONLY specify the port number.\n");
+		return false;
+	}
+	if (optind < argument_count)
+	{
+		server->port_number = atoi(argument_array[optind]);
+	}
+
+	// only worker processes can have listening sockets and CPUs of their own
+	bool worker_processes = server->mode == OTP_MODE_PREFORK ||
+							(server->reuse_port && (server->mode == OTP_MODE_EPOLL || server->mode == OTP_MODE_IO_URING));
+	if (server->reuse_port && !worker_processes)
+	{
+		fprintf(stderr, "SERVER: ERROR- --reuseport needs the prefork, epoll or io_uring mode\n");
+		return false;
+	}
+	if (server->reuse_port && server->port_number < 0)
+	{
+		fprintf(stderr, "SERVER: ERROR- --reuseport needs a port number\n");
+		return false;
+	}
+	if (server->pin_cpus && !worker_processes)
+	{
+		fprintf(stderr, "SERVER: ERROR- --pin-cpus needs worker processes (the prefork mode, or --reuseport)\n");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Creates the socket that listens for client connections on the given port. With reuse_port, any number of
+ * sockets may listen on the port at once (SO_REUSEPORT), and the kernel spreads new connections across them.
+ * @param port_number: int, port number on which the server will listen
+ * @param backlog: int, pending connections allowed to queue up
+ * @param reuse_port: bool, true to share the port with the other worker processes' sockets
+ * @return int, file descriptor of the listening socket (exits on failure)
+ */
+static int open_listening_socket(int port_number, int backlog, bool reuse_port)
+{
+	// struct to hold socket address (IP address + port number) of the server
+	struct sockaddr_in server_socket_address;
+
+	int listening_socket_fd = socket(AF_INET, SOCK_STREAM, 0); // IPv4, TCP
+	if (listening_socket_fd < 0)
+	{
+		fprintf(stderr, "SERVER: ERROR opening socket\n");
+		exit(1);
+	}
+
+	// allow an immediate restart on the same port while old connections are still in TIME_WAIT
+	int reuse_address = 1;
+	setsockopt(listening_socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse_address, sizeof(reuse_address));
+	if (reuse_port && setsockopt(listening_socket_fd, SOL_SOCKET, SO_REUSEPORT, &reuse_address, sizeof(reuse_address)) < 0)
+	{
+		fprintf(stderr, "SERVER: ERROR setting SO_REUSEPORT\n");
+		exit(1);
+	}
+
+	memset((char *)&server_socket_address, '\0', sizeof(server_socket_address)); // clear out the socket address struct
+	server_socket_address.sin_family = AF_INET;									 // the address should be network capable
+	server_socket_address.sin_port = htons(port_number);						 // bind to port number after converting to network byte order
+	server_socket_address.sin_addr.s_addr = INADDR_ANY;							 // allow a client at any address to connect to this server
+
+	// associate the server socket with the given port
+	if (bind(listening_socket_fd, (struct sockaddr *)&server_socket_address, sizeof(server_socket_address)) < 0)
+	{
+		fprintf(stderr, "SERVER: ERROR on binding\n");
+		exit(1);
+	}
+
+	listen(listening_socket_fd, backlog); // start listening for client connections
+	return listening_socket_fd;
+}
+
+/**
+ * Creates the socket that listens for client connections on the given Unix domain socket path, for clients
+ * on the same host, whose requests then skip the TCP/IP stack. A socket left at the path by an earlier run is
+ * replaced; any other file there is not.
+ * @param socket_path: path of the socket (shorter than sun_path, checked by parse_server_options())
+ * @param backlog: int, pending connections allowed to queue up
+ * @return int, file descriptor of the listening socket (exits on failure)
+ */
+static int open_unix_listening_socket(const char *socket_path, int backlog)
+{
+	struct sockaddr_un server_socket_address = {.sun_family = AF_UNIX};
+	strcpy(server_socket_address.sun_path, socket_path);
+
+	int listening_socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listening_socket_fd < 0)
+	{
+		fprintf(stderr, "SERVER: ERROR opening socket\n");
+		exit(1);
+	}
+
+	struct stat file_status;
+	if (stat(socket_path, &file_status) == 0 && S_ISSOCK(file_status.st_mode))
+	{
+		unlink(socket_path);
+	}
+	if (bind(listening_socket_fd, (struct sockaddr *)&server_socket_address, sizeof(server_socket_address)) < 0)
+	{
+		fprintf(stderr, "SERVER: ERROR on binding %s\n", socket_path);
+		exit(1);
+	}
+
+	listen(listening_socket_fd, backlog);
+	return listening_socket_fd;
+}
+
+/**
+ * Waits for a connection on any of the server's listening sockets and accepts it, for the worker models
+ * that block in accept(). With a single listening socket and no --max-connections this is a plain accept().
+ * Otherwise poll() finds a socket that is ready, and also watches the connections admission control refused,
+ * dropping what they send until they close or their time is up; the listening sockets are then non-blocking
+ * (see otp_run_server()), so when another worker takes the connection first this one goes back to waiting
+ * instead of blocking in accept() on one socket.
+ * @param server: pointer to the server
+ * @return int, file descriptor of the connection socket, or -1 with errno set (EINTR when a signal arrived)
+ */
+static int accept_connection(const struct otp_server *server)
+{
+	if (server->listening_socket_count == 1 && server->max_connections == 0)
+	{
+		return accept(server->listening_socket_fds[0], NULL, NULL);
+	}
+
+	struct pollfd poll_entries[OTP_MAX_LISTENING_SOCKETS + OTP_MAX_DRAINING_CONNECTIONS];
+	while (true)
+	{
+		for (int i = 0; i < server->listening_socket_count; i++)
+		{
+			poll_entries[i] = (struct pollfd){.fd = server->listening_socket_fds[i], .events = POLLIN};
+		}
+		for (int i = 0; i < refused.count; i++)
+		{
+			poll_entries[server->listening_socket_count + i] = (struct pollfd){.fd = refused.fds[i], .events = POLLIN};
+		}
+		int timeout_ms = -1;
+		if (refused.count > 0)
+		{
+			long long remaining_ns = refused.deadlines_ns[0] - otp_current_time_ns();
+			timeout_ms = remaining_ns > 0 ? (int)((remaining_ns + 999999) / 1000000) : 0;
+		}
+		if (poll(poll_entries, server->listening_socket_count + refused.count, timeout_ms) < 0)
+		{
+			return -1;
+		}
+		drain_refused_connections(poll_entries + server->listening_socket_count);
+		for (int i = 0; i < server->listening_socket_count; i++)
+		{
+			if (!(poll_entries[i].revents & POLLIN))
+			{
+				continue;
+			}
+			int connection_socket_fd = accept(server->listening_socket_fds[i], NULL, NULL);
+			if (connection_socket_fd >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			{
+				return connection_socket_fd; // accepted sockets do not inherit O_NONBLOCK
+			}
+		}
+	}
+}
+
+/**
+ * Drops what the refused connections have sent since the last poll(), and closes those whose client has
+ * closed, that have sent more than OTP_REFUSAL_DRAIN_BYTES, or whose OTP_REFUSAL_DRAIN_MS are up.
+ * @param poll_entries: pointer to the poll() results of the refused connections, in their order
+ */
+static void drain_refused_connections(const struct pollfd *poll_entries)
+{
+	char discarded[OTP_DISCARD_BUFFER_SIZE];
+	long long now_ns = otp_current_time_ns();
+	int kept = 0;
+	for (int i = 0, count = refused.count; i < count; i++)
+	{
+		bool open = refused.deadlines_ns[kept] > now_ns;
+		while (open && (poll_entries[i].revents & (POLLIN | POLLHUP | POLLERR)))
+		{
+			int bytes_received = recv(refused.fds[kept], discarded, sizeof(discarded), MSG_DONTWAIT);
+			if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			{
+				break; // everything sent so far is dropped
+			}
+			refused.remaining_bytes[kept] -= bytes_received;
+			open = bytes_received > 0 && refused.remaining_bytes[kept] > 0;
+		}
+		if (open)
+		{
+			kept++;
+		}
+		else
+		{
+			close_refused_connection(kept);
+		}
+	}
+}
+
+/**
+ * Closes a refused connection and removes it from the ones being drained.
+ * @param index: int, its position among them
+ */
+static void close_refused_connection(int index)
+{
+	close(refused.fds[index]);
+	refused.count--;
+	for (int i = index; i < refused.count; i++)
+	{
+		refused.fds[i] = refused.fds[i + 1];
+		refused.deadlines_ns[i] = refused.deadlines_ns[i + 1];
+		refused.remaining_bytes[i] = refused.remaining_bytes[i + 1];
+	}
+}
+
+/**
+ * Closes a forked child's copies of the refused connections its parent is draining, so they are not held
+ * open for as long as the child serves its own client.
+ */
+static void forget_refused_connections(void)
+{
+	for (int i = 0; i < refused.count; i++)
+	{
+		close(refused.fds[i]);
+	}
+	refused.count = 0;
+}
+
+/**
+ * Admission control for a connection that accept() has just returned and otp_record_accept() has counted.
+ * With --max-connections, a connection beyond the limit is not served: it counts as busy instead of active,
+ * and the caller refuses it, with otp_refuse_connection() or, in an event loop, with a connection that only
+ * sends the busy reply and drains. An overloaded server then sheds load for the cost of that reply instead of
+ * piling up processes, threads or queued connections that would slow every client down.
+ * @param server: pointer to the server
+ * @return bool, true if the connection may be served; false if it must be refused
+ */
+bool otp_admit_connection(const struct otp_server *server)
+{
+	if (server->max_connections == 0 ||
+		__atomic_load_n(&server->stats->active_connections, __ATOMIC_RELAXED) <= (unsigned long)server->max_connections)
+	{
+		return true;
+	}
+	otp_record_refusal(server->stats);
+	return false;
+}
+
+/**
+ * Refuses a connection that admission control turned away, for the blocking worker models: answers
+ * OTP_REPLY_BUSY in place of the reply to its first request, shuts down the sending side, and leaves the
+ * connection to accept_connection(), which reads and drops whatever the client still sends until it closes,
+ * or for at most OTP_REFUSAL_DRAIN_BYTES and OTP_REFUSAL_DRAIN_MS. Closing with the request unread would
+ * make the kernel reset the connection, which can kill a client in the middle of sending it before it ever
+ * reads the reply. Nothing here waits for the client, so the acceptor goes straight back to accepting; with
+ * OTP_MAX_DRAINING_CONNECTIONS already draining, the oldest of them is closed to make room.
+ * @param connection_socket_fd: int, file descriptor of the connection socket (closed once drained)
+ */
+void otp_refuse_connection(int connection_socket_fd)
+{
+	int converted_error = htonl(OTP_REPLY_BUSY);
+	send(connection_socket_fd, &converted_error, sizeof(int), MSG_DONTWAIT | MSG_NOSIGNAL);
+	shutdown(connection_socket_fd, SHUT_WR);
+
+	if (refused.count == OTP_MAX_DRAINING_CONNECTIONS)
+	{
+		close_refused_connection(0);
+	}
+	refused.fds[refused.count] = connection_socket_fd;
+	refused.deadlines_ns[refused.count] = otp_current_time_ns() + OTP_REFUSAL_DRAIN_MS * 1000000LL;
+	refused.remaining_bytes[refused.count] = OTP_REFUSAL_DRAIN_BYTES;
+	refused.count++;
+}
+
+/**
+ * Receives the client type from the client, and rejects the connection if it is not
+ * the type this server serves.
+ * @param server: pointer to the server
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @return bool, true if the client may be served
+ */
+static bool check_client_type(const struct otp_server *server, int connection_socket_fd)
+{
+	char client_type[OTP_HANDSHAKE_LENGTH + 1];
+
+	// receive client type with partial receive handling
+	if (!otp_receive_all(connection_socket_fd, client_type, OTP_HANDSHAKE_LENGTH))
+	{
+		fprintf(stderr, "SERVER: ERROR receiving client type\n");
+		otp_record_error(server->stats, OTP_ERROR_RECEIVE);
+		return false;
+	}
+
+	client_type[OTP_HANDSHAKE_LENGTH] = '\0'; // ensure null-termination
+
+	// reject the client if it is of the wrong type
+	if (strcmp(client_type, server->role->client_type) != 0)
+	{
+		fprintf(stderr, "SERVER: ERROR- client rejected\n");
+		otp_record_error(server->stats, OTP_ERROR_REJECTED);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Handles a single client connection.
+ * Checks the client type, then serves requests until the client ends the session: messages and keys
+ * answered with the result of the server's cipher, tagged requests answered the same way with their
+ * tag, stream requests answered chunk by chunk, pad uploads, requests keyed by an uploaded pad, and the
+ * choice of wire encoding for the rest of the session. In the threads model tagged requests are handed to
+ * the cipher threads, so later ones are received while earlier ones are still being served and each
+ * reply leaves as soon as it is ready.
+ * Errors are reported, counted and returned instead of exiting, so this can run on a worker thread
+ * or in a long-lived worker process. The CPU time the session took is added to the statistics. The
+ * connection socket is always closed.
+ * @param server: pointer to the server
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @return bool, true if every request was served and the session ended cleanly
+ */
+bool otp_handle_client(const struct otp_server *server, int connection_socket_fd)
+{
+	struct tagged_session session = {.connection_socket_fd = connection_socket_fd, .encoding = OTP_ENCODING_TEXT};
+	struct tagged_session *pipelined_session = NULL;
+	if (server->mode == OTP_MODE_THREADS)
+	{
+		pthread_mutex_init(&session.lock, NULL);
+		pthread_cond_init(&session.answered, NULL);
+		pthread_mutex_init(&session.send_lock, NULL);
+		pipelined_session = &session;
+	}
+
+	long long cpu_started_ns = otp_thread_cpu_time_ns();
+	long long started_ns = otp_current_time_ns();
+	otp_set_no_delay(connection_socket_fd);
+	bool succeeded = check_client_type(server, connection_socket_fd);
+	if (succeeded)
+	{
+		otp_record_phase(server->stats, OTP_PHASE_HANDSHAKE, otp_current_time_ns() - started_ns);
+	}
+
+	while (succeeded)
+	{
+		int frame_header;
+		int status = otp_receive_next_request(connection_socket_fd, &frame_header);
+		if (status == 0)
+		{
+			break; // the client ended the session
+		}
+
+		if (status < 0)
+		{
+			fprintf(stderr, "SERVER: ERROR receiving message size\n");
+			otp_record_error(server->stats, OTP_ERROR_RECEIVE);
+			succeeded = false;
+		}
+		else if (frame_header == OTP_FRAME_TAGGED)
+		{
+			// answered (and counted) by a cipher thread in the threads model
+			succeeded = serve_tagged_request(server, &session, pipelined_session != NULL);
+			continue;
+		}
+		else if (pipelined_session && !wait_for_tagged_replies(pipelined_session))
+		{
+			succeeded = false; // untagged replies must not overtake tagged ones
+		}
+		else if (frame_header == OTP_FRAME_ENCODING)
+		{
+			// only changed once no tagged reply is outstanding, so the cipher threads see a fixed encoding
+			succeeded = serve_encoding_request(server, &session);
+			continue; // not a cipher request, so not counted
+		}
+		else if (frame_header == OTP_FRAME_STREAM)
+		{
+			succeeded = serve_stream_request(server, connection_socket_fd);
+		}
+		else if (frame_header == OTP_FRAME_PAD_UPLOAD)
+		{
+			succeeded = serve_pad_upload(server, connection_socket_fd, session.encoding);
+		}
+		else if (frame_header == OTP_FRAME_PAD_REQUEST)
+		{
+			succeeded = serve_pad_request(server, connection_socket_fd, session.encoding);
+			continue; // counted there, unless refused as busy
+		}
+		else if (frame_header == OTP_FRAME_PAD_RELEASE)
+		{
+			succeeded = serve_pad_release(server, connection_socket_fd);
+			continue; // not a cipher request, so not counted
+		}
+		else if (frame_header < 0)
+		{
+			fprintf(stderr, "SERVER: ERROR- invalid message size\n");
+			otp_record_error(server->stats, OTP_ERROR_PROTOCOL);
+			succeeded = false;
+		}
+		else
+		{
+			succeeded = serve_message_request(server, connection_socket_fd, session.encoding, frame_header);
+			continue; // counted there, unless refused as busy
+		}
+		if (succeeded)
+		{
+			otp_record_request(server->stats);
+		}
+	}
+
+	if (pipelined_session)
+	{
+		// the cipher threads may still be sending replies on the socket
+		succeeded = wait_for_tagged_replies(pipelined_session) && succeeded;
+		pthread_mutex_destroy(&session.lock);
+		pthread_cond_destroy(&session.answered);
+		pthread_mutex_destroy(&session.send_lock);
+	}
+	close(connection_socket_fd);
+	otp_record_cpu_time(server->stats, cpu_started_ns);
+	return succeeded;
+}
+
+/**
+ * Applies the server's cipher to a message, which checks every message and key character in the same pass.
+ * A request holding a character outside the alphabet is refused rather than answered with garbage; the
+ * caller sends the client OTP_REPLY_BAD_CHARACTER and ends the session.
+ * @param server: pointer to the server
+ * @param message: pointer to the message characters
+ * @param key: pointer to at least length key characters
+ * @param result: pointer to memory for the result (may be the message)
+ * @param length: int, number of characters
+ * @return bool, true if the result is complete, false if a character was refused
+ */
+bool otp_apply_cipher(const struct otp_server *server, const char *message, const char *key, char *result, int length)
+{
+	int bad_position = server->role->cipher(message, key, result, length);
+	if (bad_position >= 0)
+	{
+		fprintf(stderr, "SERVER: ERROR- bad character at position %d of message or key\n", bad_position);
+		otp_record_error(server->stats, OTP_ERROR_BAD_CHARACTER);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Records the phases of a request once its reply has been sent (or has failed): the time to receive it, to
+ * apply the cipher and to send the reply each go into their phase histogram, and into the request trace if
+ * the server keeps one.
+ * @param server: pointer to the server
+ * @param type: enum otp_request_type, the kind of request
+ * @param size: int, number of message (or pad, or chunk) characters
+ * @param timing: pointer to the times the request was started, received and ciphered at
+ * @param succeeded: bool, false if the request was refused or its reply could not be sent
+ */
+void otp_finish_request_timing(const struct otp_server *server, enum otp_request_type type, int size,
+							   const struct otp_request_timing *timing, bool succeeded)
+{
+	long long sent_ns = otp_current_time_ns();
+	long long receive_ns = timing->received_ns - timing->started_ns;
+	long long cipher_ns = timing->ciphered_ns - timing->received_ns;
+	otp_record_phase(server->stats, OTP_PHASE_RECEIVE, receive_ns);
+	otp_record_phase(server->stats, OTP_PHASE_CIPHER, cipher_ns);
+	otp_record_phase(server->stats, OTP_PHASE_SEND, sent_ns - timing->ciphered_ns);
+	if (server->trace_ring)
+	{
+		struct otp_trace_entry entry = {
+			.started_us = timing->started_ns / 1000,
+			.pid = server->pid,
+			.type = type,
+			.size = size,
+			.succeeded = succeeded,
+			.receive_ns = receive_ns,
+			.cipher_ns = cipher_ns,
+			.send_ns = sent_ns - timing->ciphered_ns};
+		otp_trace_request(server->trace_ring, &entry);
+	}
+}
+
+/**
+ * Reserves memory for a request whose size has been received, before any of it is allocated, at the capacity
+ * of its buffers (see otp_buffer_capacity()). With --max-buffered, a request that would take the memory every
+ * worker holds over the limit first has the buffer pools freed what they keep, as that may be what takes the
+ * room; if it still does not fit it is counted as busy and not served, and the caller reads and drops the rest
+ * of it, replies OTP_REPLY_BUSY and goes on with the session. Release the reservation with
+ * otp_release_buffered_bytes() once the request's buffers are freed.
+ * @param server: pointer to the server
+ * @param reserved: long long, bytes the request has already reserved (for its message, when its key's size
+ * arrives), or 0
+ * @param bytes: long long, further bytes the request will hold
+ * @return bool, false if the request must be refused
+ */
+bool otp_reserve_request_memory(const struct otp_server *server, long long reserved, long long bytes)
+{
+	if (otp_reserve_buffered_bytes(server->stats, reserved, bytes, server->max_buffered))
+	{
+		return true;
+	}
+	otp_trim_buffer_pools();
+	if (otp_reserve_buffered_bytes(server->stats, reserved, bytes, server->max_buffered))
+	{
+		return true;
+	}
+	otp_record_error(server->stats, OTP_ERROR_BUSY);
+	return false;
+}
+
+/**
+ * Receives and drops the rest of a request refused as busy after its message size was received: the message
+ * and, unless the request is keyed by a stored pad, the key message after it. The request is never held in
+ * memory, and the next one is read from the right place, so the session goes on.
+ * @param server: pointer to the server
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param encoding: int, the session's wire encoding
+ * @param message_size: int, size of the message, whose header has already been received
+ * @param keyed: bool, true if a key message follows the message
+ * @return bool, false if the rest of the request could not be received (the error is printed and counted)
+ */
+static bool discard_refused_request(const struct otp_server *server, int connection_socket_fd, int encoding,
+									int message_size, bool keyed)
+{
+	int key_size = 0;
+	if (!otp_discard_received_bytes(connection_socket_fd, otp_encoded_size(encoding, message_size)) ||
+		(keyed && (!otp_receive_frame_header(connection_socket_fd, &key_size) || key_size < 0 ||
+				   !otp_discard_received_bytes(connection_socket_fd, otp_encoded_size(encoding, key_size)))))
+	{
+		fprintf(stderr, "SERVER: ERROR receiving message\n");
+		otp_record_error(server->stats, OTP_ERROR_RECEIVE);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Receives the message and key of a request whose message size has already been received, and checks
+ * that the key is long enough. Prints and counts the error if not. The key's memory is reserved as soon as
+ * its size arrives, so a key far longer than its message cannot take the server over --max-buffered either;
+ * if it would, the key is dropped unread and the request is refused as busy.
+ * @param server: pointer to the server
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param encoding: int, the session's wire encoding
+ * @param message_size: pointer to the received message size; updated to exclude trailing null characters
+ * @param message: pointer to where the message is stored (otp_free_buffer() it)
+ * @param key: pointer to where the key is stored (otp_free_buffer() it)
+ * @param reserved_bytes: pointer to the bytes reserved for the request; the key's size is added to it
+ * @return int, 1 if both were received and the key is at least as long as the message, 0 if the request was
+ * read in full but refused as busy (the caller replies), or -1 on error
+ */
+static int receive_message_and_key(const struct otp_server *server, int connection_socket_fd, int encoding, int *message_size,
+								   char **message, char **key, long long *reserved_bytes)
+{
+	// receive message from client
+	*message = otp_receive_encoded_message_body(connection_socket_fd, message_size, encoding);
+	if (!*message)
+	{
+		fprintf(stderr, "SERVER: ERROR receiving message\n");
+		otp_record_error(server->stats, OTP_ERROR_RECEIVE);
+		return -1;
+	}
+
+	// receive key from client, once its memory is reserved
+	int key_size;
+	if (!otp_receive_frame_header(connection_socket_fd, &key_size))
+	{
+		fprintf(stderr, "SERVER: ERROR receiving key\n");
+		otp_record_error(server->stats, OTP_ERROR_RECEIVE);
+		otp_free_buffer(*message);
+		return -1;
+	}
+	long long key_bytes = key_size >= 0 ? (long long)otp_buffer_capacity((size_t)key_size + 1) : 0;
+	if (key_size >= 0 && !otp_reserve_request_memory(server, *reserved_bytes, key_bytes))
+	{
+		otp_free_buffer(*message);
+		if (!otp_discard_received_bytes(connection_socket_fd, otp_encoded_size(encoding, key_size)))
+		{
+			fprintf(stderr, "SERVER: ERROR receiving key\n");
+			otp_record_error(server->stats, OTP_ERROR_RECEIVE);
+			return -1;
+		}
+		return 0;
+	}
+	*reserved_bytes += key_bytes;
+	*key = otp_receive_encoded_message_body(connection_socket_fd, &key_size, encoding);
+	if (!*key)
+	{
+		fprintf(stderr, "SERVER: ERROR receiving key\n");
+		otp_record_error(server->stats, OTP_ERROR_RECEIVE);
+		otp_free_buffer(*message);
+		return -1;
+	}
+
+	// check that key is at least as long as the message
+	if (key_size < *message_size)
+	{
+		fprintf(stderr, "SERVER: ERROR- key is too short\n");
+		otp_record_error(server->stats, OTP_ERROR_PROTOCOL);
+		otp_free_buffer(*message);
+		otp_free_buffer(*key);
+		return -1;
+	}
+	return 1;
+}
+
+/**
+ * Serves a request made of a whole message and key: receives both, applies the server's cipher,
+ * and sends the result back as one message.
+ * @param server: pointer to the server
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param encoding: int, the session's wire encoding
+ * @param message_size: int, size of the message, whose header has already been received
+ * @return bool, true if the result was sent to the client, or the request was refused as busy
+ */
+static bool serve_message_request(const struct otp_server *server, int connection_socket_fd, int encoding, int message_size)
+{
+	struct otp_request_timing timing = {.started_ns = otp_current_time_ns()};
+	char *message;
+	char *key;
+	// message and result (+1 for null terminator); the key is reserved once its size arrives
+	long long reserved_bytes = 2LL * otp_buffer_capacity((size_t)message_size + 1);
+	if (!otp_reserve_request_memory(server, 0, reserved_bytes))
+	{
+		return discard_refused_request(server, connection_socket_fd, encoding, message_size, true) &&
+			   otp_send_error_reply(connection_socket_fd, OTP_REPLY_BUSY) == 0;
+	}
+	int received = receive_message_and_key(server, connection_socket_fd, encoding, &message_size, &message, &key,
+										   &reserved_bytes);
+	if (received <= 0)
+	{
+		otp_release_buffered_bytes(server->stats, reserved_bytes);
+		return received == 0 && otp_send_error_reply(connection_socket_fd, OTP_REPLY_BUSY) == 0;
+	}
+	timing.received_ns = otp_current_time_ns();
+
+	// allocate memory for the result
+	char *result = otp_allocate_buffer(message_size + 1); // +1 for null terminator
+	if (!result)
+	{
+		fprintf(stderr, "SERVER: ERROR allocating memory for result\n");
+		otp_record_error(server->stats, OTP_ERROR_MEMORY);
+		otp_free_buffer(message);
+		otp_free_buffer(key);
+		otp_release_buffered_bytes(server->stats, reserved_bytes);
+		return false;
+	}
+
+	bool succeeded = otp_apply_cipher(server, message, key, result, message_size);
+	timing.ciphered_ns = otp_current_time_ns();
+	if (!succeeded)
+	{
+		otp_send_error_reply(connection_socket_fd, OTP_REPLY_BAD_CHARACTER);
+	}
+	else if (otp_send_encoded_message(connection_socket_fd, result, message_size, encoding) < 0)
+	{
+		fprintf(stderr, "SERVER: ERROR sending message\n");
+		otp_record_error(server->stats, OTP_ERROR_SEND);
+		succeeded = false;
+	}
+	else
+	{
+		otp_record_request(server->stats);
+		otp_record_transfer(server->stats, 2LL * message_size, message_size);
+	}
+	otp_finish_request_timing(server, OTP_REQUEST_MESSAGE, message_size, &timing, succeeded);
+
+	// clean up
+	otp_free_buffer(message);
+	otp_free_buffer(key);
+	otp_free_buffer(result);
+	otp_release_buffered_bytes(server->stats, reserved_bytes);
+	return succeeded;
+}
+
+/**
+ * Serves a tagged request: receives its tag, message and key, and either answers it here (with the tag in
+ * front of the result) or, in the threads model, queues it for a cipher thread and returns right away so
+ * the next request can be received.
+ * @param server: pointer to the server
+ * @param session: pointer to the connection's session
+ * @param queue_reply: bool, true to leave the reply to a cipher thread (threads model only)
+ * @return bool, true if the request was answered, queued or refused as busy, and no earlier reply has failed
+ */
+static bool serve_tagged_request(const struct otp_server *server, struct tagged_session *session, bool queue_reply)
+{
+	int connection_socket_fd = session->connection_socket_fd;
+	struct otp_request_timing timing = {.started_ns = otp_current_time_ns()};
+	int tag;
+	int message_size;
+	char *message;
+	char *key;
+
+	if (!otp_receive_frame_header(connection_socket_fd, &tag) ||
+		!otp_receive_frame_header(connection_socket_fd, &message_size))
+	{
+		fprintf(stderr, "SERVER: ERROR receiving message size\n");
+		otp_record_error(server->stats, OTP_ERROR_RECEIVE);
+		return false;
+	}
+	if (message_size < 0)
+	{
+		fprintf(stderr, "SERVER: ERROR- invalid message size\n");
+		otp_record_error(server->stats, OTP_ERROR_PROTOCOL);
+		return false;
+	}
+	long long reserved_bytes = 2LL * otp_buffer_capacity((size_t)message_size + 1);
+	int received = 0;
+	if (otp_reserve_request_memory(server, 0, reserved_bytes))
+	{
+		received = receive_message_and_key(server, connection_socket_fd, session->encoding, &message_size, &message,
+										   &key, &reserved_bytes);
+		if (received <= 0)
+		{
+			otp_release_buffered_bytes(server->stats, reserved_bytes);
+		}
+	}
+	else if (!discard_refused_request(server, connection_socket_fd, session->encoding, message_size, true))
+	{
+		received = -1;
+	}
+	if (received < 0)
+	{
+		return false;
+	}
+	if (received == 0)
+	{
+		// earlier requests may still be answered by the cipher threads
+		pthread_mutex_t *send_lock = queue_reply ? &session->send_lock : NULL;
+		if (send_lock)
+		{
+			pthread_mutex_lock(send_lock);
+		}
+		bool refused = refuse_tagged_request(connection_socket_fd, tag, OTP_REPLY_BUSY);
+		if (send_lock)
+		{
+			pthread_mutex_unlock(send_lock);
+		}
+		return refused;
+	}
+	timing.received_ns = otp_current_time_ns();
+
+	if (!queue_reply)
+	{
+		char *result = otp_allocate_buffer(message_size + 1);
+		bool succeeded = result != NULL;
+		if (!succeeded)
+		{
+			fprintf(stderr, "SERVER: ERROR allocating memory for result\n");
+			otp_record_error(server->stats, OTP_ERROR_MEMORY);
+		}
+		else if (!otp_apply_cipher(server, message, key, result, message_size))
+		{
+			timing.ciphered_ns = otp_current_time_ns();
+			refuse_tagged_request(connection_socket_fd, tag, OTP_REPLY_BAD_CHARACTER);
+			otp_finish_request_timing(server, OTP_REQUEST_TAGGED, message_size, &timing, false);
+			succeeded = false;
+		}
+		else
+		{
+			timing.ciphered_ns = otp_current_time_ns();
+			succeeded = otp_send_tagged_message(connection_socket_fd, tag, result, message_size, session->encoding) == 0;
+			otp_finish_request_timing(server, OTP_REQUEST_TAGGED, message_size, &timing, succeeded);
+			if (!succeeded)
+			{
+				fprintf(stderr, "SERVER: ERROR sending message\n");
+				otp_record_error(server->stats, OTP_ERROR_SEND);
+			}
+		}
+		if (succeeded)
+		{
+			otp_record_request(server->stats);
+			otp_record_transfer(server->stats, 2LL * message_size, message_size);
+		}
+		otp_free_buffer(message);
+		otp_free_buffer(key);
+		otp_free_buffer(result);
+		otp_release_buffered_bytes(server->stats, reserved_bytes);
+		return succeeded;
+	}
+
+	// keep at most OTP_PIPELINE_MAX_IN_FLIGHT requests of this connection in memory
+	pthread_mutex_lock(&session->lock);
+	while (session->in_flight >= OTP_PIPELINE_MAX_IN_FLIGHT && !session->failed)
+	{
+		pthread_cond_wait(&session->answered, &session->lock);
+	}
+	bool failed = session->failed;
+	if (!failed)
+	{
+		session->in_flight++;
+	}
+	pthread_mutex_unlock(&session->lock);
+	if (failed)
+	{
+		otp_free_buffer(message);
+		otp_free_buffer(key);
+		otp_release_buffered_bytes(server->stats, reserved_bytes);
+		return false;
+	}
+
+	// queue the request, waiting while every cipher thread is busy and the queue is full
+	pthread_mutex_lock(&tagged_queue.lock);
+	while (tagged_queue.count == TAGGED_JOB_QUEUE_CAPACITY)
+	{
+		pthread_cond_wait(&tagged_queue.not_full, &tagged_queue.lock);
+	}
+	int tail = (tagged_queue.head + tagged_queue.count) % TAGGED_JOB_QUEUE_CAPACITY;
+	tagged_queue.jobs[tail] = (struct tagged_job){session, tag, message, key, message_size, reserved_bytes, timing};
+	tagged_queue.count++;
+	pthread_cond_signal(&tagged_queue.not_empty);
+	pthread_mutex_unlock(&tagged_queue.lock);
+	return true;
+}
+
+/**
+ * Refuses a tagged request: sends its tag, then the error in place of the result size. In the threads model
+ * the caller holds the send lock.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param tag: int, tag of the request
+ * @param error: int, the reason, e.g. OTP_REPLY_BAD_CHARACTER
+ * @return bool, true if the refusal was sent
+ */
+static bool refuse_tagged_request(int connection_socket_fd, int tag, int error)
+{
+	int refusal[2] = {htonl(tag), htonl(error)};
+	return otp_send_all(connection_socket_fd, refusal, sizeof(refusal)) == 0;
+}
+
+/**
+ * Waits until every tagged request of a session has been answered.
+ * @param session: pointer to the session
+ * @return bool, false if one of the replies could not be sent
+ */
+static bool wait_for_tagged_replies(struct tagged_session *session)
+{
+	pthread_mutex_lock(&session->lock);
+	while (session->in_flight > 0)
+	{
+		pthread_cond_wait(&session->answered, &session->lock);
+	}
+	bool succeeded = !session->failed;
+	pthread_mutex_unlock(&session->lock);
+	return succeeded;
+}
+
+/**
+ * Serves a stream request: receives one chunk of message and key at a time, and sends its result
+ * before receiving the next, so memory use is fixed and the first result leaves after one chunk.
+ * @param server: pointer to the server
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @return bool, true if every chunk was answered, including the terminating one
+ */
+static bool serve_stream_request(const struct otp_server *server, int connection_socket_fd)
+{
+	char *chunk = otp_allocate_buffer(2 * OTP_STREAM_CHUNK_SIZE);			// message characters, then key characters
+	char *reply = otp_allocate_buffer(sizeof(int) + OTP_STREAM_CHUNK_SIZE); // result size, then result characters
+	bool succeeded = false;
+
+	if (!chunk || !reply)
+	{
+		fprintf(stderr, "SERVER: ERROR allocating memory for stream\n");
+		otp_record_error(server->stats, OTP_ERROR_MEMORY);
+		otp_free_buffer(chunk);
+		otp_free_buffer(reply);
+		return false;
+	}
+
+	while (true)
+	{
+		int chunk_size;
+		struct otp_request_timing timing;
+		if (!otp_receive_frame_header(connection_socket_fd, &chunk_size))
+		{
+			fprintf(stderr, "SERVER: ERROR receiving chunk size\n");
+			otp_record_error(server->stats, OTP_ERROR_RECEIVE);
+			break;
+		}
+		if (chunk_size < 0 || chunk_size > OTP_STREAM_CHUNK_SIZE)
+		{
+			fprintf(stderr, "SERVER: ERROR- invalid chunk size\n");
+			otp_record_error(server->stats, OTP_ERROR_PROTOCOL);
+			break;
+		}
+		timing.started_ns = otp_current_time_ns();
+		if (!otp_receive_all(connection_socket_fd, chunk, 2 * chunk_size))
+		{
+			fprintf(stderr, "SERVER: ERROR receiving chunk\n");
+			otp_record_error(server->stats, OTP_ERROR_RECEIVE);
+			break;
+		}
+		timing.received_ns = otp_current_time_ns();
+
+		// answer the chunk (a chunk of size 0 ends the request and is echoed)
+		int converted_size = htonl(chunk_size);
+		memcpy(reply, &converted_size, sizeof(int));
+		bool answered = otp_apply_cipher(server, chunk, chunk + chunk_size, reply + sizeof(int), chunk_size);
+		timing.ciphered_ns = otp_current_time_ns();
+		if (!answered)
+		{
+			otp_send_error_reply(connection_socket_fd, OTP_REPLY_BAD_CHARACTER);
+			otp_finish_request_timing(server, OTP_REQUEST_STREAM, chunk_size, &timing, false);
+			break;
+		}
+		answered = otp_send_all(connection_socket_fd, reply, sizeof(int) + chunk_size) == 0;
+		otp_finish_request_timing(server, OTP_REQUEST_STREAM, chunk_size, &timing, answered);
+		if (!answered)
+		{
+			fprintf(stderr, "SERVER: ERROR sending message\n");
+			otp_record_error(server->stats, OTP_ERROR_SEND);
+			break;
+		}
+		otp_record_transfer(server->stats, 2LL * chunk_size, chunk_size);
+		if (chunk_size == 0)
+		{
+			succeeded = true;
+			break;
+		}
+	}
+
+	otp_free_buffer(chunk);
+	otp_free_buffer(reply);
+	return succeeded;
+}
+
+/**
+ * Serves a pad upload: receives the pad straight into the shared pad store (unpacking it there if the
+ * session is packed), and replies with its ID.
+ * @param server: pointer to the server
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param encoding: int, the session's wire encoding
+ * @return bool, true if the pad was stored and its ID sent to the client
+ */
+static bool serve_pad_upload(const struct otp_server *server, int connection_socket_fd, int encoding)
+{
+	int pad_size;
+	int pad_id;
+	if (!otp_receive_frame_header(connection_socket_fd, &pad_size))
+	{
+		fprintf(stderr, "SERVER: ERROR receiving message size\n");
+		otp_record_error(server->stats, OTP_ERROR_RECEIVE);
+		return false;
+	}
+	struct otp_request_timing timing = {.started_ns = otp_current_time_ns()};
+
+	char *pad = otp_reserve_pad(server->pad_store, pad_size, &pad_id);
+	if (!pad)
+	{
+		fprintf(stderr, errno == ENOSPC ? "SERVER: ERROR- pad store is full\n" : "SERVER: ERROR- invalid pad size\n");
+		otp_record_error(server->stats, errno == ENOSPC ? OTP_ERROR_PAD : OTP_ERROR_PROTOCOL);
+		return false;
+	}
+	if (!otp_receive_all(connection_socket_fd, pad, otp_encoded_size(encoding, pad_size)))
+	{
+		fprintf(stderr, "SERVER: ERROR receiving pad\n");
+		otp_record_error(server->stats, OTP_ERROR_RECEIVE);
+		otp_discard_pad(server->pad_store, pad_id);
+		return false;
+	}
+	if (encoding == OTP_ENCODING_PACKED && !otp_unpack_characters(pad, pad_size, pad))
+	{
+		fprintf(stderr, "SERVER: ERROR- invalid packed message\n");
+		otp_record_error(server->stats, OTP_ERROR_PROTOCOL);
+		otp_discard_pad(server->pad_store, pad_id);
+		return false;
+	}
+	otp_publish_pad(server->pad_store, pad_id);
+	timing.received_ns = timing.ciphered_ns = otp_current_time_ns(); // a pad is only stored
+
+	int converted_id = htonl(pad_id);
+	bool succeeded = otp_send_all(connection_socket_fd, &converted_id, sizeof(int)) == 0;
+	otp_finish_request_timing(server, OTP_REQUEST_PAD_UPLOAD, pad_size, &timing, succeeded);
+	if (!succeeded)
+	{
+		fprintf(stderr, "SERVER: ERROR sending message\n");
+		otp_record_error(server->stats, OTP_ERROR_SEND);
+		return false;
+	}
+	otp_record_transfer(server->stats, pad_size, 0);
+	return true;
+}
+
+/**
+ * Serves a pad request: receives the pad ID, offset and message, and answers with the result of the
+ * server's cipher keyed by that range of the stored pad. The range is marked as used first, so it can
+ * never key another request.
+ * @param server: pointer to the server
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param encoding: int, the session's wire encoding
+ * @return bool, true if the result was sent to the client, or the request was refused as busy
+ */
+static bool serve_pad_request(const struct otp_server *server, int connection_socket_fd, int encoding)
+{
+	struct otp_request_timing timing = {.started_ns = otp_current_time_ns()};
+	int pad_id;
+	int offset;
+	int message_size;
+	if (!otp_receive_frame_header(connection_socket_fd, &pad_id) ||
+		!otp_receive_frame_header(connection_socket_fd, &offset) ||
+		!otp_receive_frame_header(connection_socket_fd, &message_size))
+	{
+		fprintf(stderr, "SERVER: ERROR receiving message size\n");
+		otp_record_error(server->stats, OTP_ERROR_RECEIVE);
+		return false;
+	}
+	// the key is in the pad store, and the result replaces the message
+	long long reserved_bytes = message_size >= 0 ? (long long)otp_buffer_capacity((size_t)message_size + 1) : 0;
+	if (!otp_reserve_request_memory(server, 0, reserved_bytes))
+	{
+		return discard_refused_request(server, connection_socket_fd, encoding, message_size, false) &&
+			   otp_send_error_reply(connection_socket_fd, OTP_REPLY_BUSY) == 0;
+	}
+
+	char *message = otp_receive_encoded_message_body(connection_socket_fd, &message_size, encoding);
+	if (!message)
+	{
+		fprintf(stderr, "SERVER: ERROR receiving message\n");
+		otp_record_error(server->stats, OTP_ERROR_RECEIVE);
+		otp_release_buffered_bytes(server->stats, reserved_bytes);
+		return false;
+	}
+
+	const char *key = otp_use_pad(server->pad_store, pad_id, offset, message_size);
+	if (!key)
+	{
+		fprintf(stderr, "SERVER: ERROR- pad range unavailable\n");
+		otp_record_error(server->stats, OTP_ERROR_PAD);
+		otp_free_buffer(message);
+		otp_release_buffered_bytes(server->stats, reserved_bytes);
+		return false;
+	}
+
+	// the result replaces the message, so no other buffer is needed
+	timing.received_ns = otp_current_time_ns();
+	bool succeeded = otp_apply_cipher(server, message, key, message, message_size);
+	timing.ciphered_ns = otp_current_time_ns();
+	otp_finish_pad_use(server->pad_store, pad_id);
+	if (!succeeded)
+	{
+		otp_send_error_reply(connection_socket_fd, OTP_REPLY_BAD_CHARACTER);
+	}
+	else if (otp_send_encoded_message(connection_socket_fd, message, message_size, encoding) < 0)
+	{
+		fprintf(stderr, "SERVER: ERROR sending message\n");
+		otp_record_error(server->stats, OTP_ERROR_SEND);
+		succeeded = false;
+	}
+	else
+	{
+		otp_record_request(server->stats);
+		otp_record_transfer(server->stats, message_size, message_size);
+	}
+	otp_finish_request_timing(server, OTP_REQUEST_PAD_REQUEST, message_size, &timing, succeeded);
+	otp_free_buffer(message);
+	otp_release_buffered_bytes(server->stats, reserved_bytes);
+	return succeeded;
+}
+
+/**
+ * Serves an encoding request: receives the wire encoding the client asks for, and replies with the one the
+ * session will use from now on (the one asked for if it is supported, plain text otherwise).
+ * @param server: pointer to the server
+ * @param session: pointer to the connection's session, whose encoding is updated
+ * @return bool, true if the reply was sent to the client
+ */
+static bool serve_encoding_request(const struct otp_server *server, struct tagged_session *session)
+{
+	int encoding;
+	if (!otp_receive_frame_header(session->connection_socket_fd, &encoding))
+	{
+		fprintf(stderr, "SERVER: ERROR receiving encoding\n");
+		otp_record_error(server->stats, OTP_ERROR_RECEIVE);
+		return false;
+	}
+
+	session->encoding = otp_encoding_supported(encoding) ? encoding : OTP_ENCODING_TEXT;
+	int converted_encoding = htonl(session->encoding);
+	if (otp_send_all(session->connection_socket_fd, &converted_encoding, sizeof(int)) < 0)
+	{
+		fprintf(stderr, "SERVER: ERROR sending message\n");
+		otp_record_error(server->stats, OTP_ERROR_SEND);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Serves a pad release: receives the ID of a stored pad the client is done with, retires the pad so its room
+ * can take another one, and replies with 0.
+ * @param server: pointer to the server
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @return bool, true if the reply was sent
+ */
+static bool serve_pad_release(const struct otp_server *server, int connection_socket_fd)
+{
+	int pad_id;
+	if (!otp_receive_frame_header(connection_socket_fd, &pad_id))
+	{
+		fprintf(stderr, "SERVER: ERROR receiving pad ID\n");
+		otp_record_error(server->stats, OTP_ERROR_RECEIVE);
+		return false;
+	}
+	otp_retire_pad(server->pad_store, pad_id);
+
+	int reply = 0;
+	if (otp_send_all(connection_socket_fd, &reply, sizeof(int)) < 0)
+	{
+		fprintf(stderr, "SERVER: ERROR sending message\n");
+		otp_record_error(server->stats, OTP_ERROR_SEND);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Raises the soft limit on open file descriptors to the hard limit, for the worker models
+ * that keep one descriptor open per connection in a single process.
+ */
+void otp_raise_file_descriptor_limit(void)
+{
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+/**
+ * Signal handler for SIGINT and SIGTERM; asks the accept loop to stop.
+ * @param signal_number: int, the signal received
+ */
+static void handle_stop_signal(int signal_number)
+{
+	(void)signal_number;
+	otp_stop_requested = 1;
+}
+
+/**
+ * Signal handler for SIGCHLD in the fork model; reaps every child that has exited, as soon as it exits, so
+ * none is left a zombie however long the server waits for its next connection.
+ * @param signal_number: int, the signal received
+ */
+static void reap_children(int signal_number)
+{
+	(void)signal_number;
+	int saved_errno = errno; // the interrupted code may be about to read errno
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+		;
+	errno = saved_errno;
+}
+
+/**
+ * Installs the stop signal handlers and ignores SIGPIPE, so a client that disconnects
+ * early makes send() fail instead of killing the process (and every thread in it).
+ * SA_RESTART is deliberately not set, so a blocked accept() returns when a stop is requested.
+ */
+static void install_signal_handlers(void)
+{
+	struct sigaction stop_action;
+	memset(&stop_action, 0, sizeof(stop_action));
+	stop_action.sa_handler = handle_stop_signal;
+	sigemptyset(&stop_action.sa_mask);
+	sigaction(SIGINT, &stop_action, NULL);
+	sigaction(SIGTERM, &stop_action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+}
+
+/**
+ * Runs the original worker model: a new child process is forked for every accepted connection, up to
+ * --max-connections children at once. Children are reaped by a SIGCHLD handler as they exit.
+ * @param server: pointer to the server
+ */
+static void run_fork_server(struct otp_server *server)
+{
+	// SA_RESTART, so the helper threads' system calls are not interrupted by every child that exits
+	struct sigaction child_action;
+	memset(&child_action, 0, sizeof(child_action));
+	child_action.sa_handler = reap_children;
+	child_action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&child_action.sa_mask);
+	sigaction(SIGCHLD, &child_action, NULL);
+
+	while (!otp_stop_requested)
+	{
+		// accept the connection request, which creates a connection socket
+		int connection_socket_fd = accept_connection(server);
+		if (connection_socket_fd < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue; // interrupted by a signal; re-check otp_stop_requested
+			}
+			fprintf(stderr, "SERVER: ERROR on accept\n");
+			exit(1);
+		}
+		long long accepted_at_us = otp_record_accept(server->stats);
+		if (!otp_admit_connection(server))
+		{
+			otp_refuse_connection(connection_socket_fd);
+			continue;
+		}
+
+		pid_t child_PID = fork(); // create new process
+
+		switch (child_PID)
+		{
+		case -1:
+			perror("fork() failed\n");
+			exit(1);
+			break;
+
+		case 0: // child process
+			signal(SIGINT, SIG_DFL);
+			signal(SIGTERM, SIG_DFL);
+			server->pid = getpid();
+			for (int i = 0; i < server->listening_socket_count; i++)
+			{
+				close(server->listening_socket_fds[i]);
+			}
+			if (server->metrics_address)
+			{
+				close(server->metrics_socket_fd);
+			}
+			forget_refused_connections();
+			otp_record_connection(server->stats, accepted_at_us, otp_handle_client(server, connection_socket_fd));
+			otp_empty_buffer_pools(); // no longer counted against --max-buffered once the child is gone
+			_exit(0);				  // terminate child process
+
+		default:						 // parent process
+			close(connection_socket_fd); // close the connection socket for this client
+		}
+	}
+}
+
+/**
+ * Runs the prefork worker model: a fixed pool of long-lived child processes that each accept
+ * and serve connections in a loop. The parent only replaces workers that die. With --reuseport the
+ * epoll and io_uring models run here too, as one event loop per worker process.
+ * @param server: pointer to the server
+ */
+static void run_prefork_server(struct otp_server *server)
+{
+	pid_t *worker_PIDs = calloc(server->worker_count, sizeof(pid_t));
+	if (!worker_PIDs)
+	{
+		fprintf(stderr, "SERVER: ERROR allocating memory for workers\n");
+		exit(1);
+	}
+
+	while (!otp_stop_requested)
+	{
+		// start (or restart) any worker that is not running
+		for (int i = 0; i < server->worker_count; i++)
+		{
+			if (worker_PIDs[i] > 0)
+			{
+				continue;
+			}
+
+			pid_t child_PID = fork();
+			if (child_PID == -1)
+			{
+				perror("fork() failed\n");
+				exit(1);
+			}
+			if (child_PID == 0)
+			{
+				run_prefork_worker(server, i); // never returns
+			}
+			worker_PIDs[i] = child_PID;
+		}
+
+		// sleep until a worker exits or a stop is requested
+		pid_t exited_PID = wait(NULL);
+		for (int i = 0; i < server->worker_count; i++)
+		{
+			if (exited_PID > 0 && worker_PIDs[i] == exited_PID)
+			{
+				worker_PIDs[i] = 0;
+			}
+		}
+	}
+
+	// stop the workers
+	for (int i = 0; i < server->worker_count; i++)
+	{
+		if (worker_PIDs[i] > 0)
+		{
+			kill(worker_PIDs[i], SIGTERM);
+		}
+	}
+	while (wait(NULL) > 0)
+		;
+	free(worker_PIDs);
+}
+
+/**
+ * Main loop of a prefork worker process. The kernel hands each connection to exactly one
+ * of the workers blocked in accept() on the shared listening socket. With --reuseport every worker
+ * but the first replaces the TCP socket with one of its own on the same port, so the kernel spreads
+ * connections across the workers' sockets instead of waking them all on one, and an epoll or io_uring
+ * worker runs its event loop over its own socket.
+ * @param server: pointer to the server
+ * @param index: int, the worker's number, from 0
+ */
+static void run_prefork_worker(struct otp_server *server, int index)
+{
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	server->pid = getpid();
+	if (server->metrics_address)
+	{
+		close(server->metrics_socket_fd); // served by the parent
+	}
+	if (server->pin_cpus)
+	{
+		pin_worker_to_cpu(index);
+	}
+	if (server->reuse_port && index > 0)
+	{
+		// the first worker keeps the socket the parent opened, which also holds the port while workers restart
+		int inherited_socket_fd = server->listening_socket_fds[0];
+		server->listening_socket_fds[0] = open_listening_socket(server->port_number, server->listen_backlog, true);
+		fcntl(server->listening_socket_fds[0], F_SETFL, fcntl(inherited_socket_fd, F_GETFL));
+		close(inherited_socket_fd);
+	}
+	if (server->mode == OTP_MODE_EPOLL)
+	{
+		otp_run_event_loop_server(server);
+		_exit(0);
+	}
+#ifdef USE_IO_URING
+	if (server->mode == OTP_MODE_IO_URING)
+	{
+		otp_run_uring_server(server);
+		_exit(0);
+	}
+#endif
+
+	while (true)
+	{
+		int connection_socket_fd = accept_connection(server);
+		if (connection_socket_fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
+			fprintf(stderr, "SERVER: ERROR on accept\n");
+			_exit(1);
+		}
+		long long accepted_at_us = otp_record_accept(server->stats);
+		if (!otp_admit_connection(server))
+		{
+			otp_refuse_connection(connection_socket_fd);
+			continue;
+		}
+		otp_record_connection(server->stats, accepted_at_us, otp_handle_client(server, connection_socket_fd));
+	}
+}
+
+/**
+ * Pins the calling worker process to one of the CPUs it may run on: worker i to the i-th of them,
+ * wrapping around when there are more workers than CPUs. A worker that stays on one CPU keeps its
+ * caches warm, and with --reuseport the connections on its socket are served where they arrive.
+ * @param index: int, the worker's number, from 0
+ */
+static void pin_worker_to_cpu(int index)
+{
+	cpu_set_t allowed_cpus;
+	if (sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus) < 0)
+	{
+		fprintf(stderr, "SERVER: ERROR reading CPU affinity\n");
+		return;
+	}
+	int position = index % CPU_COUNT(&allowed_cpus);
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (CPU_ISSET(cpu, &allowed_cpus) && position-- == 0)
+		{
+			cpu_set_t worker_cpu;
+			CPU_ZERO(&worker_cpu);
+			CPU_SET(cpu, &worker_cpu);
+			if (sched_setaffinity(0, sizeof(worker_cpu), &worker_cpu) < 0)
+			{
+				fprintf(stderr, "SERVER: ERROR pinning worker %d to CPU %d\n", index, cpu);
+			}
+			return;
+		}
+	}
+}
+
+/**
+ * Runs the thread pool worker model: the calling thread accepts connections and queues them
+ * for a fixed pool of worker threads.
+ * @param server: pointer to the server
+ */
+static void run_thread_server(struct otp_server *server)
+{
+	pthread_mutex_init(&queue.lock, NULL);
+	pthread_cond_init(&queue.not_empty, NULL);
+	pthread_cond_init(&queue.not_full, NULL);
+	pthread_mutex_init(&tagged_queue.lock, NULL);
+	pthread_cond_init(&tagged_queue.not_empty, NULL);
+	pthread_cond_init(&tagged_queue.not_full, NULL);
+
+	// block the stop signals in the workers, so they are always delivered to this (accepting) thread
+	sigset_t stop_signals, previous_signals;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, &previous_signals);
+
+	// each worker thread serves one connection at a time; each cipher thread answers tagged requests
+	// from any connection
+	for (int i = 0; i < 2 * server->worker_count; i++)
+	{
+		pthread_t worker_thread;
+		void *(*start)(void *) = i < server->worker_count ? connection_worker_thread : cipher_worker_thread;
+		if (pthread_create(&worker_thread, NULL, start, server) != 0)
+		{
+			fprintf(stderr, "SERVER: ERROR creating worker thread\n");
+			exit(1);
+		}
+		pthread_detach(worker_thread);
+	}
+	pthread_sigmask(SIG_SETMASK, &previous_signals, NULL);
+
+	while (!otp_stop_requested)
+	{
+		int connection_socket_fd = accept_connection(server);
+		if (connection_socket_fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
+			fprintf(stderr, "SERVER: ERROR on accept\n");
+			exit(1);
+		}
+		long long accepted_at_us = otp_record_accept(server->stats);
+		if (!otp_admit_connection(server))
+		{
+			otp_refuse_connection(connection_socket_fd); // queued connections count as active, so the limit
+			continue;									 // also bounds the wait for a worker
+		}
+
+		// queue the connection, waiting while every worker is busy and the queue is full
+		pthread_mutex_lock(&queue.lock);
+		while (queue.count == CONNECTION_QUEUE_CAPACITY)
+		{
+			pthread_cond_wait(&queue.not_full, &queue.lock);
+		}
+		int tail = (queue.head + queue.count) % CONNECTION_QUEUE_CAPACITY;
+		queue.connection_fds[tail] = connection_socket_fd;
+		queue.accepted_at_us[tail] = accepted_at_us;
+		queue.count++;
+		pthread_cond_signal(&queue.not_empty);
+		pthread_mutex_unlock(&queue.lock);
+	}
+}
+
+/**
+ * Main loop of a worker thread: takes connections off the queue and serves them.
+ * @param argument: pointer to the server
+ * @return NULL (never returns)
+ */
+static void *connection_worker_thread(void *argument)
+{
+	struct otp_server *server = argument;
+
+	while (true)
+	{
+		pthread_mutex_lock(&queue.lock);
+		while (queue.count == 0)
+		{
+			pthread_cond_wait(&queue.not_empty, &queue.lock);
+		}
+		int connection_socket_fd = queue.connection_fds[queue.head];
+		long long accepted_at_us = queue.accepted_at_us[queue.head];
+		queue.head = (queue.head + 1) % CONNECTION_QUEUE_CAPACITY;
+		queue.count--;
+		pthread_cond_signal(&queue.not_full);
+		pthread_mutex_unlock(&queue.lock);
+
+		otp_record_connection(server->stats, accepted_at_us, otp_handle_client(server, connection_socket_fd));
+	}
+	return NULL;
+}
+
+/**
+ * Main loop of a cipher thread: takes tagged requests off the queue, applies the server's cipher, and
+ * sends each reply as soon as it is ready, whatever the order the requests arrived in.
+ * @param argument: pointer to the server
+ * @return NULL (never returns)
+ */
+static void *cipher_worker_thread(void *argument)
+{
+	struct otp_server *server = argument;
+	long long cpu_started_ns = otp_thread_cpu_time_ns();
+
+	while (true)
+	{
+		pthread_mutex_lock(&tagged_queue.lock);
+		while (tagged_queue.count == 0)
+		{
+			pthread_cond_wait(&tagged_queue.not_empty, &tagged_queue.lock);
+		}
+		struct tagged_job job = tagged_queue.jobs[tagged_queue.head];
+		tagged_queue.head = (tagged_queue.head + 1) % TAGGED_JOB_QUEUE_CAPACITY;
+		tagged_queue.count--;
+		pthread_cond_signal(&tagged_queue.not_full);
+		pthread_mutex_unlock(&tagged_queue.lock);
+
+		struct tagged_session *session = job.session;
+		job.timing.received_ns = otp_current_time_ns(); // so the receive phase includes the wait in the queue
+		char *result = otp_allocate_buffer(job.message_size + 1);
+		bool succeeded = result != NULL;
+		if (!succeeded)
+		{
+			fprintf(stderr, "SERVER: ERROR allocating memory for result\n");
+			otp_record_error(server->stats, OTP_ERROR_MEMORY);
+		}
+		else if (!otp_apply_cipher(server, job.message, job.key, result, job.message_size))
+		{
+			job.timing.ciphered_ns = otp_current_time_ns();
+			pthread_mutex_lock(&session->send_lock);
+			refuse_tagged_request(session->connection_socket_fd, job.tag, OTP_REPLY_BAD_CHARACTER);
+			pthread_mutex_unlock(&session->send_lock);
+			otp_finish_request_timing(server, OTP_REQUEST_TAGGED, job.message_size, &job.timing, false);
+			shutdown(session->connection_socket_fd, SHUT_RD); // wakes the connection's thread to end the session
+			succeeded = false;
+		}
+		else
+		{
+			job.timing.ciphered_ns = otp_current_time_ns();
+			pthread_mutex_lock(&session->send_lock);
+			succeeded = otp_send_tagged_message(session->connection_socket_fd, job.tag, result, job.message_size,
+												session->encoding) == 0;
+			pthread_mutex_unlock(&session->send_lock);
+			otp_finish_request_timing(server, OTP_REQUEST_TAGGED, job.message_size, &job.timing, succeeded);
+			if (!succeeded)
+			{
+				fprintf(stderr, "SERVER: ERROR sending message\n");
+				otp_record_error(server->stats, OTP_ERROR_SEND);
+			}
+		}
+		if (succeeded)
+		{
+			otp_record_request(server->stats);
+			otp_record_transfer(server->stats, 2LL * job.message_size, job.message_size);
+		}
+		otp_free_buffer(job.message);
+		otp_free_buffer(job.key);
+		otp_free_buffer(result);
+		otp_release_buffered_bytes(server->stats, job.reserved_bytes);
+		cpu_started_ns = otp_record_cpu_time(server->stats, cpu_started_ns); // waiting for a job takes none
+
+		pthread_mutex_lock(&session->lock);
+		session->failed = session->failed || !succeeded;
+		session->in_flight--;
+		pthread_cond_broadcast(&session->answered);
+		pthread_mutex_unlock(&session->lock);
+	}
+	return NULL;
+}
+
+/**
+ * Creates the shared memory request ring and starts the thread that serves it. The thread runs next to any
+ * worker model, in the server's first process, with the stop signals blocked so they still reach the
+ * accepting thread.
+ * @param server: pointer to the server, whose ring is filled in (exits on failure)
+ */
+static void start_shm_ring_thread(struct otp_server *server)
+{
+	server->shm_ring = otp_create_shm_ring(server->shm_name, server->role->client_type);
+	if (!server->shm_ring)
+	{
+		fprintf(stderr, "SERVER: ERROR creating shared memory ring %s (%s)\n", server->shm_name, strerror(errno));
+		exit(1);
+	}
+
+	sigset_t stop_signals, previous_signals;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, &previous_signals);
+	pthread_t ring_thread;
+	if (pthread_create(&ring_thread, NULL, shm_ring_thread, server) != 0)
+	{
+		fprintf(stderr, "SERVER: ERROR creating shared memory ring thread\n");
+		exit(1);
+	}
+	pthread_detach(ring_thread);
+	pthread_sigmask(SIG_SETMASK, &previous_signals, NULL);
+}
+
+/**
+ * Main loop of the shared memory ring thread: takes submitted requests in order, and replaces each message
+ * with the result of the server's cipher, keyed by the pad range the request names, in its slot. Its CPU
+ * time is added to the statistics once per lap of the ring.
+ * @param argument: pointer to the server
+ * @return NULL (never returns)
+ */
+static void *shm_ring_thread(void *argument)
+{
+	struct otp_server *server = argument;
+	long long cpu_started_ns = otp_thread_cpu_time_ns();
+	unsigned long served = 0;
+
+	while (true)
+	{
+		struct otp_shm_request request;
+		char *message = otp_next_shm_request(server->shm_ring, &request);
+		struct otp_request_timing timing = {.started_ns = otp_current_time_ns()};
+		timing.received_ns = timing.started_ns; // the message is already in the slot
+		int status = request.length;
+		const char *key = NULL;
+		if (request.length < 0 || request.length > OTP_SHM_SLOT_SIZE)
+		{
+			fprintf(stderr, "SERVER: ERROR- bad message size in shared memory request\n");
+			otp_record_error(server->stats, OTP_ERROR_PROTOCOL);
+			status = -EINVAL;
+		}
+		else if (!(key = otp_use_pad(server->pad_store, request.pad_id, request.offset, request.length)))
+		{
+			fprintf(stderr, "SERVER: ERROR- pad range unavailable\n");
+			otp_record_error(server->stats, OTP_ERROR_PAD);
+			status = -errno;
+		}
+		else
+		{
+			if (!otp_apply_cipher(server, message, key, message, request.length))
+			{
+				status = -EILSEQ;
+			}
+			timing.ciphered_ns = otp_current_time_ns();
+			otp_finish_pad_use(server->pad_store, request.pad_id);
+		}
+		if (status >= 0)
+		{
+			otp_record_request(server->stats);
+			otp_record_transfer(server->stats, request.length, request.length);
+		}
+		otp_complete_shm_request(server->shm_ring, &request, status);
+		if (key)
+		{
+			otp_finish_request_timing(server, OTP_REQUEST_SHM, request.length, &timing, status >= 0);
+		}
+		if (++served % OTP_SHM_RING_SLOTS == 0)
+		{
+			// reading the clock is a system call, which a request on the ring otherwise never makes
+			cpu_started_ns = otp_record_cpu_time(server->stats, cpu_started_ns);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Creates the trace ring and starts the thread that prints it whenever the server receives SIGUSR1. SIGUSR1 is
+ * blocked in the calling thread first, so every thread created and process forked afterwards leaves it to this
+ * thread's sigwait(), and printing happens outside any signal handler.
+ * @param server: pointer to the server, whose trace ring is filled in (exits on failure)
+ */
+static void start_trace_dump_thread(struct otp_server *server)
+{
+	server->trace_ring = otp_create_trace_ring(server->trace_capacity);
+	if (!server->trace_ring)
+	{
+		fprintf(stderr, "SERVER: ERROR allocating trace of %d requests\n", server->trace_capacity);
+		exit(1);
+	}
+
+	sigset_t dump_signal, previous_signals;
+	sigemptyset(&dump_signal);
+	sigaddset(&dump_signal, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &dump_signal, NULL);
+	sigset_t stop_signals;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, &previous_signals);
+	pthread_t dump_thread;
+	if (pthread_create(&dump_thread, NULL, trace_dump_thread, server) != 0)
+	{
+		fprintf(stderr, "SERVER: ERROR creating trace thread\n");
+		exit(1);
+	}
+	pthread_detach(dump_thread);
+	pthread_sigmask(SIG_SETMASK, &previous_signals, NULL);
+}
+
+/**
+ * Main loop of the trace thread: waits for SIGUSR1 and prints the trace ring to stderr each time it arrives.
+ * @param argument: pointer to the server
+ * @return NULL (never returns)
+ */
+static void *trace_dump_thread(void *argument)
+{
+	struct otp_server *server = argument;
+	sigset_t dump_signal;
+	sigemptyset(&dump_signal);
+	sigaddset(&dump_signal, SIGUSR1);
+
+	while (true)
+	{
+		int signal_number;
+		if (sigwait(&dump_signal, &signal_number) == 0)
+		{
+			otp_dump_trace_ring(server->trace_ring, stderr);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Prints the command line usage of the server to stderr.
+ * @param role: pointer to the role, for the program name
+ */
+static void print_usage(const struct otp_server_role *role)
+{
+	fprintf(stderr, "USAGE: %s [--mode fork|prefork|threads|epoll|io_uring] [--workers N] [--pad-store-size BYTES] [--socket PATH] [--shm NAME] [--metrics PORT|PATH] [--trace N] [--backlog N] [--reuseport] [--pin-cpus] [--max-connections N] [--max-buffered BYTES] port\n"
+					"   or: %s [options] --socket PATH\n",
+			role->program_name, role->program_name);
+}
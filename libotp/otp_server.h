@@ -0,0 +1,97 @@
+#ifndef OTP_SERVER_H
+#define OTP_SERVER_H
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h> // for SOMAXCONN
+#include "otp_cipher.h"
+#include "otp_pad_store.h"
+#include "otp_shm_ring.h"
+#include "otp_stats.h"
+#include "otp_trace.h"
+
+#define OTP_DEFAULT_LISTEN_BACKLOG SOMAXCONN // pending connections allowed to queue up (capped by net.core.somaxconn)
+#define OTP_DEFAULT_WORKER_COUNT 4 // number of workers used by the prefork and threads models
+#define OTP_MAX_LISTENING_SOCKETS 2 // a TCP port and a Unix domain socket
+#define OTP_REFUSAL_DRAIN_BYTES (16 << 20) // bytes a connection refused at accept may still send before it is closed
+#define OTP_REFUSAL_DRAIN_MS 100			   // how long it may take to send them
+#define OTP_MAX_DRAINING_CONNECTIONS 64		   // refused connections a blocking acceptor drains at once
+
+// what makes a server an encryption or a decryption server
+struct otp_server_role
+{
+	const char *program_name;	// name printed in the usage message, e.g. "enc_server"
+	const char *client_type;	// handshake the clients must send, e.g. OTP_ENCRYPT_CLIENT
+	otp_cipher_function cipher; // transforms the message with the key, e.g. otp_encrypt
+};
+
+// how accepted connections are handed to the code that serves them
+enum otp_worker_mode
+{
+	OTP_MODE_FORK,	  // fork a new child process for every connection (original behaviour)
+	OTP_MODE_PREFORK, // a fixed pool of long-lived processes that each call accept()
+	OTP_MODE_THREADS, // a single acceptor thread feeding a fixed pool of worker threads
+	OTP_MODE_EPOLL,	  // a single-threaded epoll event loop over non-blocking sockets
+	OTP_MODE_IO_URING // a single-threaded io_uring completion loop (only with IO_URING=1 ./build.sh)
+};
+
+// a running server: its role, configuration and shared statistics
+struct otp_server
+{
+	const struct otp_server_role *role;
+	enum otp_worker_mode mode;
+	const char *mode_name;
+	int worker_count;
+	int port_number;									  // TCP port, or -1 when only listening on a Unix domain socket
+	int listen_backlog;									  // pending connections each listening socket may queue
+	bool reuse_port;									  // each worker process listens on the port with its own socket
+	bool pin_cpus;										  // each worker process is pinned to a CPU of its own
+	int max_connections;								  // connections served at once before new ones are refused, or 0
+	long long max_buffered;								  // bytes held for requests before new ones are refused, or 0
+	const char *socket_path;							  // path of the Unix domain socket, or NULL for none
+	int listening_socket_fds[OTP_MAX_LISTENING_SOCKETS]; // the TCP port's socket and/or the Unix domain socket
+	int listening_socket_count;
+	size_t pad_store_size;			  // bytes reserved for uploaded pads
+	const char *shm_name;			  // shared memory name of the request ring, or NULL for none
+	const char *metrics_address;	  // port or Unix domain socket path of the metrics endpoint, or NULL for none
+	int metrics_socket_fd;			  // listening socket of the metrics endpoint
+	struct otp_server_stats *stats;	  // shared by every worker
+	struct otp_pad_store *pad_store; // shared by every worker
+	struct otp_shm_ring *shm_ring;	  // served by its own thread in the server's first process
+	int trace_capacity;				  // requests kept in the trace ring, or 0 for no trace
+	struct otp_trace_ring *trace_ring; // shared by every worker, printed on SIGUSR1
+	int pid;						  // process serving, as recorded in the trace (updated in forked workers)
+};
+
+// when a request reached each phase, for the phase histograms and the request trace
+struct otp_request_timing
+{
+	long long started_ns;  // its header had arrived
+	long long received_ns; // its message and key had arrived
+	long long ciphered_ns; // its result was ready
+};
+
+extern volatile sig_atomic_t otp_stop_requested; // set by SIGINT/SIGTERM
+
+int otp_run_server(int argument_count, char *argument_array[], const struct otp_server_role *role);
+bool otp_admit_connection(const struct otp_server *server);
+bool otp_reserve_request_memory(const struct otp_server *server, long long reserved, long long bytes);
+void otp_refuse_connection(int connection_socket_fd);
+bool otp_handle_client(const struct otp_server *server, int connection_socket_fd);
+bool otp_apply_cipher(const struct otp_server *server, const char *message, const char *key, char *result, int length);
+void otp_finish_request_timing(const struct otp_server *server, enum otp_request_type type, int size,
+							   const struct otp_request_timing *timing, bool succeeded);
+void otp_raise_file_descriptor_limit(void);
+
+// worker models that live in their own files
+void otp_run_event_loop_server(struct otp_server *server);
+#ifdef USE_IO_URING
+void otp_run_uring_server(struct otp_server *server);
+#endif
+
+// the Prometheus-style metrics endpoint, in otp_metrics.c
+void otp_start_metrics_endpoint(struct otp_server *server);
+void otp_stop_metrics_endpoint(const struct otp_server *server);
+
+#endif
@@ -0,0 +1,324 @@
+#include <string.h>
+#include <errno.h>
+#include <limits.h>		 // for INT_MAX
+#include <time.h>		 // for struct timespec
+#include <unistd.h>		 // for ftruncate, syscall
+#include <fcntl.h>		 // for O_CREAT
+#include <sys/mman.h>	 // for shm_open, mmap
+#include <sys/stat.h>	 // for fstat
+#include <sys/syscall.h> // for SYS_futex
+#include <linux/futex.h> // for FUTEX_WAIT
+#include "otp_shm_ring.h"
+
+#define SPIN_LIMIT 128				  // checks of a slot before going to sleep on it
+#define CALLER_WAKE_INTERVAL_NS 100000000 // a sleeping caller checks whether the server has stopped this often
+
+// function prototypes
+static void futex_wait(uint32_t *word, uint32_t expected, const struct timespec *timeout);
+static void futex_wake(uint32_t *word);
+static void relax(void);
+
+/**
+ * Creates the shared memory segment of a ring with every slot free, replacing any segment left under the name
+ * by an earlier run. Only the user running the server can attach to it.
+ * @param name: POSIX shared memory name, e.g. "/otp_enc"
+ * @param client_type: string, the client type callers must be, e.g. OTP_ENCRYPT_CLIENT
+ * @return struct otp_shm_ring *, the ring, or NULL with errno set if it could not be created
+ */
+struct otp_shm_ring *otp_create_shm_ring(const char *name, const char *client_type)
+{
+	shm_unlink(name);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600); // messages and results are secret
+	if (fd < 0)
+	{
+		return NULL;
+	}
+	if (ftruncate(fd, sizeof(struct otp_shm_ring)) < 0)
+	{
+		int truncate_error = errno;
+		close(fd);
+		shm_unlink(name);
+		errno = truncate_error;
+		return NULL;
+	}
+	struct otp_shm_ring *ring = mmap(NULL, sizeof(struct otp_shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED)
+	{
+		shm_unlink(name);
+		return NULL;
+	}
+
+	// a new segment is all zeros; slot i is free for position i
+	ring->slot_count = OTP_SHM_RING_SLOTS;
+	ring->slot_size = OTP_SHM_SLOT_SIZE;
+	strncpy(ring->client_type, client_type, OTP_HANDSHAKE_LENGTH);
+	for (uint32_t i = 0; i < OTP_SHM_RING_SLOTS; i++)
+	{
+		ring->slots[i].sequence = i;
+	}
+	__atomic_store_n(&ring->magic, OTP_SHM_RING_MAGIC, __ATOMIC_RELEASE);
+	return ring;
+}
+
+/**
+ * Marks a ring as closed, so callers stop waiting for replies that will never come, and removes its name so no
+ * new caller can attach. The mapping is left in place for a server thread that may still be using it.
+ * @param ring: pointer to the ring
+ * @param name: the name it was created under
+ */
+void otp_close_shm_ring(struct otp_shm_ring *ring, const char *name)
+{
+	__atomic_store_n(&ring->closed, 1, __ATOMIC_SEQ_CST);
+	for (int i = 0; i < OTP_SHM_RING_SLOTS; i++)
+	{
+		futex_wake(&ring->slots[i].sequence);
+	}
+	shm_unlink(name);
+}
+
+/**
+ * Waits for the next request to be submitted, in the order the slots were claimed. For the server's single
+ * ring thread only. The request's fields are copied out of the slot, so a caller cannot change them later.
+ * @param ring: pointer to the ring
+ * @param request: pointer to where the request is stored
+ * @return char *, the slot's data, holding request->length characters of message, to be replaced by the result
+ */
+char *otp_next_shm_request(struct otp_shm_ring *ring, struct otp_shm_request *request)
+{
+	uint32_t position = ring->head;
+	struct otp_shm_slot *slot = &ring->slots[position % OTP_SHM_RING_SLOTS];
+	for (int spin = 0; __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != position + 1; spin++)
+	{
+		if (spin < SPIN_LIMIT)
+		{
+			relax();
+			continue;
+		}
+
+		// announce the sleep before the last check, so a caller submitting now either is seen here or sees it
+		__atomic_store_n(&ring->server_sleeping, 1, __ATOMIC_SEQ_CST);
+		uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST);
+		if (sequence != position + 1)
+		{
+			futex_wait(&slot->sequence, sequence, NULL);
+		}
+		__atomic_store_n(&ring->server_sleeping, 0, __ATOMIC_RELAXED);
+	}
+
+	*request = (struct otp_shm_request){position, slot->pad_id, slot->offset, slot->length};
+	ring->head = position + 1;
+	return ring->data[position % OTP_SHM_RING_SLOTS];
+}
+
+/**
+ * Hands a request's slot back to its caller with the result in place, waking the caller if it is asleep.
+ * @param ring: pointer to the ring
+ * @param request: pointer to the request returned by otp_next_shm_request()
+ * @param status: int, the result length, or a negative errno value if the request was refused
+ */
+void otp_complete_shm_request(struct otp_shm_ring *ring, const struct otp_shm_request *request, int status)
+{
+	struct otp_shm_slot *slot = &ring->slots[request->position % OTP_SHM_RING_SLOTS];
+	slot->status = status;
+	__atomic_store_n(&slot->sequence, request->position + 2, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&slot->caller_waiting, __ATOMIC_SEQ_CST))
+	{
+		futex_wake(&slot->sequence);
+	}
+}
+
+/**
+ * Maps the ring a server created, and checks that it serves callers of the given type.
+ * @param name: POSIX shared memory name the server was started with
+ * @param client_type: string, the caller's client type, e.g. OTP_ENCRYPT_CLIENT
+ * @return struct otp_shm_ring *, the ring, or NULL with errno set (ENOENT if no server created it, EPROTO if
+ * it is not a ring or serves the other client type)
+ */
+struct otp_shm_ring *otp_attach_shm_ring(const char *name, const char *client_type)
+{
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+	struct stat segment_status;
+	if (fstat(fd, &segment_status) < 0 || segment_status.st_size != sizeof(struct otp_shm_ring))
+	{
+		close(fd);
+		errno = EPROTO;
+		return NULL;
+	}
+	struct otp_shm_ring *ring = mmap(NULL, sizeof(struct otp_shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != OTP_SHM_RING_MAGIC ||
+		ring->slot_count != OTP_SHM_RING_SLOTS || ring->slot_size != OTP_SHM_SLOT_SIZE ||
+		strncmp(ring->client_type, client_type, OTP_HANDSHAKE_LENGTH) != 0)
+	{
+		munmap(ring, sizeof(struct otp_shm_ring));
+		errno = EPROTO;
+		return NULL;
+	}
+	return ring;
+}
+
+/**
+ * Unmaps a ring attached with otp_attach_shm_ring(). Every claimed slot should have been released.
+ * @param ring: pointer to the ring
+ */
+void otp_detach_shm_ring(struct otp_shm_ring *ring)
+{
+	munmap(ring, sizeof(struct otp_shm_ring));
+}
+
+/**
+ * Claims the next free slot for a request, without waiting. Safe to call from any number of threads and
+ * processes at once.
+ * @param ring: pointer to the ring
+ * @param position: pointer to where the slot's position is stored, to pass to the other calls
+ * @return char *, the slot's OTP_SHM_SLOT_SIZE bytes of data to write the message into, or NULL with errno set
+ * (EAGAIN if every slot is in use, EPIPE if the server has stopped)
+ */
+char *otp_claim_shm_slot(struct otp_shm_ring *ring, uint32_t *position)
+{
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	while (true)
+	{
+		if (__atomic_load_n(&ring->closed, __ATOMIC_RELAXED))
+		{
+			errno = EPIPE;
+			return NULL;
+		}
+
+		struct otp_shm_slot *slot = &ring->slots[tail % OTP_SHM_RING_SLOTS];
+		int32_t lap_difference = (int32_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - tail);
+		if (lap_difference == 0)
+		{
+			// free for this position; take it unless another caller does first (which reloads tail)
+			if (__atomic_compare_exchange_n(&ring->tail, &tail, tail + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				*position = tail;
+				return ring->data[tail % OTP_SHM_RING_SLOTS];
+			}
+		}
+		else if (lap_difference < 0)
+		{
+			errno = EAGAIN; // still in use from the previous lap
+			return NULL;
+		}
+		else
+		{
+			tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED); // another caller claimed it
+		}
+	}
+}
+
+/**
+ * Submits a claimed slot whose data holds the message, waking the server if it is asleep.
+ * @param ring: pointer to the ring
+ * @param position: uint32_t, position returned by otp_claim_shm_slot()
+ * @param pad_id: int, ID of the pad that keys the request
+ * @param offset: int, position of the first pad character to use
+ * @param length: int, number of message characters (at most OTP_SHM_SLOT_SIZE)
+ */
+void otp_submit_shm_request(struct otp_shm_ring *ring, uint32_t position, int pad_id, int offset, int length)
+{
+	struct otp_shm_slot *slot = &ring->slots[position % OTP_SHM_RING_SLOTS];
+	slot->pad_id = pad_id;
+	slot->offset = offset;
+	slot->length = length;
+	__atomic_store_n(&slot->sequence, position + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->server_sleeping, __ATOMIC_SEQ_CST))
+	{
+		futex_wake(&slot->sequence);
+	}
+}
+
+/**
+ * Waits for the server to complete a submitted request. The result is then in the slot's data, until the slot
+ * is released.
+ * @param ring: pointer to the ring
+ * @param position: uint32_t, position returned by otp_claim_shm_slot()
+ * @return int, the result length, or -1 with errno set (EILSEQ if the message held a bad character, ENOENT,
+ * ERANGE or EALREADY if the pad range could not be used, EINVAL for a bad length, EPIPE if the server stopped)
+ */
+int otp_wait_for_shm_reply(struct otp_shm_ring *ring, uint32_t position)
+{
+	struct otp_shm_slot *slot = &ring->slots[position % OTP_SHM_RING_SLOTS];
+	const struct timespec wake_interval = {0, CALLER_WAKE_INTERVAL_NS};
+	for (int spin = 0; __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != position + 2; spin++)
+	{
+		if (__atomic_load_n(&ring->closed, __ATOMIC_RELAXED))
+		{
+			errno = EPIPE;
+			return -1;
+		}
+		if (spin < SPIN_LIMIT)
+		{
+			relax();
+			continue;
+		}
+
+		// as in otp_next_shm_request(), announce the sleep before the last check
+		__atomic_store_n(&slot->caller_waiting, 1, __ATOMIC_SEQ_CST);
+		uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST);
+		if (sequence == position + 1)
+		{
+			futex_wait(&slot->sequence, sequence, &wake_interval);
+		}
+	}
+
+	if (slot->status < 0)
+	{
+		errno = -slot->status;
+		return -1;
+	}
+	return slot->status;
+}
+
+/**
+ * Frees a slot once its result has been read, for the position a lap later.
+ * @param ring: pointer to the ring
+ * @param position: uint32_t, position returned by otp_claim_shm_slot()
+ */
+void otp_release_shm_slot(struct otp_shm_ring *ring, uint32_t position)
+{
+	struct otp_shm_slot *slot = &ring->slots[position % OTP_SHM_RING_SLOTS];
+	slot->caller_waiting = 0;
+	__atomic_store_n(&slot->sequence, position + OTP_SHM_RING_SLOTS, __ATOMIC_RELEASE);
+}
+
+/**
+ * Sleeps until the futex word is woken, unless it no longer holds the expected value.
+ * @param word: pointer to the futex word, in the shared segment
+ * @param expected: uint32_t, value the word held when the caller decided to sleep
+ * @param timeout: pointer to the longest time to sleep, or NULL to sleep until woken
+ */
+static void futex_wait(uint32_t *word, uint32_t expected, const struct timespec *timeout)
+{
+	syscall(SYS_futex, word, FUTEX_WAIT, expected, timeout, NULL, 0); // not FUTEX_PRIVATE_FLAG: shared by processes
+}
+
+/**
+ * Wakes every thread sleeping on a futex word.
+ * @param word: pointer to the futex word, in the shared segment
+ */
+static void futex_wake(uint32_t *word)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Tells the CPU the thread is spinning, so it yields pipeline resources to its sibling hyperthread.
+ */
+static void relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
@@ -0,0 +1,70 @@
+#ifndef OTP_SHM_RING_H
+#define OTP_SHM_RING_H
+
+#include <stdint.h>
+#include "otp_protocol.h"
+
+// A server started with --shm NAME also serves callers on the same host through a ring of request slots in the
+// POSIX shared memory segment NAME. A caller claims a slot, writes its message into the slot's data, and submits
+// it with a pad ID and offset (see otp_pad_store.h; the pad is uploaded over a connection first). The server's
+// ring thread takes submitted slots in order, replaces each message with its result in place, and marks the slot
+// completed with a status: the result length, or a negative errno value (EILSEQ for a bad character, ENOENT,
+// ERANGE or EALREADY for an unusable pad range). The caller reads the result and releases the slot.
+//
+// Any number of callers may submit at once (the ring is multi-producer, single-consumer). Each slot's sequence
+// number tells its state for the position it was claimed at: the position itself while free or being filled,
+// position + 1 once submitted, position + 2 once completed, and the position a lap later once released. Both
+// sides spin briefly and then sleep on that word with a futex, and only wake the other side if it is asleep, so a
+// busy ring carries requests without any system call. A caller that dies between claiming and submitting a slot
+// stalls the ring until the server is restarted.
+#define OTP_SHM_RING_MAGIC 0x4f545052U // "OTPR"
+#define OTP_SHM_RING_SLOTS 64			// slots in a ring (a power of two)
+#define OTP_SHM_SLOT_SIZE 65536			// bytes of message data per slot
+
+// one request slot; the sequence number and the flags are futex words shared with the other side
+struct otp_shm_slot
+{
+	uint32_t sequence;		 // state of the slot (see above)
+	uint32_t caller_waiting; // the caller is asleep waiting for the reply
+	int pad_id;
+	int offset;
+	int length; // characters of message data
+	int status; // result length, or a negative errno value
+} __attribute__((aligned(64)));
+
+// the shared memory segment
+struct otp_shm_ring
+{
+	uint32_t magic;
+	uint32_t slot_count;
+	uint32_t slot_size;
+	uint32_t closed;								 // the server has stopped
+	char client_type[OTP_HANDSHAKE_LENGTH + 1];		 // callers must be of this type, e.g. OTP_ENCRYPT_CLIENT
+	uint32_t tail __attribute__((aligned(64)));		 // next position to claim (callers)
+	uint32_t head __attribute__((aligned(64)));		 // next position to serve (server)
+	uint32_t server_sleeping;						 // the server is asleep waiting for the slot at head
+	struct otp_shm_slot slots[OTP_SHM_RING_SLOTS];
+	char data[OTP_SHM_RING_SLOTS][OTP_SHM_SLOT_SIZE]; // message, then result, of each slot
+};
+
+// a submitted request, as the server read it from its slot
+struct otp_shm_request
+{
+	uint32_t position;
+	int pad_id;
+	int offset;
+	int length;
+};
+
+struct otp_shm_ring *otp_create_shm_ring(const char *name, const char *client_type);
+void otp_close_shm_ring(struct otp_shm_ring *ring, const char *name);
+char *otp_next_shm_request(struct otp_shm_ring *ring, struct otp_shm_request *request);
+void otp_complete_shm_request(struct otp_shm_ring *ring, const struct otp_shm_request *request, int status);
+struct otp_shm_ring *otp_attach_shm_ring(const char *name, const char *client_type);
+void otp_detach_shm_ring(struct otp_shm_ring *ring);
+char *otp_claim_shm_slot(struct otp_shm_ring *ring, uint32_t *position);
+void otp_submit_shm_request(struct otp_shm_ring *ring, uint32_t position, int pad_id, int offset, int length);
+int otp_wait_for_shm_reply(struct otp_shm_ring *ring, uint32_t position);
+void otp_release_shm_slot(struct otp_shm_ring *ring, uint32_t position);
+
+#endif
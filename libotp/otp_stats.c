@@ -0,0 +1,427 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>	  // for clock_gettime
+#include <sys/mman.h> // for mmap
+#include "otp_cipher.h"
+#include "otp_stats.h"
+
+// names of the error kinds in the metrics, indexed by enum otp_error_kind
+static const char *const error_kind_names[OTP_ERROR_KIND_COUNT] = {
+	"rejected", "receive", "protocol", "bad_character", "pad", "send", "memory", "busy"};
+
+// names of the phases in the metrics and the exit summary, indexed by enum otp_phase
+static const char *const phase_names[OTP_PHASE_COUNT] = {"handshake", "receive", "cipher", "send"};
+
+// function prototypes
+static void write_metric_header(FILE *output, const char *name, const char *type, const char *help);
+static void write_histogram_metric(FILE *output, const char *name, const char *labels,
+								   const struct otp_histogram *histogram, unsigned long long sum, double unit_seconds);
+
+/**
+ * Returns the current time of the monotonic clock.
+ * @return long long, time in microseconds
+ */
+long long otp_current_time_us(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Returns the current time of the monotonic clock, for timing the phases of a request. Read through the vDSO,
+ * so it costs a few tens of nanoseconds and no system call.
+ * @return long long, time in nanoseconds
+ */
+long long otp_current_time_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Maps a latency to its histogram bucket.
+ * Small values get one bucket each; larger values get OTP_HISTOGRAM_SUB_BUCKETS buckets per power of two,
+ * so the relative error stays below 12.5% over the whole range.
+ * @param value: long long, latency (in the histogram's unit)
+ * @return int, index of the bucket
+ */
+int otp_histogram_bucket_index(long long value)
+{
+	if (value < OTP_HISTOGRAM_LINEAR_BUCKETS)
+	{
+		return value < 0 ? 0 : (int)value;
+	}
+
+	int exponent = 63 - __builtin_clzll((unsigned long long)value); // position of the highest set bit (>= 4)
+	int sub_bucket = (int)(value >> (exponent - 3)) & (OTP_HISTOGRAM_SUB_BUCKETS - 1);
+	int index = OTP_HISTOGRAM_LINEAR_BUCKETS + (exponent - 4) * OTP_HISTOGRAM_SUB_BUCKETS + sub_bucket;
+	return index < OTP_HISTOGRAM_BUCKETS ? index : OTP_HISTOGRAM_BUCKETS - 1;
+}
+
+/**
+ * Returns the largest latency that falls into the given histogram bucket.
+ * @param index: int, index of the bucket
+ * @return long long, latency (in the histogram's unit)
+ */
+long long otp_histogram_bucket_upper_bound(int index)
+{
+	if (index < OTP_HISTOGRAM_LINEAR_BUCKETS)
+	{
+		return index;
+	}
+
+	int exponent = (index - OTP_HISTOGRAM_LINEAR_BUCKETS) / OTP_HISTOGRAM_SUB_BUCKETS + 4;
+	int sub_bucket = (index - OTP_HISTOGRAM_LINEAR_BUCKETS) % OTP_HISTOGRAM_SUB_BUCKETS;
+	return ((long long)(OTP_HISTOGRAM_SUB_BUCKETS + sub_bucket + 1) << (exponent - 3)) - 1;
+}
+
+/**
+ * Adds one latency to a histogram. Uses an atomic increment, since threads and processes
+ * update shared histograms concurrently.
+ * @param histogram: pointer to the histogram
+ * @param value: long long, latency (in the histogram's unit)
+ */
+void otp_histogram_record(struct otp_histogram *histogram, long long value)
+{
+	__atomic_fetch_add(&histogram->buckets[otp_histogram_bucket_index(value)], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Returns the number of latencies recorded in a histogram.
+ * @param histogram: pointer to the histogram
+ * @return unsigned long, the number of samples
+ */
+unsigned long otp_histogram_count(const struct otp_histogram *histogram)
+{
+	unsigned long total = 0;
+	for (int i = 0; i < OTP_HISTOGRAM_BUCKETS; i++)
+	{
+		total += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+	}
+	return total;
+}
+
+/**
+ * Computes a latency percentile from a histogram.
+ * @param histogram: pointer to the histogram
+ * @param percentile: double, the percentile to compute (0-100)
+ * @return long long, latency in the histogram's unit (0 if nothing was recorded)
+ */
+long long otp_histogram_percentile(const struct otp_histogram *histogram, double percentile)
+{
+	unsigned long total = otp_histogram_count(histogram);
+	unsigned long rank = (unsigned long)(total * percentile / 100.0 + 0.5); // rank of the wanted sample
+	unsigned long seen = 0;
+
+	if (total == 0)
+	{
+		return 0;
+	}
+	if (rank == 0)
+	{
+		rank = 1;
+	}
+
+	for (int i = 0; i < OTP_HISTOGRAM_BUCKETS; i++)
+	{
+		seen += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+		if (seen >= rank)
+		{
+			return otp_histogram_bucket_upper_bound(i);
+		}
+	}
+	return otp_histogram_bucket_upper_bound(OTP_HISTOGRAM_BUCKETS - 1);
+}
+
+/**
+ * Creates the statistics block in memory shared with any child processes forked afterwards.
+ * @return struct otp_server_stats *, pointer to the zeroed statistics
+ */
+struct otp_server_stats *otp_create_server_stats(void)
+{
+	struct otp_server_stats *stats = mmap(NULL, sizeof(struct otp_server_stats), PROT_READ | PROT_WRITE,
+										  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED)
+	{
+		fprintf(stderr, "SERVER: ERROR allocating shared statistics\n");
+		exit(1);
+	}
+	stats->started_at_us = otp_current_time_us();
+	return stats;
+}
+
+/**
+ * Counts a connection accept() has just returned as active, until otp_record_connection() records its end.
+ * @param stats: pointer to the shared statistics
+ * @return long long, the time of the accept in microseconds, for otp_record_connection()
+ */
+long long otp_record_accept(struct otp_server_stats *stats)
+{
+	__atomic_fetch_add(&stats->active_connections, 1, __ATOMIC_RELAXED);
+	return otp_current_time_us();
+}
+
+/**
+ * Records a finished connection in the shared statistics.
+ * @param stats: pointer to the shared statistics
+ * @param accepted_at_us: long long, time at which accept() returned the connection (see otp_record_accept())
+ * @param succeeded: bool, whether the client was served without errors
+ */
+void otp_record_connection(struct otp_server_stats *stats, long long accepted_at_us, bool succeeded)
+{
+	long long latency_us = otp_current_time_us() - accepted_at_us;
+	otp_histogram_record(&stats->latency, latency_us);
+	__atomic_fetch_add(&stats->latency_sum_us, latency_us, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&stats->active_connections, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->connections, 1, __ATOMIC_RELAXED);
+	if (!succeeded)
+	{
+		__atomic_fetch_add(&stats->failures, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Records a connection that was refused as soon as it was accepted because the server was over capacity: it
+ * is no longer active and counts as busy, but was not served, so it stays out of the connection latencies.
+ * @param stats: pointer to the shared statistics
+ */
+void otp_record_refusal(struct otp_server_stats *stats)
+{
+	__atomic_fetch_sub(&stats->active_connections, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->errors[OTP_ERROR_BUSY], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Reserves memory for a request against the server's limit on buffered bytes, before it is allocated. Every
+ * worker, in every process, reserves from the same count, so the limit holds for the whole server, and the
+ * free buffers the pools keep count against it too. A request may reserve more than once as its sizes arrive
+ * (its key after its message).
+ * @param stats: pointer to the shared statistics
+ * @param reserved: long long, bytes the request has already reserved, or 0
+ * @param bytes: long long, further bytes the request will hold
+ * @param limit: long long, the most all requests together may hold, or 0 for no limit
+ * @return bool, false if the request would take the server over the limit (nothing more is then reserved)
+ */
+bool otp_reserve_buffered_bytes(struct otp_server_stats *stats, long long reserved, long long bytes, long long limit)
+{
+	long long buffered = __atomic_add_fetch(&stats->buffered_bytes, bytes, __ATOMIC_RELAXED);
+	long long pooled = __atomic_load_n(&stats->pool.pooled_bytes, __ATOMIC_RELAXED);
+	if (limit > 0 && buffered + pooled > limit && buffered > reserved + bytes) // a request larger than the limit may still run alone
+	{
+		__atomic_fetch_sub(&stats->buffered_bytes, bytes, __ATOMIC_RELAXED);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Returns the memory of a request reserved with otp_reserve_buffered_bytes() once it has been freed.
+ * @param stats: pointer to the shared statistics
+ * @param bytes: long long, bytes that were reserved
+ */
+void otp_release_buffered_bytes(struct otp_server_stats *stats, long long bytes)
+{
+	__atomic_fetch_sub(&stats->buffered_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Counts a request served in the shared statistics.
+ * @param stats: pointer to the shared statistics
+ */
+void otp_record_request(struct otp_server_stats *stats)
+{
+	__atomic_fetch_add(&stats->requests, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Adds the characters of a served request (or chunk of a stream request) to the shared statistics.
+ * @param stats: pointer to the shared statistics
+ * @param received: long long, message, key and pad characters received (a key counts as long as its message)
+ * @param sent: long long, result characters sent
+ */
+void otp_record_transfer(struct otp_server_stats *stats, long long received, long long sent)
+{
+	__atomic_fetch_add(&stats->received_characters, received, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->sent_characters, sent, __ATOMIC_RELAXED);
+}
+
+/**
+ * Counts an error in the shared statistics; the server also prints it, as it always has.
+ * @param stats: pointer to the shared statistics
+ * @param kind: enum otp_error_kind, what went wrong
+ */
+void otp_record_error(struct otp_server_stats *stats, enum otp_error_kind kind)
+{
+	__atomic_fetch_add(&stats->errors[kind], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Adds the time a request (or connection) spent in one phase to that phase's histogram.
+ * @param stats: pointer to the shared statistics
+ * @param phase: enum otp_phase, the phase
+ * @param duration_ns: long long, time spent in it, in nanoseconds
+ */
+void otp_record_phase(struct otp_server_stats *stats, enum otp_phase phase, long long duration_ns)
+{
+	otp_histogram_record(&stats->phases[phase], duration_ns);
+	__atomic_fetch_add(&stats->phase_sum_ns[phase], duration_ns, __ATOMIC_RELAXED);
+}
+
+/**
+ * Returns the CPU time the calling thread has used, in user and kernel mode. Time spent blocked in a
+ * system call is not counted, so the difference over a request is what serving it cost.
+ * @return long long, nanoseconds
+ */
+long long otp_thread_cpu_time_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Adds the CPU time the calling thread has used since a reading of otp_thread_cpu_time_ns() to the shared
+ * statistics.
+ * @param stats: pointer to the shared statistics
+ * @param since_ns: long long, the earlier reading
+ * @return long long, the current reading, from which a loop can measure its next round
+ */
+long long otp_record_cpu_time(struct otp_server_stats *stats, long long since_ns)
+{
+	long long now_ns = otp_thread_cpu_time_ns();
+	__atomic_fetch_add(&stats->cpu_time_ns, now_ns - since_ns, __ATOMIC_RELAXED);
+	return now_ns;
+}
+
+/**
+ * Prints a one-line summary of the connections served so far to stderr, so the
+ * worker models can be compared under the same load, and a second line with the time spent in each phase.
+ * @param stats: pointer to the shared statistics
+ * @param mode_name: string, name of the worker model in use
+ * @param worker_count: int, number of workers (1 for the single-process models)
+ */
+void otp_print_server_stats(const struct otp_server_stats *stats, const char *mode_name, int worker_count)
+{
+	double elapsed_seconds = (otp_current_time_us() - stats->started_at_us) / 1000000.0;
+	unsigned long connections = __atomic_load_n(&stats->connections, __ATOMIC_RELAXED);
+
+	fprintf(stderr, "SERVER: mode=%s workers=%d connections=%lu requests=%lu failed=%lu busy=%lu elapsed=%.2fs "
+					"rate=%.1f conn/s p50=%lldus p99=%lldus\n",
+			mode_name, worker_count, connections, __atomic_load_n(&stats->requests, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats->failures, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats->errors[OTP_ERROR_BUSY], __ATOMIC_RELAXED),
+			elapsed_seconds, elapsed_seconds > 0 ? connections / elapsed_seconds : 0.0,
+			otp_histogram_percentile(&stats->latency, 50), otp_histogram_percentile(&stats->latency, 99));
+
+	fprintf(stderr, "SERVER: phases p50/p99/p999");
+	for (int i = 0; i < OTP_PHASE_COUNT; i++)
+	{
+		fprintf(stderr, " %s=%lld/%lld/%lldns", phase_names[i], otp_histogram_percentile(&stats->phases[i], 50),
+				otp_histogram_percentile(&stats->phases[i], 99), otp_histogram_percentile(&stats->phases[i], 99.9));
+	}
+	fprintf(stderr, "\n");
+}
+
+/**
+ * Writes the HELP and TYPE lines that introduce a metric in the Prometheus text format.
+ * @param output: the stream to write to
+ * @param name: string, name of the metric
+ * @param type: string, "counter", "gauge" or "histogram"
+ * @param help: string, description of the metric
+ */
+static void write_metric_header(FILE *output, const char *name, const char *type, const char *help)
+{
+	fprintf(output, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * Writes the shared statistics in the Prometheus text exposition format, for the metrics endpoint.
+ * @param output: the stream to write to
+ * @param stats: pointer to the shared statistics
+ * @param program_name: string, name of the server, e.g. "enc_server"
+ * @param mode_name: string, name of the worker model in use
+ * @param worker_count: int, number of workers (1 for the single-process models)
+ */
+void otp_write_server_metrics(FILE *output, const struct otp_server_stats *stats, const char *program_name,
+							  const char *mode_name, int worker_count)
+{
+	write_metric_header(output, "otp_server_info", "gauge", "The server, its worker model and its cipher kernel.");
+	fprintf(output, "otp_server_info{program=\"%s\",mode=\"%s\",workers=\"%d\",kernel=\"%s\"} 1\n", program_name,
+			mode_name, worker_count, otp_cipher_kernel_name());
+	write_metric_header(output, "otp_uptime_seconds", "gauge", "Time since the server started.");
+	fprintf(output, "otp_uptime_seconds %.3f\n", (otp_current_time_us() - stats->started_at_us) / 1000000.0);
+
+	write_metric_header(output, "otp_connections_total", "counter", "Connections served.");
+	fprintf(output, "otp_connections_total %lu\n", __atomic_load_n(&stats->connections, __ATOMIC_RELAXED));
+	write_metric_header(output, "otp_connections_failed_total", "counter", "Connections that ended in an error.");
+	fprintf(output, "otp_connections_failed_total %lu\n", __atomic_load_n(&stats->failures, __ATOMIC_RELAXED));
+	write_metric_header(output, "otp_active_connections", "gauge", "Connections accepted and not closed yet.");
+	fprintf(output, "otp_active_connections %lu\n", __atomic_load_n(&stats->active_connections, __ATOMIC_RELAXED));
+	write_metric_header(output, "otp_buffered_bytes", "gauge", "Memory held for requests being received or served.");
+	fprintf(output, "otp_buffered_bytes %lld\n", __atomic_load_n(&stats->buffered_bytes, __ATOMIC_RELAXED));
+	write_metric_header(output, "otp_pooled_bytes", "gauge", "Memory of free buffers kept for reuse.");
+	fprintf(output, "otp_pooled_bytes %lld\n", __atomic_load_n(&stats->pool.pooled_bytes, __ATOMIC_RELAXED));
+	write_metric_header(output, "otp_requests_total", "counter", "Requests served, including shared memory ones.");
+	fprintf(output, "otp_requests_total %lu\n", __atomic_load_n(&stats->requests, __ATOMIC_RELAXED));
+	write_metric_header(output, "otp_received_characters_total", "counter",
+						"Message, key and pad characters received (a key counts as long as its message).");
+	fprintf(output, "otp_received_characters_total %llu\n",
+			__atomic_load_n(&stats->received_characters, __ATOMIC_RELAXED));
+	write_metric_header(output, "otp_sent_characters_total", "counter", "Result characters sent.");
+	fprintf(output, "otp_sent_characters_total %llu\n", __atomic_load_n(&stats->sent_characters, __ATOMIC_RELAXED));
+	write_metric_header(output, "otp_errors_total", "counter", "Errors, by kind.");
+	for (int i = 0; i < OTP_ERROR_KIND_COUNT; i++)
+	{
+		fprintf(output, "otp_errors_total{type=\"%s\"} %lu\n", error_kind_names[i],
+				__atomic_load_n(&stats->errors[i], __ATOMIC_RELAXED));
+	}
+	write_metric_header(output, "otp_cpu_seconds_total", "counter",
+						"CPU time the workers spent serving; divide its rate by that of otp_requests_total for the CPU time per request.");
+	fprintf(output, "otp_cpu_seconds_total %.6f\n", __atomic_load_n(&stats->cpu_time_ns, __ATOMIC_RELAXED) / 1e9);
+
+	write_metric_header(output, "otp_connection_duration_seconds", "histogram", "Time from accept() to close().");
+	write_histogram_metric(output, "otp_connection_duration_seconds", "", &stats->latency,
+						   __atomic_load_n(&stats->latency_sum_us, __ATOMIC_RELAXED), 1e-6);
+	write_metric_header(output, "otp_phase_duration_seconds", "histogram",
+						"Time spent in each phase of serving a request (the handshake once per connection).");
+	for (int i = 0; i < OTP_PHASE_COUNT; i++)
+	{
+		char labels[32];
+		snprintf(labels, sizeof(labels), "phase=\"%s\"", phase_names[i]);
+		write_histogram_metric(output, "otp_phase_duration_seconds", labels, &stats->phases[i],
+							   __atomic_load_n(&stats->phase_sum_ns[i], __ATOMIC_RELAXED), 1e-9);
+	}
+}
+
+/**
+ * Writes the samples of a histogram metric: a cumulative bucket at the end of every power of two of the
+ * histogram's range (the last of its sub-buckets), then +Inf, the sum and the count. Every scrape has the same
+ * buckets, empty or not, so rates and quantiles over a series never see buckets appear mid-window.
+ * @param output: the stream to write to
+ * @param name: string, name of the metric
+ * @param labels: string, labels that tell this histogram from others of the same metric (may be empty)
+ * @param histogram: pointer to the histogram
+ * @param sum: unsigned long long, sum of the recorded values
+ * @param unit_seconds: double, seconds per unit of the histogram (1e-6 for microseconds)
+ */
+static void write_histogram_metric(FILE *output, const char *name, const char *labels,
+								   const struct otp_histogram *histogram, unsigned long long sum, double unit_seconds)
+{
+	const char *separator = labels[0] ? "," : "";
+	unsigned long seen = 0;
+	for (int i = 0; i < OTP_HISTOGRAM_BUCKETS; i++)
+	{
+		seen += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+		long long upper_bound = otp_histogram_bucket_upper_bound(i);
+		if (((upper_bound + 1) & upper_bound) == 0) // the last bucket below a power of two
+		{
+			fprintf(output, "%s_bucket{%s%sle=\"%.9g\"} %lu\n", name, labels, separator, upper_bound * unit_seconds,
+					seen);
+		}
+	}
+	fprintf(output, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, separator, seen);
+	fprintf(output, labels[0] ? "%s_sum{%s} %.9f\n" : "%s_sum%s %.9f\n", name, labels, sum * unit_seconds);
+	fprintf(output, labels[0] ? "%s_count{%s} %lu\n" : "%s_count%s %lu\n", name, labels, seen);
+}
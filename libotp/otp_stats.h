@@ -0,0 +1,86 @@
+#ifndef OTP_STATS_H
+#define OTP_STATS_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "otp_buffer_pool.h"
+
+#define OTP_HISTOGRAM_LINEAR_BUCKETS 16 // latencies below this many microseconds get one bucket each
+#define OTP_HISTOGRAM_SUB_BUCKETS 8		// buckets per power of two above the linear range
+#define OTP_HISTOGRAM_BUCKETS (OTP_HISTOGRAM_LINEAR_BUCKETS + OTP_HISTOGRAM_SUB_BUCKETS * 40)
+
+// log-linear latency histogram (of microseconds or nanoseconds); safe to update from several threads or processes
+// at once
+struct otp_histogram
+{
+	unsigned long buckets[OTP_HISTOGRAM_BUCKETS];
+};
+
+// what went wrong when a connection or request failed, for the error counters
+enum otp_error_kind
+{
+	OTP_ERROR_REJECTED,		 // a client of the wrong type
+	OTP_ERROR_RECEIVE,		 // receiving failed, or the client disconnected in the middle of a request
+	OTP_ERROR_PROTOCOL,		 // an invalid size or packed message, or a key shorter than its message
+	OTP_ERROR_BAD_CHARACTER, // a message or key character outside the alphabet
+	OTP_ERROR_PAD,			 // the pad store was full, or a pad range was unavailable
+	OTP_ERROR_SEND,			 // sending a reply failed
+	OTP_ERROR_MEMORY,		 // memory ran out
+	OTP_ERROR_BUSY,			 // a connection or request shed because the server was over capacity (not printed)
+	OTP_ERROR_KIND_COUNT
+};
+
+// the phases of serving a request, each timed into a histogram of its own
+enum otp_phase
+{
+	OTP_PHASE_HANDSHAKE, // from the start of a connection until its client type has been checked
+	OTP_PHASE_RECEIVE,	 // from a request's header until its message and key have arrived
+	OTP_PHASE_CIPHER,	 // applying the cipher kernel
+	OTP_PHASE_SEND,		 // sending the reply
+	OTP_PHASE_COUNT
+};
+
+// counters shared by every worker of a server (lives in a MAP_SHARED mapping so forked children can update it)
+struct otp_server_stats
+{
+	long long started_at_us;				   // time the server started accepting connections
+	unsigned long connections;				   // number of connections served
+	unsigned long active_connections;		   // number of connections accepted and not closed yet
+	unsigned long requests;					   // number of requests served (a connection can carry many)
+	unsigned long failures;					   // number of connections that ended in an error
+	unsigned long errors[OTP_ERROR_KIND_COUNT]; // number of errors of each kind
+	unsigned long long received_characters;	   // message, key and pad characters received
+	unsigned long long sent_characters;		   // result characters sent
+	unsigned long long cpu_time_ns;			   // CPU time the workers spent serving, in every process
+	long long buffered_bytes;				   // memory the workers hold for requests being received or served
+	struct otp_pool_budget pool;			   // free buffers the workers keep for reuse, counted with buffered_bytes
+	unsigned long long latency_sum_us;		   // sum of the connection latencies in the histogram
+	struct otp_histogram latency;			   // connection latency from accept() to close()
+	struct otp_histogram phases[OTP_PHASE_COUNT];		 // time spent in each phase, in nanoseconds
+	unsigned long long phase_sum_ns[OTP_PHASE_COUNT]; // sum of the times in each phase histogram
+};
+
+long long otp_current_time_us(void);
+long long otp_current_time_ns(void);
+int otp_histogram_bucket_index(long long value);
+long long otp_histogram_bucket_upper_bound(int index);
+void otp_histogram_record(struct otp_histogram *histogram, long long value);
+unsigned long otp_histogram_count(const struct otp_histogram *histogram);
+long long otp_histogram_percentile(const struct otp_histogram *histogram, double percentile);
+struct otp_server_stats *otp_create_server_stats(void);
+long long otp_record_accept(struct otp_server_stats *stats);
+void otp_record_connection(struct otp_server_stats *stats, long long accepted_at_us, bool succeeded);
+void otp_record_refusal(struct otp_server_stats *stats);
+bool otp_reserve_buffered_bytes(struct otp_server_stats *stats, long long reserved, long long bytes, long long limit);
+void otp_release_buffered_bytes(struct otp_server_stats *stats, long long bytes);
+void otp_record_request(struct otp_server_stats *stats);
+void otp_record_transfer(struct otp_server_stats *stats, long long received, long long sent);
+void otp_record_error(struct otp_server_stats *stats, enum otp_error_kind kind);
+void otp_record_phase(struct otp_server_stats *stats, enum otp_phase phase, long long duration_ns);
+long long otp_thread_cpu_time_ns(void);
+long long otp_record_cpu_time(struct otp_server_stats *stats, long long since_ns);
+void otp_print_server_stats(const struct otp_server_stats *stats, const char *mode_name, int worker_count);
+void otp_write_server_metrics(FILE *output, const struct otp_server_stats *stats, const char *program_name,
+							  const char *mode_name, int worker_count);
+
+#endif
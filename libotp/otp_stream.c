@@ -0,0 +1,223 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h> // for poll
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "otp_file.h"
+#include "otp_protocol.h"
+#include "otp_stream.h"
+
+// the sending half of a stream request
+struct stream_sender
+{
+	FILE *message_file;
+	FILE *key_file;
+	int remaining;		// characters of the message not yet read from the files
+	bool validate;		// reject characters outside the alphabet
+	bool finished;		// the terminating chunk has been prepared
+	char *buffer;		// chunk size, message characters, key characters
+	int buffer_size;	// bytes of the current chunk
+	int buffer_sent;	// bytes of the current chunk sent so far
+};
+
+// the receiving half of a stream request
+struct stream_receiver
+{
+	FILE *output_file;
+	int header;			 // size of the current result chunk, in network byte order while being received
+	int header_received; // bytes of the size received so far
+	int chunk_remaining; // result characters of the current chunk still to come
+	bool finished;		 // the terminating chunk has been received
+	char *buffer;
+};
+
+// function prototypes
+static int prepare_stream_chunk(struct stream_sender *sender);
+static int send_stream_bytes(int connection_socket_fd, struct stream_sender *sender);
+static int receive_stream_bytes(int connection_socket_fd, struct stream_receiver *receiver);
+
+/**
+ * Runs a stream request on a connection whose handshake has been sent: reads the message and key from the
+ * files one chunk at a time, and writes the result chunks to the output file as they arrive. Sending and
+ * receiving overlap, so the first result chunk comes back while later chunks are still being sent and
+ * memory use does not depend on the message size.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param message_file: file positioned at the first message character
+ * @param key_file: file positioned at the first key character (at least length characters must follow)
+ * @param length: int, number of message characters to send
+ * @param output_file: file the result is written to
+ * @param validate: bool, whether to check the message and key for characters outside the alphabet
+ * @return int, 0 on success, -1 with errno set on failure (EINVAL for a bad character, EPROTO for an invalid reply,
+ * EILSEQ if the server refused a bad character)
+ */
+int otp_stream_files(int connection_socket_fd, FILE *message_file, FILE *key_file, int length,
+					 FILE *output_file, bool validate)
+{
+	struct stream_sender sender = {message_file, key_file, length, validate};
+	struct stream_receiver receiver = {output_file};
+	int status = 0;
+
+	sender.buffer = malloc(sizeof(int) + 2 * OTP_STREAM_CHUNK_SIZE);
+	receiver.buffer = malloc(OTP_STREAM_CHUNK_SIZE);
+	if (!sender.buffer || !receiver.buffer)
+	{
+		free(sender.buffer);
+		free(receiver.buffer);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	// announce the stream request
+	int converted_header = htonl(OTP_FRAME_STREAM);
+	status = otp_send_all(connection_socket_fd, &converted_header, sizeof(int));
+
+	while (status == 0 && !receiver.finished)
+	{
+		if (sender.buffer_sent == sender.buffer_size && !sender.finished)
+		{
+			status = prepare_stream_chunk(&sender);
+			if (status < 0)
+			{
+				break;
+			}
+		}
+
+		// wait until the server has sent something, or can take more of the current chunk
+		struct pollfd poll_entry = {.fd = connection_socket_fd, .events = POLLIN};
+		if (sender.buffer_sent < sender.buffer_size)
+		{
+			poll_entry.events |= POLLOUT;
+		}
+		if (poll(&poll_entry, 1, -1) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			status = -1;
+			break;
+		}
+
+		if (poll_entry.revents & (POLLIN | POLLHUP | POLLERR))
+		{
+			status = receive_stream_bytes(connection_socket_fd, &receiver);
+		}
+		if (status == 0 && (poll_entry.revents & POLLOUT))
+		{
+			status = send_stream_bytes(connection_socket_fd, &sender);
+		}
+	}
+
+	free(sender.buffer);
+	free(receiver.buffer);
+	return status;
+}
+
+/**
+ * Reads the next chunk of the message and key into the send buffer, or prepares the terminating chunk
+ * once the whole message has been read.
+ * @param sender: pointer to the sending half of the request
+ * @return int, 0 on success, -1 with errno set if the files could not be read or contain bad characters
+ */
+static int prepare_stream_chunk(struct stream_sender *sender)
+{
+	int chunk_size = sender->remaining < OTP_STREAM_CHUNK_SIZE ? sender->remaining : OTP_STREAM_CHUNK_SIZE;
+	char *message = sender->buffer + sizeof(int);
+	char *key = message + chunk_size;
+
+	if (fread(message, 1, chunk_size, sender->message_file) != (size_t)chunk_size ||
+		fread(key, 1, chunk_size, sender->key_file) != (size_t)chunk_size)
+	{
+		errno = EIO;
+		return -1;
+	}
+	if (sender->validate && (otp_find_invalid_character(message, chunk_size) >= 0 ||
+							 otp_find_invalid_character(key, chunk_size) >= 0))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	int converted_size = htonl(chunk_size);
+	memcpy(sender->buffer, &converted_size, sizeof(int));
+	sender->buffer_size = sizeof(int) + 2 * chunk_size;
+	sender->buffer_sent = 0;
+	sender->remaining -= chunk_size;
+	sender->finished = chunk_size == 0;
+	return 0;
+}
+
+/**
+ * Sends as much of the current chunk as the socket accepts without blocking.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param sender: pointer to the sending half of the request
+ * @return int, 0 on success, -1 with errno set if the connection failed
+ */
+static int send_stream_bytes(int connection_socket_fd, struct stream_sender *sender)
+{
+	int bytes_sent = send(connection_socket_fd, sender->buffer + sender->buffer_sent,
+						  sender->buffer_size - sender->buffer_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (bytes_sent < 0)
+	{
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+	}
+	sender->buffer_sent += bytes_sent;
+	return 0;
+}
+
+/**
+ * Receives whatever the server has sent without blocking, and writes completed result characters
+ * to the output file.
+ * @param connection_socket_fd: int, file descriptor of the connection socket
+ * @param receiver: pointer to the receiving half of the request
+ * @return int, 0 on success, -1 with errno set if the connection failed or the reply is invalid
+ */
+static int receive_stream_bytes(int connection_socket_fd, struct stream_receiver *receiver)
+{
+	int bytes_received;
+
+	if (receiver->chunk_remaining == 0)
+	{
+		// receiving the size of the next result chunk
+		bytes_received = recv(connection_socket_fd, (char *)&receiver->header + receiver->header_received,
+							  sizeof(int) - receiver->header_received, MSG_DONTWAIT);
+	}
+	else
+	{
+		int wanted = receiver->chunk_remaining < OTP_STREAM_CHUNK_SIZE ? receiver->chunk_remaining : OTP_STREAM_CHUNK_SIZE;
+		bytes_received = recv(connection_socket_fd, receiver->buffer, wanted, MSG_DONTWAIT);
+	}
+
+	if (bytes_received < 0)
+	{
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+	}
+	if (bytes_received == 0)
+	{
+		errno = ECONNRESET; // server disconnected before the request was complete
+		return -1;
+	}
+
+	if (receiver->chunk_remaining > 0)
+	{
+		fwrite(receiver->buffer, 1, bytes_received, receiver->output_file);
+		receiver->chunk_remaining -= bytes_received;
+		return 0;
+	}
+
+	receiver->header_received += bytes_received;
+	if (receiver->header_received == sizeof(int))
+	{
+		receiver->header_received = 0;
+		receiver->chunk_remaining = ntohl(receiver->header);
+		if (receiver->chunk_remaining < 0 || receiver->chunk_remaining > OTP_STREAM_CHUNK_SIZE)
+		{
+			errno = otp_reply_error_number(receiver->chunk_remaining);
+			return -1;
+		}
+		receiver->finished = receiver->chunk_remaining == 0;
+	}
+	return 0;
+}
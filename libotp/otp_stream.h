@@ -0,0 +1,16 @@
+#ifndef OTP_STREAM_H
+#define OTP_STREAM_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+// A stream request starts with the frame header OTP_FRAME_STREAM. The client then sends chunks, each a 4-byte
+// size in network byte order followed by that many message characters and that many key characters, and the
+// server answers every chunk with a 4-byte size and the result. A chunk of size 0 ends the request, and the
+// server echoes it. Neither side ever holds more than one chunk per direction, whatever the message size.
+#define OTP_STREAM_CHUNK_SIZE 65536 // largest chunk either side may send
+
+int otp_stream_files(int connection_socket_fd, FILE *message_file, FILE *key_file, int length,
+					 FILE *output_file, bool validate);
+
+#endif
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h> // for mmap
+#include "otp_trace.h"
+
+// names of the request types in a dump, indexed by enum otp_request_type
+static const char *const request_type_names[OTP_REQUEST_TYPE_COUNT] = {
+	"message", "tagged", "stream", "pad_upload", "pad_request", "shm"};
+
+/**
+ * Creates a trace ring in memory shared with any child processes forked afterwards.
+ * @param capacity: int, number of entries (positive)
+ * @return struct otp_trace_ring *, the empty ring, or NULL if it could not be mapped
+ */
+struct otp_trace_ring *otp_create_trace_ring(int capacity)
+{
+	size_t size = sizeof(struct otp_trace_ring) + (size_t)capacity * sizeof(struct otp_trace_entry);
+	struct otp_trace_ring *ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED)
+	{
+		return NULL;
+	}
+	ring->capacity = capacity;
+	return ring;
+}
+
+/**
+ * Writes a request into the next entry of the ring, overwriting the oldest once the ring is full. Safe to call
+ * from any number of threads and processes at once; costs one atomic add and two ordered stores.
+ * @param ring: pointer to the ring
+ * @param entry: pointer to the request's entry (its sequence number is filled in here)
+ */
+void otp_trace_request(struct otp_trace_ring *ring, const struct otp_trace_entry *entry)
+{
+	unsigned long position = __atomic_fetch_add(&ring->next, 1, __ATOMIC_RELAXED);
+	struct otp_trace_entry *slot = &ring->entries[position % ring->capacity];
+
+	__atomic_store_n(&slot->sequence, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE); // readers see the entry as being written before any field changes
+	slot->started_us = entry->started_us;
+	slot->pid = entry->pid;
+	slot->type = entry->type;
+	slot->size = entry->size;
+	slot->succeeded = entry->succeeded;
+	slot->receive_ns = entry->receive_ns;
+	slot->cipher_ns = entry->cipher_ns;
+	slot->send_ns = entry->send_ns;
+	__atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Prints the entries of the ring, oldest first, one line each. Entries being written at the time are skipped.
+ * @param ring: pointer to the ring
+ * @param output: the stream to print to
+ */
+void otp_dump_trace_ring(struct otp_trace_ring *ring, FILE *output)
+{
+	unsigned long next = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE);
+	unsigned long first = next > (unsigned long)ring->capacity ? next - ring->capacity : 0;
+
+	fprintf(output, "SERVER: trace of the last %lu requests\n", next - first);
+	for (unsigned long position = first; position < next; position++)
+	{
+		struct otp_trace_entry *slot = &ring->entries[position % ring->capacity];
+		unsigned long sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		struct otp_trace_entry entry = *slot;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE); // the copy is complete before the sequence number is checked again
+		if (sequence != position + 1 || __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence)
+		{
+			continue; // still being written, or already overwritten by a later request
+		}
+		fprintf(output, "SERVER: trace at=%lldus pid=%d type=%s size=%d %s receive=%lldns cipher=%lldns send=%lldns\n",
+				entry.started_us, entry.pid, otp_request_type_name(entry.type), entry.size,
+				entry.succeeded ? "ok" : "failed", entry.receive_ns, entry.cipher_ns, entry.send_ns);
+	}
+	fflush(output);
+}
+
+/**
+ * Returns the name of a request type, as printed in a dump.
+ * @param type: int, enum otp_request_type
+ * @return string, the name
+ */
+const char *otp_request_type_name(int type)
+{
+	return type >= 0 && type < OTP_REQUEST_TYPE_COUNT ? request_type_names[type] : "unknown";
+}
@@ -0,0 +1,53 @@
+#ifndef OTP_TRACE_H
+#define OTP_TRACE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// A server started with --trace N keeps the timing of its last N requests in a ring of entries in shared memory,
+// written by every worker (threads and forked processes alike) without a lock: a writer claims the next position
+// with an atomic add, and marks the entry at that position as being written and then as complete with its
+// sequence number. A reader copies an entry and keeps it only if the sequence number was the same before and
+// after, so an entry that was being rewritten while it was read is skipped rather than printed torn. The server
+// prints the ring to stderr on SIGUSR1.
+
+// the kinds of request a trace entry can be
+enum otp_request_type
+{
+	OTP_REQUEST_MESSAGE,	 // a whole message and key
+	OTP_REQUEST_TAGGED,		 // a tagged request
+	OTP_REQUEST_STREAM,		 // one chunk of a stream request
+	OTP_REQUEST_PAD_UPLOAD,	 // a pad upload
+	OTP_REQUEST_PAD_REQUEST, // a message keyed by an uploaded pad
+	OTP_REQUEST_SHM,		 // a request on the shared memory ring
+	OTP_REQUEST_TYPE_COUNT
+};
+
+// one traced request
+struct otp_trace_entry
+{
+	unsigned long sequence; // position + 1 once written, 0 while being written
+	long long started_us;	// monotonic time at which the request's header arrived
+	int pid;				// process that served it
+	int type;				// enum otp_request_type
+	int size;				// message (or pad, or chunk) characters
+	bool succeeded;			// false if the request was refused or its reply could not be sent
+	long long receive_ns;	// time to receive the message and key after the header
+	long long cipher_ns;	// time in the cipher kernel
+	long long send_ns;		// time to send the reply
+};
+
+// the shared ring of trace entries
+struct otp_trace_ring
+{
+	unsigned long next; // position the next entry is written at
+	int capacity;		// number of entries
+	struct otp_trace_entry entries[];
+};
+
+struct otp_trace_ring *otp_create_trace_ring(int capacity);
+void otp_trace_request(struct otp_trace_ring *ring, const struct otp_trace_entry *entry);
+void otp_dump_trace_ring(struct otp_trace_ring *ring, FILE *output);
+const char *otp_request_type_name(int type);
+
+#endif
@@ -0,0 +1,493 @@
+#ifdef USE_IO_URING
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>		// for mmap
+#include <sys/socket.h>
+#include <sys/syscall.h>	// for syscall
+#include <linux/io_uring.h> // io_uring kernel interface (built with IO_URING=1 ./build.sh)
+#include "otp_connection.h"
+
+#define URING_ENTRIES 1024	   // submission queue size of the io_uring
+#define URING_BUFFER_COUNT 1024 // receive buffers provided to the kernel (power of two)
+#define URING_BUFFER_SIZE 4096  // size of each provided receive buffer
+#define URING_BUFFER_GROUP 0	   // buffer group ID of the provided receive buffers
+#define URING_TAG_RECEIVE 1	   // low bits of the user_data of a receive
+#define URING_TAG_SEND 2		   // low bits of the user_data of a send
+#define URING_TAG_TIMER 3		   // user_data of a timeout or cancellation, which have no connection
+#define URING_TAG_MASK 3		   // (the low bits of an accept hold the index of its listening socket instead)
+
+// a minimal io_uring: the mapped submission and completion rings plus receive buffers shared with the kernel
+struct uring
+{
+	int fd;
+	unsigned sq_entries;
+	unsigned *sq_head; // advanced by the kernel as it consumes submissions
+	unsigned *sq_tail; // advanced by us to publish submissions
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_local_tail; // submissions prepared but not yet published
+	unsigned to_submit;		// submissions published since the last io_uring_enter()
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head; // advanced by us as we consume completions
+	unsigned *cq_tail; // advanced by the kernel to publish completions
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *buffer_ring; // receive buffers the kernel picks from
+	unsigned short buffer_ring_tail;
+	char *buffers; // URING_BUFFER_COUNT buffers of URING_BUFFER_SIZE bytes
+	struct __kernel_timespec timeout; // when the pending timeout fires, relative to its submission
+	bool timeout_pending;			  // a timeout is queued, waking the loop for the oldest draining connection
+};
+
+// function prototypes
+static void setup_uring(struct uring *ring);
+static struct io_uring_sqe *get_uring_sqe(struct uring *ring);
+static int submit_uring(struct uring *ring, unsigned wait_for);
+static void provide_uring_buffer(struct uring *ring, unsigned short buffer_id);
+static void queue_uring_accept(struct uring *ring, const struct otp_server *server, int index);
+static void queue_uring_receive(struct uring *ring, struct otp_connection *connection);
+static void queue_uring_send(struct uring *ring, struct otp_connection *connection);
+static void expire_uring_connections(struct uring *ring);
+static void handle_uring_completion(struct otp_server *server, struct uring *ring, struct io_uring_cqe *cqe);
+static void queue_uring_next(struct uring *ring, struct otp_connection *connection);
+static bool keep_pending_bytes(struct otp_connection *connection, const char *data, int length);
+
+/**
+ * Runs the io_uring worker model: a single thread drives accept, receive and send through one io_uring.
+ * A multishot accept stays armed for the whole run, receives land in buffers provided to the kernel up
+ * front, and every submission prepared while handling a batch of completions goes to the kernel in the
+ * same io_uring_enter() that waits for the next batch, so a small request costs a fraction of a syscall.
+ * @param server: pointer to the server
+ */
+void otp_run_uring_server(struct otp_server *server)
+{
+	struct uring ring;
+
+	otp_raise_file_descriptor_limit();
+	setup_uring(&ring);
+	for (int i = 0; i < server->listening_socket_count; i++)
+	{
+		queue_uring_accept(&ring, server, i);
+	}
+
+	long long cpu_started_ns = otp_thread_cpu_time_ns();
+	while (!otp_stop_requested)
+	{
+		// submit everything queued so far and wait for at least one completion
+		expire_uring_connections(&ring);
+		if (submit_uring(&ring, 1) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue; // interrupted by a signal; re-check otp_stop_requested
+			}
+			fprintf(stderr, "SERVER: ERROR submitting to io_uring\n");
+			exit(1);
+		}
+
+		// handle every completion the kernel has posted
+		unsigned head = *ring.cq_head;
+		while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+		{
+			handle_uring_completion(server, &ring, &ring.cqes[head & *ring.cq_mask]);
+			head++;
+			__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+		}
+
+		// includes the sends and receives the kernel ran inside io_uring_enter(), which waiting does not add to
+		cpu_started_ns = otp_record_cpu_time(server->stats, cpu_started_ns);
+	}
+	close(ring.fd);
+}
+
+/**
+ * Creates the io_uring, maps its rings, and registers the provided receive buffers.
+ * @param ring: pointer to the ring to set up
+ */
+static void setup_uring(struct uring *ring)
+{
+	struct io_uring_params params;
+
+	memset(ring, 0, sizeof(*ring));
+
+	// only this thread submits, and completions are only needed when we wait for them
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ring->fd < 0 && errno == EINVAL)
+	{
+		memset(&params, 0, sizeof(params)); // older kernel; run without the optimizations
+		ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	}
+	if (ring->fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		fprintf(stderr, "SERVER: ERROR setting up io_uring\n");
+		exit(1);
+	}
+
+	// map the submission and completion rings (one mapping) and the submission queue entries
+	size_t ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t completion_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (completion_size > ring_size)
+	{
+		ring_size = completion_size;
+	}
+	char *rings = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (rings == MAP_FAILED || ring->sqes == MAP_FAILED)
+	{
+		fprintf(stderr, "SERVER: ERROR mapping io_uring\n");
+		exit(1);
+	}
+
+	ring->sq_entries = params.sq_entries;
+	ring->sq_head = (unsigned *)(rings + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(rings + params.sq_off.tail);
+	ring->sq_mask = (unsigned *)(rings + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(rings + params.sq_off.array);
+	ring->sq_local_tail = *ring->sq_tail;
+	ring->cq_head = (unsigned *)(rings + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(rings + params.cq_off.tail);
+	ring->cq_mask = (unsigned *)(rings + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+	// register a ring of receive buffers the kernel picks from, so no buffer is pinned to an idle connection
+	ring->buffer_ring = mmap(NULL, URING_BUFFER_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+							 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ring->buffers = malloc((size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+	struct io_uring_buf_reg buffer_registration = {
+		.ring_addr = (unsigned long)ring->buffer_ring,
+		.ring_entries = URING_BUFFER_COUNT,
+		.bgid = URING_BUFFER_GROUP};
+	if (ring->buffer_ring == MAP_FAILED || !ring->buffers ||
+		syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &buffer_registration, 1) < 0)
+	{
+		fprintf(stderr, "SERVER: ERROR registering io_uring receive buffers\n");
+		exit(1);
+	}
+	for (int i = 0; i < URING_BUFFER_COUNT; i++)
+	{
+		provide_uring_buffer(ring, i);
+	}
+}
+
+/**
+ * Returns a cleared submission queue entry, submitting queued entries first if the queue is full.
+ * The entry is published to the kernel immediately but only submitted by the next submit_uring().
+ * @param ring: pointer to the ring
+ * @return struct io_uring_sqe *, the entry to fill in
+ */
+static struct io_uring_sqe *get_uring_sqe(struct uring *ring)
+{
+	while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+	{
+		submit_uring(ring, 0);
+	}
+
+	unsigned index = ring->sq_local_tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	ring->sq_local_tail++;
+	ring->to_submit++;
+	return sqe;
+}
+
+/**
+ * Submits every queued entry and optionally waits for completions, in a single io_uring_enter().
+ * @param ring: pointer to the ring
+ * @param wait_for: unsigned, number of completions to wait for (0 to only submit)
+ * @return int, -1 with errno set on failure
+ */
+static int submit_uring(struct uring *ring, unsigned wait_for)
+{
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_for,
+							wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (submitted < 0)
+	{
+		return -1;
+	}
+	ring->to_submit -= submitted;
+	return submitted;
+}
+
+/**
+ * Hands a receive buffer (back) to the kernel.
+ * @param ring: pointer to the ring
+ * @param buffer_id: unsigned short, index of the buffer
+ */
+static void provide_uring_buffer(struct uring *ring, unsigned short buffer_id)
+{
+	struct io_uring_buf *buffer = &ring->buffer_ring->bufs[ring->buffer_ring_tail & (URING_BUFFER_COUNT - 1)];
+	buffer->addr = (unsigned long)(ring->buffers + (size_t)buffer_id * URING_BUFFER_SIZE);
+	buffer->len = URING_BUFFER_SIZE;
+	buffer->bid = buffer_id;
+	ring->buffer_ring_tail++;
+	__atomic_store_n(&ring->buffer_ring->tail, ring->buffer_ring_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Queues a multishot accept on one of the listening sockets, which keeps producing a completion per
+ * accepted connection.
+ * @param ring: pointer to the ring
+ * @param server: pointer to the server
+ * @param index: int, index of the listening socket in server->listening_socket_fds
+ */
+static void queue_uring_accept(struct uring *ring, const struct otp_server *server, int index)
+{
+	struct io_uring_sqe *sqe = get_uring_sqe(ring);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = server->listening_socket_fds[index];
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = index; // a NULL connection marks accept completions
+}
+
+/**
+ * Queues a receive for a connection into one of the provided buffers.
+ * @param ring: pointer to the ring
+ * @param connection: pointer to the connection
+ */
+static void queue_uring_receive(struct uring *ring, struct otp_connection *connection)
+{
+	struct io_uring_sqe *sqe = get_uring_sqe(ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = connection->fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = (unsigned long)connection | URING_TAG_RECEIVE;
+}
+
+/**
+ * Queues a send of the rest of a connection's reply.
+ * @param ring: pointer to the ring
+ * @param connection: pointer to the connection
+ */
+static void queue_uring_send(struct uring *ring, struct otp_connection *connection)
+{
+	struct io_uring_sqe *sqe = get_uring_sqe(ring);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = connection->fd;
+	sqe->addr = (unsigned long)(connection->reply + connection->reply_sent);
+	sqe->len = connection->reply_size - connection->reply_sent;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (unsigned long)connection | URING_TAG_SEND;
+}
+
+/**
+ * Ends the drain of every refused connection whose time is up by cancelling its receive, which then completes
+ * and closes it, and queues a timeout for the next one to expire unless one is already pending.
+ * @param ring: pointer to the ring
+ */
+static void expire_uring_connections(struct uring *ring)
+{
+	struct otp_connection *connection;
+	while ((connection = otp_next_expired_connection()))
+	{
+		connection->state = OTP_STATE_FINISHED;
+		struct io_uring_sqe *sqe = get_uring_sqe(ring);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (unsigned long)connection | URING_TAG_RECEIVE;
+		sqe->user_data = URING_TAG_TIMER;
+	}
+
+	int timeout_ms = otp_drain_timeout_ms();
+	if (timeout_ms < 0 || ring->timeout_pending)
+	{
+		return;
+	}
+	ring->timeout = (struct __kernel_timespec){.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000LL};
+	struct io_uring_sqe *sqe = get_uring_sqe(ring);
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (unsigned long)&ring->timeout;
+	sqe->len = 1;
+	sqe->user_data = URING_TAG_TIMER;
+	ring->timeout_pending = true;
+}
+
+/**
+ * Acts on one completion: registers accepted connections, feeds received bytes through the protocol
+ * stages, and continues or finishes connections once a reply has been sent.
+ * @param server: pointer to the server
+ * @param ring: pointer to the ring
+ * @param cqe: pointer to the completion
+ */
+static void handle_uring_completion(struct otp_server *server, struct uring *ring, struct io_uring_cqe *cqe)
+{
+	struct otp_connection *connection = (struct otp_connection *)(unsigned long)(cqe->user_data & ~(unsigned long)URING_TAG_MASK);
+	int tag = cqe->user_data & URING_TAG_MASK;
+	int consumed;
+
+	if (!connection && tag == URING_TAG_TIMER)
+	{
+		if (cqe->res == -ETIME)
+		{
+			ring->timeout_pending = false; // the loop checks the draining connections next
+		}
+		return; // otherwise a cancellation, whose receive completes on its own
+	}
+	if (!connection) // accept
+	{
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+		{
+			queue_uring_accept(ring, server, tag); // the kernel stopped the multishot accept; re-arm it
+		}
+		if (cqe->res < 0)
+		{
+			if (cqe->res != -ECONNABORTED && cqe->res != -EINTR)
+			{
+				fprintf(stderr, "SERVER: ERROR on accept\n");
+			}
+			return;
+		}
+
+		connection = otp_create_connection(server, cqe->res);
+		if (!connection)
+		{
+			return;
+		}
+		queue_uring_next(ring, connection); // a connection refused at accept sends the busy reply first
+		return;
+	}
+
+	if (tag == URING_TAG_RECEIVE)
+	{
+		if (connection->state == OTP_STATE_FINISHED) // its drain expired, and the receive was cancelled
+		{
+			if (cqe->flags & IORING_CQE_F_BUFFER)
+			{
+				provide_uring_buffer(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			}
+			otp_close_connection(connection, true);
+			return;
+		}
+		if (cqe->res == -ENOBUFS)
+		{
+			queue_uring_receive(ring, connection); // every buffer is in use; try again after this batch
+			return;
+		}
+		if (cqe->res == 0 && otp_connection_between_requests(connection))
+		{
+			otp_close_connection(connection, true); // the client closed the session
+			return;
+		}
+		if (cqe->res <= 0)
+		{
+			if (connection->state != OTP_STATE_DRAIN) // a refused client may reset the connection
+			{
+				fprintf(stderr, cqe->res == 0 ? "SERVER: ERROR client disconnected unexpectedly\n"
+											   : "SERVER: ERROR receiving from client\n");
+				otp_record_error(server->stats, OTP_ERROR_RECEIVE);
+			}
+			otp_close_connection(connection, false);
+			return;
+		}
+
+		// feed the received bytes through the protocol stages, keep any bytes past the end of the request
+		// for after its reply, then give the buffer back
+		unsigned short buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		char *data = ring->buffers + (size_t)buffer_id * URING_BUFFER_SIZE;
+		consumed = otp_consume_connection_bytes(connection, data, cqe->res);
+		if (consumed >= 0 && consumed < cqe->res && !keep_pending_bytes(connection, data + consumed, cqe->res - consumed))
+		{
+			consumed = -1;
+		}
+		provide_uring_buffer(ring, buffer_id);
+
+		if (consumed < 0)
+		{
+			otp_close_connection(connection, false);
+		}
+		else
+		{
+			queue_uring_next(ring, connection);
+		}
+		return;
+	}
+
+	// send
+	if (cqe->res < 0)
+	{
+		fprintf(stderr, "SERVER: ERROR sending message\n");
+		otp_record_error(server->stats, OTP_ERROR_SEND);
+		otp_close_connection(connection, false);
+		return;
+	}
+	connection->reply_sent += cqe->res;
+	if (connection->reply_sent < connection->reply_size)
+	{
+		queue_uring_send(ring, connection); // partial send; queue the rest
+		return;
+	}
+	if (!otp_finish_connection_reply(connection))
+	{
+		otp_close_connection(connection, false); // the request was refused
+		return;
+	}
+
+	// serve whatever arrived while the reply was being sent before receiving more
+	if (connection->pending_size > 0)
+	{
+		consumed = otp_consume_connection_bytes(connection, connection->pending, connection->pending_size);
+		if (consumed < 0)
+		{
+			otp_close_connection(connection, false);
+			return;
+		}
+		connection->pending_size -= consumed;
+		memmove(connection->pending, connection->pending + consumed, connection->pending_size);
+	}
+	queue_uring_next(ring, connection);
+}
+
+/**
+ * Queues the next operation of a connection: a send once its reply is ready, otherwise a receive.
+ * Closes the connection instead if the client has ended the session.
+ * @param ring: pointer to the ring
+ * @param connection: pointer to the connection
+ */
+static void queue_uring_next(struct uring *ring, struct otp_connection *connection)
+{
+	if (connection->state == OTP_STATE_FINISHED)
+	{
+		otp_close_connection(connection, true);
+	}
+	else if (connection->state == OTP_STATE_REPLY)
+	{
+		queue_uring_send(ring, connection);
+	}
+	else
+	{
+		queue_uring_receive(ring, connection);
+	}
+}
+
+/**
+ * Keeps bytes that arrived after the end of the request being answered, since the receive buffer
+ * they are in goes back to the kernel. At most one receive buffer's worth is ever kept.
+ * @param connection: pointer to the connection
+ * @param data: pointer to the bytes
+ * @param length: int, number of bytes
+ * @return bool, false if memory ran out
+ */
+static bool keep_pending_bytes(struct otp_connection *connection, const char *data, int length)
+{
+	if (!connection->pending)
+	{
+		connection->pending = malloc(URING_BUFFER_SIZE);
+		if (!connection->pending)
+		{
+			fprintf(stderr, "SERVER: ERROR allocating memory for connection\n");
+			otp_record_error(connection->server->stats, OTP_ERROR_MEMORY);
+			return false;
+		}
+	}
+	memcpy(connection->pending, data, length);
+	connection->pending_size = length;
+	return true;
+}
+#endif
@@ -0,0 +1,150 @@
+#include <stdio.h>	// for fprintf
+#include <stdlib.h> // for malloc
+#include <stdint.h> // for uint32_t
+#include <errno.h>	// for errno
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>	// for open
+#include <unistd.h> // for write, pwrite
+#include "otp_encoding.h" // for otp_pack_characters, otp_unpack_characters
+#include "otp_file.h"	  // for otp_map_file
+#include "otp_pad_file.h" // the packed pad file format
+
+// macros
+#define PIECE_CHARACTERS ((1 << 20) / 5 * 5) // characters converted at a time (whole packed groups)
+#define USAGE "USAGE: padconv input_file output_file\n"
+
+// function prototypes
+int write_all(int fd, const char *buffer, size_t length);
+int pack_text_file(const struct otp_mapped_file *input, int output_fd, char *buffer);
+int unpack_pad_file(const struct otp_mapped_file *input, int output_fd, char *buffer);
+
+/**
+ * Writes a whole buffer to a file descriptor, continuing after short writes.
+ * @param fd: int, file descriptor to write to
+ * @param buffer: bytes to write
+ * @param length: size_t, number of bytes
+ * @return int, 0 on success, -1 with errno set if the write failed
+ */
+int write_all(int fd, const char *buffer, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t bytes_written = write(fd, buffer, length);
+		if (bytes_written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		buffer += bytes_written;
+		length -= bytes_written;
+	}
+	return 0;
+}
+
+/**
+ * Writes the characters of a text key file as a pad file, a piece at a time. The packed bytes follow
+ * room for the header, which is written last, once their checksum is known.
+ * @param input: pointer to the mapped text file (its characters already checked)
+ * @param output_fd: int, file descriptor of the output, a regular file positioned at its start
+ * @param buffer: pointer to PIECE_CHARACTERS bytes of scratch memory
+ * @return int, 0 on success, -1 with errno set if the output could not be written
+ */
+int pack_text_file(const struct otp_mapped_file *input, int output_fd, char *buffer)
+{
+	uint32_t checksum = 0;
+	if (lseek(output_fd, OTP_PAD_FILE_HEADER_SIZE, SEEK_SET) < 0)
+	{
+		return -1;
+	}
+	for (int offset = 0; offset < input->length; offset += PIECE_CHARACTERS)
+	{
+		int piece = input->length - offset < PIECE_CHARACTERS ? input->length - offset : PIECE_CHARACTERS;
+		otp_pack_characters(input->contents + offset, piece, buffer);
+		int size = otp_encoded_size(OTP_ENCODING_PACKED, piece);
+		checksum = otp_crc32c(checksum, buffer, size);
+		if (write_all(output_fd, buffer, size) < 0)
+		{
+			return -1;
+		}
+	}
+
+	char header[OTP_PAD_FILE_HEADER_SIZE];
+	otp_format_pad_file_header(header, input->length, checksum);
+	return pwrite(output_fd, header, sizeof(header), 0) == sizeof(header) ? 0 : -1;
+}
+
+/**
+ * Writes the characters of a pad file as a text key file, a piece at a time, followed by a newline.
+ * @param input: pointer to the mapped pad file (already checked against its checksum)
+ * @param output_fd: int, file descriptor of the output
+ * @param buffer: pointer to PIECE_CHARACTERS bytes of scratch memory
+ * @return int, 0 on success, -1 with errno set if the output could not be written
+ */
+int unpack_pad_file(const struct otp_mapped_file *input, int output_fd, char *buffer)
+{
+	for (int offset = 0; offset < input->length; offset += PIECE_CHARACTERS)
+	{
+		int piece = input->length - offset < PIECE_CHARACTERS ? input->length - offset : PIECE_CHARACTERS;
+		otp_unpack_characters(input->contents + otp_encoded_size(OTP_ENCODING_PACKED, offset), piece, buffer);
+		if (write_all(output_fd, buffer, piece) < 0)
+		{
+			return -1;
+		}
+	}
+	return write_all(output_fd, "\n", 1);
+}
+
+/**
+ * Converts a key between the text format (characters and a trailing newline) and the packed pad file
+ * format (see otp_pad_file.h), in whichever direction the input calls for: a text key file becomes a pad
+ * file, and a pad file becomes a text key file. The input is checked first (its characters, or its
+ * checksum), and converted a piece at a time, so memory use does not depend on the size of the key.
+ * @param argument_count: int, the number of command line arguments
+ * @param argument_array: array, the command line arguments entered (the input and output file paths)
+ */
+int main(int argument_count, char *argument_array[])
+{
+	if (argument_count != 3)
+	{
+		fprintf(stderr, USAGE);
+		exit(1);
+	}
+	const char *input_path = argument_array[1];
+	const char *output_path = argument_array[2];
+
+	struct otp_mapped_file input;
+	if (otp_map_file(input_path, &input) < 0)
+	{
+		fprintf(stderr, "ERROR: Could not read %s (%s)\n", input_path, strerror(errno));
+		exit(2);
+	}
+	bool packing = input.encoding != OTP_ENCODING_PACKED;
+	if (packing ? otp_find_invalid_mapped_character(&input) >= 0 : otp_verify_pad_file(&input) < 0)
+	{
+		fprintf(stderr, packing ? "ERROR: %s contains bad characters\n" : "ERROR: Pad file %s is corrupt\n", input_path);
+		exit(2);
+	}
+
+	int output_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0600); // pads are secret
+	char *buffer = malloc(PIECE_CHARACTERS);
+	if (output_fd < 0 || !buffer)
+	{
+		fprintf(stderr, "ERROR: Could not open %s\n", output_path);
+		exit(3);
+	}
+
+	int status = packing ? pack_text_file(&input, output_fd, buffer) : unpack_pad_file(&input, output_fd, buffer);
+	if (status < 0 || close(output_fd) < 0)
+	{
+		fprintf(stderr, "ERROR: Could not write %s (%s)\n", output_path, strerror(errno));
+		exit(3);
+	}
+
+	free(buffer);
+	otp_unmap_file(&input);
+	return 0;
+}